@@ -18,27 +18,54 @@ COMPILE_ARGS = ("-Wall -g -O2 -shared -fPIC"
 SSE_FLAGS = "-mfpmath=sse -msse2"
 SOURCE_FILES = [
     'pyhelper.c', 'serialqueue.c', 'stepcompress.c', 'itersolve.c', 'trapq.c',
-    'pollreactor.c', 'msgblock.c', 'trdispatch.c',
+    'pollreactor.c', 'msgblock.c', 'trdispatch.c', 'usbbulk.c', 'bulkqueue.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_corexz.c', 'kin_delta.c',
     'kin_deltesian.c', 'kin_polar.c', 'kin_rotary_delta.c', 'kin_winch.c',
-    'kin_extruder.c', 'kin_shaper.c', 'kin_idex.c',
+    'kin_extruder.c', 'kin_shaper.c', 'kin_idex.c', 'lookahead.c',
+    'mempool.c',
 ]
 DEST_LIB = "c_helper.so"
+# Optional host specific tuning (see the "C modules" section of
+# docs/Packaging.md).  The selected modes are stored in BUILD_MODE_FILE.
+BUILD_MODE_FILE = "c_helper.mode"
+# 32-bit ARM also accepts -march=native, so its -mfpu=auto variant is
+# tried first (other gcc targets reject -mfpu)
+NATIVE_FLAGS = ["-mcpu=native -mfpu=auto", "-march=native", "-mcpu=native"]
+PGO_DIR = "pgo"
+PGO_GENERATE_FLAGS = "-fprofile-generate -fprofile-update=atomic"
+PGO_USE_FLAGS = ["-fprofile-use -fprofile-partial-training",
+                 "-fprofile-use"]
+PGO_USE_EXTRA = "-Wno-error=coverage-mismatch"
+PGO_DIR_FLAGS = "-fprofile-dir=%s -Wno-missing-profile"
 OTHER_FILES = [
     'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h',
-    'trapq.h', 'pollreactor.h', 'msgblock.h'
+    'trapq.h', 'pollreactor.h', 'msgblock.h', 'usbbulk.h', 'kin_shaper.h',
+    'mempool.h'
 ]
 
 defs_stepcompress = """
     struct pull_history_steps {
         uint64_t first_clock, last_clock;
         int64_t start_position;
-        int step_count, interval, add;
+        int step_count, interval, add, add2;
+        uint32_t max_error;
+    };
+    struct stepcompress_stats {
+        uint64_t steps, messages, bytes;
+        double compress_time;
     };
 
     struct stepcompress *stepcompress_alloc(uint32_t oid);
     void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
         , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag);
+    void stepcompress_fill_add2(struct stepcompress *sc
+        , int32_t queue_step_add2_msgtag);
+    void stepcompress_fill_queue_steps(struct stepcompress *sc
+        , int32_t queue_steps_msgtag, int has_dir);
+    void stepcompress_set_compress_method(struct stepcompress *sc
+        , int method);
+    void stepcompress_set_reserved_moves(struct stepcompress *sc
+        , int count);
     void stepcompress_set_invert_sdir(struct stepcompress *sc
         , uint32_t invert_sdir);
     void stepcompress_free(struct stepcompress *sc);
@@ -47,10 +74,14 @@ defs_stepcompress = """
         , uint64_t clock, int64_t last_position);
     int64_t stepcompress_find_past_position(struct stepcompress *sc
         , uint64_t clock);
+    double stepcompress_find_past_position_frac(struct stepcompress *sc
+        , uint64_t clock);
     int stepcompress_queue_msg(struct stepcompress *sc
         , uint32_t *data, int len);
     int stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
         , uint32_t *data, int len);
+    void stepcompress_get_stats(struct stepcompress *sc
+        , struct stepcompress_stats *stats);
     int stepcompress_extract_old(struct stepcompress *sc
         , struct pull_history_steps *p, int max
         , uint64_t start_clock, uint64_t end_clock);
@@ -62,9 +93,17 @@ defs_stepcompress = """
         , double time_offset, double mcu_freq);
     int steppersync_flush(struct steppersync *ss, uint64_t move_clock
         , uint64_t clear_history_clock);
+    int steppersync_get_free_moves(struct steppersync *ss, uint64_t clock);
+    int steppersync_note_mcu_free_moves(struct steppersync *ss
+        , uint64_t clock, int free_count);
 """
 
 defs_itersolve = """
+    struct itersolve_stats {
+        uint64_t calls, iterations, iter_steps;
+        double gen_time;
+    };
+
     int32_t itersolve_generate_steps(struct stepper_kinematics *sk
         , double flush_time);
     double itersolve_check_active(struct stepper_kinematics *sk
@@ -78,6 +117,12 @@ defs_itersolve = """
     void itersolve_set_position(struct stepper_kinematics *sk
         , double x, double y, double z);
     double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
+    void itersolve_get_stats(struct stepper_kinematics *sk
+        , struct itersolve_stats *stats);
+    struct itersolve_pool *itersolve_pool_alloc(int num_threads);
+    void itersolve_pool_free(struct itersolve_pool *ip);
+    void itersolve_pool_begin(struct itersolve_pool *ip);
+    int32_t itersolve_pool_finish(struct itersolve_pool *ip);
 """
 
 defs_trapq = """
@@ -95,12 +140,15 @@ defs_trapq = """
         , double start_pos_x, double start_pos_y, double start_pos_z
         , double axes_r_x, double axes_r_y, double axes_r_z
         , double start_v, double cruise_v, double accel);
+    void trapq_append_batch(struct trapq *tq, double *data, int count);
     void trapq_finalize_moves(struct trapq *tq, double print_time
         , double clear_history_time);
     void trapq_set_position(struct trapq *tq, double print_time
         , double pos_x, double pos_y, double pos_z);
     int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
         , double start_time, double end_time);
+    int trapq_shm_open(struct trapq *tq, const char *filename
+        , int record_count);
 """
 
 defs_kin_cartesian = """
@@ -118,6 +166,14 @@ defs_kin_corexz = """
 defs_kin_delta = """
     struct stepper_kinematics *delta_stepper_alloc(double arm2
         , double tower_x, double tower_y);
+    struct delta_limits *delta_limits_alloc(double slow_ratio
+        , double min_scale);
+    void delta_limits_free(struct delta_limits *dl);
+    void delta_limits_set_tower(struct delta_limits *dl, int tower
+        , double arm2, double tower_x, double tower_y);
+    double delta_limits_calc_scale(struct delta_limits *dl
+        , double start_x, double start_y, double end_x, double end_y
+        , double axes_r_x, double axes_r_y, double axes_r_z);
 """
 
 defs_kin_deltesian = """
@@ -144,6 +200,9 @@ defs_kin_extruder = """
     struct stepper_kinematics *extruder_stepper_alloc(void);
     void extruder_set_pressure_advance(struct stepper_kinematics *sk
         , double pressure_advance, double smooth_time);
+    int extruder_set_shaper_params(struct stepper_kinematics *sk, char axis
+        , int n, double a[], double t[]);
+    double extruder_get_step_generation_window(struct stepper_kinematics *sk);
 """
 
 defs_kin_shaper = """
@@ -164,6 +223,19 @@ defs_kin_idex = """
     struct stepper_kinematics * dual_carriage_alloc(void);
 """
 
+defs_lookahead = """
+    struct lookahead *lookahead_alloc(void);
+    void lookahead_free(struct lookahead *la);
+    void lookahead_reset(struct lookahead *la);
+    void lookahead_add_move(struct lookahead *la, double move_d, double accel
+        , double junction_deviation, double max_cruise_v2
+        , double delta_v2, double smooth_delta_v2, int is_kinematic_move
+        , double axes_r_x, double axes_r_y, double axes_r_z
+        , double extruder_v2);
+    int lookahead_flush(struct lookahead *la, int lazy, double *junctions);
+    void lookahead_remove_moves(struct lookahead *la, int count);
+"""
+
 defs_serialqueue = """
     #define MESSAGE_MAX 64
     struct pull_queue_message {
@@ -175,26 +247,52 @@ defs_serialqueue = """
 
     struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
         , int client_id);
+    struct serialqueue *serialqueue_alloc_shared(int serial_fd
+        , char serial_fd_type, int client_id);
     void serialqueue_exit(struct serialqueue *sq);
     void serialqueue_free(struct serialqueue *sq);
     struct command_queue *serialqueue_alloc_commandqueue(void);
+    void serialqueue_set_commandqueue_priority(struct command_queue *cq
+        , int priority);
     void serialqueue_free_commandqueue(struct command_queue *cq);
     void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
         , uint8_t *msg, int len, uint64_t min_clock, uint64_t req_clock
         , uint64_t notify_id);
+    void serialqueue_send_encode(struct serialqueue *sq
+        , struct command_queue *cq, int msgtag, int64_t *data, int len
+        , uint64_t min_clock, uint64_t req_clock, uint64_t notify_id);
     void serialqueue_pull(struct serialqueue *sq
         , struct pull_queue_message *pqm);
+    int serialqueue_pull_batch(struct serialqueue *sq
+        , struct pull_queue_message *q, int max);
+    int serialqueue_set_thread_priority(struct serialqueue *sq
+        , int priority);
     void serialqueue_set_wire_frequency(struct serialqueue *sq
         , double frequency);
+    void serialqueue_set_canbus_fd(struct serialqueue *sq
+        , double data_frequency);
+    void serialqueue_set_canbus_timestamps(struct serialqueue *sq
+        , int enable);
     void serialqueue_set_receive_window(struct serialqueue *sq
         , int receive_window);
+    void serialqueue_set_batch_time(struct serialqueue *sq
+        , double batch_time);
     void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
         , double conv_time, uint64_t conv_clock, uint64_t last_clock);
+    void serialqueue_get_buffer_stats(struct serialqueue *sq
+        , int *ready_bytes, int *upcoming_bytes);
     void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
     int serialqueue_extract_old(struct serialqueue *sq, int sentq
         , struct pull_queue_message *q, int max);
 """
 
+defs_msgblock = """
+    int msgblock_decode_params(uint8_t *msg, int msg_len, char *types
+        , int64_t *data);
+    int msgblock_decode_stream(uint8_t *buf, int buf_len, char **formats
+        , int64_t *data, int data_max, int *consumed);
+"""
+
 defs_trdispatch = """
     void trdispatch_start(struct trdispatch *td, uint32_t dispatch_reason);
     void trdispatch_stop(struct trdispatch *td);
@@ -208,21 +306,47 @@ defs_trdispatch = """
         , uint64_t expire_ticks, uint64_t min_extend_ticks);
 """
 
+defs_bulkqueue = """
+    struct bulkqueue_msg {
+        uint32_t sequence;
+        int len;
+        uint8_t data[MESSAGE_MAX];
+    };
+
+    struct bulkqueue *bulkqueue_alloc(struct serialqueue *sq
+        , uint32_t msgtag, uint32_t oid);
+    void bulkqueue_free(struct bulkqueue *bq);
+    void bulkqueue_start(struct bulkqueue *bq);
+    void bulkqueue_stop(struct bulkqueue *bq);
+    int bulkqueue_pull(struct bulkqueue *bq, struct bulkqueue_msg *msgs
+        , int max);
+"""
+
 defs_pyhelper = """
     void set_python_logging_callback(void (*func)(const char *));
     double get_monotonic(void);
 """
 
+defs_mempool = """
+    struct pull_mempool {
+        const char *name;
+        int64_t size, live, free, peak;
+    };
+
+    int mempool_get_stats(struct pull_mempool *pm, int max);
+"""
+
 defs_std = """
     void free(void*);
 """
 
 defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std, defs_stepcompress,
-    defs_itersolve, defs_trapq, defs_trdispatch,
+    defs_itersolve, defs_trapq, defs_trdispatch, defs_bulkqueue, defs_msgblock,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_corexz, defs_kin_delta,
     defs_kin_deltesian, defs_kin_polar, defs_kin_rotary_delta, defs_kin_winch,
-    defs_kin_extruder, defs_kin_shaper, defs_kin_idex,
+    defs_kin_extruder, defs_kin_shaper, defs_kin_idex, defs_lookahead,
+    defs_mempool,
 ]
 
 # Update filenames to an absolute path
@@ -253,6 +377,48 @@ def check_gcc_option(option):
     res = os.system(cmd)
     return res == 0
 
+# Return the first option in a list that the current gcc version supports
+def find_gcc_option(options):
+    for option in options:
+        if check_gcc_option(option):
+            return option
+    return None
+
+# Read the list of optional build modes
+def get_build_modes(modefile):
+    try:
+        f = open(modefile, 'r')
+        data = f.read()
+        f.close()
+    except (IOError, OSError):
+        return []
+    return data.split()
+
+# Store the list of optional build modes
+def set_build_modes(modefile, modes):
+    f = open(modefile, 'w')
+    f.write(" ".join(modes) + "\n")
+    f.close()
+
+# Determine the gcc flags for the optional build modes
+def get_build_mode_flags(srcdir, modes):
+    flags = []
+    if 'native' in modes:
+        option = find_gcc_option(NATIVE_FLAGS)
+        if option is None:
+            logging.warning("Compiler does not support native cpu tuning")
+        else:
+            flags.append(option)
+    pgodir = os.path.join(srcdir, PGO_DIR)
+    if 'pgo-generate' in modes:
+        flags.append(PGO_GENERATE_FLAGS)
+        flags.append(PGO_DIR_FLAGS % (pgodir,))
+    elif 'pgo-use' in modes:
+        flags.append(find_gcc_option(PGO_USE_FLAGS) or PGO_USE_FLAGS[-1])
+        flags.append(PGO_USE_EXTRA)
+        flags.append(PGO_DIR_FLAGS % (pgodir,))
+    return flags
+
 # Check if the current gcc version supports a particular command-line option
 def do_build_code(cmd):
     res = os.system(cmd)
@@ -277,11 +443,12 @@ def get_ffi():
         srcfiles = get_abs_files(srcdir, SOURCE_FILES)
         ofiles = get_abs_files(srcdir, OTHER_FILES)
         destlib = get_abs_files(srcdir, [DEST_LIB])[0]
-        if check_build_code(srcfiles+ofiles+[__file__], destlib):
+        modefile = get_abs_files(srcdir, [BUILD_MODE_FILE])[0]
+        if check_build_code(srcfiles+ofiles+[__file__, modefile], destlib):
+            flags = get_build_mode_flags(srcdir, get_build_modes(modefile))
             if check_gcc_option(SSE_FLAGS):
-                cmd = "%s %s %s" % (GCC_CMD, SSE_FLAGS, COMPILE_ARGS)
-            else:
-                cmd = "%s %s" % (GCC_CMD, COMPILE_ARGS)
+                flags.insert(0, SSE_FLAGS)
+            cmd = "%s %s" % (GCC_CMD, " ".join(flags + [COMPILE_ARGS]))
             logging.info("Building C code module %s", DEST_LIB)
             do_build_code(cmd % (destlib, ' '.join(srcfiles)))
         FFI_main = cffi.FFI()
@@ -316,5 +483,36 @@ def run_hub_ctrl(enable_power):
     os.system(HC_CMD % (hubdir, enable_power))
 
 
-if __name__ == '__main__':
+def main():
+    import optparse
+    usage = "%prog [options]"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-n", "--native", action="store_true",
+                    help="tune the code for the host cpu")
+    opts.add_option("-g", "--pgo-generate", action="store_true",
+                    help="build code that records an execution profile")
+    opts.add_option("-u", "--pgo-use", action="store_true",
+                    help="optimize using a previously recorded profile")
+    opts.add_option("-d", "--default", action="store_true",
+                    help="restore the default build flags")
+    options, args = opts.parse_args()
+    if args or (options.pgo_generate and options.pgo_use):
+        opts.error("Invalid arguments")
+    srcdir = os.path.dirname(os.path.realpath(__file__))
+    modefile = get_abs_files(srcdir, [BUILD_MODE_FILE])[0]
+    modes = get_build_modes(modefile)
+    if options.default:
+        modes = []
+    if options.native and 'native' not in modes:
+        modes.append('native')
+    if options.pgo_generate or options.pgo_use:
+        modes = [m for m in modes if not m.startswith('pgo-')]
+        modes.append('pgo-generate' if options.pgo_generate else 'pgo-use')
+    if (options.native or options.pgo_generate or options.pgo_use
+        or options.default):
+        set_build_modes(modefile, modes)
+    logging.basicConfig(level=logging.INFO)
     get_ffi()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,162 @@
+// Low-level storage of "sensor_bulk_data" messages
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code stores the payload of sensor_bulk_data messages for a
+// single sensor oid directly from the serialqueue background thread
+// (via a fastreader).  The host code can then obtain all the pending
+// messages with a single call to bulkqueue_pull().
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // container_of
+#include "msgblock.h" // message_free
+#include "pyhelper.h" // report_errno
+#include "serialqueue.h" // serialqueue_add_fastreader
+
+struct bulkqueue_msg {
+    uint32_t sequence;
+    int len;
+    uint8_t data[MESSAGE_MAX];
+};
+
+struct bulkqueue {
+    struct fastreader fr;
+    struct serialqueue *sq;
+    int is_active;
+
+    pthread_mutex_t lock; // protects variables below
+    struct bulkqueue_msg *msgs;
+    int pos, count, alloc;
+};
+
+#define QUEUE_START_SIZE 256
+
+// Handle a sensor_bulk_data message (callback from serialqueue fastreader)
+static void
+handle_bulk_data(struct fastreader *fr, uint8_t *data, int len)
+{
+    struct bulkqueue *bq = container_of(fr, struct bulkqueue, fr);
+
+    // Parse: sensor_bulk_data oid=%c sequence=%hu data=%*s
+    uint8_t *p = &data[MESSAGE_HEADER_SIZE + fr->prefix_len];
+    uint8_t *end = &data[len - MESSAGE_TRAILER_SIZE];
+    uint32_t sequence = msgblock_parse_int(&p);
+    if (p >= end)
+        return;
+    int data_len = *p++;
+    if (p + data_len != end)
+        return;
+
+    // Store message
+    pthread_mutex_lock(&bq->lock);
+    if (bq->count >= bq->alloc) {
+        if (bq->pos) {
+            bq->count -= bq->pos;
+            memmove(bq->msgs, &bq->msgs[bq->pos]
+                    , bq->count * sizeof(*bq->msgs));
+            bq->pos = 0;
+        } else {
+            int alloc = bq->alloc ? bq->alloc * 2 : QUEUE_START_SIZE;
+            bq->msgs = realloc(bq->msgs, alloc * sizeof(*bq->msgs));
+            bq->alloc = alloc;
+        }
+    }
+    struct bulkqueue_msg *m = &bq->msgs[bq->count++];
+    m->sequence = sequence & 0xffff;
+    m->len = data_len;
+    memcpy(m->data, p, data_len);
+    pthread_mutex_unlock(&bq->lock);
+}
+
+// Discard all stored messages
+static void
+bulkqueue_clear(struct bulkqueue *bq)
+{
+    pthread_mutex_lock(&bq->lock);
+    bq->pos = bq->count = 0;
+    pthread_mutex_unlock(&bq->lock);
+}
+
+// Start collecting messages
+void __visible
+bulkqueue_start(struct bulkqueue *bq)
+{
+    bulkqueue_clear(bq);
+    if (!bq->is_active) {
+        bq->is_active = 1;
+        serialqueue_add_fastreader(bq->sq, &bq->fr);
+    }
+}
+
+// Stop collecting messages (and free any unread messages)
+void __visible
+bulkqueue_stop(struct bulkqueue *bq)
+{
+    if (bq->is_active) {
+        bq->is_active = 0;
+        serialqueue_rm_fastreader(bq->sq, &bq->fr);
+    }
+    pthread_mutex_lock(&bq->lock);
+    free(bq->msgs);
+    bq->msgs = NULL;
+    bq->pos = bq->count = bq->alloc = 0;
+    pthread_mutex_unlock(&bq->lock);
+}
+
+// Copy up to 'max' stored messages into 'msgs'.  Returns the number
+// of messages copied.
+int __visible
+bulkqueue_pull(struct bulkqueue *bq, struct bulkqueue_msg *msgs, int max)
+{
+    pthread_mutex_lock(&bq->lock);
+    int count = bq->count - bq->pos;
+    if (count > max)
+        count = max;
+    memcpy(msgs, &bq->msgs[bq->pos], count * sizeof(*msgs));
+    bq->pos += count;
+    if (bq->pos >= bq->count)
+        bq->pos = bq->count = 0;
+    pthread_mutex_unlock(&bq->lock);
+    return count;
+}
+
+// Create a new 'struct bulkqueue' object
+struct bulkqueue * __visible
+bulkqueue_alloc(struct serialqueue *sq, uint32_t msgtag, uint32_t oid)
+{
+    struct bulkqueue *bq = malloc(sizeof(*bq));
+    memset(bq, 0, sizeof(*bq));
+    bq->sq = sq;
+
+    // Setup fastreader to match sensor_bulk_data messages
+    uint32_t prefix[] = {msgtag, oid};
+    struct queue_message *dummy = message_alloc_and_encode(
+        prefix, ARRAY_SIZE(prefix));
+    memcpy(bq->fr.prefix, dummy->msg, dummy->len);
+    bq->fr.prefix_len = dummy->len;
+    message_free(dummy);
+    bq->fr.func = handle_bulk_data;
+    bq->fr.skip_pull = 1;
+
+    int ret = pthread_mutex_init(&bq->lock, NULL);
+    if (ret) {
+        report_errno("bulkqueue pthread_mutex_init", ret);
+        free(bq);
+        return NULL;
+    }
+    return bq;
+}
+
+// Free memory associated with a 'struct bulkqueue' object
+void __visible
+bulkqueue_free(struct bulkqueue *bq)
+{
+    if (!bq)
+        return;
+    bulkqueue_stop(bq);
+    pthread_mutex_destroy(&bq->lock);
+    free(bq);
+}
@@ -4,12 +4,15 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // fabs
+#include <math.h> // fabs, sqrt
+#include <pthread.h> // pthread_mutex_lock
 #include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/prctl.h> // prctl
 #include "compiler.h" // __visible
 #include "itersolve.h" // itersolve_generate_steps
-#include "pyhelper.h" // errorf
+#include "pyhelper.h" // errorf, get_monotonic
 #include "stepcompress.h" // queue_append_start
 #include "trapq.h" // struct move
 
@@ -24,6 +27,252 @@ struct timepos {
 
 #define SEEK_TIME_RESET 0.000100
 
+// Return the time (limited to start..end) that a move reaches 'dist'
+// by solving "half_accel*t^2 + start_v*t - dist = 0" for t
+static inline double
+move_calc_time(struct move *m, double dist, double start, double end)
+{
+    double start_v = m->start_v, half_accel = m->half_accel;
+    double disc = start_v * start_v + 4. * half_accel * dist;
+    double step_time = end;
+    if (disc >= 0.) {
+        // Moves with a negative velocity (eg, extruder retracts) have
+        // a decreasing distance
+        if (start_v < 0. || (!start_v && half_accel < 0.))
+            step_time = 2. * dist / (start_v - sqrt(disc));
+        else
+            step_time = 2. * dist / (start_v + sqrt(disc));
+    }
+    if (!(step_time >= start)) // or NaN
+        step_time = start;
+    if (step_time > end)
+        step_time = end;
+    return step_time;
+}
+
+// Generate step times for a portion of a move where the stepper
+// position is a linear function of the move distance:
+//   position(t) = base + ratio * (start_v * t + half_accel * t^2)
+// The step times can then be found directly using the quadratic
+// formula instead of an iterative search.
+static int32_t
+itersolve_gen_steps_linear(struct stepper_kinematics *sk, struct move *m
+                           , double start, double end
+                           , double base, double ratio)
+{
+    double half_step = .5 * sk->step_dist, pos = sk->commanded_pos;
+    double start_dist = move_get_distance(m, start);
+    double end_dist = move_get_distance(m, end);
+    double start_pos = base + ratio * start_dist;
+    double end_pos = base + ratio * end_dist;
+    // The move distance decreases on moves with a negative velocity
+    double min_dist = start_dist, max_dist = end_dist;
+    if (end_dist < start_dist) {
+        min_dist = end_dist;
+        max_dist = start_dist;
+    }
+    int sdir = stepcompress_get_step_dir(sk->sc), mdir = end_pos > start_pos;
+    if (ratio && start < end) {
+        double inv_ratio = 1. / ratio;
+        for (;;) {
+            double target = mdir ? pos + half_step : pos - half_step;
+            double rel_dist = mdir ? end_pos - target : target - end_pos;
+            // A direction change must be past the step (like the
+            // iterative solver's direction change detection)
+            if (rel_dist < (mdir == sdir ? -.000000001 : .000000010))
+                break;
+            double dist = (target - base) * inv_ratio;
+            if (dist < min_dist)
+                dist = min_dist;
+            if (dist > max_dist)
+                dist = max_dist;
+            double step_time = move_calc_time(m, dist, start, end);
+            int32_t ret = stepcompress_append(sk->sc, mdir, m->print_time
+                                              , step_time);
+            if (ret)
+                return ret;
+            sdir = mdir;
+            pos = mdir ? target + half_step : target - half_step;
+        }
+    }
+    // Avoid rollback if stepper fully reaches step position
+    double reach_pos = sdir == mdir ? end_pos : start_pos;
+    if (start < end && (sdir ? reach_pos >= pos : reach_pos <= pos)) {
+        int32_t ret = stepcompress_commit(sk->sc);
+        if (ret)
+            return ret;
+    }
+    sk->commanded_pos = pos;
+    if (sk->post_cb)
+        sk->post_cb(sk);
+    return 0;
+}
+
+// Generate step times for a portion of a move where the stepper
+// position only increases (or only decreases) and the kinematics can
+// directly calculate the move distance of a given stepper position
+static int32_t
+itersolve_gen_steps_monotonic(struct stepper_kinematics *sk, struct move *m
+                              , double start, double end, int mdir)
+{
+    sk_calc_callback calc_position_cb = sk->calc_position_cb;
+    double half_step = .5 * sk->step_dist, pos = sk->commanded_pos;
+    double start_pos = calc_position_cb(sk, m, start);
+    double end_pos = calc_position_cb(sk, m, end);
+    double start_dist = move_get_distance(m, start);
+    double end_dist = move_get_distance(m, end);
+    int sdir = stepcompress_get_step_dir(sk->sc);
+    if (start < end) {
+        for (;;) {
+            double target = mdir ? pos + half_step : pos - half_step;
+            double rel_dist = mdir ? end_pos - target : target - end_pos;
+            if (rel_dist < (mdir == sdir ? -.000000001 : .000000010))
+                break;
+            double dist = sk->calc_inverse_cb(sk, m, target, mdir);
+            if (dist < start_dist)
+                dist = start_dist;
+            if (dist > end_dist)
+                dist = end_dist;
+            double step_time = move_calc_time(m, dist, start, end);
+            int32_t ret = stepcompress_append(sk->sc, mdir, m->print_time
+                                              , step_time);
+            if (ret)
+                return ret;
+            sdir = mdir;
+            pos = mdir ? target + half_step : target - half_step;
+        }
+    }
+    // Avoid rollback if stepper fully reaches step position
+    double reach_pos = sdir == mdir ? end_pos : start_pos;
+    if (start < end && (sdir ? reach_pos >= pos : reach_pos <= pos)) {
+        int32_t ret = stepcompress_commit(sk->sc);
+        if (ret)
+            return ret;
+    }
+    sk->commanded_pos = pos;
+    return 0;
+}
+
+// Generate step times for a move where the stepper position has at
+// most one peak - the move is split at the peak and each side is
+// solved with itersolve_gen_steps_monotonic()
+static int32_t
+itersolve_gen_steps_inverse(struct stepper_kinematics *sk, struct move *m
+                            , double start, double end, double peak_dist
+                            , int peak_is_max)
+{
+    double peak_time = end;
+    if (peak_dist <= 0.)
+        peak_time = start;
+    else if (peak_dist < move_get_distance(m, end))
+        peak_time = move_calc_time(m, peak_dist, start, end);
+    int32_t ret = 0;
+    if (start < peak_time)
+        ret = itersolve_gen_steps_monotonic(sk, m, start, peak_time
+                                            , peak_is_max);
+    if (!ret && peak_time < end)
+        ret = itersolve_gen_steps_monotonic(sk, m, peak_time, end
+                                            , !peak_is_max);
+    if (!ret && sk->post_cb)
+        sk->post_cb(sk);
+    return ret;
+}
+
+// Return the time (limited to 0..end) that a quadratic reaches 'dist'
+// by solving "half_accel*t^2 + start_v*t - dist = 0" for t
+static inline double
+poly_calc_time(double start_v, double half_accel, double dist, double end)
+{
+    double disc = start_v * start_v + 4. * half_accel * dist;
+    double step_time = end;
+    if (disc >= 0.)
+        step_time = 2. * dist / (start_v + sqrt(disc));
+    if (!(step_time >= 0.)) // or NaN
+        step_time = 0.;
+    if (step_time > end)
+        step_time = end;
+    return step_time;
+}
+
+// Generate step times for a section of a quadratic segment (starting
+// at 'seg_start' with coefficients 'c') where the stepper position
+// only increases (or only decreases)
+static int32_t
+itersolve_gen_steps_poly_piece(struct stepper_kinematics *sk, struct move *m
+                               , double seg_start, double start, double end
+                               , double c[3])
+{
+    double half_step = .5 * sk->step_dist, pos = sk->commanded_pos;
+    double start_pos = c[0] + (c[1] + c[2] * start) * start;
+    double end_pos = c[0] + (c[1] + c[2] * end) * end;
+    double start_v = c[1] + 2. * c[2] * start, half_accel = c[2];
+    double piece_t = end - start, piece_start = seg_start + start;
+    int sdir = stepcompress_get_step_dir(sk->sc), mdir = end_pos > start_pos;
+    if (!mdir) {
+        start_v = -start_v;
+        half_accel = -half_accel;
+    }
+    for (;;) {
+        double target = mdir ? pos + half_step : pos - half_step;
+        double rel_dist = mdir ? end_pos - target : target - end_pos;
+        if (rel_dist < (mdir == sdir ? -.000000001 : .000000010))
+            break;
+        double dist = mdir ? target - start_pos : start_pos - target;
+        if (dist < 0.)
+            dist = 0.;
+        double step_time = poly_calc_time(start_v, half_accel, dist, piece_t);
+        int32_t ret = stepcompress_append(sk->sc, mdir, m->print_time
+                                          , piece_start + step_time);
+        if (ret)
+            return ret;
+        sdir = mdir;
+        pos = mdir ? target + half_step : target - half_step;
+    }
+    // Avoid rollback if stepper fully reaches step position
+    double reach_pos = sdir == mdir ? end_pos : start_pos;
+    if (sdir ? reach_pos >= pos : reach_pos <= pos) {
+        int32_t ret = stepcompress_commit(sk->sc);
+        if (ret)
+            return ret;
+    }
+    sk->commanded_pos = pos;
+    return 0;
+}
+
+// Generate step times for a portion of a move where the kinematics
+// can describe the stepper position as a series of quadratic segments
+// (via calc_poly_cb).  Each segment is split at its peak and the step
+// times found directly using the quadratic formula.
+static int32_t
+itersolve_gen_steps_poly(struct stepper_kinematics *sk, struct move *m
+                         , double start, double end)
+{
+    double seg_start = start;
+    while (seg_start < end) {
+        double c[3];
+        double seg_t = sk->calc_poly_cb(sk, m, seg_start, c);
+        if (!(seg_t > 0. && seg_t < end - seg_start)) // or NaN
+            seg_t = end - seg_start;
+        double peak_t = seg_t;
+        if (c[2]) {
+            double vertex_t = -c[1] / (2. * c[2]);
+            if (vertex_t > 0. && vertex_t < seg_t)
+                peak_t = vertex_t;
+        }
+        int32_t ret = itersolve_gen_steps_poly_piece(sk, m, seg_start
+                                                     , 0., peak_t, c);
+        if (!ret && peak_t < seg_t)
+            ret = itersolve_gen_steps_poly_piece(sk, m, seg_start
+                                                 , peak_t, seg_t, c);
+        if (ret)
+            return ret;
+        seg_start += seg_t;
+    }
+    if (sk->post_cb)
+        sk->post_cb(sk);
+    return 0;
+}
+
 // Generate step times for a portion of a move
 static int32_t
 itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
@@ -36,6 +285,16 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
         start = 0.;
     if (end > m->move_t)
         end = m->move_t;
+    double base, ratio;
+    if (sk->calc_linear_cb && sk->calc_linear_cb(sk, m, &base, &ratio))
+        return itersolve_gen_steps_linear(sk, m, start, end, base, ratio);
+    double peak_dist;
+    int peak_is_max;
+    if (sk->calc_peak_cb && sk->calc_peak_cb(sk, m, &peak_dist, &peak_is_max))
+        return itersolve_gen_steps_inverse(sk, m, start, end, peak_dist
+                                           , peak_is_max);
+    if (sk->calc_poly_cb)
+        return itersolve_gen_steps_poly(sk, m, start, end);
     struct timepos old_guess = {start, sk->commanded_pos}, guess = old_guess;
     int sdir = stepcompress_get_step_dir(sk->sc);
     int is_dir_change = 0, have_bracket = 0, check_oscillate = 0;
@@ -43,12 +302,21 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
     double last_time=start, low_time=start, high_time=start + SEEK_TIME_RESET;
     if (high_time > end)
         high_time = end;
+    double prev_step_time = 0., prev2_step_time = 0., predict_time = 0.;
+    int step_history = 0;
     for (;;) {
         // Use the "secant method" to guess a new time from previous guesses
         double guess_dist = guess.position - target;
         double og_dist = old_guess.position - target;
         double next_time = ((old_guess.time*guess_dist - guess.time*og_dist)
                             / (guess_dist - og_dist));
+        int is_predict = 0;
+        if (predict_time > low_time && predict_time < high_time) {
+            // Try the time extrapolated from the previous step times
+            next_time = predict_time;
+            is_predict = 1;
+        }
+        predict_time = 0.;
         if (!(next_time > low_time && next_time < high_time)) { // or NaN
             // Next guess is outside bounds checks - validate it
             if (have_bracket) {
@@ -67,9 +335,11 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
             }
         }
         // Calculate position at next_time guess
+        struct timepos prev_old_guess = old_guess;
         old_guess = guess;
         guess.time = next_time;
         guess.position = calc_position_cb(sk, m, next_time);
+        sk->stats.iterations++;
         guess_dist = guess.position - target;
         if (fabs(guess_dist) > .000000001) {
             // Guess does not look close enough - update bounds
@@ -85,6 +355,12 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
                 high_time = guess.time;
                 have_bracket = 1;
             } else if (rel_dist < -(half_step + half_step + .000000010)) {
+                if (is_predict) {
+                    // Extrapolated past a direction change - discard guess
+                    guess = old_guess;
+                    old_guess = prev_old_guess;
+                    continue;
+                }
                 // Found direction change
                 sdir = !sdir;
                 target = (sdir ? target + half_step + half_step
@@ -93,6 +369,9 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
                 high_time = guess.time;
                 is_dir_change = have_bracket = 1;
                 check_oscillate = 0;
+                // The new target is also reached at last_time, so
+                // force a bisect next to avoid converging there
+                old_guess = guess;
             } else {
                 low_time = guess.time;
             }
@@ -109,6 +388,18 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
         if (ret)
             return ret;
         target = sdir ? target+half_step+half_step : target-half_step-half_step;
+        // Predict the next step time by extrapolating the last three
+        // step times (steps are evenly spaced in position)
+        if (is_dir_change)
+            step_history = 0;
+        if (step_history >= 2)
+            predict_time = (3. * (guess.time - prev_step_time)
+                            + prev2_step_time);
+        else
+            step_history++;
+        prev2_step_time = prev_step_time;
+        prev_step_time = guess.time;
+        sk->stats.iter_steps++;
         // Reset bounds checking
         double seek_time_delta = 1.5 * (guess.time - last_time);
         if (seek_time_delta < .000000001)
@@ -142,18 +433,23 @@ check_active(struct stepper_kinematics *sk, struct move *m)
             || (af & AF_Z && m->axes_r.z != 0.));
 }
 
+static int32_t itersolve_pool_queue(struct itersolve_pool *ip
+                                    , struct stepper_kinematics *sk
+                                    , double flush_time);
+// The active pool is per thread, as each printer hosted by the process
+// generates its steps from its own thread
+static __thread struct itersolve_pool *active_pool;
+
 // Generate step times for a range of moves on the trapq
-int32_t __visible
-itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
+static int32_t
+gen_steps_moves(struct stepper_kinematics *sk, double flush_time)
 {
     double last_flush_time = sk->last_flush_time;
     sk->last_flush_time = flush_time;
     if (!sk->tq)
         return 0;
     trapq_check_sentinels(sk->tq);
-    struct move *m = list_first_entry(&sk->tq->moves, struct move, node);
-    while (last_flush_time >= m->print_time + m->move_t)
-        m = list_next_entry(m, node);
+    struct move *m = trapq_find_move(sk->tq, last_flush_time);
     double force_steps_time = sk->last_move_time + sk->gen_steps_post_active;
     int skip_count = 0;
     for (;;) {
@@ -211,6 +507,26 @@ itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
     }
 }
 
+// Generate step times and track the time spent doing so
+static int32_t
+gen_steps(struct stepper_kinematics *sk, double flush_time)
+{
+    double start_time = get_monotonic();
+    int32_t ret = gen_steps_moves(sk, flush_time);
+    sk->stats.gen_time += get_monotonic() - start_time;
+    sk->stats.calls++;
+    return ret;
+}
+
+// Generate step times (or defer them to an active itersolve_pool)
+int32_t __visible
+itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
+{
+    if (active_pool)
+        return itersolve_pool_queue(active_pool, sk, flush_time);
+    return gen_steps(sk, flush_time);
+}
+
 // Check if the given stepper is likely to be active in the given time range
 double __visible
 itersolve_check_active(struct stepper_kinematics *sk, double flush_time)
@@ -218,9 +534,7 @@ itersolve_check_active(struct stepper_kinematics *sk, double flush_time)
     if (!sk->tq)
         return 0.;
     trapq_check_sentinels(sk->tq);
-    struct move *m = list_first_entry(&sk->tq->moves, struct move, node);
-    while (sk->last_flush_time >= m->print_time + m->move_t)
-        m = list_next_entry(m, node);
+    struct move *m = trapq_find_move(sk->tq, sk->last_flush_time);
     for (;;) {
         if (check_active(sk, m))
             return m->print_time;
@@ -278,3 +592,213 @@ itersolve_get_commanded_pos(struct stepper_kinematics *sk)
 {
     return sk->commanded_pos;
 }
+
+// Report step generation statistics
+void __visible
+itersolve_get_stats(struct stepper_kinematics *sk
+                    , struct itersolve_stats *stats)
+{
+    *stats = sk->stats;
+}
+
+
+/****************************************************************
+ * Parallel step generation
+ ****************************************************************/
+
+// Each stepper_kinematics only writes to its own stepcompress object
+// and only reads from its trapq, so the step generation for different
+// steppers is independent and may run on multiple host cores.  While
+// a pool is "active" (between itersolve_pool_begin() and
+// itersolve_pool_finish()) calls to itersolve_generate_steps() are
+// queued instead of run.  The queued work is then run in parallel by
+// the pool threads (along with the caller's thread) during
+// itersolve_pool_finish().
+
+struct itersolve_job {
+    struct stepper_kinematics *sk;
+    double flush_time;
+};
+
+struct itersolve_pool {
+    // Threading
+    pthread_t *threads;
+    int num_threads;
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond, done_cond;
+    int is_exit;
+    int run_count, next_job, done_count;
+    int32_t result;
+    // Queued work (only accessed from the caller's thread)
+    struct itersolve_job *jobs;
+    int job_alloc, job_count;
+};
+
+// Add a stepper to the list of pending step generation work
+static int32_t
+itersolve_pool_queue(struct itersolve_pool *ip, struct stepper_kinematics *sk
+                     , double flush_time)
+{
+    int i;
+    for (i=0; i<ip->job_count; i++)
+        if (ip->jobs[i].sk == sk) {
+            // Only one thread may process a given stepper
+            ip->jobs[i].flush_time = flush_time;
+            return 0;
+        }
+    if (ip->job_count >= ip->job_alloc) {
+        int alloc = ip->job_alloc ? ip->job_alloc * 2 : 16;
+        struct itersolve_job *jobs = realloc(ip->jobs, alloc * sizeof(*jobs));
+        if (!jobs) {
+            errorf("itersolve_pool out of memory");
+            return ERROR_RET;
+        }
+        ip->jobs = jobs;
+        ip->job_alloc = alloc;
+    }
+    ip->jobs[ip->job_count].sk = sk;
+    ip->jobs[ip->job_count].flush_time = flush_time;
+    ip->job_count++;
+    return 0;
+}
+
+// Process queued jobs until none are left (must hold ip->lock)
+static void
+pool_run_jobs(struct itersolve_pool *ip)
+{
+    while (ip->next_job < ip->run_count) {
+        struct itersolve_job job = ip->jobs[ip->next_job++];
+        pthread_mutex_unlock(&ip->lock);
+        int32_t ret = gen_steps(job.sk, job.flush_time);
+        pthread_mutex_lock(&ip->lock);
+        if (ret && !ip->result)
+            ip->result = ret;
+        ip->done_count++;
+        if (ip->done_count >= ip->run_count)
+            pthread_cond_signal(&ip->done_cond);
+    }
+}
+
+// Main code for the worker threads
+static void *
+pool_thread(void *data)
+{
+    struct itersolve_pool *ip = data;
+    prctl(PR_SET_NAME, "itersolve");
+    pthread_mutex_lock(&ip->lock);
+    while (!ip->is_exit) {
+        pool_run_jobs(ip);
+        pthread_cond_wait(&ip->cond, &ip->lock);
+    }
+    pthread_mutex_unlock(&ip->lock);
+    return NULL;
+}
+
+// Allocate a new 'itersolve_pool' object
+struct itersolve_pool * __visible
+itersolve_pool_alloc(int num_threads)
+{
+    struct itersolve_pool *ip = malloc(sizeof(*ip));
+    if (!ip) {
+        errorf("itersolve_pool_alloc out of memory");
+        return NULL;
+    }
+    memset(ip, 0, sizeof(*ip));
+    int ret = pthread_mutex_init(&ip->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_cond_init(&ip->cond, NULL);
+    if (ret)
+        goto fail_lock;
+    ret = pthread_cond_init(&ip->done_cond, NULL);
+    if (ret)
+        goto fail_cond;
+    // Without any threads all work is run from itersolve_pool_finish()
+    if (num_threads > 0)
+        ip->threads = malloc(num_threads * sizeof(*ip->threads));
+    if (ip->threads) {
+        for (; ip->num_threads < num_threads; ip->num_threads++) {
+            ret = pthread_create(&ip->threads[ip->num_threads], NULL
+                                 , pool_thread, ip);
+            if (ret) {
+                // Fall back to using the threads that could be started
+                report_errno("pthread_create", ret);
+                break;
+            }
+        }
+    }
+    return ip;
+
+fail_cond:
+    pthread_cond_destroy(&ip->cond);
+fail_lock:
+    pthread_mutex_destroy(&ip->lock);
+fail:
+    report_errno("itersolve_pool_alloc", ret);
+    free(ip);
+    return NULL;
+}
+
+// Free memory associated with an 'itersolve_pool' object
+void __visible
+itersolve_pool_free(struct itersolve_pool *ip)
+{
+    if (!ip)
+        return;
+    if (active_pool == ip)
+        active_pool = NULL;
+    pthread_mutex_lock(&ip->lock);
+    ip->is_exit = 1;
+    pthread_cond_broadcast(&ip->cond);
+    pthread_mutex_unlock(&ip->lock);
+    int i;
+    for (i=0; i<ip->num_threads; i++) {
+        int ret = pthread_join(ip->threads[i], NULL);
+        if (ret)
+            report_errno("pthread_join", ret);
+    }
+    pthread_cond_destroy(&ip->done_cond);
+    pthread_cond_destroy(&ip->cond);
+    pthread_mutex_destroy(&ip->lock);
+    free(ip->threads);
+    free(ip->jobs);
+    free(ip);
+}
+
+// Start queuing calls to itersolve_generate_steps()
+void __visible
+itersolve_pool_begin(struct itersolve_pool *ip)
+{
+    active_pool = ip;
+}
+
+// Generate the steps for all queued steppers and wait for completion
+int32_t __visible
+itersolve_pool_finish(struct itersolve_pool *ip)
+{
+    if (active_pool == ip)
+        active_pool = NULL;
+    int i, job_count = ip->job_count;
+    if (!job_count)
+        return 0;
+    // Update the trapq sentinels prior to any concurrent access
+    for (i=0; i<job_count; i++) {
+        struct stepper_kinematics *sk = ip->jobs[i].sk;
+        if (sk->tq)
+            trapq_check_sentinels(sk->tq);
+    }
+    pthread_mutex_lock(&ip->lock);
+    ip->run_count = job_count;
+    ip->next_job = ip->done_count = 0;
+    ip->result = 0;
+    if (ip->num_threads && job_count > 1)
+        pthread_cond_broadcast(&ip->cond);
+    pool_run_jobs(ip);
+    while (ip->done_count < job_count)
+        pthread_cond_wait(&ip->done_cond, &ip->lock);
+    int32_t ret = ip->result;
+    ip->run_count = ip->next_job = ip->done_count = 0;
+    pthread_mutex_unlock(&ip->lock);
+    ip->job_count = 0;
+    return ret;
+}
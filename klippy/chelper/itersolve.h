@@ -9,9 +9,25 @@ enum {
 
 struct stepper_kinematics;
 struct move;
+struct itersolve_pool;
 typedef double (*sk_calc_callback)(struct stepper_kinematics *sk, struct move *m
                                    , double move_time);
+typedef int (*sk_linear_callback)(struct stepper_kinematics *sk
+                                  , struct move *m
+                                  , double *base, double *ratio);
+typedef int (*sk_peak_callback)(struct stepper_kinematics *sk, struct move *m
+                                , double *peak_dist, int *peak_is_max);
+typedef double (*sk_inverse_callback)(struct stepper_kinematics *sk
+                                      , struct move *m, double pos
+                                      , int is_rising);
+typedef double (*sk_poly_callback)(struct stepper_kinematics *sk
+                                   , struct move *m, double move_time
+                                   , double coefs[3]);
 typedef void (*sk_post_callback)(struct stepper_kinematics *sk);
+struct itersolve_stats {
+    uint64_t calls, iterations, iter_steps;
+    double gen_time;
+};
 struct stepper_kinematics {
     double step_dist, commanded_pos;
     struct stepcompress *sc;
@@ -20,8 +36,13 @@ struct stepper_kinematics {
     struct trapq *tq;
     int active_flags;
     double gen_steps_pre_active, gen_steps_post_active;
+    struct itersolve_stats stats;
 
     sk_calc_callback calc_position_cb;
+    sk_linear_callback calc_linear_cb;
+    sk_peak_callback calc_peak_cb;
+    sk_inverse_callback calc_inverse_cb;
+    sk_poly_callback calc_poly_cb;
     sk_post_callback post_cb;
 };
 
@@ -37,5 +58,11 @@ double itersolve_calc_position_from_coord(struct stepper_kinematics *sk
 void itersolve_set_position(struct stepper_kinematics *sk
                             , double x, double y, double z);
 double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
+void itersolve_get_stats(struct stepper_kinematics *sk
+                         , struct itersolve_stats *stats);
+struct itersolve_pool *itersolve_pool_alloc(int num_threads);
+void itersolve_pool_free(struct itersolve_pool *ip);
+void itersolve_pool_begin(struct itersolve_pool *ip);
+int32_t itersolve_pool_finish(struct itersolve_pool *ip);
 
 #endif // itersolve.h
@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // sqrt
+#include <math.h> // sqrt, fabs
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
@@ -27,6 +27,73 @@ delta_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(ds->arm2 - dx*dx - dy*dy) + c.z;
 }
 
+// Vertical moves are a linear function of the move distance
+static int
+delta_stepper_calc_linear(struct stepper_kinematics *sk, struct move *m
+                          , double *base, double *ratio)
+{
+    if (m->axes_r.x || m->axes_r.y)
+        return 0;
+    struct delta_stepper *ds = container_of(sk, struct delta_stepper, sk);
+    double dx = ds->tower_x - m->start_pos.x, dy = ds->tower_y - m->start_pos.y;
+    *base = sqrt(ds->arm2 - dx*dx - dy*dy) + m->start_pos.z;
+    *ratio = m->axes_r.z;
+    return 1;
+}
+
+// The carriage position along a straight move is a concave function
+// of the move distance, so it has at most one peak.  Report the move
+// distance of that peak (where the carriage velocity is zero).
+static int
+delta_stepper_calc_peak(struct stepper_kinematics *sk, struct move *m
+                        , double *peak_dist, int *peak_is_max)
+{
+    struct delta_stepper *ds = container_of(sk, struct delta_stepper, sk);
+    double dx = ds->tower_x - m->start_pos.x, dy = ds->tower_y - m->start_pos.y;
+    double rx = m->axes_r.x, ry = m->axes_r.y, rz = m->axes_r.z;
+    double h = rx*rx + ry*ry, s2 = ds->arm2 - dx*dx - dy*dy;
+    if (!h || s2 <= 0.)
+        return 0;
+    double g = rx*dx + ry*dy;
+    *peak_dist = (g + rz * sqrt(g*g + h * s2)) / h;
+    *peak_is_max = 1;
+    return 1;
+}
+
+// Find the move distance where the carriage reaches 'pos' (the
+// intersection of the move line with a sphere of radius arm_length
+// centered on the carriage)
+static double
+delta_stepper_calc_inverse(struct stepper_kinematics *sk, struct move *m
+                           , double pos, int is_rising)
+{
+    struct delta_stepper *ds = container_of(sk, struct delta_stepper, sk);
+    double dx = ds->tower_x - m->start_pos.x, dy = ds->tower_y - m->start_pos.y;
+    double rx = m->axes_r.x, ry = m->axes_r.y, rz = m->axes_r.z;
+    double w = pos - m->start_pos.z;
+    // Solve "n*d^2 - 2*b*d + c = 0" for the move distance d
+    double n = rx*rx + ry*ry + rz*rz;
+    double b = w*rz + rx*dx + ry*dy;
+    double c = w*w + dx*dx + dy*dy - ds->arm2;
+    double disc = b*b - n*c;
+    double sq = disc > 0. ? sqrt(disc) : 0.;
+    double q = b >= 0. ? b + sq : b - sq;
+    if (!q)
+        return 0.;
+    double d1 = q / n, d2 = c / q;
+    if (d1 > d2) {
+        double t = d1;
+        d1 = d2;
+        d2 = t;
+    }
+    // Only one root has the carriage above the toolhead - with two
+    // valid roots, the first is on the rising side of the peak
+    int d1_valid = w - rz*d1 >= 0., d2_valid = w - rz*d2 >= 0.;
+    if (is_rising)
+        return d1_valid || !d2_valid ? d1 : d2;
+    return d2_valid || !d1_valid ? d2 : d1;
+}
+
 struct stepper_kinematics * __visible
 delta_stepper_alloc(double arm2, double tower_x, double tower_y)
 {
@@ -36,6 +103,82 @@ delta_stepper_alloc(double arm2, double tower_x, double tower_y)
     ds->tower_x = tower_x;
     ds->tower_y = tower_y;
     ds->sk.calc_position_cb = delta_stepper_calc_position;
+    ds->sk.calc_linear_cb = delta_stepper_calc_linear;
+    ds->sk.calc_peak_cb = delta_stepper_calc_peak;
+    ds->sk.calc_inverse_cb = delta_stepper_calc_inverse;
     ds->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &ds->sk;
 }
+
+
+/****************************************************************
+ * Move velocity limits
+ ****************************************************************/
+
+struct delta_limits {
+    double slow_ratio, min_scale;
+    double arm2[3], tower_x[3], tower_y[3];
+};
+
+struct delta_limits * __visible
+delta_limits_alloc(double slow_ratio, double min_scale)
+{
+    struct delta_limits *dl = malloc(sizeof(*dl));
+    memset(dl, 0, sizeof(*dl));
+    dl->slow_ratio = slow_ratio;
+    dl->min_scale = min_scale;
+    return dl;
+}
+
+void __visible
+delta_limits_free(struct delta_limits *dl)
+{
+    free(dl);
+}
+
+void __visible
+delta_limits_set_tower(struct delta_limits *dl, int tower, double arm2
+                       , double tower_x, double tower_y)
+{
+    if (tower < 0 || tower >= 3)
+        return;
+    dl->arm2[tower] = arm2;
+    dl->tower_x[tower] = tower_x;
+    dl->tower_y[tower] = tower_y;
+}
+
+// Return the ratio of carriage velocity to toolhead velocity
+static double
+tower_ratio(struct delta_limits *dl, int tower, double x, double y
+            , double rx, double ry, double rz)
+{
+    double dx = dl->tower_x[tower] - x, dy = dl->tower_y[tower] - y;
+    double s2 = dl->arm2[tower] - dx*dx - dy*dy;
+    if (s2 <= 0.)
+        return INFINITY;
+    return fabs(rz + (rx*dx + ry*dy) / sqrt(s2));
+}
+
+// Determine the amount a move's velocity and acceleration must be
+// scaled so that no carriage exceeds slow_ratio times the toolhead
+// limits.  Along a straight move the carriage velocity ratio is
+// monotonic, so checking the move end points is exact.
+double __visible
+delta_limits_calc_scale(struct delta_limits *dl
+                        , double start_x, double start_y
+                        , double end_x, double end_y
+                        , double axes_r_x, double axes_r_y, double axes_r_z)
+{
+    double max_ratio = 0.;
+    int i;
+    for (i = 0; i < 3; i++) {
+        double r1 = tower_ratio(dl, i, start_x, start_y
+                                , axes_r_x, axes_r_y, axes_r_z);
+        double r2 = tower_ratio(dl, i, end_x, end_y
+                                , axes_r_x, axes_r_y, axes_r_z);
+        max_ratio = fmax(max_ratio, fmax(r1, r2));
+    }
+    if (max_ratio <= dl->slow_ratio)
+        return 1.;
+    return fmax(dl->slow_ratio / max_ratio, dl->min_scale);
+}
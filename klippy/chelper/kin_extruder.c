@@ -9,6 +9,7 @@
 #include <string.h> // memset
 #include "compiler.h" // __visible
 #include "itersolve.h" // struct stepper_kinematics
+#include "kin_shaper.h" // struct shaper_pulses
 #include "pyhelper.h" // errorf
 #include "trapq.h" // move_get_distance
 
@@ -24,6 +25,11 @@
 //         definitive_integral(pa_position(x) * (smooth_time/2 - abs(t-x)) * dx,
 //                             from=t-smooth_time/2, to=t+smooth_time/2)
 //         / ((smooth_time/2)**2))
+// The result may then also be filtered by the toolhead input shaper
+// pulses.  When the x and y axes use different shapers, the average
+// of the two shaped positions is used:
+//     shaped_position(t) = .5 * (sum(a_x[i] * smooth_position(t + t_x[i]))
+//                                + sum(a_y[i] * smooth_position(t + t_y[i])))
 
 // Calculate the definitive integral of the motion formula:
 //   position(t) = base + t * (start_v + t * half_accel)
@@ -50,10 +56,11 @@ extruder_integrate_time(double base, double start_v, double half_accel
     return ei - si;
 }
 
-// Calculate the definitive integral of extruder for a given move
-static double
-pa_move_integrate(struct move *m, double pressure_advance
-                  , double base, double start, double end, double time_offset)
+// Calculate the definitive integrals of extruder for a given move
+static void
+pa_move_integrals(struct move *m, double pressure_advance
+                  , double base, double start, double end
+                  , double *iext, double *wgt_ext)
 {
     if (start < 0.)
         start = 0.;
@@ -67,14 +74,65 @@ pa_move_integrate(struct move *m, double pressure_advance
     double start_v = m->start_v + pressure_advance * 2. * m->half_accel;
     // Calculate definitive integral
     double ha = m->half_accel;
-    double iext = extruder_integrate(base, start_v, ha, start, end);
-    double wgt_ext = extruder_integrate_time(base, start_v, ha, start, end);
+    *iext = extruder_integrate(base, start_v, ha, start, end);
+    *wgt_ext = extruder_integrate_time(base, start_v, ha, start, end);
+}
+
+// Calculate the definitive integral of extruder for a given move
+static double
+pa_move_integrate(struct move *m, double pressure_advance
+                  , double base, double start, double end, double time_offset)
+{
+    double iext, wgt_ext;
+    pa_move_integrals(m, pressure_advance, base, start, end, &iext, &wgt_ext);
     return wgt_ext - time_offset * iext;
 }
 
+// Running integrals over the moves fully contained in one side of the
+// smoothing window.  The window edge is located in move 'm' which
+// starts at time 'start' (relative to the start of the current move).
+// The moves between 'm' and the current move contribute:
+//   sum_wgt - window_time * sum_ext   (previous moves)
+//   window_time * sum_ext - sum_wgt   (future moves)
+struct pa_window_edge {
+    struct move *m;
+    double start, sum_ext, sum_wgt;
+};
+
+struct pa_window {
+    struct move *move;
+    uint64_t update_count;
+    struct pa_window_edge prev, next;
+};
+
+// Reset the window cache if the move or trapq may have changed
+static void
+pa_window_check(struct pa_window *w, struct move *m, uint64_t update_count)
+{
+    if (likely(w->move == m && w->update_count == update_count))
+        return;
+    w->move = m;
+    w->update_count = update_count;
+    memset(&w->prev, 0, sizeof(w->prev));
+    memset(&w->next, 0, sizeof(w->next));
+    w->prev.m = w->next.m = m;
+}
+
+// Add (or with sign=-1. remove) a full move to a window edge's sums
+static void
+pa_edge_update(struct pa_window_edge *e, struct move *m, double start
+               , double start_base, double pressure_advance, double sign)
+{
+    double iext, wgt_ext, base = m->start_pos.x - start_base;
+    pa_move_integrals(m, pressure_advance, base, 0., m->move_t
+                      , &iext, &wgt_ext);
+    e->sum_ext += sign * iext;
+    e->sum_wgt += sign * (wgt_ext + start * iext);
+}
+
 // Calculate the definitive integral of the extruder over a range of moves
 static double
-pa_range_integrate(struct move *m, double move_time
+pa_range_integrate(struct pa_window *w, struct move *m, double move_time
                    , double pressure_advance, double hst)
 {
     // Calculate integral for the current move
@@ -82,21 +140,45 @@ pa_range_integrate(struct move *m, double move_time
     double start_base = m->start_pos.x;
     res += pa_move_integrate(m, pressure_advance, 0., start, move_time, start);
     res -= pa_move_integrate(m, pressure_advance, 0., move_time, end, end);
-    // Integrate over previous moves
-    struct move *prev = m;
-    while (unlikely(start < 0.)) {
-        prev = list_prev_entry(prev, node);
-        start += prev->move_t;
-        double base = prev->start_pos.x - start_base;
-        res += pa_move_integrate(prev, pressure_advance, base, start
-                                 , prev->move_t, start);
+    // Slide the start of the window over previous moves
+    struct pa_window_edge *e = &w->prev;
+    while (unlikely(start < e->start)) {
+        if (e->m != m)
+            pa_edge_update(e, e->m, e->start, start_base, pressure_advance, 1.);
+        e->m = list_prev_entry(e->m, node);
+        e->start -= e->m->move_t;
+    }
+    while (unlikely(e->m != m && start >= e->start + e->m->move_t)) {
+        e->start += e->m->move_t;
+        e->m = list_next_entry(e->m, node);
+        if (e->m != m)
+            pa_edge_update(e, e->m, e->start, start_base, pressure_advance,-1.);
+    }
+    if (e->m != m) {
+        double base = e->m->start_pos.x - start_base, offset = start - e->start;
+        res += pa_move_integrate(e->m, pressure_advance, base, offset
+                                 , e->m->move_t, offset);
+        res += e->sum_wgt - start * e->sum_ext;
     }
-    // Integrate over future moves
-    while (unlikely(end > m->move_t)) {
-        end -= m->move_t;
-        m = list_next_entry(m, node);
-        double base = m->start_pos.x - start_base;
-        res -= pa_move_integrate(m, pressure_advance, base, 0., end, end);
+    // Slide the end of the window over future moves
+    e = &w->next;
+    while (unlikely(end > e->start + e->m->move_t)) {
+        if (e->m != m)
+            pa_edge_update(e, e->m, e->start, start_base, pressure_advance, 1.);
+        e->start += e->m->move_t;
+        e->m = list_next_entry(e->m, node);
+    }
+    while (unlikely(e->m != m && end <= e->start)) {
+        e->m = list_prev_entry(e->m, node);
+        e->start -= e->m->move_t;
+        if (e->m != m)
+            pa_edge_update(e, e->m, e->start, start_base, pressure_advance,-1.);
+    }
+    if (e->m != m) {
+        double base = e->m->start_pos.x - start_base, offset = end - e->start;
+        res -= pa_move_integrate(e->m, pressure_advance, base, 0., offset
+                                 , offset);
+        res += end * e->sum_ext - e->sum_wgt;
     }
     return res;
 }
@@ -104,22 +186,107 @@ pa_range_integrate(struct move *m, double move_time
 struct extruder_stepper {
     struct stepper_kinematics sk;
     double pressure_advance, half_smooth_time, inv_half_smooth_time2;
+    struct pa_window window;
+    // Input shaper pulses (and a smoothing window for each pulse)
+    struct shaper_pulses sx, sy;
+    struct pa_window wx[SHAPER_MAX_PULSES], wy[SHAPER_MAX_PULSES];
+    int same_xy;
 };
 
+// Calculate the extruder position (with pressure advance smoothing)
 static double
-extruder_calc_position(struct stepper_kinematics *sk, struct move *m
-                       , double move_time)
+extruder_pa_position(struct extruder_stepper *es, struct pa_window *w
+                     , struct move *m, double move_time)
 {
-    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
     double hst = es->half_smooth_time;
     if (!hst)
         // Pressure advance not enabled
         return m->start_pos.x + move_get_distance(m, move_time);
     // Apply pressure advance and average over smooth_time
-    double area = pa_range_integrate(m, move_time, es->pressure_advance, hst);
+    struct trapq *tq = es->sk.tq;
+    pa_window_check(w, m, tq ? tq->update_count : 0);
+    double area = pa_range_integrate(w, m, move_time
+                                     , es->pressure_advance, hst);
     return m->start_pos.x + area * es->inv_half_smooth_time2;
 }
 
+// Calculate the extruder position filtered by a set of shaper pulses
+static double
+extruder_shaped_position(struct extruder_stepper *es, struct shaper_pulses *sp
+                         , struct pa_window *windows, struct move *m
+                         , double move_time)
+{
+    if (!sp->num_pulses)
+        return extruder_pa_position(es, &es->window, m, move_time);
+    struct trapq *tq = es->sk.tq;
+    shaper_check_cache(sp, m, tq ? tq->update_count : 0);
+    double res = 0.;
+    int i;
+    for (i = 0; i < sp->num_pulses; ++i) {
+        double time;
+        struct move *pm = shaper_pulse_move(sp, i, move_time, &time);
+        res += sp->pulses[i].a * extruder_pa_position(es, &windows[i]
+                                                      , pm, time);
+    }
+    return res;
+}
+
+static double
+extruder_calc_position(struct stepper_kinematics *sk, struct move *m
+                       , double move_time)
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    double pos = extruder_shaped_position(es, &es->sx, es->wx, m, move_time);
+    if (es->same_xy)
+        return pos;
+    pos += extruder_shaped_position(es, &es->sy, es->wy, m, move_time);
+    return .5 * pos;
+}
+
+static int
+extruder_calc_linear(struct stepper_kinematics *sk, struct move *m
+                     , double *base, double *ratio)
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    if (es->half_smooth_time || es->sx.num_pulses || es->sy.num_pulses)
+        // Pressure advance smoothing and input shaping require the
+        // iterative solver
+        return 0;
+    *base = m->start_pos.x;
+    *ratio = 1.;
+    return 1;
+}
+
+// Reset the cached smoothing windows
+static void
+extruder_reset_windows(struct extruder_stepper *es)
+{
+    int i;
+    es->window.move = NULL;
+    for (i = 0; i < ARRAY_SIZE(es->wx); i++)
+        es->wx[i].move = es->wy[i].move = NULL;
+}
+
+// Note the time range around a move that impacts the stepper position
+static void
+extruder_note_generation_time(struct extruder_stepper *es)
+{
+    double hst = es->half_smooth_time, pre_active = 0., post_active = 0.;
+    struct shaper_pulses *sps[2] = { &es->sx, &es->sy };
+    int i;
+    for (i = 0; i < ARRAY_SIZE(sps); i++) {
+        struct shaper_pulses *sp = sps[i];
+        if (!sp->num_pulses)
+            continue;
+        if (sp->pulses[sp->num_pulses-1].t > pre_active)
+            pre_active = sp->pulses[sp->num_pulses-1].t;
+        if (-sp->pulses[0].t > post_active)
+            post_active = -sp->pulses[0].t;
+    }
+    es->sk.gen_steps_pre_active = hst + pre_active;
+    es->sk.gen_steps_post_active = hst + post_active;
+}
+
 void __visible
 extruder_set_pressure_advance(struct stepper_kinematics *sk
                               , double pressure_advance, double smooth_time)
@@ -127,19 +294,45 @@ extruder_set_pressure_advance(struct stepper_kinematics *sk
     struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
     double hst = smooth_time * .5;
     es->half_smooth_time = hst;
-    es->sk.gen_steps_pre_active = es->sk.gen_steps_post_active = hst;
+    extruder_note_generation_time(es);
+    extruder_reset_windows(es);
     if (! hst)
         return;
     es->inv_half_smooth_time2 = 1. / (hst * hst);
     es->pressure_advance = pressure_advance;
 }
 
+int __visible
+extruder_set_shaper_params(struct stepper_kinematics *sk, char axis
+                           , int n, double a[], double t[])
+{
+    if (axis != 'x' && axis != 'y')
+        return -1;
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    struct shaper_pulses *sp = axis == 'x' ? &es->sx : &es->sy;
+    int status = init_shaper(n, a, t, sp);
+    es->same_xy = shaper_pulses_equal(&es->sx, &es->sy);
+    extruder_note_generation_time(es);
+    extruder_reset_windows(es);
+    return status;
+}
+
+double __visible
+extruder_get_step_generation_window(struct stepper_kinematics *sk)
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    return es->sk.gen_steps_pre_active > es->sk.gen_steps_post_active
+         ? es->sk.gen_steps_pre_active : es->sk.gen_steps_post_active;
+}
+
 struct stepper_kinematics * __visible
 extruder_stepper_alloc(void)
 {
     struct extruder_stepper *es = malloc(sizeof(*es));
     memset(es, 0, sizeof(*es));
+    es->same_xy = 1;
     es->sk.calc_position_cb = extruder_calc_position;
+    es->sk.calc_linear_cb = extruder_calc_linear;
     es->sk.active_flags = AF_X;
     return &es->sk;
 }
@@ -11,6 +11,7 @@
 #include <string.h> // memset
 #include "compiler.h" // __visible
 #include "itersolve.h" // struct stepper_kinematics
+#include "kin_shaper.h" // struct shaper_pulses
 #include "trapq.h" // struct move
 
 
@@ -18,13 +19,6 @@
  * Shaper initialization
  ****************************************************************/
 
-struct shaper_pulses {
-    int num_pulses;
-    struct {
-        double t, a;
-    } pulses[5];
-};
-
 // Shift pulses around 'mid-point' t=0 so that the input shaper is an identity
 // transformation for constant-speed motion (i.e. input_shaper(v * T) = v * T)
 static void
@@ -38,7 +32,7 @@ shift_pulses(struct shaper_pulses *sp)
         sp->pulses[i].t -= ts;
 }
 
-static int
+int
 init_shaper(int n, double a[], double t[], struct shaper_pulses *sp)
 {
     if (n < 0 || n > ARRAY_SIZE(sp->pulses)) {
@@ -56,10 +50,25 @@ init_shaper(int n, double a[], double t[], struct shaper_pulses *sp)
         sp->pulses[n-i-1].t = -t[i];
     }
     sp->num_pulses = n;
+    sp->cache_move = NULL;
     shift_pulses(sp);
     return 0;
 }
 
+// Check if two sets of shaper pulses are identical
+int
+shaper_pulses_equal(struct shaper_pulses *sp1, struct shaper_pulses *sp2)
+{
+    if (sp1->num_pulses != sp2->num_pulses)
+        return 0;
+    int i;
+    for (i = 0; i < sp1->num_pulses; ++i)
+        if (sp1->pulses[i].t != sp2->pulses[i].t
+            || sp1->pulses[i].a != sp2->pulses[i].a)
+            return 0;
+    return 1;
+}
+
 
 /****************************************************************
  * Generic position calculation via shaper convolution
@@ -74,32 +83,91 @@ get_axis_position(struct move *m, int axis, double move_time)
     return start_pos + axis_r * move_dist;
 }
 
+// Calculate the position from the convolution of the shaper with input signal
 static inline double
-get_axis_position_across_moves(struct move *m, int axis, double time)
+calc_position(struct move *m, int axis, double move_time
+              , struct shaper_pulses *sp, struct trapq *tq)
 {
-    while (likely(time < 0.)) {
-        m = list_prev_entry(m, node);
-        time += m->move_t;
+    shaper_check_cache(sp, m, tq ? tq->update_count : 0);
+    double res = 0.;
+    int num_pulses = sp->num_pulses, i;
+    for (i = 0; i < num_pulses; ++i) {
+        double time;
+        struct move *pm = shaper_pulse_move(sp, i, move_time, &time);
+        res += sp->pulses[i].a * get_axis_position(pm, axis, time);
     }
-    while (likely(time > m->move_t)) {
-        time -= m->move_t;
-        m = list_next_entry(m, node);
+    return res;
+}
+
+// Calculate both the x and y shaped positions when the two axes use
+// identical shaper pulses (the move lookup and distance calculation
+// for each pulse is then shared between the axes)
+static inline void
+calc_xy_position(struct move *m, double move_time, struct shaper_pulses *sp
+                 , struct trapq *tq, struct coord *c)
+{
+    shaper_check_cache(sp, m, tq ? tq->update_count : 0);
+    double res_x = 0., res_y = 0.;
+    int num_pulses = sp->num_pulses, i;
+    for (i = 0; i < num_pulses; ++i) {
+        double time, a = sp->pulses[i].a;
+        struct move *pm = shaper_pulse_move(sp, i, move_time, &time);
+        double move_dist = move_get_distance(pm, time);
+        res_x += a * (pm->start_pos.x + pm->axes_r.x * move_dist);
+        res_y += a * (pm->start_pos.y + pm->axes_r.y * move_dist);
     }
-    return get_axis_position(m, axis, time);
+    c->x = res_x;
+    c->y = res_y;
 }
 
-// Calculate the position from the convolution of the shaper with input signal
+
+// Minimum time a quadratic segment is allowed to span - pulses closer
+// than this to the end of their move are treated as in the next move
+#define POLY_MIN_TIME 0.000000001
+
+// Calculate the shaped position of an axis as a quadratic polynomial
+// "c[0] + c[1]*t + c[2]*t^2" of the time since 'move_time'.  Within
+// the returned duration each pulse stays in a single move, so the
+// polynomial is exact over that whole period.
 static inline double
-calc_position(struct move *m, int axis, double move_time
-              , struct shaper_pulses *sp)
+calc_position_poly(struct move *m, int axis, double move_time
+                   , struct shaper_pulses *sp, struct trapq *tq, double c[3])
 {
-    double res = 0.;
-    int num_pulses = sp->num_pulses, i;
+    int num_pulses = sp ? sp->num_pulses : 0, i;
+    double axis_r, duration = m->move_t - move_time;
+    if (!num_pulses) {
+        axis_r = m->axes_r.axis[axis - 'x'];
+        c[0] = get_axis_position(m, axis, move_time);
+        c[1] = axis_r * (m->start_v + 2. * m->half_accel * move_time);
+        c[2] = axis_r * m->half_accel;
+        return duration;
+    }
+    shaper_check_cache(sp, m, tq ? tq->update_count : 0);
+    c[0] = c[1] = c[2] = 0.;
     for (i = 0; i < num_pulses; ++i) {
         double t = sp->pulses[i].t, a = sp->pulses[i].a;
-        res += a * get_axis_position_across_moves(m, axis, move_time + t);
+        struct move *pm = sp->cache[i].m;
+        double offset = sp->cache[i].offset, time = move_time + t - offset;
+        while (unlikely(time < 0.)) {
+            pm = list_prev_entry(pm, node);
+            time += pm->move_t;
+            offset -= pm->move_t;
+        }
+        while (unlikely(time >= pm->move_t - POLY_MIN_TIME)) {
+            time -= pm->move_t;
+            offset += pm->move_t;
+            pm = list_next_entry(pm, node);
+        }
+        sp->cache[i].m = pm;
+        sp->cache[i].offset = offset;
+        axis_r = a * pm->axes_r.axis[axis - 'x'];
+        c[0] += a * get_axis_position(pm, axis, time);
+        c[1] += axis_r * (pm->start_v + 2. * pm->half_accel * time);
+        c[2] += axis_r * pm->half_accel;
+        if (pm->move_t - time < duration)
+            duration = pm->move_t - time;
     }
-    return res;
+    return duration;
 }
 
 
@@ -114,6 +182,10 @@ struct input_shaper {
     struct stepper_kinematics *orig_sk;
     struct move m;
     struct shaper_pulses sx, sy;
+    int same_xy;
+    // Stepper position as "lin_base + lin_ratio . shaped_coord" when
+    // the original kinematics are a linear function of the toolhead
+    double lin_base, lin_ratio[3];
 };
 
 // Optimized calc_position when only x axis is needed
@@ -124,7 +196,8 @@ shaper_x_calc_position(struct stepper_kinematics *sk, struct move *m
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
     if (!is->sx.num_pulses)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
+    is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx
+                              , sk->tq);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -136,7 +209,8 @@ shaper_y_calc_position(struct stepper_kinematics *sk, struct move *m
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
     if (!is->sy.num_pulses)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+    is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy
+                              , sk->tq);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -148,14 +222,74 @@ shaper_xy_calc_position(struct stepper_kinematics *sk, struct move *m
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
     if (!is->sx.num_pulses && !is->sy.num_pulses)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
+    if (is->same_xy) {
+        is->m.start_pos.z = m->start_pos.z
+            + m->axes_r.z * move_get_distance(m, move_time);
+        calc_xy_position(m, move_time, &is->sx, sk->tq, &is->m.start_pos);
+        return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
+    }
     is->m.start_pos = move_get_coord(m, move_time);
     if (is->sx.num_pulses)
-        is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
+        is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx
+                              , sk->tq);
     if (is->sy.num_pulses)
-        is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+        is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy
+                              , sk->tq);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
+// Calculate the stepper position as a quadratic polynomial of time
+// (only used when the original kinematics are linear)
+static double
+shaper_calc_poly(struct stepper_kinematics *sk, struct move *m
+                 , double move_time, double coefs[3])
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    struct shaper_pulses *sps[3] = { &is->sx, &is->sy, NULL };
+    double duration = m->move_t - move_time;
+    coefs[0] = is->lin_base;
+    coefs[1] = coefs[2] = 0.;
+    int i;
+    for (i = 0; i < 3; ++i) {
+        double ratio = is->lin_ratio[i], c[3];
+        if (!ratio)
+            continue;
+        double d = calc_position_poly(m, 'x' + i, move_time, sps[i]
+                                      , sk->tq, c);
+        if (d < duration)
+            duration = d;
+        coefs[0] += ratio * c[0];
+        coefs[1] += ratio * c[1];
+        coefs[2] += ratio * c[2];
+    }
+    return duration;
+}
+
+// Check if the original kinematics are a linear function of the
+// toolhead position (by probing its calc_linear_cb along each axis)
+static void
+shaper_note_linear(struct input_shaper *is)
+{
+    struct stepper_kinematics *orig_sk = is->orig_sk;
+    is->sk.calc_poly_cb = NULL;
+    if (!orig_sk->calc_linear_cb)
+        return;
+    struct move probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.move_t = 1.;
+    double base = 0., ratio;
+    int i;
+    for (i = 0; i < 3; ++i) {
+        memset(&probe.axes_r, 0, sizeof(probe.axes_r));
+        probe.axes_r.axis[i] = 1.;
+        if (!orig_sk->calc_linear_cb(orig_sk, &probe, &base, &ratio))
+            return;
+        is->lin_ratio[i] = ratio;
+    }
+    is->lin_base = base;
+    is->sk.calc_poly_cb = shaper_calc_poly;
+}
+
 int __visible
 input_shaper_set_sk(struct stepper_kinematics *sk
                     , struct stepper_kinematics *orig_sk)
@@ -171,6 +305,7 @@ input_shaper_set_sk(struct stepper_kinematics *sk
         return -1;
     is->sk.active_flags = orig_sk->active_flags;
     is->orig_sk = orig_sk;
+    shaper_note_linear(is);
     is->sk.commanded_pos = orig_sk->commanded_pos;
     is->sk.last_flush_time = orig_sk->last_flush_time;
     is->sk.last_move_time = orig_sk->last_move_time;
@@ -195,6 +330,15 @@ shaper_note_generation_time(struct input_shaper *is)
     is->sk.gen_steps_post_active = post_active;
 }
 
+// Note if the x and y axes are shaped with identical pulses
+static void
+shaper_note_same_xy(struct input_shaper *is)
+{
+    is->same_xy = ((is->sk.active_flags & (AF_X | AF_Y)) == (AF_X | AF_Y)
+                   && is->sx.num_pulses
+                   && shaper_pulses_equal(&is->sx, &is->sy));
+}
+
 int __visible
 input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
                                , int n, double a[], double t[])
@@ -208,6 +352,7 @@ input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
     if (is->orig_sk->active_flags & (axis == 'x' ? AF_X : AF_Y)) {
         status = init_shaper(n, a, t, sp);
         shaper_note_generation_time(is);
+        shaper_note_same_xy(is);
     }
     return status;
 }
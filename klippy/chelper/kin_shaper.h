@@ -0,0 +1,70 @@
+#ifndef KIN_SHAPER_H
+#define KIN_SHAPER_H
+
+#include <stdint.h> // uint64_t
+#include "compiler.h" // likely
+#include "trapq.h" // struct move
+
+#define SHAPER_MAX_PULSES 5
+
+struct shaper_pulses {
+    int num_pulses;
+    struct {
+        double t, a;
+    } pulses[SHAPER_MAX_PULSES];
+    // Cache of the moves containing each pulse time
+    struct move *cache_move;
+    uint64_t cache_update_count;
+    struct {
+        struct move *m;
+        double offset;
+    } cache[SHAPER_MAX_PULSES];
+};
+
+int init_shaper(int n, double a[], double t[], struct shaper_pulses *sp);
+int shaper_pulses_equal(struct shaper_pulses *sp1, struct shaper_pulses *sp2);
+
+// Reset the pulse move cache if the move or trapq may have changed
+static inline void
+shaper_check_cache(struct shaper_pulses *sp, struct move *m
+                   , uint64_t update_count)
+{
+    if (likely(sp->cache_move == m && sp->cache_update_count == update_count))
+        return;
+    sp->cache_move = m;
+    sp->cache_update_count = update_count;
+    int i;
+    for (i = 0; i < sp->num_pulses; ++i) {
+        sp->cache[i].m = m;
+        sp->cache[i].offset = 0.;
+    }
+}
+
+// Find the move containing the time of pulse 'i' (and the time of the
+// pulse relative to the start of that move)
+static inline struct move *
+shaper_pulse_move(struct shaper_pulses *sp, int i, double move_time
+                  , double *pulse_time)
+{
+    // Successive solver guesses are close in time, so start the
+    // search from the move found on the previous guess
+    struct move *pm = sp->cache[i].m;
+    double offset = sp->cache[i].offset;
+    double time = move_time + sp->pulses[i].t - offset;
+    while (unlikely(time < 0.)) {
+        pm = list_prev_entry(pm, node);
+        time += pm->move_t;
+        offset -= pm->move_t;
+    }
+    while (unlikely(time > pm->move_t)) {
+        time -= pm->move_t;
+        offset += pm->move_t;
+        pm = list_next_entry(pm, node);
+    }
+    sp->cache[i].m = pm;
+    sp->cache[i].offset = offset;
+    *pulse_time = time;
+    return pm;
+}
+
+#endif // kin_shaper.h
@@ -28,6 +28,54 @@ winch_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(dx*dx + dy*dy + dz*dz);
 }
 
+// The cable length along a straight move is a convex function of the
+// move distance, so it has at most one minimum.  Report the move
+// distance of that minimum (where the cable velocity is zero).
+static int
+winch_stepper_calc_peak(struct stepper_kinematics *sk, struct move *m
+                        , double *peak_dist, int *peak_is_max)
+{
+    struct winch_stepper *hs = container_of(sk, struct winch_stepper, sk);
+    double dx = hs->anchor.x - m->start_pos.x;
+    double dy = hs->anchor.y - m->start_pos.y;
+    double dz = hs->anchor.z - m->start_pos.z;
+    double rx = m->axes_r.x, ry = m->axes_r.y, rz = m->axes_r.z;
+    double n = rx*rx + ry*ry + rz*rz;
+    if (!n)
+        return 0;
+    *peak_dist = (rx*dx + ry*dy + rz*dz) / n;
+    *peak_is_max = 0;
+    return 1;
+}
+
+// Find the move distance where the cable length reaches 'pos' (the
+// intersection of the move line with a sphere of radius 'pos'
+// centered on the anchor)
+static double
+winch_stepper_calc_inverse(struct stepper_kinematics *sk, struct move *m
+                           , double pos, int is_rising)
+{
+    struct winch_stepper *hs = container_of(sk, struct winch_stepper, sk);
+    double dx = hs->anchor.x - m->start_pos.x;
+    double dy = hs->anchor.y - m->start_pos.y;
+    double dz = hs->anchor.z - m->start_pos.z;
+    double rx = m->axes_r.x, ry = m->axes_r.y, rz = m->axes_r.z;
+    // Solve "n*d^2 - 2*b*d + c = 0" for the move distance d
+    double n = rx*rx + ry*ry + rz*rz;
+    double b = rx*dx + ry*dy + rz*dz;
+    double c = dx*dx + dy*dy + dz*dz - pos*pos;
+    double disc = b*b - n*c;
+    double sq = disc > 0. ? sqrt(disc) : 0.;
+    double q = b >= 0. ? b + sq : b - sq;
+    if (!q)
+        return b / n;
+    double d1 = q / n, d2 = c / q;
+    // The cable shortens before the minimum and lengthens after it
+    if (is_rising)
+        return d1 > d2 ? d1 : d2;
+    return d1 > d2 ? d2 : d1;
+}
+
 struct stepper_kinematics * __visible
 winch_stepper_alloc(double anchor_x, double anchor_y, double anchor_z)
 {
@@ -37,6 +85,8 @@ winch_stepper_alloc(double anchor_x, double anchor_y, double anchor_z)
     hs->anchor.y = anchor_y;
     hs->anchor.z = anchor_z;
     hs->sk.calc_position_cb = winch_stepper_calc_position;
+    hs->sk.calc_peak_cb = winch_stepper_calc_peak;
+    hs->sk.calc_inverse_cb = winch_stepper_calc_inverse;
     hs->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &hs->sk;
 }
@@ -0,0 +1,244 @@
+// Toolhead move "look-ahead" velocity planning
+//
+// Copyright (C) 2016-2024  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // sqrt
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "trapq.h" // struct coord
+
+// Junction speeds are tracked in velocity squared.  The delta_v2 is
+// the maximum amount of this squared-velocity that can change in a
+// move.
+struct lookahead_move {
+    double move_d, accel, junction_deviation, max_cruise_v2;
+    double delta_v2, smooth_delta_v2;
+    struct coord axes_r;
+    int is_kinematic_move;
+    double max_start_v2, max_smoothed_v2;
+};
+
+struct lookahead_delayed {
+    int pos;
+    double start_v2, end_v2;
+};
+
+struct lookahead {
+    struct lookahead_move *queue;
+    struct lookahead_delayed *delayed;
+    int count, alloc;
+};
+
+#define QUEUE_START_SIZE 64
+
+
+/****************************************************************
+ * Junction calculation
+ ****************************************************************/
+
+static inline double
+fmin2(double a, double b)
+{
+    return a < b ? a : b;
+}
+
+// Find the maximum junction velocity between two moves
+static void
+calc_junction(struct lookahead_move *move, struct lookahead_move *prev_move
+              , double extruder_v2)
+{
+    if (!move->is_kinematic_move || !prev_move->is_kinematic_move)
+        return;
+    // Find max velocity using "approximated centripetal velocity"
+    struct coord *axes_r = &move->axes_r, *prev_axes_r = &prev_move->axes_r;
+    double junction_cos_theta = -(axes_r->x * prev_axes_r->x
+                                  + axes_r->y * prev_axes_r->y
+                                  + axes_r->z * prev_axes_r->z);
+    if (junction_cos_theta > 0.999999)
+        return;
+    if (junction_cos_theta < -0.999999)
+        junction_cos_theta = -0.999999;
+    double sin_theta_d2 = sqrt(0.5*(1.0-junction_cos_theta));
+    double R_jd = sin_theta_d2 / (1. - sin_theta_d2);
+    // Approximated circle must contact moves no further away than mid-move
+    double tan_theta_d2 = sin_theta_d2 / sqrt(0.5*(1.0+junction_cos_theta));
+    double move_centripetal_v2 = .5 * move->move_d * tan_theta_d2 * move->accel;
+    double prev_move_centripetal_v2 = (.5 * prev_move->move_d * tan_theta_d2
+                                       * prev_move->accel);
+    // Apply limits
+    double v2 = R_jd * move->junction_deviation * move->accel;
+    v2 = fmin2(v2, R_jd * prev_move->junction_deviation * prev_move->accel);
+    v2 = fmin2(v2, move_centripetal_v2);
+    v2 = fmin2(v2, prev_move_centripetal_v2);
+    v2 = fmin2(v2, extruder_v2);
+    v2 = fmin2(v2, move->max_cruise_v2);
+    v2 = fmin2(v2, prev_move->max_cruise_v2);
+    v2 = fmin2(v2, prev_move->max_start_v2 + prev_move->delta_v2);
+    move->max_start_v2 = v2;
+    move->max_smoothed_v2 = fmin2(
+        v2, prev_move->max_smoothed_v2 + prev_move->smooth_delta_v2);
+}
+
+
+/****************************************************************
+ * Velocity planning
+ ****************************************************************/
+
+static inline void
+set_junction(double *junctions, int pos
+             , double start_v2, double cruise_v2, double end_v2)
+{
+    junctions[pos*3] = start_v2;
+    junctions[pos*3 + 1] = cruise_v2;
+    junctions[pos*3 + 2] = end_v2;
+}
+
+// Determine the start, cruise, and end velocities (squared) of the
+// queued moves.  The velocities of each move that may be flushed are
+// stored in 'junctions' (three doubles per move).  Returns the number
+// of moves that may be flushed (which may be zero).
+int __visible
+lookahead_flush(struct lookahead *la, int lazy, double *junctions)
+{
+    struct lookahead_move *queue = la->queue;
+    struct lookahead_delayed *delayed = la->delayed;
+    int update_flush_count = lazy, flush_count = la->count, num_delayed = 0;
+    // Traverse queue from last to first move and determine maximum
+    // junction speed assuming the robot comes to a complete stop
+    // after the last move.
+    double next_end_v2 = 0., next_smoothed_v2 = 0., peak_cruise_v2 = 0.;
+    int i;
+    for (i=flush_count-1; i>=0; i--) {
+        struct lookahead_move *move = &queue[i];
+        double reachable_start_v2 = next_end_v2 + move->delta_v2;
+        double start_v2 = fmin2(move->max_start_v2, reachable_start_v2);
+        double reachable_smoothed_v2 = next_smoothed_v2+move->smooth_delta_v2;
+        double smoothed_v2 = fmin2(move->max_smoothed_v2
+                                   , reachable_smoothed_v2);
+        if (smoothed_v2 < reachable_smoothed_v2) {
+            // It's possible for this move to accelerate
+            if (smoothed_v2 + move->smooth_delta_v2 > next_smoothed_v2
+                || num_delayed) {
+                // This move can decelerate or this is a full accel
+                // move after a full decel move
+                if (update_flush_count && peak_cruise_v2) {
+                    flush_count = i;
+                    update_flush_count = 0;
+                }
+                peak_cruise_v2 = fmin2(move->max_cruise_v2, (
+                    smoothed_v2 + reachable_smoothed_v2) * .5);
+                if (num_delayed) {
+                    // Propagate peak_cruise_v2 to any delayed moves
+                    if (!update_flush_count && i < flush_count) {
+                        double mc_v2 = peak_cruise_v2;
+                        while (num_delayed) {
+                            struct lookahead_delayed *d
+                                = &delayed[--num_delayed];
+                            mc_v2 = fmin2(mc_v2, d->start_v2);
+                            set_junction(junctions, d->pos
+                                         , fmin2(d->start_v2, mc_v2), mc_v2
+                                         , fmin2(d->end_v2, mc_v2));
+                        }
+                    }
+                    num_delayed = 0;
+                }
+            }
+            if (!update_flush_count && i < flush_count) {
+                double cruise_v2 = fmin2(
+                    (start_v2 + reachable_start_v2) * .5
+                    , fmin2(move->max_cruise_v2, peak_cruise_v2));
+                set_junction(junctions, i, fmin2(start_v2, cruise_v2)
+                             , cruise_v2, fmin2(next_end_v2, cruise_v2));
+            }
+        } else {
+            // Delay calculating this move until peak_cruise_v2 is known
+            struct lookahead_delayed *d = &delayed[num_delayed++];
+            d->pos = i;
+            d->start_v2 = start_v2;
+            d->end_v2 = next_end_v2;
+        }
+        next_end_v2 = start_v2;
+        next_smoothed_v2 = smoothed_v2;
+    }
+    if (update_flush_count)
+        return 0;
+    return flush_count;
+}
+
+
+/****************************************************************
+ * Queue management
+ ****************************************************************/
+
+// Add a move to the look-ahead queue
+void __visible
+lookahead_add_move(struct lookahead *la, double move_d, double accel
+                   , double junction_deviation, double max_cruise_v2
+                   , double delta_v2, double smooth_delta_v2
+                   , int is_kinematic_move
+                   , double axes_r_x, double axes_r_y, double axes_r_z
+                   , double extruder_v2)
+{
+    if (la->count >= la->alloc) {
+        int alloc = la->alloc ? la->alloc * 2 : QUEUE_START_SIZE;
+        la->queue = realloc(la->queue, alloc * sizeof(*la->queue));
+        la->delayed = realloc(la->delayed, alloc * sizeof(*la->delayed));
+        la->alloc = alloc;
+    }
+    struct lookahead_move *move = &la->queue[la->count++];
+    memset(move, 0, sizeof(*move));
+    move->move_d = move_d;
+    move->accel = accel;
+    move->junction_deviation = junction_deviation;
+    move->max_cruise_v2 = max_cruise_v2;
+    move->delta_v2 = delta_v2;
+    move->smooth_delta_v2 = smooth_delta_v2;
+    move->is_kinematic_move = is_kinematic_move;
+    move->axes_r.x = axes_r_x;
+    move->axes_r.y = axes_r_y;
+    move->axes_r.z = axes_r_z;
+    if (la->count > 1)
+        calc_junction(move, move - 1, extruder_v2);
+}
+
+// Remove moves from the front of the look-ahead queue
+void __visible
+lookahead_remove_moves(struct lookahead *la, int count)
+{
+    if (count >= la->count) {
+        la->count = 0;
+        return;
+    }
+    la->count -= count;
+    memmove(la->queue, &la->queue[count], la->count * sizeof(*la->queue));
+}
+
+// Remove all moves from the look-ahead queue
+void __visible
+lookahead_reset(struct lookahead *la)
+{
+    la->count = 0;
+}
+
+// Allocate a new 'lookahead' object
+struct lookahead * __visible
+lookahead_alloc(void)
+{
+    struct lookahead *la = malloc(sizeof(*la));
+    memset(la, 0, sizeof(*la));
+    return la;
+}
+
+// Free memory associated with a 'lookahead' object
+void __visible
+lookahead_free(struct lookahead *la)
+{
+    if (!la)
+        return;
+    free(la->queue);
+    free(la->delayed);
+    free(la);
+}
@@ -0,0 +1,94 @@
+// Fixed size object allocation with per-type free lists and statistics
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <stdint.h> // int64_t
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "mempool.h" // mempool_alloc
+
+struct mempool_item {
+    struct mempool_item *next;
+};
+
+// List of all pools that have been used (for mempool_get_stats)
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mempool *pools;
+
+// Add a pool to the list of pools reported by mempool_get_stats()
+static void
+mempool_register(struct mempool *mp)
+{
+    pthread_mutex_lock(&pools_lock);
+    mp->next = pools;
+    pools = mp;
+    pthread_mutex_unlock(&pools_lock);
+}
+
+// Allocate a zero'd object - reusing a previously freed object if able
+void *
+mempool_alloc(struct mempool *mp)
+{
+    pthread_mutex_lock(&mp->lock);
+    if (!mp->registered) {
+        mp->registered = 1;
+        mempool_register(mp);
+    }
+    struct mempool_item *item = mp->free_list;
+    if (item) {
+        mp->free_list = item->next;
+        mp->free_count--;
+    }
+    mp->live++;
+    if (mp->live > mp->peak)
+        mp->peak = mp->live;
+    pthread_mutex_unlock(&mp->lock);
+    if (!item) {
+        size_t size = mp->size;
+        if (size < sizeof(*item))
+            size = sizeof(*item);
+        item = malloc(size);
+    }
+    memset(item, 0, mp->size);
+    return item;
+}
+
+// Release an object - it is retained for reuse unless the free list is full
+void
+mempool_free(struct mempool *mp, void *p)
+{
+    if (!p)
+        return;
+    struct mempool_item *item = p;
+    pthread_mutex_lock(&mp->lock);
+    mp->live--;
+    if (mp->free_count < mp->max_free) {
+        item->next = mp->free_list;
+        mp->free_list = item;
+        mp->free_count++;
+        item = NULL;
+    }
+    pthread_mutex_unlock(&mp->lock);
+    free(item);
+}
+
+// Report the object counts of each pool
+int __visible
+mempool_get_stats(struct pull_mempool *pm, int max)
+{
+    pthread_mutex_lock(&pools_lock);
+    struct mempool *mp = pools;
+    int count = 0;
+    for (; mp && count < max; mp = mp->next, count++) {
+        pthread_mutex_lock(&mp->lock);
+        pm[count].name = mp->name;
+        pm[count].size = mp->size;
+        pm[count].live = mp->live;
+        pm[count].free = mp->free_count;
+        pm[count].peak = mp->peak;
+        pthread_mutex_unlock(&mp->lock);
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return count;
+}
@@ -0,0 +1,34 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <pthread.h> // pthread_mutex_t
+#include <stddef.h> // size_t
+#include <stdint.h> // int64_t
+
+struct mempool_item;
+
+struct mempool {
+    const char *name;
+    size_t size;
+    int max_free;
+    pthread_mutex_t lock;
+    struct mempool_item *free_list;
+    int free_count, registered;
+    int64_t live, peak;
+    struct mempool *next;
+};
+
+struct pull_mempool {
+    const char *name;
+    int64_t size, live, free, peak;
+};
+
+#define MEMPOOL_DEFINE(NAME, SIZE, MAX_FREE) {                      \
+        .name = (NAME), .size = (SIZE), .max_free = (MAX_FREE),     \
+        .lock = PTHREAD_MUTEX_INITIALIZER }
+
+void *mempool_alloc(struct mempool *mp);
+void mempool_free(struct mempool *mp, void *p);
+int mempool_get_stats(struct pull_mempool *pm, int max);
+
+#endif // mempool.h
@@ -7,6 +7,8 @@
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include "compiler.h" // __visible
+#include "mempool.h" // mempool_alloc
 #include "msgblock.h" // message_alloc
 #include "pyhelper.h" // errorf
 
@@ -15,18 +17,49 @@
  * Serial protocol helpers
  ****************************************************************/
 
+// Lookup table for the crc "ccitt" algorithm (one entry per byte value)
+static const uint16_t crc16_ccitt_table[256] = {
+    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
 // Implement the standard crc "ccitt" algorithm on the given buffer
 uint16_t
 msgblock_crc16_ccitt(uint8_t *buf, uint8_t len)
 {
     uint16_t crc = 0xffff;
-    while (len--) {
-        uint8_t data = *buf++;
-        data ^= crc & 0xff;
-        data ^= data << 4;
-        crc = ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
-               ^ ((uint16_t)data << 3));
-    }
+    while (len--)
+        crc = (crc >> 8) ^ crc16_ccitt_table[(crc ^ *buf++) & 0xff];
     return crc;
 }
 
@@ -69,8 +102,8 @@ error: ;
 }
 
 // Encode an integer as a variable length quantity (vlq)
-static uint8_t *
-encode_int(uint8_t *p, uint32_t v)
+uint8_t *
+msgblock_encode_int(uint8_t *p, uint32_t v)
 {
     int32_t sv = v;
     if (sv < (3L<<5)  && sv >= -(1L<<5))  goto f4;
@@ -86,8 +119,8 @@ f4: *p++ = v & 0x7f;
 }
 
 // Parse an integer that was encoded as a "variable length quantity"
-static uint32_t
-parse_int(uint8_t **pp)
+uint32_t
+msgblock_parse_int(uint8_t **pp)
 {
     uint8_t *p = *pp, c = *p++;
     uint32_t v = c & 0x7f;
@@ -110,7 +143,7 @@ msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len)
     while (data_len--) {
         if (p >= end)
             return -1;
-        *data++ = parse_int(&p);
+        *data++ = msgblock_parse_int(&p);
     }
     if (p != end)
         // Invalid message
@@ -118,18 +151,111 @@ msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len)
     return 0;
 }
 
+// Decode message parameters given a string of parameter types ('u'
+// unsigned int, 'i' signed int, 's' buffer).  A buffer is stored as
+// its offset from 'base' shifted left by 8 bits plus its length.
+static int
+decode_param_types(uint8_t **pp, uint8_t *end, char *types, int64_t *data
+                   , uint8_t *base)
+{
+    uint8_t *p = *pp;
+    int count = 0;
+    for (; *types; types++, count++) {
+        if (p >= end)
+            return -1;
+        switch (*types) {
+        case 'u':
+            *data++ = msgblock_parse_int(&p);
+            break;
+        case 'i':
+            *data++ = (int32_t)msgblock_parse_int(&p);
+            break;
+        case 's': {
+            int len = *p++;
+            if (len > end - p)
+                return -1;
+            *data++ = ((int64_t)(p - base) << 8) | len;
+            p += len;
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+    *pp = p;
+    return count;
+}
+
+// Decode the parameters of a received message (see decode_param_types
+// for the format of 'types' and 'data').  Returns the number of
+// parameters decoded or -1 if the message does not match the types.
+int __visible
+msgblock_decode_params(uint8_t *msg, int msg_len, char *types
+                       , int64_t *data)
+{
+    uint8_t *p = &msg[MESSAGE_HEADER_SIZE];
+    uint8_t *end = &msg[msg_len - MESSAGE_TRAILER_SIZE];
+    // Skip the message id (ids over 127 use more than one byte)
+    while (p < end && *p++ & 0x80)
+        ;
+    int count = decode_param_types(&p, end, types, data, msg);
+    if (p != end)
+        // Invalid message
+        return -1;
+    return count;
+}
+
+// Decode a stream of message blocks (such as a debug output file).
+// The parameter types of each message id are given in 'formats' (an
+// array of 128 entries).  Each message is stored in 'data' as its id
+// followed by its parameters (buffer offsets are relative to 'buf').
+// Decoding stops at the first block that is incomplete, invalid, or
+// contains an unknown message.  Returns the number of 'data' entries
+// filled and stores the number of bytes decoded in 'consumed'.
+int __visible
+msgblock_decode_stream(uint8_t *buf, int buf_len, char **formats
+                       , int64_t *data, int data_max, int *consumed)
+{
+    int pos = 0, count = 0;
+    while (data_max - count >= MESSAGE_PAYLOAD_MAX) {
+        uint8_t need_sync = 0;
+        int len = msgblock_check(&need_sync, &buf[pos], buf_len - pos);
+        if (len <= 0)
+            break;
+        uint8_t *p = &buf[pos + MESSAGE_HEADER_SIZE];
+        uint8_t *end = &buf[pos + len - MESSAGE_TRAILER_SIZE];
+        int64_t *d = &data[count];
+        while (p < end) {
+            uint8_t msgid = *p++;
+            if (msgid & 0x80 || !formats[msgid])
+                goto done;
+            *d++ = msgid;
+            int ret = decode_param_types(&p, end, formats[msgid], d, buf);
+            if (ret < 0)
+                goto done;
+            d += ret;
+        }
+        count = d - data;
+        pos += len;
+    }
+done:
+    *consumed = pos;
+    return count;
+}
+
 
 /****************************************************************
  * Command queues
  ****************************************************************/
 
+static struct mempool message_pool = MEMPOOL_DEFINE(
+    "queue_message", sizeof(struct queue_message), 1024);
+
 // Allocate a 'struct queue_message' object
 struct queue_message *
 message_alloc(void)
 {
-    struct queue_message *qm = malloc(sizeof(*qm));
-    memset(qm, 0, sizeof(*qm));
-    return qm;
+    return mempool_alloc(&message_pool);
 }
 
 // Allocate a queue_message and fill it with the specified data
@@ -150,7 +276,7 @@ message_alloc_and_encode(uint32_t *data, int len)
     int i;
     uint8_t *p = qm->msg;
     for (i=0; i<len; i++) {
-        p = encode_int(p, data[i]);
+        p = msgblock_encode_int(p, data[i]);
         if (p > &qm->msg[MESSAGE_PAYLOAD_MAX])
             goto fail;
     }
@@ -167,7 +293,7 @@ fail:
 void
 message_free(struct queue_message *qm)
 {
-    free(qm);
+    mempool_free(&message_pool, qm);
 }
 
 // Free all the messages on a queue
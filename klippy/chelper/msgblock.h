@@ -24,6 +24,8 @@ struct queue_message {
         // Filled when on a command queue
         struct {
             uint64_t min_clock, req_clock;
+            // Number of mcu 'move queue' items used (if min_clock set)
+            int move_count;
         };
         // Filled when in sent/receive queues
         struct {
@@ -41,7 +43,13 @@ struct clock_estimate {
 
 uint16_t msgblock_crc16_ccitt(uint8_t *buf, uint8_t len);
 int msgblock_check(uint8_t *need_sync, uint8_t *buf, int buf_len);
+uint8_t *msgblock_encode_int(uint8_t *p, uint32_t v);
+uint32_t msgblock_parse_int(uint8_t **pp);
 int msgblock_decode(uint32_t *data, int data_len, uint8_t *msg, int msg_len);
+int msgblock_decode_params(uint8_t *msg, int msg_len, char *types
+                           , int64_t *data);
+int msgblock_decode_stream(uint8_t *buf, int buf_len, char **formats
+                           , int64_t *data, int data_max, int *consumed);
 struct queue_message *message_alloc(void);
 struct queue_message *message_fill(uint8_t *data, int len);
 struct queue_message *message_alloc_and_encode(uint32_t *data, int len);
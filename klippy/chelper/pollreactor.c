@@ -4,11 +4,17 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <errno.h> // EPERM
 #include <fcntl.h> // fcntl
 #include <math.h> // ceil
 #include <poll.h> // poll
+#include <stddef.h> // offsetof
+#include <pthread.h> // pthread_mutex_lock
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/epoll.h> // epoll_wait
+#include <unistd.h> // pipe
+#include "list.h" // list_add_tail
 #include "pollreactor.h" // pollreactor_alloc
 #include "pyhelper.h" // report_errno
 
@@ -17,6 +23,11 @@ struct pollreactor_timer {
     double (*callback)(void *data, double eventtime);
 };
 
+struct pollreactor_fdref {
+    struct pollreactor *pr;
+    int pos;
+};
+
 struct pollreactor {
     int num_fds, num_timers, must_exit;
     void *callback_data;
@@ -24,6 +35,11 @@ struct pollreactor {
     struct pollfd *fds;
     void (**fd_callbacks)(void *data, double eventtime);
     struct pollreactor_timer *timers;
+    // Group support
+    struct pollreactor_group *group;
+    struct list_node group_node;
+    struct pollreactor_fdref *fdrefs;
+    void (*exit_callback)(void *data);
 };
 
 // Allocate a new 'struct pollreactor' object
@@ -59,6 +75,8 @@ pollreactor_free(struct pollreactor *pr)
     pr->fd_callbacks = NULL;
     free(pr->timers);
     pr->timers = NULL;
+    free(pr->fdrefs);
+    pr->fdrefs = NULL;
     free(pr);
 }
 
@@ -73,6 +91,15 @@ pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback
     pr->fd_callbacks[pos] = callback;
 }
 
+// Add a callback for when a file descriptor (fd) becomes writable
+void
+pollreactor_add_fd_writable(struct pollreactor *pr, int pos, int fd
+                            , void *callback)
+{
+    pollreactor_add_fd(pr, pos, fd, callback, 1);
+    pr->fds[pos].events |= POLLOUT;
+}
+
 // Add a timer callback
 void
 pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback)
@@ -162,6 +189,204 @@ pollreactor_is_exit(struct pollreactor *pr)
     return pr->must_exit;
 }
 
+// A pollreactor_group services the fds and timers of several
+// pollreactor instances from a single thread using epoll.
+
+struct pollreactor_group {
+    int epoll_fd, must_exit;
+    int pipe_fds[2];
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond;
+    struct list_head members;
+};
+
+#define PRG_MAX_EVENTS 16
+
+// Allocate a new 'struct pollreactor_group' object
+struct pollreactor_group *
+pollreactor_group_alloc(void)
+{
+    struct pollreactor_group *g = malloc(sizeof(*g));
+    memset(g, 0, sizeof(*g));
+    list_init(&g->members);
+    g->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g->epoll_fd < 0)
+        goto fail;
+    int ret = pipe(g->pipe_fds);
+    if (ret)
+        goto fail;
+    fd_set_non_blocking(g->pipe_fds[0]);
+    fd_set_non_blocking(g->pipe_fds[1]);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    ret = epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, g->pipe_fds[0], &ev);
+    if (ret)
+        goto fail;
+    ret = pthread_mutex_init(&g->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_cond_init(&g->cond, NULL);
+    if (ret)
+        goto fail;
+    return g;
+
+fail:
+    report_errno("pollreactor_group_alloc", -1);
+    return NULL;
+}
+
+// Free resources associated with a 'struct pollreactor_group' object
+void
+pollreactor_group_free(struct pollreactor_group *g)
+{
+    if (!list_empty(&g->members)) {
+        errorf("Memory leak! Can't free non-empty pollreactor_group");
+        return;
+    }
+    close(g->epoll_fd);
+    close(g->pipe_fds[0]);
+    close(g->pipe_fds[1]);
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->cond);
+    free(g);
+}
+
+// Wake the group thread if it is in epoll_wait()
+static void
+group_kick(struct pollreactor_group *g)
+{
+    int ret = write(g->pipe_fds[1], ".", 1);
+    if (ret < 0)
+        report_errno("pipe write", ret);
+}
+
+// Have the group thread service the fds and timers of 'pr'.  The
+// optional exit_callback is invoked from the group thread once 'pr'
+// has requested an exit and is no longer being serviced.
+int
+pollreactor_group_add(struct pollreactor_group *g, struct pollreactor *pr
+                      , void (*exit_callback)(void *data))
+{
+    pr->fdrefs = malloc(pr->num_fds * sizeof(*pr->fdrefs));
+    pr->exit_callback = exit_callback;
+    pthread_mutex_lock(&g->lock);
+    int i;
+    for (i=0; i<pr->num_fds; i++) {
+        pr->fdrefs[i].pr = pr;
+        pr->fdrefs[i].pos = i;
+        struct epoll_event ev = { .data.ptr = &pr->fdrefs[i] };
+        if (pr->fds[i].events & POLLIN)
+            ev.events |= EPOLLIN;
+        if (pr->fds[i].events & POLLOUT)
+            ev.events |= EPOLLOUT;
+        int ret = epoll_ctl(g->epoll_fd, EPOLL_CTL_ADD, pr->fds[i].fd, &ev);
+        if (ret && !(errno == EPERM && !ev.events)) {
+            // Regular files can't be polled (and are never reported
+            // as hung up), so only failures on other fds are errors
+            report_errno("epoll_ctl", ret);
+            while (i--)
+                epoll_ctl(g->epoll_fd, EPOLL_CTL_DEL, pr->fds[i].fd, NULL);
+            pthread_mutex_unlock(&g->lock);
+            return -1;
+        }
+    }
+    pr->group = g;
+    list_add_tail(&pr->group_node, &g->members);
+    pthread_mutex_unlock(&g->lock);
+    group_kick(g);
+    return 0;
+}
+
+// Wait for the group thread to stop servicing 'pr' (which must have
+// been requested to exit via pollreactor_do_exit())
+void
+pollreactor_group_wait_removed(struct pollreactor_group *g
+                               , struct pollreactor *pr)
+{
+    group_kick(g);
+    pthread_mutex_lock(&g->lock);
+    while (pr->group) {
+        int ret = pthread_cond_wait(&g->cond, &g->lock);
+        if (ret)
+            report_errno("pthread_cond_wait", ret);
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+// Stop servicing a member that has requested an exit
+static void
+group_remove(struct pollreactor_group *g, struct pollreactor *pr)
+{
+    int i;
+    for (i=0; i<pr->num_fds; i++)
+        epoll_ctl(g->epoll_fd, EPOLL_CTL_DEL, pr->fds[i].fd, NULL);
+    list_del(&pr->group_node);
+    pr->group = NULL;
+    if (pr->exit_callback)
+        pr->exit_callback(pr->callback_data);
+    pthread_cond_broadcast(&g->cond);
+}
+
+// Run timers on all members and return the epoll_wait() timeout
+static int
+group_check_timers(struct pollreactor_group *g, double eventtime, int busy)
+{
+    int timeout = 1000;
+    pthread_mutex_lock(&g->lock);
+    struct pollreactor *pr, *npr;
+    list_for_each_entry_safe(pr, npr, &g->members, group_node) {
+        if (pr->must_exit) {
+            group_remove(g, pr);
+            continue;
+        }
+        int t = pollreactor_check_timers(pr, eventtime, busy);
+        if (t < timeout)
+            timeout = t;
+    }
+    pthread_mutex_unlock(&g->lock);
+    return timeout;
+}
+
+// Repeatedly check for timer and fd events on all group members
+void
+pollreactor_group_run(struct pollreactor_group *g)
+{
+    struct epoll_event events[PRG_MAX_EVENTS];
+    double eventtime = get_monotonic();
+    int busy = 1;
+    while (! g->must_exit) {
+        int timeout = group_check_timers(g, eventtime, busy);
+        busy = 0;
+        int ret = epoll_wait(g->epoll_fd, events, PRG_MAX_EVENTS, timeout);
+        eventtime = get_monotonic();
+        if (ret > 0) {
+            busy = 1;
+            int i;
+            for (i=0; i<ret; i++) {
+                struct pollreactor_fdref *ref = events[i].data.ptr;
+                if (!ref) {
+                    char dummy[4096];
+                    int r = read(g->pipe_fds[0], dummy, sizeof(dummy));
+                    (void)r;
+                    continue;
+                }
+                struct pollreactor *pr = ref->pr;
+                pr->fd_callbacks[ref->pos](pr->callback_data, eventtime);
+            }
+        } else if (ret < 0 && errno != EINTR) {
+            report_errno("epoll_wait", ret);
+            g->must_exit = 1;
+        }
+    }
+}
+
+// Request that a currently running pollreactor_group_run() loop exit
+void
+pollreactor_group_do_exit(struct pollreactor_group *g)
+{
+    g->must_exit = 1;
+    group_kick(g);
+}
+
 int
 fd_set_non_blocking(int fd)
 {
@@ -9,12 +9,22 @@ struct pollreactor *pollreactor_alloc(int num_fds, int num_timers
 void pollreactor_free(struct pollreactor *pr);
 void pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback
                         , int write_only);
+void pollreactor_add_fd_writable(struct pollreactor *pr, int pos, int fd
+                                 , void *callback);
 void pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback);
 double pollreactor_get_timer(struct pollreactor *pr, int pos);
 void pollreactor_update_timer(struct pollreactor *pr, int pos, double waketime);
 void pollreactor_run(struct pollreactor *pr);
 void pollreactor_do_exit(struct pollreactor *pr);
 int pollreactor_is_exit(struct pollreactor *pr);
+struct pollreactor_group *pollreactor_group_alloc(void);
+void pollreactor_group_free(struct pollreactor_group *g);
+int pollreactor_group_add(struct pollreactor_group *g, struct pollreactor *pr
+                          , void (*exit_callback)(void *data));
+void pollreactor_group_wait_removed(struct pollreactor_group *g
+                                    , struct pollreactor *pr);
+void pollreactor_group_run(struct pollreactor_group *g);
+void pollreactor_group_do_exit(struct pollreactor_group *g);
 int fd_set_non_blocking(int fd);
 
 #endif // pollreactor.h
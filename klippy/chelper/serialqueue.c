@@ -13,14 +13,19 @@
 // background thread is launched to do this work and minimize latency.
 
 #include <linux/can.h> // // struct can_frame
+#include <linux/can/raw.h> // CAN_RAW_RECV_OWN_MSGS
 #include <math.h> // fabs
 #include <pthread.h> // pthread_mutex_lock
+#include <sched.h> // SCHED_FIFO
 #include <stddef.h> // offsetof
 #include <stdint.h> // uint64_t
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/prctl.h> // prctl
+#include <sys/socket.h> // recvmsg
 #include <termios.h> // tcflush
+#include <time.h> // clock_gettime
 #include <unistd.h> // pipe
 #include "compiler.h" // __visible
 #include "list.h" // list_add_tail
@@ -28,50 +33,69 @@
 #include "pollreactor.h" // pollreactor_alloc
 #include "pyhelper.h" // get_monotonic
 #include "serialqueue.h" // struct queue_message
+#include "usbbulk.h" // usbbulk_read
 
 struct command_queue {
     struct list_head upcoming_queue, ready_queue;
     struct list_node node;
+    int priority;
 };
 
+#define RECEIVE_RING_SIZE 512
+
 struct serialqueue {
     // Input reading
     struct pollreactor *pr;
     int serial_fd, serial_fd_type, client_id;
+    struct usbbulk *usb;
     int pipe_fds[2];
     uint8_t input_buf[4096];
     uint8_t need_sync;
     int input_pos;
+    double input_time;
+    // Canbus transmit echo tracking
+    uint8_t echo_buf[MESSAGE_MAX * 2];
+    uint8_t echo_need_sync;
+    int echo_pos;
     // Threading
     pthread_t tid;
+    int shared_thread;
     pthread_mutex_t lock; // protects variables below
     pthread_cond_t cond;
     int receive_waiting;
     // Baud / clock tracking
-    int receive_window;
-    double bittime_adjust, idle_time;
+    int receive_window, canbus_fd, canbus_timestamps;
+    double bittime_adjust, fd_bittime_adjust, idle_time, batch_time;
     struct clock_estimate ce;
     double last_receive_sent_time;
     // Retransmit support
     uint64_t send_seq, receive_seq;
     uint64_t ignore_nak_seq, last_ack_seq, retransmit_seq, rtt_sample_seq;
+    uint64_t probe_seq;
+    int probe_resend;
     struct list_head sent_queue;
     double srtt, rttvar, rto;
     // Pending transmission message queues
     struct list_head pending_queues;
     int ready_bytes, upcoming_bytes, need_ack_bytes, last_ack_bytes;
     uint64_t need_kick_clock;
+    int have_priority, need_kick_priority;
     struct list_head notify_queue;
     double last_write_fail_time;
-    // Received messages
-    struct list_head receive_queue;
+    // Received messages (ring buffer shared with serialqueue_pull())
+    struct pull_queue_message receive_ring[RECEIVE_RING_SIZE];
+    uint32_t receive_head, receive_tail, receive_debug_pos;
+    struct list_head receive_overflow;
     // Fastreader support
     pthread_mutex_t fast_reader_dispatch_lock;
     struct list_head fast_readers;
     // Debugging
-    struct list_head old_sent, old_receive;
+    struct list_head old_sent;
+    uint8_t *debug_buf;
+    int debug_buf_len;
     // Stats
     uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+    uint32_t blocks_write, retransmit_nak, retransmit_timeout;
 };
 
 #define SQPF_SERIAL 0
@@ -85,16 +109,20 @@ struct serialqueue {
 #define SQT_UART 'u'
 #define SQT_CAN 'c'
 #define SQT_DEBUGFILE 'f'
+#define SQT_USBBULK 'b'
 
 #define MIN_RTO 0.025
 #define MAX_RTO 5.000
 #define MAX_PENDING_BLOCKS 12
+#define PRIORITY_RESERVE_BLOCKS 1
 #define MIN_REQTIME_DELTA 0.250
 #define MIN_BACKGROUND_DELTA 0.005
+#define MAX_BATCH_TIME 0.100
 #define IDLE_QUERY_TIME 1.0
 
 #define DEBUG_QUEUE_SENT 100
 #define DEBUG_QUEUE_RECEIVE 100
+#define DEBUG_BUF_SIZE (256 * 1024)
 
 // Create a series of empty messages and add them to a list
 static void
@@ -128,6 +156,34 @@ check_wake_receive(struct serialqueue *sq)
     }
 }
 
+// Add a received message to the ring buffer read by serialqueue_pull()
+static void
+receive_queue_add(struct serialqueue *sq, uint8_t *msg, int len
+                  , double sent_time, double receive_time, uint64_t notify_id)
+{
+    uint32_t head = sq->receive_head;
+    uint32_t tail = __atomic_load_n(&sq->receive_tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= RECEIVE_RING_SIZE
+        || !list_empty(&sq->receive_overflow)) {
+        // Reader is not keeping up - store in (ordered) overflow list
+        struct queue_message *qm = message_fill(msg, len);
+        qm->sent_time = sent_time;
+        qm->receive_time = receive_time;
+        qm->notify_id = notify_id;
+        list_add_tail(&qm->node, &sq->receive_overflow);
+        return;
+    }
+    struct pull_queue_message *pqm = &sq->receive_ring[
+        head % RECEIVE_RING_SIZE];
+    if (len)
+        memcpy(pqm->msg, msg, len);
+    pqm->len = len;
+    pqm->sent_time = sent_time;
+    pqm->receive_time = receive_time;
+    pqm->notify_id = notify_id;
+    __atomic_store_n(&sq->receive_head, head + 1, __ATOMIC_RELEASE);
+}
+
 // Write to the internal pipe to wake the background thread if in poll
 static void
 kick_bg_thread(struct serialqueue *sq)
@@ -140,12 +196,20 @@ kick_bg_thread(struct serialqueue *sq)
 // Minimum number of bits in a canbus message
 #define CANBUS_PACKET_BITS ((1 + 11 + 3 + 4) + (16 + 2 + 7 + 3))
 #define CANBUS_IFS_BITS 4
+// Minimum number of bits in a canbus FD message (with bit rate switching)
+#define CANFD_NOMINAL_BITS ((1 + 11 + 5) + (2 + 7 + 3))
+#define CANFD_DATA_BITS (1 + 4 + 4 + 21)
 
 // Determine minimum time needed to transmit a given number of bytes
 static double
 calculate_bittime(struct serialqueue *sq, uint32_t bytes)
 {
-    if (sq->serial_fd_type == SQT_CAN) {
+    if (sq->serial_fd_type == SQT_CAN && sq->canbus_fd) {
+        uint32_t pkts = DIV_ROUND_UP(bytes, CANFD_MAX_DLEN);
+        uint32_t nbits = pkts * CANFD_NOMINAL_BITS - CANBUS_IFS_BITS;
+        uint32_t dbits = bytes * 8 + pkts * CANFD_DATA_BITS;
+        return sq->bittime_adjust * nbits + sq->fd_bittime_adjust * dbits;
+    } else if (sq->serial_fd_type == SQT_CAN) {
         uint32_t pkts = DIV_ROUND_UP(bytes, 8);
         uint32_t bits = bytes * 8 + pkts * CANBUS_PACKET_BITS - CANBUS_IFS_BITS;
         return sq->bittime_adjust * bits;
@@ -206,15 +270,38 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         sq->rtt_sample_seq = 0;
     }
     if (list_empty(&sq->sent_queue)) {
+        sq->probe_seq = sq->probe_resend = 0;
         pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NEVER);
+    } else if (sq->probe_seq && rseq >= sq->probe_seq) {
+        // The mcu accepted a timeout retransmit probe, so it must have
+        // discarded the blocks sent after it - resend them now
+        sq->probe_seq = 0;
+        sq->probe_resend = 1;
+        pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NOW);
     } else {
         struct queue_message *sent = list_first_entry(
             &sq->sent_queue, struct queue_message, node);
+        sq->probe_resend = 0;
         double nr = eventtime + sq->rto + calculate_bittime(sq, sent->len);
         pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, nr);
     }
 }
 
+// Find a fast reader that matches the current input message
+static struct fastreader *
+find_fastreader(struct serialqueue *sq, int len)
+{
+    struct fastreader *fr;
+    list_for_each_entry(fr, &sq->fast_readers, node) {
+        if (len < fr->prefix_len + MESSAGE_MIN
+            || memcmp(&sq->input_buf[MESSAGE_HEADER_SIZE]
+                      , fr->prefix, fr->prefix_len) != 0)
+            continue;
+        return fr;
+    }
+    return NULL;
+}
+
 // Process a well formed input message
 static void
 handle_message(struct serialqueue *sq, double eventtime, int len)
@@ -247,39 +334,38 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         if (notify_msg_sent_seq > wake_seq)
             break;
         list_del(&qm->node);
-        qm->len = 0;
-        qm->sent_time = sq->last_receive_sent_time;
-        qm->receive_time = eventtime;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        receive_queue_add(sq, NULL, 0, sq->last_receive_sent_time, eventtime
+                          , qm->notify_id);
+        message_free(qm);
         must_wake = 1;
     }
 
     // Process message
+    struct fastreader *fr = find_fastreader(sq, len);
     if (len == MESSAGE_MIN) {
         // Ack/nak message
         if (sq->last_ack_seq < rseq)
             sq->last_ack_seq = rseq;
-        else if (rseq > sq->ignore_nak_seq && !list_empty(&sq->sent_queue))
+        else if (rseq > sq->ignore_nak_seq
+                 && !list_empty(&sq->sent_queue)) {
             // Duplicate Ack is a Nak - do fast retransmit
+            sq->probe_resend = 0;
             pollreactor_update_timer(sq->pr, SQPT_RETRANSMIT, PR_NOW);
-    } else {
+        }
+    } else if (!fr || !fr->skip_pull) {
         // Data message - add to receive queue
-        struct queue_message *qm = message_fill(sq->input_buf, len);
-        qm->sent_time = (rseq > sq->retransmit_seq
-                         ? sq->last_receive_sent_time : 0.);
-        qm->receive_time = get_monotonic(); // must be time post read()
-        qm->receive_time -= calculate_bittime(sq, len);
-        list_add_tail(&qm->node, &sq->receive_queue);
+        double sent_time = (rseq > sq->retransmit_seq
+                            ? sq->last_receive_sent_time : 0.);
+        double receive_time = sq->input_time;
+        if (!receive_time)
+            receive_time = get_monotonic(); // must be time post read()
+        receive_time -= calculate_bittime(sq, len);
+        receive_queue_add(sq, sq->input_buf, len, sent_time, receive_time, 0);
         must_wake = 1;
     }
 
     // Check fast readers
-    struct fastreader *fr;
-    list_for_each_entry(fr, &sq->fast_readers, node) {
-        if (len < fr->prefix_len + MESSAGE_MIN
-            || memcmp(&sq->input_buf[MESSAGE_HEADER_SIZE]
-                      , fr->prefix, fr->prefix_len) != 0)
-            continue;
+    if (fr) {
         // Release main lock and invoke callback
         pthread_mutex_lock(&sq->fast_reader_dispatch_lock);
         if (must_wake)
@@ -295,22 +381,108 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Convert the kernel receive timestamp (if any) of a canbus frame to
+// the get_monotonic() time base
+static double
+can_frame_time(struct msghdr *mh)
+{
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPNS)
+            continue;
+        struct timespec ts, now;
+        memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+        int ret = clock_gettime(CLOCK_REALTIME, &now);
+        if (ret)
+            return 0.;
+        double age = ((now.tv_sec - ts.tv_sec)
+                      + (now.tv_nsec - ts.tv_nsec) * .000000001);
+        if (age < 0. || age > 1.)
+            // System clock changed - ignore timestamp
+            return 0.;
+        return get_monotonic() - age;
+    }
+    return 0.;
+}
+
+// Note the transmit completion time of message blocks from the echo
+// of canbus frames sent by this host
+static void
+handle_can_echo(struct serialqueue *sq, uint8_t *data, int len
+                , double frame_time)
+{
+    pthread_mutex_lock(&sq->lock);
+    if (sq->echo_pos + len > sizeof(sq->echo_buf))
+        sq->echo_pos = 0;
+    memcpy(&sq->echo_buf[sq->echo_pos], data, len);
+    sq->echo_pos += len;
+    for (;;) {
+        int mlen = msgblock_check(&sq->echo_need_sync, sq->echo_buf
+                                  , sq->echo_pos);
+        if (!mlen)
+            break;
+        if (mlen > 0 && frame_time) {
+            // Block fully transmitted - locate it in the sent queue
+            struct queue_message *qm;
+            list_for_each_entry(qm, &sq->sent_queue, node) {
+                if (qm->len == mlen && !memcmp(qm->msg, sq->echo_buf, mlen)) {
+                    qm->receive_time = frame_time;
+                    break;
+                }
+            }
+        } else if (mlen < 0) {
+            mlen = -mlen;
+        }
+        sq->echo_pos -= mlen;
+        if (sq->echo_pos)
+            memmove(sq->echo_buf, &sq->echo_buf[mlen], sq->echo_pos);
+    }
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Callback for input activity on the serial fd
 static void
 input_event(struct serialqueue *sq, double eventtime)
 {
     if (sq->serial_fd_type == SQT_CAN) {
-        struct can_frame cf;
-        int ret = read(sq->serial_fd, &cf, sizeof(cf));
+        // Classic frames are read using the (compatible) CAN FD layout
+        struct canfd_frame cf;
+        uint8_t ctrl[CMSG_SPACE(sizeof(struct timespec))];
+        struct iovec iov = { .iov_base = &cf, .iov_len = sizeof(cf) };
+        struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1
+                             , .msg_control = ctrl
+                             , .msg_controllen = sizeof(ctrl) };
+        int ret = recvmsg(sq->serial_fd, &mh, 0);
         if (ret <= 0) {
             report_errno("can read", ret);
             pollreactor_do_exit(sq->pr);
             return;
         }
+        int len = ret == CANFD_MTU ? cf.len : (cf.len > 8 ? 8 : cf.len);
+        double frame_time = 0.;
+        if (sq->canbus_timestamps)
+            frame_time = can_frame_time(&mh);
+        if (mh.msg_flags & MSG_CONFIRM) {
+            if (cf.can_id == sq->client_id)
+                handle_can_echo(sq, cf.data, len, frame_time);
+            return;
+        }
         if (cf.can_id != sq->client_id + 1)
             return;
-        memcpy(&sq->input_buf[sq->input_pos], cf.data, cf.can_dlc);
-        sq->input_pos += cf.can_dlc;
+        sq->input_time = frame_time;
+        memcpy(&sq->input_buf[sq->input_pos], cf.data, len);
+        sq->input_pos += len;
+    } else if (sq->serial_fd_type == SQT_USBBULK) {
+        int ret = usbbulk_read(sq->usb, &sq->input_buf[sq->input_pos]
+                               , sizeof(sq->input_buf) - sq->input_pos);
+        if (ret < 0) {
+            errorf("Lost communication with usb device");
+            pollreactor_do_exit(sq->pr);
+            return;
+        }
+        if (!ret)
+            return;
+        sq->input_pos += ret;
     } else {
         int ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
                        , sizeof(sq->input_buf) - sq->input_pos);
@@ -356,10 +528,52 @@ kick_event(struct serialqueue *sq, double eventtime)
     pollreactor_update_timer(sq->pr, SQPT_COMMAND, PR_NOW);
 }
 
+// Return the largest CAN FD payload size that is not greater than len
+static int
+canfd_round_len(int len)
+{
+    static const uint8_t fd_lens[] = { 64, 48, 32, 24, 20, 16, 12 };
+    int i;
+    for (i=0; i<ARRAY_SIZE(fd_lens); i++)
+        if (len >= fd_lens[i])
+            return fd_lens[i];
+    return len > 8 ? 8 : len;
+}
+
+// Write out any data buffered for a debug output file
+static void
+flush_debug_buf(struct serialqueue *sq)
+{
+    uint8_t *p = sq->debug_buf;
+    int len = sq->debug_buf_len;
+    while (len > 0) {
+        int ret = write(sq->serial_fd, p, len);
+        if (ret < 0) {
+            report_errno("write", ret);
+            break;
+        }
+        p += ret;
+        len -= ret;
+    }
+    sq->debug_buf_len = 0;
+}
+
 // OS write of data to be sent to the mcu
 static void
 do_write(struct serialqueue *sq, void *buf, int buflen)
 {
+    if (sq->debug_buf) {
+        // Debug file output is written in large blocks
+        if (sq->debug_buf_len + buflen > DEBUG_BUF_SIZE)
+            flush_debug_buf(sq);
+        memcpy(&sq->debug_buf[sq->debug_buf_len], buf, buflen);
+        sq->debug_buf_len += buflen;
+        return;
+    }
+    if (sq->serial_fd_type == SQT_USBBULK) {
+        usbbulk_write(sq->usb, buf, buflen);
+        return;
+    }
     if (sq->serial_fd_type != SQT_CAN) {
         int ret = write(sq->serial_fd, buf, buflen);
         if (ret < 0)
@@ -367,13 +581,19 @@ do_write(struct serialqueue *sq, void *buf, int buflen)
         return;
     }
     // Write to CAN fd
-    struct can_frame cf;
+    struct canfd_frame cf;
+    memset(&cf, 0, sizeof(cf));
+    int mtu = sq->canbus_fd ? CANFD_MTU : CAN_MTU;
     while (buflen) {
         int size = buflen > 8 ? 8 : buflen;
+        if (sq->canbus_fd) {
+            size = canfd_round_len(buflen);
+            cf.flags = CANFD_BRS;
+        }
         cf.can_id = sq->client_id;
-        cf.can_dlc = size;
+        cf.len = size;
         memcpy(cf.data, buf, size);
-        int ret = write(sq->serial_fd, &cf, sizeof(cf));
+        int ret = write(sq->serial_fd, &cf, mtu);
         if (ret < 0) {
             report_errno("can write", ret);
             double curtime = get_monotonic();
@@ -403,7 +623,11 @@ retransmit_event(struct serialqueue *sq, double eventtime)
 
     pthread_mutex_lock(&sq->lock);
 
-    // Retransmit all pending messages
+    // A nak means the mcu discarded every block after the one it
+    // expects, so resend them all.  On a timeout it is not known if
+    // the data or the ack was lost - only resend the first unacked
+    // block and let the mcu's response show what else is needed.
+    int is_nak = pollreactor_get_timer(sq->pr, SQPT_RETRANSMIT) == PR_NOW;
     uint8_t buf[MESSAGE_MAX * MAX_PENDING_BLOCKS + 1];
     int buflen = 0, first_buflen = 0;
     buf[buflen++] = MESSAGE_SYNC;
@@ -413,19 +637,30 @@ retransmit_event(struct serialqueue *sq, double eventtime)
         buflen += qm->len;
         if (!first_buflen)
             first_buflen = qm->len + 1;
+        if (!is_nak)
+            break;
     }
     do_write(sq, buf, buflen);
     sq->bytes_retransmit += buflen;
 
     // Update rto
-    if (pollreactor_get_timer(sq->pr, SQPT_RETRANSMIT) == PR_NOW) {
-        // Retransmit due to nak
+    if (is_nak) {
+        // Retransmit due to nak (or the follow-up to an accepted
+        // timeout probe, which is still part of the timeout recovery)
+        if (sq->probe_resend)
+            sq->retransmit_timeout++;
+        else
+            sq->retransmit_nak++;
+        sq->probe_resend = 0;
+        sq->probe_seq = 0;
         sq->ignore_nak_seq = sq->receive_seq;
         if (sq->receive_seq < sq->retransmit_seq)
             // Second nak for this retransmit - don't allow third
             sq->ignore_nak_seq = sq->retransmit_seq;
     } else {
         // Retransmit due to timeout
+        sq->retransmit_timeout++;
+        sq->probe_seq = sq->receive_seq + 1;
         sq->rto *= 2.0;
         if (sq->rto > MAX_RTO)
             sq->rto = MAX_RTO;
@@ -447,15 +682,20 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
 {
     int len = MESSAGE_HEADER_SIZE;
     while (sq->ready_bytes) {
-        // Find highest priority message (message with lowest req_clock)
+        // Find highest priority message (message on the highest
+        // priority queue with the lowest req_clock)
         uint64_t min_clock = MAX_CLOCK;
+        int max_priority = 0;
         struct command_queue *q, *cq = NULL;
         struct queue_message *qm = NULL;
         list_for_each_entry(q, &sq->pending_queues, node) {
             if (!list_empty(&q->ready_queue)) {
                 struct queue_message *m = list_first_entry(
                     &q->ready_queue, struct queue_message, node);
-                if (m->req_clock < min_clock) {
+                if (q->priority > max_priority
+                    || (q->priority == max_priority
+                        && m->req_clock < min_clock)) {
+                    max_priority = q->priority;
                     min_clock = m->req_clock;
                     cq = q;
                     qm = m;
@@ -502,33 +742,49 @@ build_and_send_command(struct serialqueue *sq, uint8_t *buf, int pending
     if (!sq->rtt_sample_seq)
         sq->rtt_sample_seq = sq->send_seq;
     sq->send_seq++;
+    sq->blocks_write++;
     sq->need_ack_bytes += len;
     list_add_tail(&out->node, &sq->sent_queue);
     return len;
 }
 
-// Determine the time the next serial data should be sent
-static double
-check_send_command(struct serialqueue *sq, int pending, double eventtime)
+// Check if the mcu has room to receive another message block (while
+// leaving room for 'reserve' additional blocks)
+static int
+check_send_window(struct serialqueue *sq, int reserve)
 {
-    if (sq->send_seq - sq->receive_seq >= MAX_PENDING_BLOCKS
+    if (sq->send_seq - sq->receive_seq >= MAX_PENDING_BLOCKS - reserve
         && sq->receive_seq != (uint64_t)-1)
         // Need an ack before more messages can be sent
-        return PR_NEVER;
+        return 0;
     if (sq->send_seq > sq->receive_seq && sq->receive_window) {
-        int need_ack_bytes = sq->need_ack_bytes + MESSAGE_MAX;
+        int need_ack_bytes = sq->need_ack_bytes + MESSAGE_MAX * (1 + reserve);
         if (sq->last_ack_seq < sq->receive_seq)
             need_ack_bytes += sq->last_ack_bytes;
         if (need_ack_bytes > sq->receive_window)
             // Wait for ack from past messages before sending next message
-            return PR_NEVER;
+            return 0;
     }
+    return 1;
+}
+
+// Determine the time the next serial data should be sent
+static double
+check_send_command(struct serialqueue *sq, int pending, double eventtime)
+{
+    sq->need_kick_priority = 0;
+    if (!check_send_window(sq, 0))
+        return PR_NEVER;
+    // Normal messages leave room for high priority messages
+    int reserve = sq->have_priority ? PRIORITY_RESERVE_BLOCKS : 0;
+    int normal_ok = !reserve || check_send_window(sq, reserve);
 
     // Check for stalled messages now ready
     double idletime = eventtime > sq->idle_time ? eventtime : sq->idle_time;
     idletime += calculate_bittime(sq, pending + MESSAGE_MIN);
     uint64_t ack_clock = clock_from_time(&sq->ce, idletime);
     uint64_t min_stalled_clock = MAX_CLOCK, min_ready_clock = MAX_CLOCK;
+    int have_ready_priority = 0;
     struct command_queue *cq;
     list_for_each_entry(cq, &sq->pending_queues, node) {
         // Move messages from the upcoming_queue to the ready_queue
@@ -556,10 +812,19 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
                 req_clock = clock_from_time(&sq->ce, bgtime + bgoffset);
             if (req_clock < min_ready_clock)
                 min_ready_clock = req_clock;
+            if (cq->priority)
+                have_ready_priority = 1;
         }
     }
 
     // Check for messages to send
+    if (have_ready_priority)
+        return PR_NOW;
+    if (!normal_ok) {
+        // Wait for an ack (or a new high priority message)
+        sq->need_kick_priority = 1;
+        return PR_NEVER;
+    }
     if (sq->ready_bytes >= MESSAGE_PAYLOAD_MAX)
         return PR_NOW;
     if (! sq->ce.est_freq) {
@@ -568,7 +833,12 @@ check_send_command(struct serialqueue *sq, int pending, double eventtime)
         sq->need_kick_clock = MAX_CLOCK;
         return PR_NEVER;
     }
-    uint64_t reqclock_delta = MIN_REQTIME_DELTA * sq->ce.est_freq;
+    double reqtime_delta = MIN_REQTIME_DELTA;
+    if (sq->batch_time)
+        // Delay partial blocks (by a bounded amount) so that more
+        // messages may be combined into a single block
+        reqtime_delta -= sq->batch_time;
+    uint64_t reqclock_delta = reqtime_delta * sq->ce.est_freq;
     if (min_ready_clock <= ack_clock + reqclock_delta)
         return PR_NOW;
     uint64_t wantclock = min_ready_clock - reqclock_delta;
@@ -607,23 +877,106 @@ command_event(struct serialqueue *sq, double eventtime)
     return waketime;
 }
 
+// Wake any receiver once the background thread stops servicing sq
+static void
+background_exit(void *data)
+{
+    struct serialqueue *sq = data;
+    if (sq->debug_buf)
+        // Write all remaining queued messages to the debug output file
+        command_event(sq, get_monotonic());
+    pthread_mutex_lock(&sq->lock);
+    if (sq->debug_buf)
+        flush_debug_buf(sq);
+    check_wake_receive(sq);
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Main background thread for reading/writing to serial port
 static void *
 background_thread(void *data)
 {
     struct serialqueue *sq = data;
+    prctl(PR_SET_NAME, "serialqueue");
     pollreactor_run(sq->pr);
+    background_exit(sq);
+    return NULL;
+}
 
-    pthread_mutex_lock(&sq->lock);
-    check_wake_receive(sq);
-    pthread_mutex_unlock(&sq->lock);
+// Optionally, a single epoll driven thread may service many
+// serialqueue instances (instead of one thread per serialqueue).
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pollreactor_group *shared_group;
+static pthread_t shared_tid;
+static int shared_count;
 
+// Main thread servicing all serialqueues using the shared thread
+static void *
+shared_background_thread(void *data)
+{
+    prctl(PR_SET_NAME, "serialqueue");
+    pollreactor_group_run(data);
     return NULL;
 }
 
+// Register a serialqueue with the shared thread (starting it if needed)
+static int
+shared_thread_add(struct serialqueue *sq)
+{
+    pthread_mutex_lock(&shared_lock);
+    if (!shared_count) {
+        shared_group = pollreactor_group_alloc();
+        if (!shared_group)
+            goto fail;
+        int ret = pthread_create(&shared_tid, NULL, shared_background_thread
+                                 , shared_group);
+        if (ret) {
+            pollreactor_group_free(shared_group);
+            shared_group = NULL;
+            goto fail;
+        }
+    }
+    int ret = pollreactor_group_add(shared_group, sq->pr, background_exit);
+    if (ret && !shared_count)
+        goto fail_stop;
+    if (ret)
+        goto fail;
+    shared_count++;
+    pthread_mutex_unlock(&shared_lock);
+    return 0;
+
+fail_stop:
+    pollreactor_group_do_exit(shared_group);
+    pthread_join(shared_tid, NULL);
+    pollreactor_group_free(shared_group);
+    shared_group = NULL;
+fail:
+    pthread_mutex_unlock(&shared_lock);
+    return -1;
+}
+
+// Wait for the shared thread to release sq (stopping it if now unused)
+static void
+shared_thread_remove(struct serialqueue *sq)
+{
+    pthread_mutex_lock(&shared_lock);
+    pollreactor_group_wait_removed(shared_group, sq->pr);
+    if (!--shared_count) {
+        pollreactor_group_do_exit(shared_group);
+        int ret = pthread_join(shared_tid, NULL);
+        if (ret)
+            report_errno("pthread_join", ret);
+        pollreactor_group_free(shared_group);
+        shared_group = NULL;
+    }
+    pthread_mutex_unlock(&shared_lock);
+}
+
 // Create a new 'struct serialqueue' object
-struct serialqueue * __visible
-serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
+static struct serialqueue *
+serialqueue_alloc_common(int serial_fd, char serial_fd_type, int client_id
+                         , int shared_thread)
 {
     struct serialqueue *sq = malloc(sizeof(*sq));
     memset(sq, 0, sizeof(*sq));
@@ -631,14 +984,28 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     sq->serial_fd_type = serial_fd_type;
     sq->client_id = client_id;
 
+    if (serial_fd_type == SQT_USBBULK) {
+        // Direct usb access - client_id is the usb interface number
+        sq->usb = usbbulk_alloc(serial_fd, client_id);
+        if (!sq->usb) {
+            free(sq);
+            return NULL;
+        }
+    }
+
     int ret = pipe(sq->pipe_fds);
     if (ret)
         goto fail;
 
     // Reactor setup
     sq->pr = pollreactor_alloc(SQPF_NUM, SQPT_NUM, sq);
-    pollreactor_add_fd(sq->pr, SQPF_SERIAL, serial_fd, input_event
-                       , serial_fd_type==SQT_DEBUGFILE);
+    if (serial_fd_type == SQT_USBBULK)
+        // Completed usb transfers are reported as a writable fd
+        pollreactor_add_fd_writable(sq->pr, SQPF_SERIAL, serial_fd
+                                    , input_event);
+    else
+        pollreactor_add_fd(sq->pr, SQPF_SERIAL, serial_fd, input_event
+                           , serial_fd_type==SQT_DEBUGFILE);
     pollreactor_add_fd(sq->pr, SQPF_PIPE, sq->pipe_fds[0], kick_event, 0);
     pollreactor_add_timer(sq->pr, SQPT_RETRANSMIT, retransmit_event);
     pollreactor_add_timer(sq->pr, SQPT_COMMAND, command_event);
@@ -652,6 +1019,9 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
         // Debug file output
         sq->receive_seq = -1;
         sq->rto = PR_NEVER;
+        sq->debug_buf = malloc(DEBUG_BUF_SIZE);
+        if (!sq->debug_buf)
+            goto fail;
     } else {
         sq->receive_seq = 1;
         sq->rto = MIN_RTO;
@@ -661,15 +1031,13 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     sq->need_kick_clock = MAX_CLOCK;
     list_init(&sq->pending_queues);
     list_init(&sq->sent_queue);
-    list_init(&sq->receive_queue);
+    list_init(&sq->receive_overflow);
     list_init(&sq->notify_queue);
     list_init(&sq->fast_readers);
 
     // Debugging
     list_init(&sq->old_sent);
-    list_init(&sq->old_receive);
     debug_queue_alloc(&sq->old_sent, DEBUG_QUEUE_SENT);
-    debug_queue_alloc(&sq->old_receive, DEBUG_QUEUE_RECEIVE);
 
     // Thread setup
     ret = pthread_mutex_init(&sq->lock, NULL);
@@ -681,9 +1049,16 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     ret = pthread_mutex_init(&sq->fast_reader_dispatch_lock, NULL);
     if (ret)
         goto fail;
-    ret = pthread_create(&sq->tid, NULL, background_thread, sq);
-    if (ret)
-        goto fail;
+    if (shared_thread) {
+        ret = shared_thread_add(sq);
+        if (ret)
+            goto fail;
+        sq->shared_thread = 1;
+    } else {
+        ret = pthread_create(&sq->tid, NULL, background_thread, sq);
+        if (ret)
+            goto fail;
+    }
 
     return sq;
 
@@ -692,15 +1067,37 @@ fail:
     return NULL;
 }
 
+// Create a new 'struct serialqueue' object with its own background thread
+struct serialqueue * __visible
+serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
+{
+    return serialqueue_alloc_common(serial_fd, serial_fd_type, client_id, 0);
+}
+
+// Create a new 'struct serialqueue' object serviced by the shared thread
+struct serialqueue * __visible
+serialqueue_alloc_shared(int serial_fd, char serial_fd_type, int client_id)
+{
+    return serialqueue_alloc_common(serial_fd, serial_fd_type, client_id, 1);
+}
+
 // Request that the background thread exit
 void __visible
 serialqueue_exit(struct serialqueue *sq)
 {
     pollreactor_do_exit(sq->pr);
     kick_bg_thread(sq);
-    int ret = pthread_join(sq->tid, NULL);
-    if (ret)
-        report_errno("pthread_join", ret);
+    if (sq->shared_thread) {
+        shared_thread_remove(sq);
+        sq->shared_thread = 0;
+    } else {
+        int ret = pthread_join(sq->tid, NULL);
+        if (ret)
+            report_errno("pthread_join", ret);
+    }
+    // Release the usb interface while the file descriptor is still open
+    usbbulk_free(sq->usb);
+    sq->usb = NULL;
 }
 
 // Free all resources associated with a serialqueue
@@ -709,14 +1106,13 @@ serialqueue_free(struct serialqueue *sq)
 {
     if (!sq)
         return;
-    if (!pollreactor_is_exit(sq->pr))
+    if (!pollreactor_is_exit(sq->pr) || sq->shared_thread)
         serialqueue_exit(sq);
     pthread_mutex_lock(&sq->lock);
     message_queue_free(&sq->sent_queue);
-    message_queue_free(&sq->receive_queue);
+    message_queue_free(&sq->receive_overflow);
     message_queue_free(&sq->notify_queue);
     message_queue_free(&sq->old_sent);
-    message_queue_free(&sq->old_receive);
     while (!list_empty(&sq->pending_queues)) {
         struct command_queue *cq = list_first_entry(
             &sq->pending_queues, struct command_queue, node);
@@ -726,6 +1122,7 @@ serialqueue_free(struct serialqueue *sq)
     }
     pthread_mutex_unlock(&sq->lock);
     pollreactor_free(sq->pr);
+    free(sq->debug_buf);
     free(sq);
 }
 
@@ -740,6 +1137,15 @@ serialqueue_alloc_commandqueue(void)
     return cq;
 }
 
+// Set the transmit priority of a 'struct command_queue'.  Ready
+// messages on a queue with a higher priority are sent ahead of
+// messages on lower priority queues (the default priority is zero).
+void __visible
+serialqueue_set_commandqueue_priority(struct command_queue *cq, int priority)
+{
+    cq->priority = priority;
+}
+
 // Free a 'struct command_queue'
 void __visible
 serialqueue_free_commandqueue(struct command_queue *cq)
@@ -799,8 +1205,14 @@ serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
     list_join_tail(msgs, &cq->upcoming_queue);
     sq->upcoming_bytes += len;
     int mustwake = 0;
-    if (qm->min_clock < sq->need_kick_clock) {
+    if (cq->priority) {
+        sq->have_priority = 1;
+        if (sq->need_kick_priority)
+            mustwake = 1;
+    }
+    if (qm->min_clock < sq->need_kick_clock || mustwake) {
         sq->need_kick_clock = 0;
+        sq->need_kick_priority = 0;
         mustwake = 1;
     }
     pthread_mutex_unlock(&sq->lock);
@@ -835,44 +1247,143 @@ serialqueue_send(struct serialqueue *sq, struct command_queue *cq, uint8_t *msg
     serialqueue_send_one(sq, cq, qm);
 }
 
-// Return a message read from the serial port (or wait for one if none
-// available)
+// Encode a command from its message tag and integer parameters and
+// schedule its transmission (like serialqueue_send())
 void __visible
-serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
+serialqueue_send_encode(struct serialqueue *sq, struct command_queue *cq
+                        , int msgtag, int64_t *data, int len
+                        , uint64_t min_clock, uint64_t req_clock
+                        , uint64_t notify_id)
 {
-    pthread_mutex_lock(&sq->lock);
-    // Wait for message to be available
-    while (list_empty(&sq->receive_queue)) {
-        if (pollreactor_is_exit(sq->pr))
-            goto exit;
-        sq->receive_waiting = 1;
-        int ret = pthread_cond_wait(&sq->cond, &sq->lock);
-        if (ret)
-            report_errno("pthread_cond_wait", ret);
+    struct queue_message *qm = message_alloc();
+    uint8_t *p = msgblock_encode_int(qm->msg, msgtag);
+    int i;
+    for (i=0; i<len; i++) {
+        p = msgblock_encode_int(p, data[i]);
+        if (p > &qm->msg[MESSAGE_PAYLOAD_MAX]) {
+            errorf("Encode error");
+            message_free(qm);
+            return;
+        }
     }
+    qm->len = p - qm->msg;
+    qm->min_clock = min_clock;
+    qm->req_clock = req_clock;
+    qm->notify_id = notify_id;
+    serialqueue_send_one(sq, cq, qm);
+}
 
-    // Remove message from queue
+// Copy a message from the receive ring buffer (without taking the lock)
+static int
+pull_ring(struct serialqueue *sq, struct pull_queue_message *pqm)
+{
+    uint32_t tail = sq->receive_tail;
+    uint32_t head = __atomic_load_n(&sq->receive_head, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return 0;
+    *pqm = sq->receive_ring[tail % RECEIVE_RING_SIZE];
+    __atomic_store_n(&sq->receive_tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Copy a message from the receive overflow list (caller must hold lock)
+static int
+pull_overflow(struct serialqueue *sq, struct pull_queue_message *pqm)
+{
+    if (list_empty(&sq->receive_overflow))
+        return 0;
     struct queue_message *qm = list_first_entry(
-        &sq->receive_queue, struct queue_message, node);
+        &sq->receive_overflow, struct queue_message, node);
     list_del(&qm->node);
-
-    // Copy message
     memcpy(pqm->msg, qm->msg, qm->len);
     pqm->len = qm->len;
     pqm->sent_time = qm->sent_time;
     pqm->receive_time = qm->receive_time;
     pqm->notify_id = qm->notify_id;
-    if (qm->len)
-        debug_queue_add(&sq->old_receive, qm);
-    else
-        message_free(qm);
+    message_free(qm);
+    return 1;
+}
 
-    pthread_mutex_unlock(&sq->lock);
-    return;
+// Return a message read from the serial port (or wait for one if none
+// available)
+void __visible
+serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
+{
+    for (;;) {
+        if (pull_ring(sq, pqm))
+            return;
+        uint32_t tail = sq->receive_tail;
 
-exit:
-    pqm->len = -1;
-    pthread_mutex_unlock(&sq->lock);
+        pthread_mutex_lock(&sq->lock);
+        if (pull_overflow(sq, pqm)) {
+            // Ring buffer is empty, but messages are in the overflow list
+            pthread_mutex_unlock(&sq->lock);
+            return;
+        }
+        if (__atomic_load_n(&sq->receive_head, __ATOMIC_ACQUIRE) != tail) {
+            pthread_mutex_unlock(&sq->lock);
+            continue;
+        }
+        if (pollreactor_is_exit(sq->pr)) {
+            pqm->len = -1;
+            pthread_mutex_unlock(&sq->lock);
+            return;
+        }
+        // Wait for message to be available
+        sq->receive_waiting = 1;
+        int ret = pthread_cond_wait(&sq->cond, &sq->lock);
+        if (ret)
+            report_errno("pthread_cond_wait", ret);
+        pthread_mutex_unlock(&sq->lock);
+    }
+}
+
+// Wait for at least one message and then return up to 'max' queued
+// messages.  Returns the number of messages stored in 'q' (the last
+// entry has a negative len if the serialqueue is exiting).
+int __visible
+serialqueue_pull_batch(struct serialqueue *sq, struct pull_queue_message *q
+                       , int max)
+{
+    if (max <= 0)
+        return 0;
+    serialqueue_pull(sq, &q[0]);
+    if (q[0].len < 0)
+        return 1;
+    int count = 1;
+    while (count < max && pull_ring(sq, &q[count]))
+        count++;
+    if (count < max) {
+        pthread_mutex_lock(&sq->lock);
+        while (count < max && pull_overflow(sq, &q[count]))
+            count++;
+        pthread_mutex_unlock(&sq->lock);
+    }
+    return count;
+}
+
+// Set a realtime scheduling priority (or 0 for normal scheduling) on
+// the background thread servicing a serialqueue
+int __visible
+serialqueue_set_thread_priority(struct serialqueue *sq, int priority)
+{
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    int policy = priority ? SCHED_FIFO : SCHED_OTHER;
+    int ret;
+    if (sq->shared_thread) {
+        pthread_mutex_lock(&shared_lock);
+        ret = pthread_setschedparam(shared_tid, policy, &param);
+        pthread_mutex_unlock(&shared_lock);
+    } else {
+        ret = pthread_setschedparam(sq->tid, policy, &param);
+    }
+    if (ret) {
+        report_errno("pthread_setschedparam", ret);
+        return -1;
+    }
+    return 0;
 }
 
 void __visible
@@ -888,6 +1399,45 @@ serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Use kernel frame timestamps (and the echo of transmitted frames)
+// to determine canbus message send and receive times
+void __visible
+serialqueue_set_canbus_timestamps(struct serialqueue *sq, int enable)
+{
+    if (sq->serial_fd_type != SQT_CAN)
+        return;
+    int val = !!enable;
+    int ret = setsockopt(sq->serial_fd, SOL_SOCKET, SO_TIMESTAMPNS
+                         , &val, sizeof(val));
+    if (ret < 0) {
+        report_errno("can timestamps", ret);
+        return;
+    }
+    ret = setsockopt(sq->serial_fd, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS
+                     , &val, sizeof(val));
+    if (ret < 0) {
+        report_errno("can recv own msgs", ret);
+        return;
+    }
+    pthread_mutex_lock(&sq->lock);
+    sq->canbus_timestamps = val;
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Enable CAN FD frames (with bit rate switching) for canbus devices
+void __visible
+serialqueue_set_canbus_fd(struct serialqueue *sq, double data_frequency)
+{
+    pthread_mutex_lock(&sq->lock);
+    if (sq->serial_fd_type == SQT_CAN && data_frequency > 0.) {
+        sq->canbus_fd = 1;
+        sq->fd_bittime_adjust = 1. / data_frequency;
+    } else {
+        sq->canbus_fd = 0;
+    }
+    pthread_mutex_unlock(&sq->lock);
+}
+
 void __visible
 serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
 {
@@ -896,6 +1446,20 @@ serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Set the maximum time a partially filled message block may be
+// delayed in order to combine it with later messages
+void __visible
+serialqueue_set_batch_time(struct serialqueue *sq, double batch_time)
+{
+    if (batch_time < 0.)
+        batch_time = 0.;
+    if (batch_time > MAX_BATCH_TIME)
+        batch_time = MAX_BATCH_TIME;
+    pthread_mutex_lock(&sq->lock);
+    sq->batch_time = batch_time;
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Set the estimated clock rate of the mcu on the other end of the
 // serial port
 void __visible
@@ -920,26 +1484,92 @@ serialqueue_get_clock_est(struct serialqueue *sq, struct clock_estimate *ce)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Report the number of message bytes waiting to be transmitted
+void __visible
+serialqueue_get_buffer_stats(struct serialqueue *sq, int *ready_bytes
+                             , int *upcoming_bytes)
+{
+    pthread_mutex_lock(&sq->lock);
+    *ready_bytes = sq->ready_bytes;
+    *upcoming_bytes = sq->upcoming_bytes;
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Return a string buffer containing statistics for the serial port
 void __visible
 serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
 {
-    struct serialqueue stats;
+    // Only copy the reported counters while holding the lock (the
+    // full serialqueue struct contains the large receive ring)
+    struct {
+        uint64_t send_seq, receive_seq, retransmit_seq;
+        double srtt, rttvar, rto;
+        int ready_bytes, upcoming_bytes;
+        uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+        uint32_t blocks_write, retransmit_nak, retransmit_timeout;
+    } stats;
     pthread_mutex_lock(&sq->lock);
-    memcpy(&stats, sq, sizeof(stats));
+    stats.send_seq = sq->send_seq;
+    stats.receive_seq = sq->receive_seq;
+    stats.retransmit_seq = sq->retransmit_seq;
+    stats.srtt = sq->srtt;
+    stats.rttvar = sq->rttvar;
+    stats.rto = sq->rto;
+    stats.ready_bytes = sq->ready_bytes;
+    stats.upcoming_bytes = sq->upcoming_bytes;
+    stats.bytes_write = sq->bytes_write;
+    stats.bytes_read = sq->bytes_read;
+    stats.bytes_retransmit = sq->bytes_retransmit;
+    stats.bytes_invalid = sq->bytes_invalid;
+    stats.blocks_write = sq->blocks_write;
+    stats.retransmit_nak = sq->retransmit_nak;
+    stats.retransmit_timeout = sq->retransmit_timeout;
     pthread_mutex_unlock(&sq->lock);
 
+    double block_fill = 0.;
+    if (stats.blocks_write)
+        block_fill = stats.bytes_write / (double)(stats.blocks_write
+                                                  * MESSAGE_MAX);
     snprintf(buf, len, "bytes_write=%u bytes_read=%u"
              " bytes_retransmit=%u bytes_invalid=%u"
              " send_seq=%u receive_seq=%u retransmit_seq=%u"
              " srtt=%.3f rttvar=%.3f rto=%.3f"
              " ready_bytes=%u upcoming_bytes=%u"
+             " blocks_write=%u block_fill=%.3f"
+             " retransmit_nak=%u retransmit_timeout=%u"
              , stats.bytes_write, stats.bytes_read
              , stats.bytes_retransmit, stats.bytes_invalid
              , (int)stats.send_seq, (int)stats.receive_seq
              , (int)stats.retransmit_seq
              , stats.srtt, stats.rttvar, stats.rto
-             , stats.ready_bytes, stats.upcoming_bytes);
+             , stats.ready_bytes, stats.upcoming_bytes
+             , stats.blocks_write, block_fill
+             , stats.retransmit_nak, stats.retransmit_timeout);
+}
+
+// Extract recently read messages that are still in the receive ring
+static int
+extract_old_receive(struct serialqueue *sq, struct pull_queue_message *q
+                    , int max)
+{
+    pthread_mutex_lock(&sq->lock);
+    uint32_t head = sq->receive_head;
+    uint32_t tail = __atomic_load_n(&sq->receive_tail, __ATOMIC_ACQUIRE);
+    uint32_t start = sq->receive_debug_pos;
+    if ((int32_t)(head - RECEIVE_RING_SIZE - start) > 0)
+        start = head - RECEIVE_RING_SIZE;
+    if ((int32_t)(tail - DEBUG_QUEUE_RECEIVE - start) > 0)
+        start = tail - DEBUG_QUEUE_RECEIVE;
+    int pos = 0;
+    for (; start != tail && pos < max; start++) {
+        struct pull_queue_message *pqm = &sq->receive_ring[
+            start % RECEIVE_RING_SIZE];
+        if (pqm->len)
+            q[pos++] = *pqm;
+    }
+    sq->receive_debug_pos = tail;
+    pthread_mutex_unlock(&sq->lock);
+    return pos;
 }
 
 // Extract old messages stored in the debug queues
@@ -947,8 +1577,10 @@ int __visible
 serialqueue_extract_old(struct serialqueue *sq, int sentq
                         , struct pull_queue_message *q, int max)
 {
-    int count = sentq ? DEBUG_QUEUE_SENT : DEBUG_QUEUE_RECEIVE;
-    struct list_head *rootp = sentq ? &sq->old_sent : &sq->old_receive;
+    if (!sentq)
+        return extract_old_receive(sq, q, max);
+    int count = DEBUG_QUEUE_SENT;
+    struct list_head *rootp = &sq->old_sent;
     struct list_head replacement, current;
     list_init(&replacement);
     debug_queue_alloc(&replacement, count);
@@ -14,6 +14,7 @@ typedef void (*fastreader_cb)(struct fastreader *fr, uint8_t *data, int len);
 struct fastreader {
     struct list_node node;
     fastreader_cb func;
+    int skip_pull; // Don't also deliver matching messages to serialqueue_pull
     int prefix_len;
     uint8_t prefix[MESSAGE_MAX];
 };
@@ -28,9 +29,14 @@ struct pull_queue_message {
 struct serialqueue;
 struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
                                       , int client_id);
+struct serialqueue *serialqueue_alloc_shared(int serial_fd
+                                             , char serial_fd_type
+                                             , int client_id);
 void serialqueue_exit(struct serialqueue *sq);
 void serialqueue_free(struct serialqueue *sq);
 struct command_queue *serialqueue_alloc_commandqueue(void);
+void serialqueue_set_commandqueue_priority(struct command_queue *cq
+                                           , int priority);
 void serialqueue_free_commandqueue(struct command_queue *cq);
 void serialqueue_add_fastreader(struct serialqueue *sq, struct fastreader *fr);
 void serialqueue_rm_fastreader(struct serialqueue *sq, struct fastreader *fr);
@@ -41,14 +47,26 @@ void serialqueue_send_one(struct serialqueue *sq, struct command_queue *cq
 void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
                       , uint8_t *msg, int len, uint64_t min_clock
                       , uint64_t req_clock, uint64_t notify_id);
+void serialqueue_send_encode(struct serialqueue *sq, struct command_queue *cq
+                             , int msgid, int64_t *data, int len
+                             , uint64_t min_clock, uint64_t req_clock
+                             , uint64_t notify_id);
 void serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm);
+int serialqueue_pull_batch(struct serialqueue *sq
+                           , struct pull_queue_message *q, int max);
+int serialqueue_set_thread_priority(struct serialqueue *sq, int priority);
 void serialqueue_set_wire_frequency(struct serialqueue *sq, double frequency);
+void serialqueue_set_canbus_fd(struct serialqueue *sq, double data_frequency);
+void serialqueue_set_canbus_timestamps(struct serialqueue *sq, int enable);
 void serialqueue_set_receive_window(struct serialqueue *sq, int receive_window);
+void serialqueue_set_batch_time(struct serialqueue *sq, double batch_time);
 void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
                                , double conv_time, uint64_t conv_clock
                                , uint64_t last_clock);
 void serialqueue_get_clock_est(struct serialqueue *sq
                                , struct clock_estimate *ce);
+void serialqueue_get_buffer_stats(struct serialqueue *sq, int *ready_bytes
+                                  , int *upcoming_bytes);
 void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
 int serialqueue_extract_old(struct serialqueue *sq, int sentq
                             , struct pull_queue_message *q, int max);
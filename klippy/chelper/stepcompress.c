@@ -11,56 +11,80 @@
 // add parameters such that 'count' pulses occur, with each step event
 // calculating the next step event time using:
 //  next_wake_time = last_wake_time + interval; interval += add
+// If the mcu supports the optional queue_step_add2 command then the
+// 'add' may also be updated after each step using: add += add2
+// If the mcu supports the optional queue_steps command then a run of
+// these sequences may be sent in a single compact message (and with
+// queue_steps_dir each sequence also carries its step direction).
 // This code is written in C (instead of python) for processing
 // efficiency - the repetitive integer math is vastly faster in C.
 
-#include <math.h> // sqrt
+#include <math.h> // sqrt, lrint
 #include <stddef.h> // offsetof
 #include <stdint.h> // uint32_t
 #include <stdio.h> // fprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // DIV_ROUND_UP
-#include "pyhelper.h" // errorf
+#include "mempool.h" // mempool_alloc
+#include "pyhelper.h" // errorf, get_monotonic
 #include "serialqueue.h" // struct queue_message
 #include "stepcompress.h" // stepcompress_alloc
 
 #define CHECK_LINES 1
 #define QUEUE_START_SIZE 1024
+#define QUEUE_STEPS_DATA_MAX 48
+
+struct step_move {
+    uint32_t interval;
+    uint16_t count;
+    int16_t add, add2;
+};
 
 struct stepcompress {
     // Buffer management
     uint32_t *queue, *queue_end, *queue_pos, *queue_next;
     // Internal tracking
     uint32_t max_error;
+    int compress_method;
     double mcu_time_offset, mcu_freq, last_step_print_time;
     // Message generation
     uint64_t last_step_clock;
     struct list_head msg_queue;
     uint32_t oid;
     int32_t queue_step_msgtag, set_next_step_dir_msgtag;
-    int sdir, invert_sdir;
+    int32_t queue_step_add2_msgtag, queue_steps_msgtag;
+    int sdir, invert_sdir, queue_steps_dir, mcu_dir;
+    // Pending queue_steps message
+    uint8_t batch_data[QUEUE_STEPS_DATA_MAX];
+    int batch_len, batch_count, batch_dir, batch_max_count;
+    uint32_t batch_next_interval;
+    uint64_t batch_req_clock, batch_min_clock;
+    struct step_move batch_first;
     // Step+dir+step filter
     uint64_t next_step_clock;
     int next_step_dir;
     // History tracking
     int64_t last_position;
     struct list_head history_list;
-};
-
-struct step_move {
-    uint32_t interval;
-    uint16_t count;
-    int16_t add;
+    // Move queue items reserved for this stepper
+    uint64_t *reserved_clocks;
+    int num_reserved_clocks;
+    // Statistics
+    struct stepcompress_stats stats;
 };
 
 struct history_steps {
     struct list_node node;
     uint64_t first_clock, last_clock;
     int64_t start_position;
-    int step_count, interval, add;
+    int step_count, interval, add, add2;
+    uint32_t max_error;
 };
 
+static struct mempool history_pool = MEMPOOL_DEFINE(
+    "history_steps", sizeof(struct history_steps), 4096);
+
 
 /****************************************************************
  * Step compression
@@ -124,7 +148,8 @@ compress_bisect_add(struct stepcompress *sc)
             nextcount++;
             if (&sc->queue_pos[nextcount-1] >= qlast) {
                 int32_t count = nextcount - 1;
-                return (struct step_move){ interval, count, add };
+                return (struct step_move){ .interval = interval
+                                           , .count = count, .add = add };
             }
             nextpoint = minmax_point(sc, sc->queue_pos + nextcount - 1);
             int32_t nextaddfactor = nextcount*(nextcount-1)/2;
@@ -192,8 +217,175 @@ compress_bisect_add(struct stepcompress *sc)
     }
     if (zerocount + zerocount/16 >= bestcount)
         // Prefer add=0 if it's similar to the best found sequence
-        return (struct step_move){ zerointerval, zerocount, 0 };
-    return (struct step_move){ bestinterval, bestcount, bestadd };
+        return (struct step_move){ .interval = zerointerval
+                                   , .count = zerocount };
+    return (struct step_move){ .interval = bestinterval, .count = bestcount
+                               , .add = bestadd };
+}
+
+// Find the longest valid sequence using a fixed 'add' and 'add2'
+static struct step_move
+compress_fixed_add(struct stepcompress *sc, uint32_t *qlast
+                   , int32_t add, int32_t add2)
+{
+    struct points point = minmax_point(sc, sc->queue_pos);
+    int64_t mininterval = point.minp, maxinterval = point.maxp;
+    int32_t count = 1;
+    while (&sc->queue_pos[count] < qlast) {
+        point = minmax_point(sc, sc->queue_pos + count);
+        int64_t nextcount = count + 1;
+        int64_t addfactor = nextcount*(nextcount-1)/2;
+        int64_t add2factor = addfactor*(nextcount-2)/3;
+        int64_t c = add*addfactor + add2*add2factor;
+        int64_t minp = point.minp - c, maxp = point.maxp - c;
+        int64_t nextmininterval = mininterval, nextmaxinterval = maxinterval;
+        if (nextmininterval*nextcount < minp)
+            nextmininterval = ((minp >= 0 ? minp + nextcount - 1 : minp)
+                               / nextcount);
+        if (nextmaxinterval*nextcount > maxp)
+            nextmaxinterval = ((maxp >= 0 ? maxp : maxp - nextcount + 1)
+                               / nextcount);
+        if (nextmininterval > nextmaxinterval)
+            break;
+        mininterval = nextmininterval;
+        maxinterval = nextmaxinterval;
+        count++;
+    }
+    return (struct step_move){ maxinterval, count, add, add2 };
+}
+
+// Estimate the 'add' of the first 'count' steps from the middle of
+// the valid time range of two of those steps
+static int32_t
+estimate_add(struct stepcompress *sc, int32_t count)
+{
+    int32_t mid = count / 2;
+    if (mid < 1)
+        return 0;
+    struct points mp = minmax_point(sc, sc->queue_pos + mid - 1);
+    struct points ep = minmax_point(sc, sc->queue_pos + count - 1);
+    double mt = .5 * ((double)mp.minp + mp.maxp);
+    double et = .5 * ((double)ep.minp + ep.maxp);
+    double add = 2. * (et * mid - mt * count) / ((double)count*mid*(count-mid));
+    if (add < -0x8000)
+        return -0x8000;
+    if (add > 0x7fff)
+        return 0x7fff;
+    return lrint(add);
+}
+
+// Find a 'step_move' by fitting an 'add' to a growing window of
+// steps and then extending the sequence with that 'add'.  Unlike
+// compress_bisect_add() this only makes a few linear passes per
+// step_move, at the cost of sometimes producing shorter sequences.
+static struct step_move
+compress_greedy(struct stepcompress *sc)
+{
+    uint32_t *qlast = sc->queue_next;
+    if (qlast > sc->queue_pos + 65535)
+        qlast = sc->queue_pos + 65535;
+    int32_t avail = qlast - sc->queue_pos;
+    struct step_move zero = compress_fixed_add(sc, qlast, 0, 0), best = zero;
+    int64_t bestreach = (int64_t)best.interval * best.count;
+    int32_t window = zero.count * 2, tries;
+    for (tries=0; tries<4 && zero.count < avail; tries++) {
+        if (window < 8)
+            window = 8;
+        if (window > avail)
+            window = avail;
+        int32_t add = estimate_add(sc, window);
+        if (!add)
+            break;
+        struct step_move move = compress_fixed_add(sc, qlast, add, 0);
+        int64_t addfactor = (int64_t)move.count * (move.count - 1) / 2;
+        int64_t reach = add * addfactor + (int64_t)move.interval * move.count;
+        if (reach > bestreach
+            || (reach == bestreach && move.interval > best.interval)) {
+            best = move;
+            bestreach = reach;
+        }
+        if (move.count < window || window >= avail)
+            break;
+        window = move.count * 2;
+    }
+    if (zero.count + zero.count/16 >= best.count)
+        // Prefer add=0 if it's similar to the best found sequence
+        return zero;
+    return best;
+}
+
+// Return the determinant of a 3x3 matrix (given as three columns)
+static double
+det3(double *a, double *b, double *c)
+{
+    return (a[0] * (b[1]*c[2] - b[2]*c[1]) - b[0] * (a[1]*c[2] - a[2]*c[1])
+            + c[0] * (a[1]*b[2] - a[2]*b[1]));
+}
+
+static int32_t
+clamp_add(double add)
+{
+    if (add < -0x8000)
+        return -0x8000;
+    if (add > 0x7fff)
+        return 0x7fff;
+    return lrint(add);
+}
+
+// Estimate the 'add' and 'add2' of the first 'count' steps from the
+// middle of the valid time range of three of those steps
+static int
+estimate_add2(struct stepcompress *sc, int32_t count
+              , int32_t *padd, int32_t *padd2)
+{
+    int32_t h = count / 3, i;
+    if (h < 2)
+        return -1;
+    double ci[3], ca[3], ca2[3], ct[3];
+    for (i=0; i<3; i++) {
+        int32_t n = h * (i + 1);
+        struct points point = minmax_point(sc, sc->queue_pos + n - 1);
+        ci[i] = n;
+        ca[i] = .5 * n * (n - 1);
+        ca2[i] = ca[i] * (n - 2) / 3.;
+        ct[i] = .5 * ((double)point.minp + point.maxp);
+    }
+    double det = det3(ci, ca, ca2);
+    if (!det)
+        return -1;
+    *padd = clamp_add(det3(ci, ct, ca2) / det);
+    *padd2 = clamp_add(det3(ci, ca, ct) / det);
+    return 0;
+}
+
+// Check if a sequence with a second order 'add2' term can cover more
+// steps than a given 'step_move' (if the mcu supports queue_step_add2)
+static struct step_move
+compress_add2(struct stepcompress *sc, struct step_move move)
+{
+    uint32_t *qlast = sc->queue_next;
+    if (qlast > sc->queue_pos + 65535)
+        qlast = sc->queue_pos + 65535;
+    int32_t avail = qlast - sc->queue_pos;
+    struct step_move best = move;
+    int32_t window = move.count * 2, tries;
+    for (tries=0; tries<3 && best.count < avail; tries++) {
+        if (window > avail)
+            window = avail;
+        int32_t add, add2;
+        if (estimate_add2(sc, window, &add, &add2) || !add2)
+            break;
+        struct step_move m2 = compress_fixed_add(sc, qlast, add, add2);
+        if (m2.count > best.count)
+            best = m2;
+        if (m2.count < window || window >= avail)
+            break;
+        window = m2.count * 2;
+    }
+    // A queue_step_add2 command is a little larger than a queue_step
+    if (best.add2 && best.count > move.count + move.count/8)
+        return best;
+    return move;
 }
 
 
@@ -201,37 +393,45 @@ compress_bisect_add(struct stepcompress *sc)
  * Step compress checking
  ****************************************************************/
 
-// Verify that a given 'step_move' matches the actual step times
+// Verify that a given 'step_move' matches the actual step times (and
+// note the largest deviation from the requested step times)
 static int
-check_line(struct stepcompress *sc, struct step_move move)
+check_line(struct stepcompress *sc, struct step_move move, uint32_t *max_dev)
 {
+    *max_dev = 0;
     if (!CHECK_LINES)
         return 0;
-    if (!move.count || (!move.interval && !move.add && move.count > 1)
+    if (!move.count
+        || (!move.interval && !move.add && !move.add2 && move.count > 1)
         || move.interval >= 0x80000000) {
-        errorf("stepcompress o=%d i=%d c=%d a=%d: Invalid sequence"
-               , sc->oid, move.interval, move.count, move.add);
+        errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d: Invalid sequence"
+               , sc->oid, move.interval, move.count, move.add, move.add2);
         return ERROR_RET;
     }
     uint32_t interval = move.interval, p = 0;
+    int32_t add = move.add;
     uint16_t i;
     for (i=0; i<move.count; i++) {
         struct points point = minmax_point(sc, sc->queue_pos + i);
         p += interval;
         if (p < point.minp || p > point.maxp) {
-            errorf("stepcompress o=%d i=%d c=%d a=%d: Point %d: %d not in %d:%d"
-                   , sc->oid, move.interval, move.count, move.add
+            errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d:"
+                   " Point %d: %d not in %d:%d"
+                   , sc->oid, move.interval, move.count, move.add, move.add2
                    , i+1, p, point.minp, point.maxp);
             return ERROR_RET;
         }
+        if (point.maxp - p > *max_dev)
+            *max_dev = point.maxp - p;
         if (interval >= 0x80000000) {
-            errorf("stepcompress o=%d i=%d c=%d a=%d:"
+            errorf("stepcompress o=%d i=%d c=%d a=%d a2=%d:"
                    " Point %d: interval overflow %d"
-                   , sc->oid, move.interval, move.count, move.add
+                   , sc->oid, move.interval, move.count, move.add, move.add2
                    , i+1, interval);
             return ERROR_RET;
         }
-        interval += move.add;
+        interval += add;
+        add += move.add2;
     }
     return 0;
 }
@@ -250,7 +450,7 @@ stepcompress_alloc(uint32_t oid)
     list_init(&sc->msg_queue);
     list_init(&sc->history_list);
     sc->oid = oid;
-    sc->sdir = -1;
+    sc->sdir = sc->mcu_dir = -1;
     return sc;
 }
 
@@ -264,6 +464,44 @@ stepcompress_fill(struct stepcompress *sc, uint32_t max_error
     sc->set_next_step_dir_msgtag = set_next_step_dir_msgtag;
 }
 
+// Set the message id of the optional queue_step_add2 command
+void __visible
+stepcompress_fill_add2(struct stepcompress *sc, int32_t queue_step_add2_msgtag)
+{
+    sc->queue_step_add2_msgtag = queue_step_add2_msgtag;
+}
+
+// Set the message id of the optional queue_steps (or queue_steps_dir)
+// command
+void __visible
+stepcompress_fill_queue_steps(struct stepcompress *sc
+                              , int32_t queue_steps_msgtag, int has_dir)
+{
+    sc->queue_steps_msgtag = queue_steps_msgtag;
+    sc->queue_steps_dir = has_dir;
+}
+
+// Select the algorithm used to compress step times into step_moves
+void __visible
+stepcompress_set_compress_method(struct stepcompress *sc, int method)
+{
+    sc->compress_method = method;
+}
+
+// Reserve 'count' mcu move queue items for this stepper's exclusive use
+void __visible
+stepcompress_set_reserved_moves(struct stepcompress *sc, int count)
+{
+    free(sc->reserved_clocks);
+    sc->reserved_clocks = NULL;
+    sc->num_reserved_clocks = 0;
+    if (count <= 0)
+        return;
+    sc->reserved_clocks = malloc(sizeof(*sc->reserved_clocks) * count);
+    memset(sc->reserved_clocks, 0, sizeof(*sc->reserved_clocks) * count);
+    sc->num_reserved_clocks = count;
+}
+
 // Set the inverted stepper direction flag
 void __visible
 stepcompress_set_invert_sdir(struct stepcompress *sc, uint32_t invert_sdir)
@@ -286,7 +524,7 @@ free_history(struct stepcompress *sc, uint64_t end_clock)
         if (hs->last_clock > end_clock)
             break;
         list_del(&hs->node);
-        free(hs);
+        mempool_free(&history_pool, hs);
     }
 }
 
@@ -304,6 +542,7 @@ stepcompress_free(struct stepcompress *sc)
     if (!sc)
         return;
     free(sc->queue);
+    free(sc->reserved_clocks);
     message_queue_free(&sc->msg_queue);
     free_history(sc, UINT64_MAX);
     free(sc);
@@ -342,32 +581,158 @@ stepcompress_set_time(struct stepcompress *sc
 // Maximium clock delta between messages in the queue
 #define CLOCK_DIFF_MAX (3<<28)
 
-// Helper to create a queue_step command from a 'struct step_move'
+// Queue a single queue_step (or queue_step_add2) command
 static void
-add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
+queue_move_msg(struct stepcompress *sc, uint64_t req_clock
+               , uint64_t move_clock, struct step_move *move)
 {
-    int32_t addfactor = move->count*(move->count-1)/2;
-    uint32_t ticks = move->add*addfactor + move->interval*(move->count-1);
-    uint64_t last_clock = first_clock + ticks;
-
-    // Create and queue a queue_step command
-    uint32_t msg[5] = {
+    uint32_t msg[6] = {
         sc->queue_step_msgtag, sc->oid, move->interval, move->count, move->add
+        , move->add2
     };
-    struct queue_message *qm = message_alloc_and_encode(msg, 5);
-    qm->min_clock = qm->req_clock = sc->last_step_clock;
-    if (move->count == 1 && first_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
-        qm->req_clock = first_clock;
+    int msglen = 5;
+    if (move->add2) {
+        msg[0] = sc->queue_step_add2_msgtag;
+        msglen = 6;
+    }
+    struct queue_message *qm = message_alloc_and_encode(msg, msglen);
+    qm->min_clock = move_clock;
+    qm->req_clock = req_clock;
+    qm->move_count = 1;
     list_add_tail(&qm->node, &sc->msg_queue);
+    sc->stats.messages++;
+    sc->stats.bytes += qm->len;
+}
+
+// Send a set_next_step_dir command if the mcu's next step direction
+// differs from 'dir'
+static void
+queue_dir_msg(struct stepcompress *sc, int dir)
+{
+    if (dir == sc->mcu_dir)
+        return;
+    sc->mcu_dir = dir;
+    uint32_t msg[3] = { sc->set_next_step_dir_msgtag, sc->oid, dir };
+    struct queue_message *qm = message_alloc_and_encode(msg, 3);
+    qm->req_clock = sc->last_step_clock;
+    list_add_tail(&qm->node, &sc->msg_queue);
+}
+
+// Return the interval the mcu uses as the base for the next move in a
+// queue_steps message (the interval after the last step of 'move')
+static uint32_t
+queue_steps_next_interval(struct step_move *move)
+{
+    uint32_t count = move->count;
+    return (move->interval + count * (uint32_t)move->add
+            + (uint32_t)move->add2 * (count * (count - 1) / 2));
+}
+
+// Transmit any pending queue_steps message
+static void
+queue_steps_flush(struct stepcompress *sc)
+{
+    if (!sc->batch_count)
+        return;
+    if (sc->batch_count == 1 && sc->batch_dir == sc->mcu_dir) {
+        // A regular queue_step command is smaller for a single move
+        queue_move_msg(sc, sc->batch_req_clock, sc->batch_min_clock
+                       , &sc->batch_first);
+        sc->batch_count = sc->batch_len = 0;
+        return;
+    }
+    uint32_t msg[2] = { sc->queue_steps_msgtag, sc->oid };
+    struct queue_message *qm = message_alloc_and_encode(msg, ARRAY_SIZE(msg));
+    qm->msg[qm->len++] = sc->batch_len;
+    memcpy(&qm->msg[qm->len], sc->batch_data, sc->batch_len);
+    qm->len += sc->batch_len;
+    // All moves are assumed to hold their mcu move queue item until
+    // the last move in the message starts
+    qm->min_clock = sc->batch_min_clock;
+    qm->req_clock = sc->batch_req_clock;
+    qm->move_count = sc->batch_count;
+    list_add_tail(&qm->node, &sc->msg_queue);
+    sc->stats.messages++;
+    sc->stats.bytes += qm->len;
+    sc->batch_count = sc->batch_len = 0;
+    sc->mcu_dir = sc->batch_dir;
+}
+
+// Encode a step_move into the delta encoded queue_steps format
+static int
+queue_steps_encode(struct stepcompress *sc, struct step_move *move
+                   , uint8_t *buf)
+{
+    uint32_t base = sc->batch_count ? sc->batch_next_interval : 0;
+    uint32_t count_flag = move->count*2 + !!move->add2;
+    if (sc->queue_steps_dir)
+        count_flag = (move->count*2 + (sc->sdir ^ sc->invert_sdir))*2
+                      + !!move->add2;
+    uint8_t *p = msgblock_encode_int(buf, count_flag);
+    p = msgblock_encode_int(p, move->interval - base);
+    p = msgblock_encode_int(p, move->add);
+    if (move->add2)
+        p = msgblock_encode_int(p, move->add2);
+    return p - buf;
+}
+
+// Add a step_move to the pending queue_steps message
+static void
+queue_steps_add(struct stepcompress *sc, struct step_move *move)
+{
+    uint8_t buf[16];
+    int len = queue_steps_encode(sc, move, buf);
+    if (sc->batch_len + len > QUEUE_STEPS_DATA_MAX
+        || (sc->batch_max_count && sc->batch_count >= sc->batch_max_count)) {
+        queue_steps_flush(sc);
+        len = queue_steps_encode(sc, move, buf);
+    }
+    if (!sc->batch_count) {
+        sc->batch_req_clock = sc->last_step_clock;
+        sc->batch_first = *move;
+    }
+    memcpy(&sc->batch_data[sc->batch_len], buf, len);
+    sc->batch_len += len;
+    sc->batch_count++;
+    sc->batch_min_clock = sc->last_step_clock;
+    sc->batch_next_interval = queue_steps_next_interval(move);
+    sc->batch_dir = sc->sdir ^ sc->invert_sdir;
+}
+
+// Helper to create a queue_step command from a 'struct step_move'
+static void
+add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move
+         , uint32_t max_error)
+{
+    int64_t count = move->count, addfactor = count*(count-1)/2;
+    int64_t add2factor = addfactor*(count-2)/3;
+    uint32_t ticks = (move->add*addfactor + move->add2*add2factor
+                      + (int64_t)move->interval*(count-1));
+    uint64_t last_clock = first_clock + ticks;
+
+    // Create and queue a queue_step (or queue_step_add2) command
+    uint64_t move_clock = sc->last_step_clock;
+    if (move->count == 1 && first_clock >= move_clock + CLOCK_DIFF_MAX) {
+        queue_steps_flush(sc);
+        queue_dir_msg(sc, sc->sdir ^ sc->invert_sdir);
+        queue_move_msg(sc, first_clock, move_clock, move);
+    } else if (sc->queue_steps_msgtag) {
+        queue_steps_add(sc, move);
+    } else {
+        queue_move_msg(sc, move_clock, move_clock, move);
+    }
     sc->last_step_clock = last_clock;
+    sc->stats.steps += move->count;
 
     // Create and store move in history tracking
-    struct history_steps *hs = malloc(sizeof(*hs));
+    struct history_steps *hs = mempool_alloc(&history_pool);
     hs->first_clock = first_clock;
     hs->last_clock = last_clock;
     hs->start_position = sc->last_position;
     hs->interval = move->interval;
     hs->add = move->add;
+    hs->add2 = move->add2;
+    hs->max_error = max_error;
     hs->step_count = sc->sdir ? move->count : -move->count;
     sc->last_position += hs->step_count;
     list_add_head(&hs->node, &sc->history_list);
@@ -375,17 +740,22 @@ add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
 
 // Convert previously scheduled steps into commands for the mcu
 static int
-queue_flush(struct stepcompress *sc, uint64_t move_clock)
+queue_flush_moves(struct stepcompress *sc, uint64_t move_clock)
 {
-    if (sc->queue_pos >= sc->queue_next)
-        return 0;
     while (sc->last_step_clock < move_clock) {
-        struct step_move move = compress_bisect_add(sc);
-        int ret = check_line(sc, move);
-        if (ret)
+        struct step_move move = (sc->compress_method == SC_METHOD_GREEDY
+                                 ? compress_greedy(sc)
+                                 : compress_bisect_add(sc));
+        if (sc->queue_step_add2_msgtag)
+            move = compress_add2(sc, move);
+        uint32_t max_error;
+        int ret = check_line(sc, move, &max_error);
+        if (ret) {
+            queue_steps_flush(sc);
             return ret;
+        }
 
-        add_move(sc, sc->last_step_clock + move.interval, &move);
+        add_move(sc, sc->last_step_clock + move.interval, &move, max_error);
 
         if (sc->queue_pos + move.count >= sc->queue_next) {
             sc->queue_pos = sc->queue_next = sc->queue;
@@ -397,12 +767,36 @@ queue_flush(struct stepcompress *sc, uint64_t move_clock)
     return 0;
 }
 
+// Compress pending steps and track the time spent doing so (a pending
+// queue_steps message is left open so that it may be extended)
+static int
+queue_flush_keep_batch(struct stepcompress *sc, uint64_t move_clock)
+{
+    if (sc->queue_pos >= sc->queue_next)
+        return 0;
+    double start_time = get_monotonic();
+    int ret = queue_flush_moves(sc, move_clock);
+    sc->stats.compress_time += get_monotonic() - start_time;
+    return ret;
+}
+
+// Compress pending steps and transmit them
+static int
+queue_flush(struct stepcompress *sc, uint64_t move_clock)
+{
+    int ret = queue_flush_keep_batch(sc, move_clock);
+    queue_steps_flush(sc);
+    return ret;
+}
+
 // Generate a queue_step for a step far in the future from the last step
 static int
 stepcompress_flush_far(struct stepcompress *sc, uint64_t abs_step_clock)
 {
-    struct step_move move = { abs_step_clock - sc->last_step_clock, 1, 0 };
-    add_move(sc, abs_step_clock, &move);
+    struct step_move move = {
+        .interval = abs_step_clock - sc->last_step_clock, .count = 1 };
+    add_move(sc, abs_step_clock, &move, 0);
+    queue_steps_flush(sc);
     calc_last_step_print_time(sc);
     return 0;
 }
@@ -413,31 +807,19 @@ set_next_step_dir(struct stepcompress *sc, int sdir)
 {
     if (sc->sdir == sdir)
         return 0;
+    if (sc->queue_steps_dir) {
+        // The direction is sent inline in the queue_steps_dir message
+        int ret = queue_flush_keep_batch(sc, UINT64_MAX);
+        if (ret)
+            return ret;
+        sc->sdir = sdir;
+        return 0;
+    }
     int ret = queue_flush(sc, UINT64_MAX);
     if (ret)
         return ret;
     sc->sdir = sdir;
-    uint32_t msg[3] = {
-        sc->set_next_step_dir_msgtag, sc->oid, sdir ^ sc->invert_sdir
-    };
-    struct queue_message *qm = message_alloc_and_encode(msg, 3);
-    qm->req_clock = sc->last_step_clock;
-    list_add_tail(&qm->node, &sc->msg_queue);
-    return 0;
-}
-
-// Slow path for queue_append() - handle next step far in future
-static int
-queue_append_far(struct stepcompress *sc)
-{
-    uint64_t step_clock = sc->next_step_clock;
-    sc->next_step_clock = 0;
-    int ret = queue_flush(sc, step_clock - CLOCK_DIFF_MAX + 1);
-    if (ret)
-        return ret;
-    if (step_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
-        return stepcompress_flush_far(sc, step_clock);
-    *sc->queue_next++ = step_clock;
+    queue_dir_msg(sc, sdir ^ sc->invert_sdir);
     return 0;
 }
 
@@ -479,6 +861,26 @@ queue_append_extend(struct stepcompress *sc)
     return 0;
 }
 
+// Slow path for queue_append() - handle next step far in future
+static int
+queue_append_far(struct stepcompress *sc)
+{
+    uint64_t step_clock = sc->next_step_clock;
+    sc->next_step_clock = 0;
+    int ret = queue_flush(sc, step_clock - CLOCK_DIFF_MAX + 1);
+    if (ret)
+        return ret;
+    if (step_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
+        return stepcompress_flush_far(sc, step_clock);
+    sc->next_step_clock = step_clock;
+    if (unlikely(sc->queue_next >= sc->queue_end))
+        // The flush may not have emptied a full queue
+        return queue_append_extend(sc);
+    *sc->queue_next++ = step_clock;
+    sc->next_step_clock = 0;
+    return 0;
+}
+
 // Add a step time to the queue (flushing the queue if needed)
 static int
 queue_append(struct stepcompress *sc)
@@ -558,7 +960,7 @@ stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock)
     if (ret)
         return ret;
     sc->last_step_clock = last_step_clock;
-    sc->sdir = -1;
+    sc->sdir = sc->mcu_dir = -1;
     calc_last_step_print_time(sc);
     return 0;
 }
@@ -574,14 +976,48 @@ stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
     sc->last_position = last_position;
 
     // Add a marker to the history list
-    struct history_steps *hs = malloc(sizeof(*hs));
-    memset(hs, 0, sizeof(*hs));
+    struct history_steps *hs = mempool_alloc(&history_pool);
     hs->first_clock = hs->last_clock = clock;
     hs->start_position = last_position;
     list_add_head(&hs->node, &sc->history_list);
     return 0;
 }
 
+// Return the number of steps of a history entry at or before 'clock'
+static int64_t
+history_step_offset(struct history_steps *hs, uint64_t clock)
+{
+    int32_t interval = hs->interval, add = hs->add;
+    int32_t ticks = (int32_t)(clock - hs->first_clock) + interval;
+    if (hs->add2) {
+        // Bisect for "count" (step times are strictly increasing)
+        int64_t low = 0, high = abs(hs->step_count);
+        while (low < high) {
+            int64_t n = (low + high + 1) / 2, af = n*(n-1)/2;
+            int64_t pos = interval*n + add*af + hs->add2*(af*(n-2)/3);
+            if (pos <= ticks)
+                low = n;
+            else
+                high = n - 1;
+        }
+        return low;
+    } else if (!add) {
+        return ticks / interval;
+    }
+    // Solve for "count" using quadratic formula
+    double a = .5 * add, b = interval - .5 * add, c = -ticks;
+    return (sqrt(b*b - 4*a*c) - b) / (2. * a);
+}
+
+// Return the clock of step 'n' (the first step is 1) of a history entry
+static uint64_t
+history_step_clock(struct history_steps *hs, int64_t n)
+{
+    int64_t af = n*(n-1)/2;
+    int64_t pos = hs->interval*n + hs->add*af + hs->add2*(af*(n-2)/3);
+    return hs->first_clock - hs->interval + pos;
+}
+
 // Search history of moves to find a past position at a given clock
 int64_t __visible
 stepcompress_find_past_position(struct stepcompress *sc, uint64_t clock)
@@ -595,15 +1031,7 @@ stepcompress_find_past_position(struct stepcompress *sc, uint64_t clock)
         }
         if (clock >= hs->last_clock)
             return hs->start_position + hs->step_count;
-        int32_t interval = hs->interval, add = hs->add;
-        int32_t ticks = (int32_t)(clock - hs->first_clock) + interval, offset;
-        if (!add) {
-            offset = ticks / interval;
-        } else {
-            // Solve for "count" using quadratic formula
-            double a = .5 * add, b = interval - .5 * add, c = -ticks;
-            offset = (sqrt(b*b - 4*a*c) - b) / (2. * a);
-        }
+        int64_t offset = history_step_offset(hs, clock);
         if (hs->step_count < 0)
             return hs->start_position - offset;
         return hs->start_position + offset;
@@ -611,6 +1039,36 @@ stepcompress_find_past_position(struct stepcompress *sc, uint64_t clock)
     return last_position;
 }
 
+// Find a past position with a fractional step position interpolated
+// from the times of the steps before and after the given clock.  A
+// step occurs when the requested position crosses the half way point
+// between two step positions, so the result is the estimated
+// requested position (in steps) at the given clock.
+double __visible
+stepcompress_find_past_position_frac(struct stepcompress *sc, uint64_t clock)
+{
+    struct history_steps *hs;
+    list_for_each_entry(hs, &sc->history_list, node) {
+        if (clock < hs->first_clock)
+            continue;
+        if (clock >= hs->last_clock)
+            break;
+        int64_t offset = history_step_offset(hs, clock);
+        if (offset < 1 || offset >= abs(hs->step_count))
+            break;
+        uint64_t step_clock = history_step_clock(hs, offset);
+        uint64_t next_clock = history_step_clock(hs, offset + 1);
+        if (next_clock <= step_clock || clock < step_clock)
+            break;
+        double frac = (double)(clock - step_clock) / (next_clock - step_clock);
+        double dpos = offset - .5 + frac;
+        if (hs->step_count < 0)
+            return hs->start_position - dpos;
+        return hs->start_position + dpos;
+    }
+    return stepcompress_find_past_position(sc, clock);
+}
+
 // Queue an mcu command to go out in order with stepper commands
 int __visible
 stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len)
@@ -636,10 +1094,19 @@ stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
 
     struct queue_message *qm = message_alloc_and_encode(data, len);
     qm->min_clock = qm->req_clock = req_clock;
+    qm->move_count = 1;
     list_add_tail(&qm->node, &sc->msg_queue);
     return 0;
 }
 
+// Report step compression statistics
+void __visible
+stepcompress_get_stats(struct stepcompress *sc
+                       , struct stepcompress_stats *stats)
+{
+    *stats = sc->stats;
+}
+
 // Return history of queue_step commands
 int __visible
 stepcompress_extract_old(struct stepcompress *sc, struct pull_history_steps *p
@@ -658,6 +1125,8 @@ stepcompress_extract_old(struct stepcompress *sc, struct pull_history_steps *p
         p->step_count = hs->step_count;
         p->interval = hs->interval;
         p->add = hs->add;
+        p->add2 = hs->add2;
+        p->max_error = hs->max_error;
         p++;
         res++;
     }
@@ -705,6 +1174,15 @@ steppersync_alloc(struct serialqueue *sq, struct stepcompress **sc_list
     ss->move_clocks = malloc(sizeof(*ss->move_clocks)*move_num);
     memset(ss->move_clocks, 0, sizeof(*ss->move_clocks)*move_num);
     ss->num_move_clocks = move_num;
+    int i;
+    for (i=0; i<sc_num; i++) {
+        struct stepcompress *sc = sc_list[i];
+        if (sc->num_reserved_clocks)
+            memset(sc->reserved_clocks, 0
+                   , sizeof(*sc->reserved_clocks) * sc->num_reserved_clocks);
+        // A queue_steps batch may not use more move queue items than exist
+        sc->batch_max_count = move_num + sc->num_reserved_clocks;
+    }
 
     return ss;
 }
@@ -748,10 +1226,9 @@ steppersync_history_expire(struct steppersync *ss, uint64_t end_clock)
 // Implement a binary heap algorithm to track when the next available
 // 'struct move' in the mcu will be available
 static void
-heap_replace(struct steppersync *ss, uint64_t req_clock)
+heap_replace(uint64_t *mc, int nmc, uint64_t req_clock)
 {
-    uint64_t *mc = ss->move_clocks;
-    int nmc = ss->num_move_clocks, pos = 0;
+    int pos = 0;
     for (;;) {
         int child1_pos = 2*pos+1, child2_pos = 2*pos+2;
         uint64_t child2_clock = child2_pos < nmc ? mc[child2_pos] : UINT64_MAX;
@@ -790,6 +1267,7 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
         // Find message with lowest reqclock
         uint64_t req_clock = MAX_CLOCK;
         struct queue_message *qm = NULL;
+        struct stepcompress *sc_qm = NULL;
         for (i=0; i<ss->sc_num; i++) {
             struct stepcompress *sc = ss->sc_list[i];
             if (!list_empty(&sc->msg_queue)) {
@@ -797,6 +1275,7 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
                     &sc->msg_queue, struct queue_message, node);
                 if (m->req_clock < req_clock) {
                     qm = m;
+                    sc_qm = sc;
                     req_clock = m->req_clock;
                 }
             }
@@ -804,12 +1283,32 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
         if (!qm || (qm->min_clock && req_clock > move_clock))
             break;
 
-        uint64_t next_avail = ss->move_clocks[0];
-        if (qm->min_clock)
+        // Moves use this stepper's reserved move queue items (if any)
+        // whenever they become available before a shared item
+        uint64_t *mc = ss->move_clocks, *rc = sc_qm->reserved_clocks;
+        int nmc = ss->num_move_clocks, nrc = sc_qm->num_reserved_clocks;
+        uint64_t next_avail = mc[0];
+        if (nrc && (!nmc || rc[0] <= next_avail))
+            next_avail = rc[0];
+        if (qm->min_clock) {
             // The qm->min_clock field is overloaded to indicate that
             // the command uses the 'move queue' and to store the time
             // that move queue item becomes available.
-            heap_replace(ss, qm->min_clock);
+            int j;
+            next_avail = 0;
+            for (j=0; j<qm->move_count; j++) {
+                uint64_t avail;
+                if (nrc && (!nmc || rc[0] <= mc[0])) {
+                    avail = rc[0];
+                    heap_replace(rc, nrc, qm->min_clock);
+                } else {
+                    avail = mc[0];
+                    heap_replace(mc, nmc, qm->min_clock);
+                }
+                if (avail > next_avail)
+                    next_avail = avail;
+            }
+        }
         // Reset the min_clock to its normal meaning (minimum transmit time)
         qm->min_clock = next_avail;
 
@@ -825,3 +1324,49 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock
     steppersync_history_expire(ss, clear_history_clock);
     return 0;
 }
+
+// Return the number of shared mcu move queue items free at 'clock'
+int __visible
+steppersync_get_free_moves(struct steppersync *ss, uint64_t clock)
+{
+    int i, count = 0;
+    for (i=0; i<ss->num_move_clocks; i++)
+        if (ss->move_clocks[i] <= clock)
+            count++;
+    return count;
+}
+
+// Note the count of free move queue items reported by the mcu at
+// 'clock'.  If the mcu has fewer free items than expected, then treat
+// the missing items as busy until all currently queued moves complete.
+int __visible
+steppersync_note_mcu_free_moves(struct steppersync *ss, uint64_t clock
+                                , int free_count)
+{
+    // Determine the number of items expected to be free at 'clock'
+    uint64_t max_clock = 0;
+    int i, j, expected = 0;
+    for (i=0; i<ss->num_move_clocks; i++) {
+        uint64_t mc = ss->move_clocks[i];
+        if (mc <= clock)
+            expected++;
+        if (mc > max_clock)
+            max_clock = mc;
+    }
+    for (i=0; i<ss->sc_num; i++) {
+        struct stepcompress *sc = ss->sc_list[i];
+        for (j=0; j<sc->num_reserved_clocks; j++)
+            if (sc->reserved_clocks[j] <= clock)
+                expected++;
+    }
+    int deficit = expected - free_count;
+    if (deficit <= 0)
+        return 0;
+    // Mark the missing items as busy in the shared move queue tracking
+    for (i=0; i<deficit && ss->num_move_clocks; i++) {
+        if (ss->move_clocks[0] > clock)
+            break;
+        heap_replace(ss->move_clocks, ss->num_move_clocks, max_clock);
+    }
+    return deficit;
+}
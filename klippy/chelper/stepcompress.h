@@ -5,16 +5,32 @@
 
 #define ERROR_RET -989898989
 
+enum {
+    SC_METHOD_BISECT, SC_METHOD_GREEDY,
+};
+
 struct pull_history_steps {
     uint64_t first_clock, last_clock;
     int64_t start_position;
-    int step_count, interval, add;
+    int step_count, interval, add, add2;
+    uint32_t max_error;
+};
+
+struct stepcompress_stats {
+    uint64_t steps, messages, bytes;
+    double compress_time;
 };
 
 struct stepcompress *stepcompress_alloc(uint32_t oid);
 void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
                        , int32_t queue_step_msgtag
                        , int32_t set_next_step_dir_msgtag);
+void stepcompress_fill_add2(struct stepcompress *sc
+                            , int32_t queue_step_add2_msgtag);
+void stepcompress_fill_queue_steps(struct stepcompress *sc
+                                   , int32_t queue_steps_msgtag, int has_dir);
+void stepcompress_set_compress_method(struct stepcompress *sc, int method);
+void stepcompress_set_reserved_moves(struct stepcompress *sc, int count);
 void stepcompress_set_invert_sdir(struct stepcompress *sc
                                   , uint32_t invert_sdir);
 void stepcompress_free(struct stepcompress *sc);
@@ -28,9 +44,13 @@ int stepcompress_set_last_position(struct stepcompress *sc, uint64_t clock
                                    , int64_t last_position);
 int64_t stepcompress_find_past_position(struct stepcompress *sc
                                         , uint64_t clock);
+double stepcompress_find_past_position_frac(struct stepcompress *sc
+                                            , uint64_t clock);
 int stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len);
 int stepcompress_queue_mq_msg(struct stepcompress *sc, uint64_t req_clock
                               , uint32_t *data, int len);
+void stepcompress_get_stats(struct stepcompress *sc
+                           , struct stepcompress_stats *stats);
 int stepcompress_extract_old(struct stepcompress *sc
                              , struct pull_history_steps *p, int max
                              , uint64_t start_clock, uint64_t end_clock);
@@ -44,5 +64,8 @@ void steppersync_set_time(struct steppersync *ss, double time_offset
                           , double mcu_freq);
 int steppersync_flush(struct steppersync *ss, uint64_t move_clock
                       , uint64_t clear_history_clock);
+int steppersync_get_free_moves(struct steppersync *ss, uint64_t clock);
+int steppersync_note_mcu_free_moves(struct steppersync *ss, uint64_t clock
+                                    , int free_count);
 
 #endif // stepcompress.h
@@ -4,20 +4,33 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <fcntl.h> // open
 #include <math.h> // sqrt
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/mman.h> // mmap
+#include <unistd.h> // ftruncate
 #include "compiler.h" // unlikely
+#include "mempool.h" // mempool_alloc
+#include "pyhelper.h" // errorf
 #include "trapq.h" // move_get_coord
 
+static struct mempool move_pool = MEMPOOL_DEFINE(
+    "trapq_move", sizeof(struct move), 4096);
+
 // Allocate a new 'move' object
 struct move *
 move_alloc(void)
 {
-    struct move *m = malloc(sizeof(*m));
-    memset(m, 0, sizeof(*m));
-    return m;
+    return mempool_alloc(&move_pool);
+}
+
+// Free a 'move' object
+static void
+move_free(struct move *m)
+{
+    mempool_free(&move_pool, m);
 }
 
 // Return the distance moved given a time in a move
@@ -40,6 +53,182 @@ move_get_coord(struct move *m, double move_time)
 
 #define NEVER_TIME 9999999999999999.9
 
+
+/****************************************************************
+ * Move index
+ ****************************************************************/
+
+// The trapq maintains contiguous arrays of the end times of all moves
+// on the "moves" and "history" lists (oldest move first) so that the
+// move active at a given time can be found with a binary search
+// instead of a list walk.
+
+// Add a move to the end of an index
+static void
+index_append(struct move_index *mi, struct move *m)
+{
+    if (mi->start + mi->count >= mi->alloc) {
+        if (mi->start && mi->start >= mi->alloc / 2) {
+            // Shuffle the index to avoid having to allocate more ram
+            memmove(mi->items, &mi->items[mi->start]
+                    , mi->count * sizeof(*mi->items));
+            mi->start = 0;
+        } else {
+            // Expand the index
+            int alloc = mi->alloc ? mi->alloc * 2 : 256;
+            mi->items = realloc(mi->items, alloc * sizeof(*mi->items));
+            mi->alloc = alloc;
+        }
+    }
+    struct trapq_index *ti = &mi->items[mi->start + mi->count++];
+    ti->end_time = m->print_time + m->move_t;
+    ti->m = m;
+}
+
+// Remove the first (oldest) move from an index
+static void
+index_pop(struct move_index *mi)
+{
+    mi->start++;
+    if (!--mi->count)
+        mi->start = 0;
+}
+
+// Remove the last (newest) move from an index
+static void
+index_pop_last(struct move_index *mi)
+{
+    if (!--mi->count)
+        mi->start = 0;
+}
+
+// Return the number of indexed moves that end at or before the given time
+static int
+index_search(struct move_index *mi, double print_time)
+{
+    struct trapq_index *items = &mi->items[mi->start];
+    int low = 0, high = mi->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (items[mid].end_time > print_time)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return low;
+}
+
+
+/****************************************************************
+ * Shared memory export
+ ****************************************************************/
+
+// Every move added to the trapq (and every position reset) may be
+// copied into a ring of records in a shared memory segment so that
+// external processes can follow the motion.  Each record is protected
+// by a "seqlock" - readers should copy a record and then verify that
+// its seq_lock field was unchanged and equal to 2*(seq+1).
+
+struct trapq_shm {
+    struct trapq_shm_header *hdr;
+    struct trapq_shm_record *records;
+    size_t size;
+    char *filename;
+};
+
+// Copy a move into the next record of the shared memory ring
+static void
+shm_write(struct trapq_shm *shm, struct move *m)
+{
+    struct trapq_shm_header *hdr = shm->hdr;
+    uint64_t seq = hdr->head;
+    struct trapq_shm_record *r = &shm->records[seq % hdr->record_count];
+    __atomic_store_n(&r->seq_lock, 2*seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    struct pull_move *p = &r->move;
+    p->print_time = m->print_time;
+    p->move_t = m->move_t;
+    p->start_v = m->start_v;
+    p->accel = 2. * m->half_accel;
+    p->start_x = m->start_pos.x;
+    p->start_y = m->start_pos.y;
+    p->start_z = m->start_pos.z;
+    p->x_r = m->axes_r.x;
+    p->y_r = m->axes_r.y;
+    p->z_r = m->axes_r.z;
+    __atomic_store_n(&r->seq_lock, 2*seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Release a shared memory segment
+static void
+shm_free(struct trapq_shm *shm)
+{
+    if (!shm)
+        return;
+    munmap(shm->hdr, shm->size);
+    unlink(shm->filename);
+    free(shm->filename);
+    free(shm);
+}
+
+// Export all future moves to a shared memory file (eg, in /dev/shm/)
+int __visible
+trapq_shm_open(struct trapq *tq, const char *filename, int record_count)
+{
+    shm_free(tq->shm);
+    tq->shm = NULL;
+    if (record_count <= 0)
+        return 0;
+    size_t size = (sizeof(struct trapq_shm_header)
+                   + record_count * sizeof(struct trapq_shm_record));
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        errorf("trapq unable to open %s", filename);
+        return -1;
+    }
+    int ret = ftruncate(fd, size);
+    void *mem = MAP_FAILED;
+    if (!ret)
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        errorf("trapq unable to map %s", filename);
+        unlink(filename);
+        return -1;
+    }
+    struct trapq_shm *shm = malloc(sizeof(*shm));
+    memset(shm, 0, sizeof(*shm));
+    shm->hdr = mem;
+    shm->records = mem + sizeof(struct trapq_shm_header);
+    shm->size = size;
+    shm->filename = strdup(filename);
+    shm->hdr->version = TRAPQ_SHM_VERSION;
+    shm->hdr->record_size = sizeof(struct trapq_shm_record);
+    shm->hdr->record_count = record_count;
+    __atomic_store_n(&shm->hdr->magic, TRAPQ_SHM_MAGIC, __ATOMIC_RELEASE);
+    tq->shm = shm;
+    return 0;
+}
+
+
+/****************************************************************
+ * Trapezoidal velocity queue
+ ****************************************************************/
+
+// Find the first move on the trapq that ends after the given time
+struct move *
+trapq_find_move(struct trapq *tq, double print_time)
+{
+    struct move *head_sentinel = list_first_entry(&tq->moves, struct move,node);
+    if (print_time < head_sentinel->print_time + head_sentinel->move_t)
+        return head_sentinel;
+    int pos = index_search(&tq->index, print_time);
+    if (pos < tq->index.count)
+        return tq->index.items[tq->index.start + pos].m;
+    return list_last_entry(&tq->moves, struct move, node);
+}
+
 // Allocate a new 'trapq' object
 struct trapq * __visible
 trapq_alloc(void)
@@ -62,13 +251,16 @@ trapq_free(struct trapq *tq)
     while (!list_empty(&tq->moves)) {
         struct move *m = list_first_entry(&tq->moves, struct move, node);
         list_del(&m->node);
-        free(m);
+        move_free(m);
     }
     while (!list_empty(&tq->history)) {
         struct move *m = list_first_entry(&tq->history, struct move, node);
         list_del(&m->node);
-        free(m);
+        move_free(m);
     }
+    free(tq->index.items);
+    free(tq->history_index.items);
+    shm_free(tq->shm);
     free(tq);
 }
 
@@ -110,9 +302,16 @@ trapq_add_move(struct trapq *tq, struct move *m)
             null_move->print_time = prev->print_time + prev->move_t;
         null_move->move_t = m->print_time - null_move->print_time;
         list_add_before(&null_move->node, &tail_sentinel->node);
+        index_append(&tq->index, null_move);
+        if (tq->shm)
+            shm_write(tq->shm, null_move);
     }
     list_add_before(&m->node, &tail_sentinel->node);
+    index_append(&tq->index, m);
     tail_sentinel->print_time = 0.;
+    tq->update_count++;
+    if (tq->shm)
+        shm_write(tq->shm, m);
 }
 
 // Fill and add a move to the trapezoid velocity queue
@@ -163,6 +362,20 @@ trapq_append(struct trapq *tq, double print_time
     }
 }
 
+// Add a series of moves to the trapezoid velocity queue.  The 'data'
+// array contains 'count' records laid out as a struct trapq_append_record.
+void __visible
+trapq_append_batch(struct trapq *tq, double *data, int count)
+{
+    struct trapq_append_record *r = (void*)data;
+    int i;
+    for (i=0; i<count; i++, r++)
+        trapq_append(tq, r->print_time, r->accel_t, r->cruise_t, r->decel_t
+                     , r->start_x, r->start_y, r->start_z
+                     , r->x_r, r->y_r, r->z_r
+                     , r->start_v, r->cruise_v, r->accel);
+}
+
 // Expire any moves older than `print_time` from the trapezoid velocity queue
 void __visible
 trapq_finalize_moves(struct trapq *tq, double print_time
@@ -170,6 +383,7 @@ trapq_finalize_moves(struct trapq *tq, double print_time
 {
     struct move *head_sentinel = list_first_entry(&tq->moves, struct move,node);
     struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
+    tq->update_count++;
     // Move expired moves from main "moves" list to "history" list
     for (;;) {
         struct move *m = list_next_entry(head_sentinel, node);
@@ -180,10 +394,13 @@ trapq_finalize_moves(struct trapq *tq, double print_time
         if (m->print_time + m->move_t > print_time)
             break;
         list_del(&m->node);
-        if (m->start_v || m->half_accel)
+        index_pop(&tq->index);
+        if (m->start_v || m->half_accel) {
             list_add_head(&m->node, &tq->history);
-        else
-            free(m);
+            index_append(&tq->history_index, m);
+        } else {
+            move_free(m);
+        }
     }
     // Free old moves from history list
     if (list_empty(&tq->history))
@@ -194,7 +411,8 @@ trapq_finalize_moves(struct trapq *tq, double print_time
         if (m == latest || m->print_time + m->move_t > clear_history_time)
             break;
         list_del(&m->node);
-        free(m);
+        index_pop(&tq->history_index);
+        move_free(m);
     }
 }
 
@@ -210,12 +428,16 @@ trapq_set_position(struct trapq *tq, double print_time
     while (!list_empty(&tq->history)) {
         struct move *m = list_first_entry(&tq->history, struct move, node);
         if (m->print_time < print_time) {
-            if (m->print_time + m->move_t > print_time)
+            if (m->print_time + m->move_t > print_time) {
                 m->move_t = print_time - m->print_time;
+                struct move_index *mi = &tq->history_index;
+                mi->items[mi->start + mi->count - 1].end_time = print_time;
+            }
             break;
         }
         list_del(&m->node);
-        free(m);
+        index_pop_last(&tq->history_index);
+        move_free(m);
     }
 
     // Add a marker to the trapq history
@@ -225,6 +447,9 @@ trapq_set_position(struct trapq *tq, double print_time
     m->start_pos.y = pos_y;
     m->start_pos.z = pos_z;
     list_add_head(&m->node, &tq->history);
+    index_append(&tq->history_index, m);
+    if (tq->shm)
+        shm_write(tq->shm, m);
 }
 
 // Return history of movement queue
@@ -232,13 +457,23 @@ int __visible
 trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
                   , double start_time, double end_time)
 {
-    int res = 0;
-    struct move *m;
-    list_for_each_entry(m, &tq->history, node) {
-        if (start_time >= m->print_time + m->move_t || res >= max)
+    // Skip history moves that start at or after end_time
+    struct move_index *mi = &tq->history_index;
+    struct trapq_index *items = &mi->items[mi->start];
+    int low = index_search(mi, start_time), high = mi->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (items[mid].m->print_time >= end_time)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    // Report moves from newest to oldest
+    int res = 0, pos;
+    for (pos = low - 1; pos >= 0 && res < max; pos--) {
+        struct move *m = items[pos].m;
+        if (start_time >= m->print_time + m->move_t)
             break;
-        if (end_time <= m->print_time)
-            continue;
         p->print_time = m->print_time;
         p->move_t = m->move_t;
         p->start_v = m->start_v;
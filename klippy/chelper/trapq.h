@@ -1,6 +1,7 @@
 #ifndef TRAPQ_H
 #define TRAPQ_H
 
+#include <stdint.h> // uint64_t
 #include "list.h" // list_node
 
 struct coord {
@@ -20,8 +21,23 @@ struct move {
     struct list_node node;
 };
 
+struct trapq_index {
+    double end_time;
+    struct move *m;
+};
+
+struct move_index {
+    struct trapq_index *items;
+    int start, count, alloc;
+};
+
 struct trapq {
     struct list_head moves, history;
+    uint64_t update_count;
+    // Time ordered indexes of the moves on the "moves" and "history" lists
+    struct move_index index, history_index;
+    // Optional export of added moves to a shared memory segment
+    struct trapq_shm *shm;
 };
 
 struct pull_move {
@@ -31,23 +47,49 @@ struct pull_move {
     double x_r, y_r, z_r;
 };
 
+// Layout of the shared memory segment created by trapq_shm_open()
+#define TRAPQ_SHM_MAGIC 0x71706174 // "tapq"
+#define TRAPQ_SHM_VERSION 1
+
+struct trapq_shm_header {
+    uint32_t magic, version, record_size, record_count;
+    uint64_t head; // Total number of records written
+};
+
+struct trapq_shm_record {
+    // Odd while the record is being written, otherwise 2*(seq+1)
+    uint64_t seq_lock;
+    struct pull_move move;
+};
+
+// Layout of each move passed to trapq_append_batch()
+struct trapq_append_record {
+    double print_time, accel_t, cruise_t, decel_t;
+    double start_x, start_y, start_z;
+    double x_r, y_r, z_r;
+    double start_v, cruise_v, accel;
+};
+
 struct move *move_alloc(void);
 double move_get_distance(struct move *m, double move_time);
 struct coord move_get_coord(struct move *m, double move_time);
 struct trapq *trapq_alloc(void);
 void trapq_free(struct trapq *tq);
 void trapq_check_sentinels(struct trapq *tq);
+struct move *trapq_find_move(struct trapq *tq, double print_time);
 void trapq_add_move(struct trapq *tq, struct move *m);
 void trapq_append(struct trapq *tq, double print_time
                   , double accel_t, double cruise_t, double decel_t
                   , double start_pos_x, double start_pos_y, double start_pos_z
                   , double axes_r_x, double axes_r_y, double axes_r_z
                   , double start_v, double cruise_v, double accel);
+void trapq_append_batch(struct trapq *tq, double *data, int count);
 void trapq_finalize_moves(struct trapq *tq, double print_time
                           , double clear_history_time);
 void trapq_set_position(struct trapq *tq, double print_time
                         , double pos_x, double pos_y, double pos_z);
 int trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
                       , double start_time, double end_time);
+int trapq_shm_open(struct trapq *tq, const char *filename, int record_count);
 
 #endif // trapq.h
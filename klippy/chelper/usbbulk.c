@@ -0,0 +1,264 @@
+// Direct USB bulk transfer support (via Linux usbfs)
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This code communicates with a USB CDC-ACM style micro-controller by
+// claiming its "data" interface and submitting bulk transfers
+// directly to the kernel (bypassing the tty layer).  Several read
+// transfers are kept in flight, and completed transfers are reported
+// by the kernel by marking the usbfs file descriptor as writable.
+
+#include <errno.h> // errno
+#include <linux/usbdevice_fs.h> // USBDEVFS_SUBMITURB
+#include <stddef.h> // offsetof
+#include <stdint.h> // uint8_t
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include <sys/ioctl.h> // ioctl
+#include <unistd.h> // read
+#include "compiler.h" // ARRAY_SIZE
+#include "msgblock.h" // MESSAGE_MAX
+#include "pyhelper.h" // errorf
+#include "usbbulk.h" // usbbulk_alloc
+
+#define USB_DT_INTERFACE 0x04
+#define USB_DT_ENDPOINT 0x05
+#define USB_ENDPOINT_XFER_BULK 0x02
+#define USB_DIR_IN 0x80
+
+#define USB_READ_URBS 8
+#define USB_WRITE_URBS 8
+#define USB_WRITE_SIZE (MESSAGE_MAX * 16)
+
+struct usbbulk_urb {
+    struct usbdevfs_urb urb;
+    int busy;
+};
+
+struct usbbulk {
+    int fd, ifno, ep_in, ep_out, in_size;
+    uint32_t if_mask;
+    struct usbbulk_urb read_urbs[USB_READ_URBS];
+    struct usbbulk_urb write_urbs[USB_WRITE_URBS];
+    uint8_t write_bufs[USB_WRITE_URBS][USB_WRITE_SIZE];
+    uint8_t *read_bufs;
+};
+
+// Find the bulk endpoints of the given interface in the usb descriptors
+static int
+find_endpoints(struct usbbulk *ub)
+{
+    uint8_t desc[4096];
+    int ret = lseek(ub->fd, 0, SEEK_SET);
+    if (ret < 0) {
+        report_errno("usb lseek", ret);
+        return -1;
+    }
+    int len = read(ub->fd, desc, sizeof(desc));
+    if (len < 0) {
+        report_errno("usb read descriptors", len);
+        return -1;
+    }
+    int pos = 0, cur_if = -1, cur_alt = -1;
+    while (pos + 2 <= len) {
+        int dlen = desc[pos], dtype = desc[pos+1];
+        if (dlen < 2 || pos + dlen > len)
+            break;
+        if (dtype == USB_DT_INTERFACE && dlen >= 9) {
+            cur_if = desc[pos+2];
+            cur_alt = desc[pos+3];
+            if (cur_if < 32)
+                ub->if_mask |= 1 << cur_if;
+        } else if (dtype == USB_DT_ENDPOINT && dlen >= 7
+                   && cur_if == ub->ifno && cur_alt == 0
+                   && (desc[pos+3] & 0x03) == USB_ENDPOINT_XFER_BULK) {
+            int addr = desc[pos+2];
+            int maxp = (desc[pos+4] | (desc[pos+5] << 8)) & 0x7ff;
+            if (addr & USB_DIR_IN) {
+                ub->ep_in = addr;
+                ub->in_size = maxp;
+            } else {
+                ub->ep_out = addr;
+            }
+        }
+        pos += dlen;
+    }
+    if (!ub->ep_in || !ub->ep_out || !ub->in_size) {
+        errorf("Unable to find usb bulk endpoints on interface %d", ub->ifno);
+        return -1;
+    }
+    return 0;
+}
+
+// Detach any kernel driver (eg, cdc_acm) and claim the interface
+static int
+claim_interface(struct usbbulk *ub)
+{
+    struct usbdevfs_disconnect_claim dc;
+    memset(&dc, 0, sizeof(dc));
+    dc.interface = ub->ifno;
+    int ret = ioctl(ub->fd, USBDEVFS_DISCONNECT_CLAIM, &dc);
+    if (ret < 0 && errno == ENOTTY) {
+        // Older kernel - disconnect and claim separately
+        struct usbdevfs_ioctl cmd = { .ifno = ub->ifno
+                                      , .ioctl_code = USBDEVFS_DISCONNECT };
+        ioctl(ub->fd, USBDEVFS_IOCTL, &cmd);
+        unsigned int ifno = ub->ifno;
+        ret = ioctl(ub->fd, USBDEVFS_CLAIMINTERFACE, &ifno);
+    }
+    if (ret < 0) {
+        report_errno("usb claim interface", ret);
+        return -1;
+    }
+    return 0;
+}
+
+// Queue a transfer with the kernel
+static int
+submit_urb(struct usbbulk *ub, struct usbbulk_urb *u)
+{
+    int ret = ioctl(ub->fd, USBDEVFS_SUBMITURB, &u->urb);
+    if (ret < 0) {
+        report_errno("usb submit urb", ret);
+        return -1;
+    }
+    u->busy = 1;
+    return 0;
+}
+
+// Claim the usb interface and start reading from it
+struct usbbulk *
+usbbulk_alloc(int fd, int ifno)
+{
+    struct usbbulk *ub = malloc(sizeof(*ub));
+    memset(ub, 0, sizeof(*ub));
+    ub->fd = fd;
+    ub->ifno = ifno;
+    if (find_endpoints(ub))
+        goto fail;
+    if (claim_interface(ub))
+        goto fail;
+    ub->read_bufs = malloc(USB_READ_URBS * ub->in_size);
+    int i;
+    for (i=0; i<ARRAY_SIZE(ub->write_urbs); i++) {
+        struct usbdevfs_urb *urb = &ub->write_urbs[i].urb;
+        urb->type = USBDEVFS_URB_TYPE_BULK;
+        urb->endpoint = ub->ep_out;
+        urb->buffer = ub->write_bufs[i];
+    }
+    for (i=0; i<ARRAY_SIZE(ub->read_urbs); i++) {
+        struct usbbulk_urb *u = &ub->read_urbs[i];
+        u->urb.type = USBDEVFS_URB_TYPE_BULK;
+        u->urb.endpoint = ub->ep_in;
+        u->urb.buffer = &ub->read_bufs[i * ub->in_size];
+        u->urb.buffer_length = ub->in_size;
+        if (submit_urb(ub, u)) {
+            usbbulk_free(ub);
+            return NULL;
+        }
+    }
+    return ub;
+
+fail:
+    free(ub);
+    return NULL;
+}
+
+// Cancel pending transfers, release the interface, and reattach the
+// kernel drivers
+void
+usbbulk_free(struct usbbulk *ub)
+{
+    if (!ub)
+        return;
+    struct usbbulk_urb *all[USB_READ_URBS + USB_WRITE_URBS];
+    int i, count = 0;
+    for (i=0; i<ARRAY_SIZE(ub->read_urbs); i++)
+        all[count++] = &ub->read_urbs[i];
+    for (i=0; i<ARRAY_SIZE(ub->write_urbs); i++)
+        all[count++] = &ub->write_urbs[i];
+    int pending = 0;
+    for (i=0; i<count; i++) {
+        if (!all[i]->busy)
+            continue;
+        ioctl(ub->fd, USBDEVFS_DISCARDURB, &all[i]->urb);
+        pending++;
+    }
+    while (pending--) {
+        struct usbdevfs_urb *urb;
+        int ret = ioctl(ub->fd, USBDEVFS_REAPURB, &urb);
+        if (ret < 0)
+            break;
+    }
+    unsigned int ifno = ub->ifno;
+    ioctl(ub->fd, USBDEVFS_RELEASEINTERFACE, &ifno);
+    for (i=0; i<32; i++) {
+        if (!(ub->if_mask & (1 << i)))
+            continue;
+        struct usbdevfs_ioctl cmd = { .ifno = i
+                                      , .ioctl_code = USBDEVFS_CONNECT };
+        ioctl(ub->fd, USBDEVFS_IOCTL, &cmd);
+    }
+    free(ub->read_bufs);
+    free(ub);
+}
+
+// Process a completed transfer (if any).  Returns the number of bytes
+// read, or a negative number if the device is no longer available.
+int
+usbbulk_read(struct usbbulk *ub, void *buf, int maxlen)
+{
+    struct usbdevfs_urb *urb;
+    int ret = ioctl(ub->fd, USBDEVFS_REAPURBNDELAY, &urb);
+    if (ret < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        report_errno("usb reap urb", ret);
+        return -1;
+    }
+    if (urb->endpoint == ub->ep_out) {
+        // Write completed
+        struct usbbulk_urb *u = container_of(urb, struct usbbulk_urb, urb);
+        u->busy = 0;
+        if (urb->status)
+            errorf("usb write status %d", urb->status);
+        return 0;
+    }
+    struct usbbulk_urb *u = container_of(urb, struct usbbulk_urb, urb);
+    u->busy = 0;
+    int status = urb->status;
+    if (status == -ENODEV || status == -ESHUTDOWN || status == -ENOENT)
+        return -1;
+    int len = 0;
+    if (status)
+        errorf("usb read status %d", status);
+    else
+        len = urb->actual_length > maxlen ? maxlen : urb->actual_length;
+    memcpy(buf, urb->buffer, len);
+    if (submit_urb(ub, u))
+        return -1;
+    return len;
+}
+
+// Queue data to be written to the device
+int
+usbbulk_write(struct usbbulk *ub, void *buf, int len)
+{
+    if (len > USB_WRITE_SIZE) {
+        errorf("usb write too large (%d)", len);
+        return -1;
+    }
+    int i;
+    for (i=0; i<ARRAY_SIZE(ub->write_urbs); i++) {
+        struct usbbulk_urb *u = &ub->write_urbs[i];
+        if (u->busy)
+            continue;
+        memcpy(u->urb.buffer, buf, len);
+        u->urb.buffer_length = len;
+        if (submit_urb(ub, u))
+            return -1;
+        return len;
+    }
+    errorf("usb write queue full");
+    return -1;
+}
@@ -0,0 +1,9 @@
+#ifndef USBBULK_H
+#define USBBULK_H
+
+struct usbbulk *usbbulk_alloc(int fd, int ifno);
+void usbbulk_free(struct usbbulk *ub);
+int usbbulk_read(struct usbbulk *ub, void *buf, int maxlen);
+int usbbulk_write(struct usbbulk *ub, void *buf, int len);
+
+#endif // usbbulk.h
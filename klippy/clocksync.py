@@ -8,6 +8,10 @@ import logging, math
 RTT_AGE = .000010 / (60. * 60.)
 DECAY = 1. / 30.
 TRANSMIT_EXTRA = .001
+RTT_JITTER = .000500
+RTT_FLOOR_AGE = .001 / 60.
+MIN_WEIGHT = .050
+RECENT_RTT_DECAY = 1. / 60.
 
 class ClockSync:
     def __init__(self, reactor):
@@ -19,9 +23,13 @@ class ClockSync:
         self.mcu_freq = 1.
         self.last_clock = 0
         self.clock_est = (0., 0., 0.)
+        self.move_free_report = None
         # Minimum round-trip-time tracking
         self.min_half_rtt = 999999999.9
         self.min_rtt_time = 0.
+        self.rtt_floor = 999999999.9
+        self.rtt_floor_time = 0.
+        self.recent_rtt = 0.
         # Linear regression of mcu clock and system sent_time
         self.time_avg = self.time_variance = 0.
         self.clock_avg = self.clock_covariance = 0.
@@ -68,12 +76,19 @@ class ClockSync:
         last_clock = self.last_clock
         clock_delta = (params['clock'] - last_clock) & 0xffffffff
         self.last_clock = clock = last_clock + clock_delta
+        # Note free move queue count (if reported by the mcu)
+        move_free = params.get('move_free')
+        if move_free is not None:
+            self.move_free_report = (clock, move_free)
         # Check if this is the best round-trip-time seen so far
         sent_time = params['#sent_time']
         if not sent_time:
             return
         receive_time = params['#receive_time']
         half_rtt = .5 * (receive_time - sent_time)
+        # Track a slowly decaying peak of recent round-trip-times
+        self.recent_rtt = max(2. * half_rtt,
+                              self.recent_rtt * (1. - RECENT_RTT_DECAY))
         aged_rtt = (sent_time - self.min_rtt_time) * RTT_AGE
         if half_rtt < self.min_half_rtt + aged_rtt:
             self.min_half_rtt = half_rtt
@@ -101,15 +116,23 @@ class ClockSync:
             self.last_prediction_time = sent_time
             self.prediction_variance = (
                 (1. - DECAY) * (self.prediction_variance + clock_diff2 * DECAY))
+        # Reduce the weight of samples with a long round-trip-time
+        aged_floor = (self.rtt_floor
+                      + (sent_time - self.rtt_floor_time) * RTT_FLOOR_AGE)
+        if half_rtt < aged_floor:
+            self.rtt_floor = aged_floor = half_rtt
+            self.rtt_floor_time = sent_time
+        excess_rtt = (half_rtt - aged_floor) / RTT_JITTER
+        decay = DECAY * max(1. / (1. + excess_rtt**2), MIN_WEIGHT)
         # Add clock and sent_time to linear regression
         diff_sent_time = sent_time - self.time_avg
-        self.time_avg += DECAY * diff_sent_time
-        self.time_variance = (1. - DECAY) * (
-            self.time_variance + diff_sent_time**2 * DECAY)
+        self.time_avg += decay * diff_sent_time
+        self.time_variance = (1. - decay) * (
+            self.time_variance + diff_sent_time**2 * decay)
         diff_clock = clock - self.clock_avg
-        self.clock_avg += DECAY * diff_clock
-        self.clock_covariance = (1. - DECAY) * (
-            self.clock_covariance + diff_sent_time * diff_clock * DECAY)
+        self.clock_avg += decay * diff_clock
+        self.clock_covariance = (1. - decay) * (
+            self.clock_covariance + diff_sent_time * diff_clock * decay)
         # Update prediction from linear regression
         new_freq = self.clock_covariance / self.time_variance
         pred_stddev = math.sqrt(self.prediction_variance)
@@ -141,14 +164,20 @@ class ClockSync:
         return last_clock + clock_diff
     def is_active(self):
         return self.queries_pending <= 4
+    def get_move_free_report(self):
+        return self.move_free_report
+    def get_recent_rtt(self):
+        return self.recent_rtt
     def dump_debug(self):
         sample_time, clock, freq = self.clock_est
         return ("clocksync state: mcu_freq=%d last_clock=%d"
                 " clock_est=(%.3f %d %.3f) min_half_rtt=%.6f min_rtt_time=%.3f"
+                " rtt_floor=%.6f(%.3f)"
                 " time_avg=%.3f(%.3f) clock_avg=%.3f(%.3f)"
                 " pred_variance=%.3f" % (
                     self.mcu_freq, self.last_clock, sample_time, clock, freq,
                     self.min_half_rtt, self.min_rtt_time,
+                    self.rtt_floor, self.rtt_floor_time,
                     self.time_avg, self.time_variance,
                     self.clock_avg, self.clock_covariance,
                     self.prediction_variance))
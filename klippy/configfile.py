@@ -3,7 +3,8 @@
 # Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, glob, re, time, logging, configparser, io
+import sys, os, glob, re, time, logging, configparser, io, threading
+import queuelogger
 
 error = configparser.Error
 
@@ -285,8 +286,11 @@ class PrinterConfig:
         regular_config = self._build_config_wrapper(regular_data, filename)
         autosave_data = self._strip_duplicates(autosave_data, regular_config)
         self.autosave = self._build_config_wrapper(autosave_data, filename)
-        cfg = self._build_config_wrapper(regular_data + autosave_data, filename)
-        return cfg
+        # Add the autosave data to the already parsed regular config
+        # (instead of parsing the combined data again)
+        self._parse_config(autosave_data, filename, regular_config.fileconfig,
+                           set())
+        return regular_config
     def check_unused_options(self, config):
         fileconfig = config.fileconfig
         objects = dict(self.printer.lookup_objects())
@@ -416,18 +420,32 @@ class PrinterConfig:
         if cfgname.endswith(".cfg"):
             backup_name = cfgname[:-4] + datestr + ".cfg"
             temp_name = cfgname[:-4] + "_autosave.cfg"
-        # Create new config file with temporary name and swap with main config
+        # Create new config file with temporary name and swap with main
+        # config (from a background thread so the reactor is not blocked)
         logging.info("SAVE_CONFIG to '%s' (backup in '%s')",
                      cfgname, backup_name)
-        try:
-            f = open(temp_name, 'w')
-            f.write(data)
-            f.close()
-            os.rename(cfgname, backup_name)
-            os.rename(temp_name, cfgname)
-        except:
-            msg = "Unable to write config file during SAVE_CONFIG"
-            logging.exception(msg)
-            raise gcode.error(msg)
+        reactor = self.printer.get_reactor()
+        completion = reactor.completion()
+        def write_config():
+            try:
+                f = open(temp_name, 'w')
+                f.write(data)
+                f.flush()
+                os.fsync(f.fileno())
+                f.close()
+                os.rename(cfgname, backup_name)
+                os.rename(temp_name, cfgname)
+            except:
+                logging.exception("Error writing config file")
+                reactor.async_complete(completion, False)
+                return
+            reactor.async_complete(completion, True)
+        wthread = threading.Thread(target=write_config)
+        queuelogger.inherit_thread_logging(wthread)
+        wthread.start()
+        is_success = completion.wait()
+        wthread.join()
+        if not is_success:
+            raise gcode.error("Unable to write config file during SAVE_CONFIG")
         # Request a restart
         gcode.request_restart('restart')
@@ -0,0 +1,78 @@
+# Support for streaming analog input samples at a fixed rate
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging
+from . import bulk_sensor
+
+BATCH_UPDATES = 0.100
+
+class ADCStream:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.name = config.get_name().split()[-1]
+        self.sample_rate = config.getfloat('sample_rate', 1000.,
+                                           minval=1., maxval=20000.)
+        # Setup mcu sensor_adc_stream bulk query code
+        ppins = self.printer.lookup_object('pins')
+        pin_params = ppins.lookup_pin(config.get('sensor_pin'))
+        self.mcu = mcu = pin_params['chip']
+        self.oid = oid = mcu.create_oid()
+        self.query_adc_stream_cmd = None
+        self.adc_scale = 1.
+        mcu.add_config_cmd("config_adc_stream oid=%d pin=%s"
+                           % (oid, pin_params['pin']))
+        mcu.add_config_cmd("query_adc_stream oid=%d rest_ticks=0"
+                           % (oid,), on_restart=True)
+        mcu.register_config_callback(self._build_config)
+        # Bulk sample message reading
+        chip_smooth = self.sample_rate * BATCH_UPDATES * 2
+        self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth, "<H")
+        # Process messages in batches
+        self.batch_bulk = bulk_sensor.BatchBulkHelper(
+            self.printer, self._process_batch,
+            self._start_measurements, self._finish_measurements, BATCH_UPDATES)
+        hdr = ('time', 'value')
+        self.batch_bulk.add_mux_endpoint("adc_stream/dump_adc_stream",
+                                         "sensor", self.name, {'header': hdr})
+    def _build_config(self):
+        self.adc_scale = 1. / self.mcu.get_constant_float("ADC_MAX")
+        cmdqueue = self.mcu.alloc_command_queue()
+        self.query_adc_stream_cmd = self.mcu.lookup_command(
+            "query_adc_stream oid=%c rest_ticks=%u", cq=cmdqueue)
+        self.ffreader.setup_query_command("query_adc_stream_status oid=%c",
+                                          oid=self.oid, cq=cmdqueue)
+    def get_mcu(self):
+        return self.mcu
+    def get_sample_rate(self):
+        return self.sample_rate
+    def add_client(self, cb):
+        self.batch_bulk.add_client(cb)
+    # Measurement decoding
+    def _convert_samples(self, samples):
+        adc_scale = self.adc_scale
+        count = 0
+        for ptime, val in samples:
+            samples[count] = (round(ptime, 6), round(val * adc_scale, 6))
+            count += 1
+    # Start, stop, and process message batches
+    def _start_measurements(self):
+        rest_ticks = self.mcu.seconds_to_clock(1. / self.sample_rate)
+        self.query_adc_stream_cmd.send([self.oid, rest_ticks])
+        logging.info("adc_stream starting '%s' measurements", self.name)
+        # Initialize clock tracking
+        self.ffreader.note_start()
+    def _finish_measurements(self):
+        # Halt bulk reading
+        self.query_adc_stream_cmd.send_wait_ack([self.oid, 0])
+        self.ffreader.note_end()
+        logging.info("adc_stream finished '%s' measurements", self.name)
+    def _process_batch(self, eventtime):
+        samples = self.ffreader.pull_samples()
+        self._convert_samples(samples)
+        if not samples:
+            return {}
+        return {'data': samples,
+                'overflows': self.ffreader.get_last_overflows()}
+
+def load_config_prefix(config):
+    return ADCStream(config)
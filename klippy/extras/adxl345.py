@@ -3,7 +3,7 @@
 # Copyright (C) 2020-2023  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, time, collections, multiprocessing, os
+import logging, time, collections, multiprocessing, os, struct
 from . import bus, bulk_sensor
 
 # ADXL345 registers
@@ -30,6 +30,26 @@ SCALE_Z  = 0.003906 * FREEFALL_ACCEL # 1 / 256 (at 3.3V) mg/LSB
 Accel_Measurement = collections.namedtuple(
     'Accel_Measurement', ('time', 'accel_x', 'accel_y', 'accel_z'))
 
+# Raw sample file formats
+RAW_FORMATS = ['csv', 'npy']
+
+# Write samples as a numpy ".npy" file (time as float64 and each
+# acceleration as float32).  This is written without numpy as numpy
+# is not required on the host.
+NPY_DTYPE = ("[('time', '<f8'), ('accel_x', '<f4'), ('accel_y', '<f4'),"
+             " ('accel_z', '<f4')]")
+def write_npy(f, samples):
+    header = "{'descr': %s, 'fortran_order': False, 'shape': (%d,), }" % (
+        NPY_DTYPE, len(samples))
+    # Pad header (including magic, version, length, and newline) to 64
+    hlen = 10 + len(header) + 1
+    header += ' ' * (-hlen % 64) + '\n'
+    f.write(b'\x93NUMPY\x01\x00' + struct.pack('<H', len(header))
+            + header.encode())
+    pack = struct.Struct('<dfff').pack
+    for i in range(0, len(samples), 4096):
+        f.write(b''.join([pack(*s) for s in samples[i:i+4096]]))
+
 # Helper class to obtain measurements
 class AccelQueryHelper:
     def __init__(self, printer):
@@ -39,20 +59,39 @@ class AccelQueryHelper:
         self.request_start_time = self.request_end_time = print_time
         self.msgs = []
         self.samples = []
+        self.stream_callback = None
+        self.stream_count = 0
+        self.stream_end_time = None
+    def set_stream_callback(self, callback):
+        # Pass samples to 'callback' as they arrive instead of storing them
+        self.stream_callback = callback
     def finish_measurements(self):
         toolhead = self.printer.lookup_object('toolhead')
         self.request_end_time = toolhead.get_last_move_time()
+        self.stream_end_time = self.request_end_time
         toolhead.wait_moves()
         self.is_finished = True
+    def _stream_batch(self, msg):
+        start_time = self.request_start_time
+        end_time = self.stream_end_time
+        samples = [s for s in msg['data'] if s[0] >= start_time
+                   and (end_time is None or s[0] <= end_time)]
+        self.stream_count += len(samples)
+        self.stream_callback(samples)
+        return True
     def handle_batch(self, msg):
         if self.is_finished:
             return False
+        if self.stream_callback is not None:
+            return self._stream_batch(msg)
         if len(self.msgs) >= 10000:
             # Avoid filling up memory with too many samples
             return False
         self.msgs.append(msg)
         return True
     def has_valid_samples(self):
+        if self.stream_callback is not None:
+            return self.stream_count > 0
         for msg in self.msgs:
             data = msg['data']
             first_sample_time = data[0][0]
@@ -92,9 +131,14 @@ class AccelQueryHelper:
                 os.nice(20)
             except:
                 pass
+            samples = self.samples or self.get_samples()
+            if filename.endswith('.npy'):
+                f = open(filename, "wb")
+                write_npy(f, samples)
+                f.close()
+                return
             f = open(filename, "w")
             f.write("#time,accel_x,accel_y,accel_z\n")
-            samples = self.samples or self.get_samples()
             for t, accel_x, accel_y, accel_z in samples:
                 f.write("%.6f,%.6f,%.6f,%.6f\n" % (
                     t, accel_x, accel_y, accel_z))
@@ -142,14 +186,18 @@ class AccelCommandHelper:
         name = gcmd.get("NAME", time.strftime("%Y%m%d_%H%M%S"))
         if not name.replace('-', '').replace('_', '').isalnum():
             raise gcmd.error("Invalid NAME parameter")
+        fmt = gcmd.get("FORMAT", "csv").lower()
+        if fmt not in RAW_FORMATS:
+            raise gcmd.error("Invalid FORMAT parameter")
         bg_client = self.bg_client
         self.bg_client = None
         bg_client.finish_measurements()
         # Write data to file
         if self.base_name == self.name:
-            filename = "/tmp/%s-%s.csv" % (self.base_name, name)
+            filename = "/tmp/%s-%s.%s" % (self.base_name, name, fmt)
         else:
-            filename = "/tmp/%s-%s-%s.csv" % (self.base_name, self.name, name)
+            filename = "/tmp/%s-%s-%s.%s" % (self.base_name, self.name, name,
+                                             fmt)
         bg_client.write_to_file(filename)
         gcmd.respond_info("Writing raw accelerometer data to %s file"
                           % (filename,))
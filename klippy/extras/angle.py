@@ -264,6 +264,90 @@ class AngleCalibration:
         configfile.remove_section(self.name)
         configfile.set(self.name, 'calibrate', ''.join(cal_contents))
 
+# Compare the angle sensor position to the commanded stepper position
+class AngleMonitor:
+    def __init__(self, config, calibration, angle_sensor):
+        self.printer = config.get_printer()
+        self.name = config.get_name().split()[1]
+        self.calibration = calibration
+        self.max_deviation = config.getfloat('monitor_max_deviation', None,
+                                             above=0.)
+        self.last_deviation = None
+        self.is_tripped = False
+        if self.max_deviation is None:
+            return
+        if calibration.stepper_name is None:
+            raise config.error("monitor_max_deviation requires stepper")
+        self.angle_to_mcu_pos = self.step_dist = 0.
+        self.monitor_gcode = None
+        if config.get('monitor_gcode', None) is not None:
+            gcode_macro = self.printer.load_object(config, 'gcode_macro')
+            self.monitor_gcode = gcode_macro.load_template(config,
+                                                           'monitor_gcode')
+        self.angle_sensor = angle_sensor
+        # Register handlers
+        self.printer.register_event_handler("klippy:ready", self.handle_ready)
+        self.printer.register_event_handler("stepper:sync_mcu_position",
+                                            self.handle_sync_mcu_pos)
+        self.printer.register_event_handler("stepper_enable:motor_off",
+                                            self.handle_motor_off)
+    def handle_ready(self):
+        microsteps, full_steps = self.calibration.get_microsteps()
+        self.angle_to_mcu_pos = full_steps * microsteps / float(1<<ANGLE_BITS)
+        self.step_dist = self.calibration.mcu_stepper.get_step_dist()
+        self.angle_sensor.add_client(self.handle_batch)
+    def handle_sync_mcu_pos(self, mcu_stepper):
+        if mcu_stepper.get_name() == self.calibration.stepper_name:
+            self.is_tripped = False
+    def handle_motor_off(self, print_time):
+        # The motor may be moved freely while disabled
+        self.calibration.mcu_pos_offset = None
+        self.is_tripped = False
+    def handle_batch(self, msg):
+        if (msg.get('position_offset') is None or self.is_tripped
+            or self.calibration.mcu_pos_offset is None):
+            return True
+        mcu_stepper = self.calibration.mcu_stepper
+        stepper_enable = self.printer.lookup_object('stepper_enable')
+        enable = stepper_enable.lookup_enable(mcu_stepper.get_name())
+        if not enable.is_motor_enabled():
+            return True
+        # Find largest deviation from commanded position in this batch
+        get_past_mcu_position = mcu_stepper.get_past_mcu_position
+        mcu_pos_offset = self.calibration.mcu_pos_offset
+        angle_to_mcu_pos = self.angle_to_mcu_pos
+        max_dev = 0.
+        for samp_time, angle in msg['data']:
+            dev = abs(mcu_pos_offset + angle * angle_to_mcu_pos
+                      - get_past_mcu_position(samp_time))
+            if dev > max_dev:
+                max_dev = dev
+        deviation = max_dev * abs(self.step_dist)
+        self.last_deviation = round(deviation, 6)
+        if deviation > self.max_deviation:
+            self.is_tripped = True
+            self._report_deviation(deviation)
+        return True
+    def _report_deviation(self, deviation):
+        msg = ("Angle sensor %s: stepper %s position deviates by %.3fmm"
+               % (self.name, self.calibration.stepper_name, deviation))
+        logging.warning(msg)
+        if self.monitor_gcode is None:
+            self.printer.invoke_shutdown(msg)
+            return
+        gcode = self.printer.lookup_object('gcode')
+        gcode.respond_info(msg)
+        reactor = self.printer.get_reactor()
+        reactor.register_callback(self._run_monitor_gcode)
+    def _run_monitor_gcode(self, eventtime):
+        gcode = self.printer.lookup_object('gcode')
+        try:
+            gcode.run_script(self.monitor_gcode.render())
+        except Exception:
+            logging.exception("Script running error")
+    def get_status(self, eventtime=None):
+        return {'deviation': self.last_deviation}
+
 class HelperA1333:
     SPI_MODE = 3
     SPI_SPEED = 10000000
@@ -454,6 +538,7 @@ class Angle:
         api_resp = {'header': ('time', 'angle')}
         self.batch_bulk.add_mux_endpoint("angle/dump_angle",
                                          "sensor", self.name, api_resp)
+        self.monitor = AngleMonitor(config, self.calibration, self)
     def _build_config(self):
         freq = self.mcu.seconds_to_clock(1.)
         while float(TCODE_ERROR << self.time_shift) / freq < 0.002:
@@ -463,7 +548,9 @@ class Angle:
             "query_spi_angle oid=%c clock=%u rest_ticks=%u time_shift=%c",
             cq=cmdqueue)
     def get_status(self, eventtime=None):
-        return {'temperature': self.sensor_helper.last_temperature}
+        status = self.monitor.get_status(eventtime)
+        status['temperature'] = self.sensor_helper.last_temperature
+        return status
     def add_client(self, client_cb):
         self.batch_bulk.add_client(client_cb)
     # Measurement decoding
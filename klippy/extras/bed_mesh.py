@@ -30,10 +30,6 @@ def within(coord, min_c, max_c, tol=0.0):
 def constrain(val, min_val, max_val):
     return min(max_val, max(min_val, val))
 
-# Linear interpolation between two values
-def lerp(t, v0, v1):
-    return (1. - t) * v0 + t * v1
-
 # retreive commma separated pair from config
 def parse_config_pair(config, option, default, minval=None, maxval=None):
     pair = config.getintlist(option, (default, default))
@@ -915,9 +911,10 @@ class MoveSplitter:
         self.z_offset = self._calc_z_offset(prev_pos)
         self.traverse_complete = False
         self.distance_checked = 0.
-        axes_d = [self.next_pos[i] - self.prev_pos[i] for i in range(4)]
-        self.total_move_length = math.sqrt(sum([d*d for d in axes_d[:3]]))
-        self.axis_move = [not isclose(d, 0., abs_tol=1e-10) for d in axes_d]
+        axes_d = [n - p for n, p in zip(self.next_pos, self.prev_pos)]
+        dx, dy, dz = axes_d[:3]
+        self.total_move_length = math.sqrt(dx*dx + dy*dy + dz*dz)
+        self.axis_move = [abs(d) > 1e-10 for d in axes_d]
     def _calc_z_offset(self, pos):
         z = self.z_mesh.calc_z(pos[0], pos[1])
         offset = self.fade_offset
@@ -928,10 +925,10 @@ class MoveSplitter:
             raise self.gcode.error(
                 "bed_mesh: Slice distance is negative "
                 "or greater than entire move length")
-        for i in range(4):
-            if self.axis_move[i]:
-                self.current_pos[i] = lerp(
-                    t, self.prev_pos[i], self.next_pos[i])
+        prev_pos, next_pos = self.prev_pos, self.next_pos
+        for i, axis_move in enumerate(self.axis_move):
+            if axis_move:
+                self.current_pos[i] = (1. - t) * prev_pos[i] + t * next_pos[i]
     def split(self):
         if not self.traverse_complete:
             if self.axis_move[0] or self.axis_move[1]:
@@ -1036,17 +1033,17 @@ class ZMesh:
             msg += "Interpolation Algorithm: %s\n" \
                    % (self.mesh_params['algo'])
             msg += "Measured points:\n"
-            for y_line in range(self.mesh_y_count - 1, -1, -1):
-                for z in matrix[y_line]:
-                    msg += "  %f" % (z)
-                msg += "\n"
+            msg += "".join(["".join(["  %f" % (z,) for z in matrix[y_line]])
+                            + "\n"
+                            for y_line in range(self.mesh_y_count - 1, -1, -1)])
             print_func(msg)
         else:
             print_func("bed_mesh: Z Mesh not generated")
     def build_mesh(self, z_matrix):
         self.probed_matrix = z_matrix
         self._sample(z_matrix)
-        self.print_mesh(logging.debug)
+        if logging.getLogger().isEnabledFor(logging.DEBUG):
+            self.print_mesh(logging.debug)
     def set_zero_reference(self, xpos, ypos):
         offset = self.calc_z(xpos, ypos)
         logging.info(
@@ -1070,9 +1067,11 @@ class ZMesh:
             tbl = self.mesh_matrix
             tx, xidx = self._get_linear_index(x + self.mesh_offsets[0], 0)
             ty, yidx = self._get_linear_index(y + self.mesh_offsets[1], 1)
-            z0 = lerp(tx, tbl[yidx][xidx], tbl[yidx][xidx+1])
-            z1 = lerp(tx, tbl[yidx+1][xidx], tbl[yidx+1][xidx+1])
-            return lerp(ty, z0, z1)
+            # Bilinear interpolation between the four nearest points
+            row0, row1 = tbl[yidx], tbl[yidx+1]
+            z0 = (1. - tx) * row0[xidx] + tx * row0[xidx+1]
+            z1 = (1. - tx) * row1[xidx] + tx * row1[xidx+1]
+            return (1. - ty) * z0 + ty * z1
         else:
             # No mesh table generated, no z-adjustment
             return 0.
@@ -1099,18 +1098,15 @@ class ZMesh:
             mesh_min = self.mesh_x_min
             mesh_cnt = self.mesh_x_count
             mesh_dist = self.mesh_x_dist
-            cfunc = self.get_x_coordinate
         else:
             # Y-axis
             mesh_min = self.mesh_y_min
             mesh_cnt = self.mesh_y_count
             mesh_dist = self.mesh_y_dist
-            cfunc = self.get_y_coordinate
-        t = 0.
         idx = int(math.floor((coord - mesh_min) / mesh_dist))
-        idx = constrain(idx, 0, mesh_cnt - 2)
-        t = (coord - cfunc(idx)) / mesh_dist
-        return constrain(t, 0., 1.), idx
+        idx = min(mesh_cnt - 2, max(0, idx))
+        t = (coord - (mesh_min + mesh_dist * idx)) / mesh_dist
+        return min(1., max(0., t)), idx
     def _sample_direct(self, z_matrix):
         self.mesh_matrix = z_matrix
     def _sample_lagrange(self, z_matrix):
@@ -1208,19 +1204,15 @@ class ZMesh:
             p2 = p3 = x_row[last_pt + x_mult]
             t = (x - last_pt) / float(x_mult)
         else:
-            found = False
-            for i in range(x_mult, last_pt, x_mult):
-                if x > i and x < (i + x_mult):
-                    p0 = x_row[i - x_mult]
-                    p1 = x_row[i]
-                    p2 = x_row[i + x_mult]
-                    p3 = x_row[i + 2*x_mult]
-                    t = (x - i) / float(x_mult)
-                    found = True
-                    break
-            if not found:
+            i = x - x % x_mult
+            if i == x:
                 raise BedMeshError(
                     "bed_mesh: Error finding x control points")
+            p0 = x_row[i - x_mult]
+            p1 = x_row[i]
+            p2 = x_row[i + x_mult]
+            p3 = x_row[i + 2*x_mult]
+            t = (x - i) / float(x_mult)
         return p0, p1, p2, p3, t
     def _get_y_ctl_pts(self, x, y):
         # Fetch control points and t for a Y value in the mesh
@@ -1238,19 +1230,15 @@ class ZMesh:
             p2 = p3 = y_col[last_pt + y_mult][x]
             t = (y - last_pt) / float(y_mult)
         else:
-            found = False
-            for i in range(y_mult, last_pt, y_mult):
-                if y > i and y < (i + y_mult):
-                    p0 = y_col[i - y_mult][x]
-                    p1 = y_col[i][x]
-                    p2 = y_col[i + y_mult][x]
-                    p3 = y_col[i + 2*y_mult][x]
-                    t = (y - i) / float(y_mult)
-                    found = True
-                    break
-            if not found:
+            i = y - y % y_mult
+            if i == y:
                 raise BedMeshError(
                     "bed_mesh: Error finding y control points")
+            p0 = y_col[i - y_mult][x]
+            p1 = y_col[i][x]
+            p2 = y_col[i + y_mult][x]
+            p3 = y_col[i + 2*y_mult][x]
+            t = (y - i) / float(y_mult)
         return p0, p1, p2, p3, t
     def _cardinal_spline(self, p, tension):
         t = p[4]
@@ -1299,6 +1287,9 @@ class ProfileManager:
                     params[key] = profile.getfloat(key)
                 elif t is str:
                     params[key] = profile.get(key)
+            temperature = profile.getfloat('temperature', None)
+            if temperature is not None:
+                self.profiles[name]['temperature'] = temperature
         # Register GCode
         self.gcode.register_command(
             'BED_MESH_PROFILE', self.cmd_BED_MESH_PROFILE,
@@ -1316,7 +1307,7 @@ class ProfileManager:
                 "The SAVE_CONFIG command will update the printer config\n"
                 "file and restart the printer" %
                 (('\n').join(self.incompatible_profiles)))
-    def save_profile(self, prof_name):
+    def save_profile(self, prof_name, temperature=None):
         z_mesh = self.bedmesh.get_mesh()
         if z_mesh is None:
             self.gcode.respond_info(
@@ -1334,16 +1325,22 @@ class ProfileManager:
             for p in line:
                 z_values += "%.6f, " % p
             z_values = z_values[:-2]
+        # replace any previous profile (including a stale temperature)
+        configfile.remove_section(cfg_name)
         configfile.set(cfg_name, 'version', PROFILE_VERSION)
         configfile.set(cfg_name, 'points', z_values)
         for key, value in mesh_params.items():
             configfile.set(cfg_name, key, value)
+        if temperature is not None:
+            configfile.set(cfg_name, 'temperature', "%.3f" % (temperature,))
         # save copy in local storage
         # ensure any self.profiles returned as status remains immutable
         profiles = dict(self.profiles)
         profiles[prof_name] = profile = {}
         profile['points'] = probed_matrix
         profile['mesh_params'] = collections.OrderedDict(mesh_params)
+        if temperature is not None:
+            profile['temperature'] = temperature
         self.profiles = profiles
         self.bedmesh.update_status()
         self.gcode.respond_info(
@@ -1364,6 +1361,51 @@ class ProfileManager:
         except BedMeshError as e:
             raise self.gcode.error(str(e))
         self.bedmesh.set_mesh(z_mesh)
+    def load_temperature_profile(self, temperature):
+        # Find profiles saved at a temperature with a matching mesh layout
+        temp_profs = [(p['temperature'], name)
+                      for name, p in self.profiles.items()
+                      if 'temperature' in p]
+        if not temp_profs:
+            raise self.gcode.error(
+                "bed_mesh: No profiles saved with a temperature")
+        nearest = min(temp_profs, key=(lambda tp: abs(tp[0] - temperature)))
+        mesh_params = self.profiles[nearest[1]]['mesh_params']
+        temp_profs = sorted([tp for tp in temp_profs
+                             if dict(self.profiles[tp[1]]['mesh_params'])
+                             == dict(mesh_params)])
+        # Linearly interpolate between the two closest temperatures
+        low = [tp for tp in temp_profs if tp[0] <= temperature]
+        high = [tp for tp in temp_profs if tp[0] > temperature]
+        if not low or not high:
+            # No extrapolation - use the nearest profile
+            low = high = [nearest]
+        low_temp, low_name = low[-1]
+        high_temp, high_name = high[0]
+        low_matrix = self.profiles[low_name]['points']
+        high_matrix = self.profiles[high_name]['points']
+        factor = 0.
+        if high_temp > low_temp:
+            factor = (temperature - low_temp) / (high_temp - low_temp)
+        probed_matrix = [[lz + (hz - lz) * factor
+                          for lz, hz in zip(low_line, high_line)]
+                         for low_line, high_line in zip(low_matrix,
+                                                        high_matrix)]
+        z_mesh = ZMesh(mesh_params, "temperature-%.1f" % (temperature,))
+        try:
+            z_mesh.build_mesh(probed_matrix)
+        except BedMeshError as e:
+            raise self.gcode.error(str(e))
+        self.bedmesh.set_mesh(z_mesh)
+        if low_name == high_name:
+            self.gcode.respond_info(
+                "Loaded mesh for temperature %.1f from profile [%s] (%.1f)"
+                % (temperature, low_name, low_temp))
+            return
+        self.gcode.respond_info(
+            "Loaded mesh for temperature %.1f from profiles [%s] (%.1f)"
+            " and [%s] (%.1f)" % (temperature, low_name, low_temp,
+                                  high_name, high_temp))
     def remove_profile(self, prof_name):
         if prof_name in self.profiles:
             configfile = self.printer.lookup_object('configfile')
@@ -1386,6 +1428,10 @@ class ProfileManager:
             'SAVE': self.save_profile,
             'REMOVE': self.remove_profile
         })
+        temperature = gcmd.get_float('LOAD_TEMPERATURE', None)
+        if temperature is not None:
+            self.load_temperature_profile(temperature)
+            return
         for key in options:
             name = gcmd.get(key, None)
             if name is not None:
@@ -1397,6 +1443,9 @@ class ProfileManager:
                     gcmd.respond_info(
                         "Profile 'default' is reserved, please choose"
                         " another profile name.")
+                elif key == 'SAVE':
+                    self.save_profile(name, gcmd.get_float('TEMPERATURE',
+                                                           None))
                 else:
                     options[key](name)
                 return
@@ -3,7 +3,8 @@
 # Copyright (C) 2020-2023  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading, struct
+import logging, threading, struct, base64
+import chelper
 
 # This "bulk sensor" module facilitates the processing of sensor chip
 # measurements that do not require the host to respond with low
@@ -99,14 +100,64 @@ class BatchBulkHelper:
         wh = self.printer.lookup_object('webhooks')
         wh.register_mux_endpoint(path, key, value, self._add_api_client)
 
+# Batch "data" that is already stored as little-endian doubles (the
+# rows are only unpacked if a client does not request packed_data)
+class PackedBatchData:
+    def __init__(self, packed, row_size, unpack_row):
+        self.packed = packed
+        self.row_size = row_size
+        self.unpack_row = unpack_row
+        self.rows = None
+    def get_packed(self):
+        return self.packed
+    def get_rows(self):
+        if self.rows is None:
+            row_size = self.row_size
+            vals = struct.unpack('<%dd' % (len(self.packed) // 8,),
+                                 self.packed)
+            self.rows = [self.unpack_row(vals[i:i+row_size])
+                         for i in range(0, len(vals), row_size)]
+        return self.rows
+
 # A webhooks wrapper for use by BatchBulkHelper
 class BatchWebhooksClient:
     def __init__(self, web_request):
         self.cconn = web_request.get_client_connection()
         self.template = web_request.get_dict('response_template', {})
+        self.packed_data = web_request.get('packed_data', False,
+                                           types=(bool,))
+    def _pack_data(self, msg):
+        # Replace "data" with its rows as base64 encoded little-endian
+        # doubles (if every row is a list of numbers or lists of numbers)
+        if 'data' not in msg:
+            return msg
+        data = msg['data']
+        if isinstance(data, PackedBatchData):
+            packed = data.get_packed()
+        else:
+            flat = []
+            for row in data:
+                for v in row:
+                    if isinstance(v, (list, tuple)):
+                        flat.extend(v)
+                    else:
+                        flat.append(v)
+            try:
+                packed = struct.pack('<%dd' % (len(flat),), *flat)
+            except (TypeError, struct.error):
+                return msg
+        msg = dict(msg)
+        del msg['data']
+        msg['packed_data'] = base64.b64encode(packed).decode()
+        return msg
     def handle_batch(self, msg):
         if self.cconn.is_closed():
             return False
+        if self.packed_data:
+            msg = self._pack_data(msg)
+        elif isinstance(msg.get('data'), PackedBatchData):
+            msg = dict(msg)
+            msg['data'] = msg['data'].get_rows()
         tmp = dict(self.template)
         tmp['params'] = msg
         self.cconn.send(tmp)
@@ -131,6 +182,44 @@ class BulkDataQueue:
     def clear_queue(self):
         self.pull_queue()
 
+# Helper class to store incoming sensor_bulk_data messages in C code
+# (the messages are not processed by the python serial reader thread)
+class BulkDataFastQueue:
+    def __init__(self, mcu, oid):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.ffi_main = ffi_main
+        self.bulkqueue_pull = ffi_lib.bulkqueue_pull
+        self.bulkqueue_start = ffi_lib.bulkqueue_start
+        self.bulkqueue_stop = ffi_lib.bulkqueue_stop
+        self.msgs = ffi_main.new('struct bulkqueue_msg[256]')
+        msgtag = mcu.lookup_command(
+            "sensor_bulk_data oid=%c sequence=%hu data=%*s").get_command_tag()
+        self.bulkqueue = ffi_main.gc(ffi_lib.bulkqueue_alloc(
+            mcu.get_serialqueue(), msgtag, oid), ffi_lib.bulkqueue_free)
+        # While started, the C code stores the messages in the bulkqueue
+        # and they are not passed to the python response handlers.
+        # Messages received while not started are passed to python and
+        # discarded by this no-op handler.  Note that sensor_bulk_data
+        # messages for this oid are therefore hidden from any other code
+        # (there is only one response handler per message name and oid,
+        # and registering another one replaces this handler).
+        mcu.register_response((lambda params: None), "sensor_bulk_data", oid)
+    def start(self):
+        self.bulkqueue_start(self.bulkqueue)
+    def stop(self):
+        self.bulkqueue_stop(self.bulkqueue)
+    def pull_queue(self):
+        # Returns a list of (sequence, data) tuples
+        buf = self.ffi_main.buffer
+        msgs = self.msgs
+        raw_samples = []
+        while 1:
+            count = self.bulkqueue_pull(self.bulkqueue, msgs, len(msgs))
+            raw_samples.extend([(m.sequence, buf(m.data, m.len)[:])
+                                for m in msgs[0:count]])
+            if count < len(msgs):
+                return raw_samples
+
 
 ######################################################################
 # Clock synchronization
@@ -221,7 +310,7 @@ class FixedFreqReader:
             " next_sequence=%hu buffered=%u possible_overflows=%hu",
             oid=oid, cq=cq)
         # Read sensor_bulk_data messages and store in a queue
-        self.bulk_queue = BulkDataQueue(self.mcu, oid=oid)
+        self.bulk_queue = BulkDataFastQueue(self.mcu, oid)
     def get_last_overflows(self):
         return self.last_overflows
     def _clear_duration_filter(self):
@@ -229,15 +318,15 @@ class FixedFreqReader:
     def note_start(self):
         self.last_sequence = 0
         self.last_overflows = 0
-        # Clear local queue (clear any stale samples from previous session)
-        self.bulk_queue.clear_queue()
+        # Start storing sensor_bulk_data messages in the local queue
+        self.bulk_queue.start()
         # Set initial clock
         self._clear_duration_filter()
         self._update_clock(is_reset=True)
         self._clear_duration_filter()
     def note_end(self):
-        # Clear local queue (free no longer needed memory)
-        self.bulk_queue.clear_queue()
+        # Stop local queue (free no longer needed memory)
+        self.bulk_queue.stop()
     def _update_clock(self, is_reset=False):
         params = self.query_status_cmd.send([self.oid])
         mcu_clock = self.mcu.clock32_to_clock64(params['clock'])
@@ -281,12 +370,11 @@ class FixedFreqReader:
         # Process every message in raw_samples
         count = seq = 0
         samples = [None] * (len(raw_samples) * samples_per_block)
-        for params in raw_samples:
-            seq_diff = (params['sequence'] - last_sequence) & 0xffff
+        for sequence, data in raw_samples:
+            seq_diff = (sequence - last_sequence) & 0xffff
             seq_diff -= (seq_diff & 0x8000) << 1
             seq = last_sequence + seq_diff
             msg_cdiff = seq * samples_per_block - chip_base
-            data = params['data']
             for i in range(len(data) // bytes_per_sample):
                 ptime = time_base + (msg_cdiff + i) * inv_freq
                 udata = unpack_from(data, i * bytes_per_sample)
@@ -245,6 +245,63 @@ class HalfStepRotaryEncoder(BaseRotaryEncoder):
     )
 
 
+######################################################################
+# Rotary encoder decoding on the micro-controller
+######################################################################
+
+ENCODER_REPORT_TIME = .010
+
+class MCU_rotary_encoder:
+    def __init__(self, printer, pins, encoder):
+        self.printer = printer
+        self.reactor = printer.get_reactor()
+        self.pins = pins
+        self.encoder = encoder
+        self.mcu = pins[0]['chip']
+        self.oid = None
+        self.last_count = 0
+        self.mcu.register_config_callback(self.build_config)
+    def build_config(self):
+        if self.mcu.try_lookup_command(
+                "config_encoder oid=%c pin1=%u pull_up1=%c pin2=%u"
+                " pull_up2=%c half_step=%c") is None:
+            # Micro-controller can't decode encoders - report pin changes
+            mcu_buttons = MCU_buttons(self.printer, self.mcu)
+            mcu_buttons.setup_buttons(self.pins, self.encoder.encoder_callback)
+            return
+        self.oid = self.mcu.create_oid()
+        p1, p2 = self.pins
+        half_step = isinstance(self.encoder, HalfStepRotaryEncoder)
+        self.mcu.add_config_cmd(
+            "config_encoder oid=%d pin1=%s pull_up1=%d pin2=%s pull_up2=%d"
+            " half_step=%d" % (self.oid, p1['pin'], p1['pullup'],
+                               p2['pin'], p2['pullup'], half_step))
+        clock = self.mcu.get_query_slot(self.oid)
+        rest_ticks = self.mcu.seconds_to_clock(QUERY_TIME)
+        report_ticks = int(ENCODER_REPORT_TIME / QUERY_TIME)
+        invert = p1['invert'] | (p2['invert'] << 1)
+        self.mcu.add_config_cmd(
+            "encoder_query oid=%d clock=%d rest_ticks=%d report_ticks=%d"
+            " invert=%d" % (self.oid, clock, rest_ticks, report_ticks, invert),
+            is_init=True)
+        self.mcu.register_response(self.handle_encoder_state,
+                                   "encoder_state", self.oid)
+    def handle_encoder_state(self, params):
+        # Expand the message count from 16-bit
+        count_diff = (params['count'] - self.last_count) & 0xffff
+        count_diff -= (count_diff & 0x8000) << 1
+        self.last_count += count_diff
+        if count_diff > 0:
+            callback = self.encoder.cw_callback
+        else:
+            callback = self.encoder.ccw_callback
+        # Invoke callbacks with this event in main thread
+        btime = params['#receive_time']
+        for i in range(abs(count_diff)):
+            self.reactor.register_async_callback(
+                (lambda et, c=callback, bt=btime: c(bt)))
+
+
 ######################################################################
 # Button registration code
 ######################################################################
@@ -294,7 +351,14 @@ class PrinterButtons:
         else:
             raise self.printer.config_error(
                 "%d steps per detent not supported" % steps_per_detent)
-        self.register_buttons([pin1, pin2], re.encoder_callback)
+        # Parse pins
+        ppins = self.printer.lookup_object('pins')
+        pin_params_list = [ppins.lookup_pin(pin, can_invert=True,
+                                            can_pullup=True)
+                           for pin in [pin1, pin2]]
+        if pin_params_list[0]['chip'] != pin_params_list[1]['chip']:
+            raise ppins.error("button pins must be on same mcu")
+        MCU_rotary_encoder(self.printer, pin_params_list, re)
     def register_button_push(self, pin, callback):
         def helper(eventtime, state, callback=callback):
             if state:
@@ -10,17 +10,22 @@ class PrinterCANBus:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.ids = {}
+        self.fd_uuids = {}
     def add_uuid(self, config, canbus_uuid, canbus_iface):
         if canbus_uuid in self.ids:
             raise config.error("Duplicate canbus_uuid")
         new_id = len(self.ids) + NODEID_FIRST
         self.ids[canbus_uuid] = new_id
+        if config.getboolean('canbus_fd', False):
+            self.fd_uuids[canbus_uuid] = canbus_iface
         return new_id
     def get_nodeid(self, canbus_uuid):
         if canbus_uuid not in self.ids:
             raise self.printer.config_error("Unknown canbus_uuid %s"
                                             % (canbus_uuid,))
         return self.ids[canbus_uuid]
+    def use_canbus_fd(self, canbus_uuid):
+        return canbus_uuid in self.fd_uuids
 
 def load_config(config):
     return PrinterCANBus(config)
@@ -163,7 +163,7 @@ class DeltaCalibrate:
         self.calculate_params(probe_positions, self.last_distances)
     def calculate_params(self, probe_positions, distances):
         height_positions = self.manual_heights + probe_positions
-        # Setup for coordinate descent analysis
+        # Setup for least squares analysis
         kin = self.printer.lookup_object('toolhead').get_kinematics()
         orig_delta_params = odp = kin.get_calibration()
         adj_params, params = odp.coordinate_descent_params(distances)
@@ -173,29 +173,26 @@ class DeltaCalibrate:
         z_weight = 1.
         if distances:
             z_weight = len(distances) / (MEASURE_WEIGHT * len(probe_positions))
-        # Perform coordinate descent
-        def delta_errorfunc(params):
-            try:
-                # Build new delta_params for params under test
-                delta_params = orig_delta_params.new_calibration(params)
-                getpos = delta_params.get_position_from_stable
-                # Calculate z height errors
-                total_error = 0.
-                for z_offset, stable_pos in height_positions:
-                    x, y, z = getpos(stable_pos)
-                    total_error += (z - z_offset)**2
-                total_error *= z_weight
-                # Calculate distance errors
-                for dist, stable_pos1, stable_pos2 in distances:
-                    x1, y1, z1 = getpos(stable_pos1)
-                    x2, y2, z2 = getpos(stable_pos2)
-                    d = math.sqrt((x1-x2)**2 + (y1-y2)**2 + (z1-z2)**2)
-                    total_error += (d - dist)**2
-                return total_error
-            except ValueError:
-                return 9999999999999.9
-        new_params = mathutil.background_coordinate_descent(
-            self.printer, adj_params, params, delta_errorfunc)
+        z_scale = math.sqrt(z_weight)
+        # Perform least squares analysis
+        def delta_residuals(params):
+            # Build new delta_params for params under test
+            delta_params = orig_delta_params.new_calibration(params)
+            getpos = delta_params.get_position_from_stable
+            # Calculate z height errors
+            res = []
+            for z_offset, stable_pos in height_positions:
+                x, y, z = getpos(stable_pos)
+                res.append((z - z_offset) * z_scale)
+            # Calculate distance errors
+            for dist, stable_pos1, stable_pos2 in distances:
+                x1, y1, z1 = getpos(stable_pos1)
+                x2, y2, z2 = getpos(stable_pos2)
+                d = math.sqrt((x1-x2)**2 + (y1-y2)**2 + (z1-z2)**2)
+                res.append(d - dist)
+            return res
+        new_params = mathutil.background_least_squares(
+            self.printer, adj_params, params, delta_residuals)
         # Log and report results
         logging.info("Calculated delta_calibrate parameters: %s", new_params)
         new_delta_params = orig_delta_params.new_calibration(new_params)
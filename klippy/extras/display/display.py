@@ -7,6 +7,7 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, os, ast
 from . import hd44780, hd44780_spi, st7920, uc1701, menu
+from .. import gcode_macro
 
 # Normal time between each screen redraw
 REDRAW_TIME = 0.500
@@ -67,22 +68,35 @@ class DisplayGroup:
         # Load all templates and store sorted by display position
         configs_by_name = {c.get_name(): c for c in data_configs}
         printer = config.get_printer()
-        gcode_macro = printer.load_object(config, 'gcode_macro')
+        pgcode_macro = printer.load_object(config, 'gcode_macro')
         self.data_items = []
         for row, col, name in sorted(items):
             c = configs_by_name[name]
             if c.get('text'):
-                template = gcode_macro.load_template(c, 'text')
+                template = pgcode_macro.load_template(c, 'text')
                 self.data_items.append((row, col, template))
+        self.render_cache = gcode_macro.TemplateRenderCache(printer)
     def show(self, display, templates, eventtime):
         context = self.data_items[0][2].create_template_context(eventtime)
-        context['draw_progress_bar'] = display.draw_progress_bar
+        drew_graphics = []
+        def draw_progress_bar(row, col, width, value):
+            drew_graphics.append(True)
+            return display.draw_progress_bar(row, col, width, value)
+        context['draw_progress_bar'] = draw_progress_bar
         def render(name, **kwargs):
             return templates[name].render(context, **kwargs)
         context['render'] = render
-        for row, col, template in self.data_items:
+        render_cache = self.render_cache
+        render_cache.start(context, eventtime)
+        def render_text(template):
+            del drew_graphics[:]
             text = template.render(context)
+            # Graphics are drawn directly and can't be cached
+            return text, not drew_graphics
+        for i, (row, col, template) in enumerate(self.data_items):
+            text = render_cache.render(i, lambda: render_text(template))
             display.draw_text(row, col, text.replace('\n', ''), eventtime)
+        render_cache.finish()
         context.clear() # Remove circular references for better gc
 
 # Global cache of DisplayTemplate, DisplayGroup, and glyphs
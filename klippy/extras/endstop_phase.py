@@ -33,7 +33,7 @@ class PhaseCalc:
     def convert_phase(self, driver_phase, driver_phases):
         phases = self.phases
         return (int(float(driver_phase) / driver_phases * phases + .5) % phases)
-    def calc_phase(self, stepper, trig_mcu_pos):
+    def get_phase(self, trig_mcu_pos):
         mcu_phase_offset = 0
         if self.tmc_module is not None:
             mcu_phase_offset, phases = self.tmc_module.get_phase_offset()
@@ -42,7 +42,9 @@ class PhaseCalc:
                     raise self.printer.command_error("Stepper %s phase unknown"
                                                      % (self.name,))
                 mcu_phase_offset = 0
-        phase = (trig_mcu_pos + mcu_phase_offset) % self.phases
+        return (trig_mcu_pos + mcu_phase_offset) % self.phases
+    def calc_phase(self, stepper, trig_mcu_pos):
+        phase = self.get_phase(trig_mcu_pos)
         self.phase_history[phase] += 1
         self.last_phase = phase
         self.last_mcu_position = trig_mcu_pos
@@ -64,6 +66,8 @@ class EndstopPhase:
                                             self.phase_calc.lookup_tmc)
         self.printer.register_event_handler("homing:home_rails_end",
                                             self.handle_home_rails_end)
+        self.printer.register_event_handler("homing:home_rails_first",
+                                            self.handle_home_rails_first)
         self.printer.load_object(config, "endstop_phase")
         # Read config
         self.endstop_phase = None
@@ -75,6 +79,7 @@ class EndstopPhase:
                                    % (trigger_phase,))
             self.endstop_phase = self.phase_calc.convert_phase(p, ps)
         self.endstop_align_zero = config.getboolean('endstop_align_zero', False)
+        self.skip_second_home = config.getboolean('skip_second_home', False)
         self.endstop_accuracy = config.getfloat('endstop_accuracy', None,
                                                 above=0.)
         # Determine endstop accuracy
@@ -89,6 +94,14 @@ class EndstopPhase:
         if self.endstop_phase_accuracy >= self.phases // 2:
             raise config.error("Endstop for %s is not accurate enough for"
                                " stepper phase adjustment" % (self.name,))
+        # Skipping the second home requires a calibrated phase and an
+        # explicit endstop accuracy
+        self.skip_phase_accuracy = self.endstop_phase_accuracy
+        if self.skip_second_home and (self.endstop_phase is None
+                                      or self.endstop_accuracy is None):
+            raise config.error("Option skip_second_home in section '%s'"
+                               " requires trigger_phase and"
+                               " endstop_accuracy" % (config.get_name(),))
         if self.printer.get_start_args().get('debugoutput') is not None:
             self.endstop_phase_accuracy = self.phases
     def align_endstop(self, rail):
@@ -116,6 +129,19 @@ class EndstopPhase:
                 "Endstop %s incorrect phase (got %d vs %d)" % (
                     self.name, phase, self.endstop_phase))
         return delta * self.step_dist
+    def handle_home_rails_first(self, homing_state, rails):
+        if not self.skip_second_home:
+            return
+        for rail in rails:
+            stepper = rail.get_steppers()[0]
+            if stepper.get_name() == self.name:
+                trig_mcu_pos = homing_state.get_trigger_position(self.name)
+                phase = self.phase_calc.get_phase(trig_mcu_pos)
+                delta = (phase - self.endstop_phase) % self.phases
+                if (delta <= self.skip_phase_accuracy
+                    or delta >= self.phases - self.skip_phase_accuracy):
+                    homing_state.confirm_first_home(self.name)
+                return
     def handle_home_rails_end(self, homing_state, rails):
         for rail in rails:
             stepper = rail.get_steppers()[0]
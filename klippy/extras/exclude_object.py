@@ -7,6 +7,55 @@
 
 import logging
 import json
+from . import virtual_sdcard
+
+# Commands that may be run in order while skipping an excluded object
+SKIP_STATE_COMMANDS = ['G92', 'M82', 'M83', 'M106', 'M107', 'M204',
+                       'SET_VELOCITY_LIMIT']
+# Amount of file data to skip before letting the reactor run other work
+SKIP_BATCH_LINES = 1000
+SKIP_READ_SIZE = 64 * 1024
+
+# Track the final position of a series of skipped G0/G1 commands
+class MoveSummary:
+    def __init__(self, gcode_move):
+        self.gcode_move = gcode_move
+        self.reset()
+    def reset(self):
+        status = self.gcode_move.get_status()
+        self.absolute_coord = status['absolute_coordinates']
+        self.absolute_extrude = status['absolute_extrude']
+        self.pos = list(status['gcode_position'])
+        self.start_e = self.max_e = self.pos[3]
+        self.speed = None
+        self.count = 0
+    def add_move(self, params):
+        if not self.absolute_coord:
+            return False
+        pos = self.pos
+        for axis, value in params:
+            if axis == 'F':
+                if value <= 0.:
+                    return False
+                self.speed = value
+            elif axis == 'E':
+                if self.absolute_extrude:
+                    pos[3] = value
+                else:
+                    pos[3] += value
+                self.max_e = max(self.max_e, pos[3])
+            else:
+                pos['XYZ'.index(axis)] = value
+        self.count += 1
+        return True
+    def flush(self):
+        # Issue the net movement (the maximum extruder position is
+        # needed for the retraction adjustment when leaving the object)
+        if self.count:
+            x, y, z, e = self.pos
+            self.gcode_move.move_path([(x, y, z, self.max_e - self.start_e),
+                                       (x, y, z, e - self.max_e)], self.speed)
+        self.reset()
 
 class ExcludeObject:
     def __init__(self, config):
@@ -199,7 +248,83 @@ class ExcludeObject:
         if not any(obj["name"] == name for obj in self.objects):
             self._add_object_definition({"name": name})
         self.current_object = name
+        self.printer.send_event("exclude_object:current_object", name)
         self.was_excluded_at_start = self._test_in_excluded_region()
+        if self.was_excluded_at_start:
+            self._skip_excluded_object()
+
+    def _skip_excluded_object(self):
+        # When printing from virtual_sdcard, jump over the moves of an
+        # excluded object instead of parsing and dispatching each of them
+        sdcard = self.printer.lookup_object('virtual_sdcard', None)
+        if sdcard is None or not sdcard.is_cmd_from_sd():
+            return
+        file_pos = sdcard.get_file_position()
+        try:
+            f = self._open_sd_file(sdcard.file_path(), file_pos)
+        except:
+            logging.exception("exclude_object file open")
+            return
+        reactor = self.printer.get_reactor()
+        args_r = self.gcode.args_r
+        summary = MoveSummary(self.gcode_move)
+        line_count = 0
+        try:
+            for raw in f:
+                line_count += 1
+                if line_count >= SKIP_BATCH_LINES:
+                    line_count = 0
+                    reactor.pause(reactor.NOW)
+                    if sdcard.must_pause_work:
+                        break
+                line = raw.split(b';', 1)[0].strip()
+                if line:
+                    line = line.decode('utf-8', 'replace').upper()
+                    parts = args_r.split(line)
+                    if len(parts) < 3 or parts[1] == 'N':
+                        break
+                    cmd = parts[1] + parts[2].strip()
+                    if cmd in ('G0', 'G1'):
+                        try:
+                            params = [(parts[i], float(parts[i+1].strip()))
+                                      for i in range(3, len(parts), 2)]
+                        except (ValueError, IndexError):
+                            break
+                        if any(a not in 'XYZEF' or len(a) != 1
+                               for a, v in params):
+                            break
+                        if not summary.add_move(params):
+                            break
+                    elif cmd in SKIP_STATE_COMMANDS:
+                        summary.flush()
+                        self.gcode.run_script_from_command(
+                            raw.decode('utf-8', 'replace'))
+                        summary.reset()
+                    else:
+                        # EXCLUDE_OBJECT_END (or an unsupported command)
+                        break
+                file_pos += len(raw)
+        finally:
+            f.close()
+            summary.flush()
+            sdcard.set_file_position(file_pos)
+    def _open_sd_file(self, fname, file_pos):
+        f, fsize = virtual_sdcard.open_gcode_file(fname)
+        ext = fname[fname.rfind('.')+1:]
+        if ext not in virtual_sdcard.COMPRESSED_GCODE_EXTS:
+            f.seek(file_pos)
+            return f
+        # Compressed files are decompressed up to the position in small
+        # pieces so that the reactor is not blocked
+        reactor = self.printer.get_reactor()
+        while file_pos:
+            data = f.read(min(file_pos, SKIP_READ_SIZE))
+            if not data:
+                f.close()
+                raise IOError("Unexpected end of file %s" % (fname,))
+            file_pos -= len(data)
+            reactor.pause(reactor.NOW)
+        return f
 
     cmd_EXCLUDE_OBJECT_END_help = "Marks the end the current object"
     def cmd_EXCLUDE_OBJECT_END(self, gcmd):
@@ -214,6 +339,7 @@ class ExcludeObject:
                               (name.upper(), self.current_object))
 
         self.current_object = None
+        self.printer.send_event("exclude_object:current_object", None)
 
     cmd_EXCLUDE_OBJECT_help = "Cancel moves inside a specified objects"
     def cmd_EXCLUDE_OBJECT(self, gcmd):
@@ -89,9 +89,11 @@ class FanTachometer:
             self.ppr = config.getint('tachometer_ppr', 2, minval=1)
             poll_time = config.getfloat('tachometer_poll_interval',
                                         0.0015, above=0.)
+            hw_counter = config.getboolean('tachometer_hardware_counter',
+                                           False)
             sample_time = 1.
             self._freq_counter = pulse_counter.FrequencyCounter(
-                printer, pin, sample_time, poll_time)
+                printer, pin, sample_time, poll_time, hw_counter)
 
     def get_status(self, eventtime):
         if self._freq_counter is not None:
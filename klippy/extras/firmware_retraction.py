@@ -14,7 +14,10 @@ class FirmwareRetraction:
         self.unretract_speed = config.getfloat('unretract_speed', 10., minval=1)
         self.unretract_length = (self.retract_length
                                  + self.unretract_extra_length)
+        self.retract_during_travel = config.getboolean(
+            'retract_during_travel', False)
         self.is_retracted = False
+        self.gcode_move = self.printer.load_object(config, 'gcode_move')
         self.gcode = self.printer.lookup_object('gcode')
         self.gcode.register_command('SET_RETRACTION', self.cmd_SET_RETRACTION,
                                     desc=self.cmd_SET_RETRACTION_help)
@@ -52,22 +55,15 @@ class FirmwareRetraction:
 
     def cmd_G10(self, gcmd):
         if not self.is_retracted:
-            self.gcode.run_script_from_command(
-                "SAVE_GCODE_STATE NAME=_retract_state\n"
-                "G91\n"
-                "G1 E-%.5f F%d\n"
-                "RESTORE_GCODE_STATE NAME=_retract_state"
-                % (self.retract_length, self.retract_speed*60))
+            self.gcode_move.extrude_move(-self.retract_length,
+                                         self.retract_speed,
+                                         self.retract_during_travel)
             self.is_retracted = True
 
     def cmd_G11(self, gcmd):
         if self.is_retracted:
-            self.gcode.run_script_from_command(
-                "SAVE_GCODE_STATE NAME=_retract_state\n"
-                "G91\n"
-                "G1 E%.5f F%d\n"
-                "RESTORE_GCODE_STATE NAME=_retract_state"
-                % (self.unretract_length, self.unretract_speed*60))
+            self.gcode_move.extrude_move(self.unretract_length,
+                                         self.unretract_speed)
             self.is_retracted = False
 
 def load_config(config):
@@ -75,6 +75,10 @@ class ForceMove:
             enable.motor_disable(print_time)
             toolhead.dwell(STALL_TIME)
     def manual_move(self, stepper, dist, speed, accel=0.):
+        if stepper.shares_step_timer():
+            raise self.printer.command_error(
+                "Stepper %s shares a step timer and can not be moved"
+                " on its own" % (stepper.get_name(),))
         toolhead = self.printer.lookup_object('toolhead')
         toolhead.flush_step_generation()
         prev_sk = stepper.set_stepper_kinematics(self.stepper_kinematics)
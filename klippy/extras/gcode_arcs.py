@@ -8,7 +8,7 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math
 
-# Coordinates created by this are converted into G1 commands.
+# Coordinates created by this are passed directly to gcode_move.
 #
 # supports XY, XZ & YZ planes with remaining axis as helical
 
@@ -93,23 +93,15 @@ class ArcSupport:
         # Build list of linear coordinates to move
         coords = self.planArc(currentPos, asTarget, asPlanar,
                               clockwise, *axes)
-        e_per_move = e_base = 0.
+        e_per_move = 0.
         if asE is not None:
             if gcodestatus['absolute_extrude']:
-                e_base = currentPos[3]
-            e_per_move = (asE - e_base) / len(coords)
-
-        # Convert coords into G1 commands
-        for coord in coords:
-            g1_params = {'X': coord[0], 'Y': coord[1], 'Z': coord[2]}
-            if e_per_move:
-                g1_params['E'] = e_base + e_per_move
-                if gcodestatus['absolute_extrude']:
-                    e_base += e_per_move
-            if asF is not None:
-                g1_params['F'] = asF
-            g1_gcmd = self.gcode.create_gcode_command("G1", "G1", g1_params)
-            self.gcode_move.cmd_G1(g1_gcmd)
+                asE -= currentPos[3]
+            e_per_move = asE / len(coords)
+
+        # Move through the coords without creating G1 commands
+        path = [(c[0], c[1], c[2], e_per_move) for c in coords]
+        self.gcode_move.move_path(path, asF)
 
     # function planArc() originates from marlin plan_arc()
     # https://github.com/MarlinFirmware/Marlin
@@ -17,8 +17,12 @@ class GetStatusWrapper:
         self.printer = printer
         self.eventtime = eventtime
         self.cache = {}
+        # Optional set that records the names of all accessed objects
+        self.access_log = None
     def __getitem__(self, val):
         sval = str(val).strip()
+        if self.access_log is not None:
+            self.access_log.add(sval)
         if sval in self.cache:
             return self.cache[sval]
         po = self.printer.lookup_object(sval, None)
@@ -39,6 +43,54 @@ class GetStatusWrapper:
             if self.__contains__(name):
                 yield name
 
+# Reuse the output of a template until the status of one of the
+# printer objects it accessed changes
+class TemplateRenderCache:
+    def __init__(self, printer):
+        self.printer = printer
+        self.cache = {}
+        self.last_cache = {}
+        self.cur_status = {}
+        self.status_wrapper = self.eventtime = None
+    def start(self, context, eventtime):
+        # Start a new round of renders using the given template context
+        self.status_wrapper = context['printer']
+        self.eventtime = eventtime
+        self.last_cache = self.cache
+        self.cache = {}
+        self.cur_status = {}
+    def finish(self):
+        self.last_cache = {}
+        self.cur_status = {}
+        self.status_wrapper = None
+    def _is_unchanged(self, name, last_status):
+        cur_status = self.cur_status
+        if name not in cur_status:
+            po = self.printer.lookup_object(name, None)
+            if po is None or not hasattr(po, 'get_status'):
+                cur_status[name] = None
+            else:
+                cur_status[name] = po.get_status(self.eventtime)
+        return cur_status[name] == last_status
+    def render(self, key, render_func):
+        # Return the cached output for 'key' or call render_func(), which
+        # returns the output and whether that output may be cached
+        cached = self.last_cache.get(key)
+        if cached is not None and all(
+                self._is_unchanged(n, st) for n, st in cached[0].items()):
+            self.cache[key] = cached
+            return cached[1]
+        status_wrapper = self.status_wrapper
+        accessed = status_wrapper.access_log = set()
+        try:
+            output, can_cache = render_func()
+        finally:
+            status_wrapper.access_log = None
+        if can_cache:
+            self.cache[key] = ({n: status_wrapper.cache.get(n)
+                                for n in accessed}, output)
+        return output
+
 # Wrapper around a Jinja2 template
 class TemplateWrapper:
     def __init__(self, printer, env, name, script):
@@ -48,7 +100,7 @@ class TemplateWrapper:
         gcode_macro = self.printer.lookup_object('gcode_macro')
         self.create_template_context = gcode_macro.create_template_context
         try:
-            self.template = env.from_string(script)
+            self.template = gcode_macro.compile_template(script)
         except Exception as e:
             msg = "Error loading template '%s': %s" % (
                  name, traceback.format_exception_only(type(e), e)[-1])
@@ -67,11 +119,35 @@ class TemplateWrapper:
     def run_gcode_from_command(self, context=None):
         self.gcode.run_script_from_command(self.render(context))
 
+# Compiled templates (by config file and script text) are kept across
+# a klippy restart
+JINJA_ENV = None
+TEMPLATE_CACHE = {}
+
 # Main gcode macro template tracking
 class PrinterGCodeMacro:
     def __init__(self, config):
+        global JINJA_ENV
         self.printer = config.get_printer()
-        self.env = jinja2.Environment('{%', '%}', '{', '}')
+        if JINJA_ENV is None:
+            JINJA_ENV = jinja2.Environment('{%', '%}', '{', '}')
+        self.env = JINJA_ENV
+        # Start a new cache so templates no longer in the config are freed
+        config_file = self.printer.get_start_args().get('config_file')
+        self.prev_templates = TEMPLATE_CACHE.get(config_file, {})
+        self.templates = TEMPLATE_CACHE[config_file] = {}
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+    def _handle_connect(self):
+        self.prev_templates = {}
+    def compile_template(self, script):
+        template = self.templates.get(script)
+        if template is None:
+            template = self.prev_templates.get(script)
+            if template is None:
+                template = self.env.from_string(script)
+            self.templates[script] = template
+        return template
     def load_template(self, config, option, default=None):
         name = "%s:%s" % (config.get_name(), option)
         if default is None:
@@ -109,6 +109,20 @@ class GCodeMove:
     def reset_last_position(self):
         if self.is_printer_ready:
             self.last_position = self.position_with_transform()
+    def extrude_move(self, e_dist, speed, parallel=False):
+        # Extruder only move (eg, a retraction) that does not alter
+        # the g-code E coordinate.  The distance and speed are scaled
+        # by the M221 extrude factor and M220 speed factor.
+        e_dist *= self.extrude_factor
+        speed *= self.speed_factor * 60.
+        self.base_position[3] += e_dist
+        if parallel:
+            toolhead = self.printer.lookup_object('toolhead')
+            toolhead.extrude_parallel(e_dist, speed)
+            self.reset_last_position()
+            return
+        self.last_position[3] += e_dist
+        self.move_with_transform(self.last_position, speed)
     # G-Code movement commands
     def cmd_G1(self, gcmd):
         # Move
@@ -141,6 +155,24 @@ class GCodeMove:
             raise gcmd.error("Unable to parse move '%s'"
                              % (gcmd.get_commandline(),))
         self.move_with_transform(self.last_position, self.speed)
+    def move_path(self, path, gcode_speed=None):
+        # Move through a list of absolute (x, y, z, e) gcode coordinates
+        # where each 'e' is the extrusion relative to the previous point
+        if gcode_speed is not None:
+            if gcode_speed <= 0.:
+                raise self.printer.command_error("Invalid speed %.3f"
+                                                 % (gcode_speed,))
+            self.speed = gcode_speed * self.speed_factor
+        pos = self.last_position
+        bx, by, bz = self.base_position[:3]
+        extrude_factor = self.extrude_factor
+        move, speed = self.move_with_transform, self.speed
+        for x, y, z, e in path:
+            pos[0] = x + bx
+            pos[1] = y + by
+            pos[2] = z + bz
+            pos[3] += e * extrude_factor
+            move(pos, speed)
     # G-Code coordinate manipulation
     def cmd_G20(self, gcmd):
         # Set units to inches
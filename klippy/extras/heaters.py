@@ -44,6 +44,8 @@ class Heater:
         # pwm caching
         self.next_pwm_time = 0.
         self.last_pwm_value = 0.
+        # Volumetric extrusion rate (mm^3/s) reported by an extruder
+        self.flow_rate = self.flow_end_time = 0.
         # Setup control algorithm sub-class
         algos = {'watermark': ControlBangBang, 'pid': ControlPID}
         algo = config.getchoice('control', algos)
@@ -56,6 +58,9 @@ class Heater:
                                          maxval=self.pwm_delay)
         self.mcu_pwm.setup_cycle_time(pwm_cycle_time)
         self.mcu_pwm.setup_max_duration(MAX_HEAT_TIME)
+        self.pwm_cycle_time = pwm_cycle_time
+        self.stagger_pwm = config.getboolean('stagger_pwm', False)
+        self.pwm_phase = None
         # Load additional modules
         self.printer.load_object(config, "verify_heater %s" % (short_name,))
         self.printer.load_object(config, "pid_calibrate")
@@ -73,12 +78,25 @@ class Heater:
             # No significant change in value - can suppress update
             return
         pwm_time = read_time + self.pwm_delay
+        if self.pwm_phase is not None:
+            # Start the pwm cycle at this heater's assigned phase
+            pwm_time += (self.pwm_phase - pwm_time) % self.pwm_cycle_time
         self.next_pwm_time = pwm_time + 0.75 * MAX_HEAT_TIME
         self.last_pwm_value = value
         self.mcu_pwm.set_pwm(pwm_time, value)
         #logging.debug("%s: pwm=%.3f@%.3f (from %.3f@%.3f [%.3f])",
         #              self.name, value, pwm_time,
         #              self.last_temp, self.last_temp_time, self.target_temp)
+    def set_pwm_phase(self, phase):
+        self.pwm_phase = phase * self.pwm_cycle_time
+    def note_flow_rate(self, flow_rate, end_time):
+        self.flow_rate, self.flow_end_time = flow_rate, end_time
+    def get_flow_rate(self, print_time):
+        flow_rate, end_time = self.flow_rate, self.flow_end_time
+        if print_time > end_time:
+            # No extrusion has been queued beyond the last report
+            return 0.
+        return flow_rate
     def temperature_callback(self, read_time, temp):
         with self.lock:
             time_diff = read_time - self.last_temp_time
@@ -187,6 +205,8 @@ class ControlPID:
         self.Kp = config.getfloat('pid_Kp') / PID_PARAM_BASE
         self.Ki = config.getfloat('pid_Ki') / PID_PARAM_BASE
         self.Kd = config.getfloat('pid_Kd') / PID_PARAM_BASE
+        self.Kff = config.getfloat('pid_flow_feedforward', 0., minval=0.)
+        self.Kff /= PID_PARAM_BASE
         self.min_deriv_time = heater.get_smooth_time()
         self.temp_integ_max = 0.
         if self.Ki:
@@ -210,6 +230,9 @@ class ControlPID:
         temp_integ = max(0., min(self.temp_integ_max, temp_integ))
         # Calculate output
         co = self.Kp*temp_err + self.Ki*temp_integ - self.Kd*temp_deriv
+        if self.Kff:
+            # Supply the power needed to heat the extruded filament
+            co += self.Kff * self.heater.get_flow_rate(read_time)
         #logging.debug("pid: %f@%.3f -> diff=%f deriv=%f err=%f integ=%f co=%d",
         #    temp, read_time, temp_diff, temp_deriv, temp_err, temp_integ, co)
         bounded_co = max(0., min(self.heater_max_power, co))
@@ -235,6 +258,7 @@ class PrinterHeaters:
         self.printer = config.get_printer()
         self.sensor_factories = {}
         self.heaters = {}
+        self.staggered_heaters = {}
         self.gcode_id_to_sensor = {}
         self.available_heaters = []
         self.available_sensors = []
@@ -272,6 +296,13 @@ class PrinterHeaters:
         sensor = self.setup_sensor(config)
         # Create heater
         self.heaters[heater_name] = heater = Heater(config, sensor)
+        if heater.stagger_pwm:
+            # Spread the pwm cycles of heaters on the same mcu evenly
+            mcu = heater.mcu_pwm.get_mcu()
+            sh = self.staggered_heaters.setdefault(mcu.get_name(), [])
+            sh.append(heater)
+            for i, h in enumerate(sh):
+                h.set_pwm_phase(float(i) / len(sh))
         self.register_sensor(config, heater, gcode_id)
         self.available_heaters.append(config.get_name())
         return heater
@@ -29,10 +29,12 @@ class StepperPosition:
         self.endstop_name = endstop_name
         self.stepper_name = stepper.get_name()
         self.start_pos = stepper.get_mcu_position()
-        self.halt_pos = self.trig_pos = None
+        self.halt_pos = self.trig_pos = self.trig_frac_pos = None
     def note_home_end(self, trigger_time):
         self.halt_pos = self.stepper.get_mcu_position()
         self.trig_pos = self.stepper.get_past_mcu_position(trigger_time)
+        self.trig_frac_pos = self.stepper.get_past_mcu_position_frac(
+            trigger_time)
 
 # Implementation of homing/probing moves
 class HomingMove:
@@ -116,7 +118,7 @@ class HomingMove:
         if probe_pos:
             halt_steps = {sp.stepper_name: sp.halt_pos - sp.start_pos
                           for sp in self.stepper_positions}
-            trig_steps = {sp.stepper_name: sp.trig_pos - sp.start_pos
+            trig_steps = {sp.stepper_name: sp.trig_frac_pos - sp.start_pos
                           for sp in self.stepper_positions}
             haltpos = trigpos = self.calc_toolhead_pos(kin_spos, trig_steps)
             if trig_steps != halt_steps:
@@ -156,6 +158,7 @@ class Homing:
         self.changed_axes = []
         self.trigger_mcu_pos = {}
         self.adjust_pos = {}
+        self.confirmed_steppers = set()
     def set_axes(self, axes):
         self.changed_axes = axes
     def get_axes(self):
@@ -164,6 +167,17 @@ class Homing:
         return self.trigger_mcu_pos[stepper_name]
     def set_stepper_adjustment(self, stepper_name, adjustment):
         self.adjust_pos[stepper_name] = adjustment
+    def confirm_first_home(self, stepper_name):
+        self.confirmed_steppers.add(stepper_name)
+    def _check_skip_second_home(self, rails, hmove):
+        # Allow modules to confirm the first home is accurate enough
+        self.toolhead.flush_step_generation()
+        self.trigger_mcu_pos = {sp.stepper_name: sp.trig_pos
+                                for sp in hmove.stepper_positions}
+        self.confirmed_steppers = set()
+        self.printer.send_event("homing:home_rails_first", self, rails)
+        return all([rail.get_steppers()[0].get_name()
+                    in self.confirmed_steppers for rail in rails])
     def _fill_coord(self, coord):
         # Fill in any None entries in 'coord' with current toolhead position
         thcoord = list(self.toolhead.get_position())
@@ -187,7 +201,7 @@ class Homing:
         hmove = HomingMove(self.printer, endstops)
         hmove.homing_move(homepos, hi.speed)
         # Perform second home
-        if hi.retract_dist:
+        if hi.retract_dist and not self._check_skip_second_home(rails, hmove):
             # Retract
             startpos = self._fill_coord(forcepos)
             homepos = self._fill_coord(movepos)
@@ -0,0 +1,96 @@
+# Support for streaming i2c sensor register reads at a fixed rate
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging, struct
+from . import bus, bulk_sensor
+
+BATCH_UPDATES = 0.100
+MAX_READ_LEN = bulk_sensor.MAX_BULK_MSG_SIZE
+
+class I2CStream:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.name = config.get_name().split()[-1]
+        self.sample_rate = config.getfloat('sample_rate', 100.,
+                                           minval=1., maxval=10000.)
+        reg = config.getint('register', minval=0, maxval=255)
+        self.sample_format = config.get('sample_format', '>h')
+        try:
+            read_len = struct.calcsize(self.sample_format)
+        except struct.error:
+            raise config.error("Invalid sample_format '%s' in section '%s'"
+                               % (self.sample_format, config.get_name()))
+        if read_len < 1 or read_len > MAX_READ_LEN:
+            raise config.error("sample_format '%s' must describe 1 to %d bytes"
+                               % (self.sample_format, MAX_READ_LEN))
+        self.i2c = bus.MCU_I2C_from_config(config, default_speed=400000)
+        # Send any chip initialization writes
+        for line in config.getlists('init_commands', (), seps=('\n',)):
+            try:
+                data = [int(v, 16) for v in line.split()]
+            except ValueError:
+                raise config.error("Invalid init_commands '%s' in section '%s'"
+                                   % (line, config.get_name()))
+            if data:
+                self.i2c.i2c_write(data)
+        # Setup mcu sensor_i2c_stream bulk query code
+        self.mcu = mcu = self.i2c.get_mcu()
+        self.oid = oid = mcu.create_oid()
+        self.query_i2c_stream_cmd = None
+        mcu.add_config_cmd(
+            "config_i2c_stream oid=%d i2c_oid=%d reg=%d read_len=%d"
+            % (oid, self.i2c.get_oid(), reg, read_len))
+        mcu.add_config_cmd("query_i2c_stream oid=%d rest_ticks=0"
+                           % (oid,), on_restart=True)
+        mcu.register_config_callback(self._build_config)
+        # Bulk sample message reading
+        chip_smooth = self.sample_rate * BATCH_UPDATES * 2
+        self.ffreader = bulk_sensor.FixedFreqReader(mcu, chip_smooth,
+                                                    self.sample_format)
+        # Process messages in batches
+        self.batch_bulk = bulk_sensor.BatchBulkHelper(
+            self.printer, self._process_batch,
+            self._start_measurements, self._finish_measurements, BATCH_UPDATES)
+        hdr = ('time', 'values')
+        self.batch_bulk.add_mux_endpoint("i2c_stream/dump_i2c_stream",
+                                         "sensor", self.name, {'header': hdr})
+    def _build_config(self):
+        cmdqueue = self.i2c.get_command_queue()
+        self.query_i2c_stream_cmd = self.mcu.lookup_command(
+            "query_i2c_stream oid=%c rest_ticks=%u", cq=cmdqueue)
+        self.ffreader.setup_query_command("query_i2c_stream_status oid=%c",
+                                          oid=self.oid, cq=cmdqueue)
+    def get_mcu(self):
+        return self.mcu
+    def get_sample_rate(self):
+        return self.sample_rate
+    def add_client(self, cb):
+        self.batch_bulk.add_client(cb)
+    # Measurement decoding
+    def _convert_samples(self, samples):
+        count = 0
+        for s in samples:
+            samples[count] = (round(s[0], 6), list(s[1:]))
+            count += 1
+    # Start, stop, and process message batches
+    def _start_measurements(self):
+        rest_ticks = self.mcu.seconds_to_clock(1. / self.sample_rate)
+        self.query_i2c_stream_cmd.send([self.oid, rest_ticks])
+        logging.info("i2c_stream starting '%s' measurements", self.name)
+        # Initialize clock tracking
+        self.ffreader.note_start()
+    def _finish_measurements(self):
+        # Halt bulk reading
+        self.query_i2c_stream_cmd.send_wait_ack([self.oid, 0])
+        self.ffreader.note_end()
+        logging.info("i2c_stream finished '%s' measurements", self.name)
+    def _process_batch(self, eventtime):
+        samples = self.ffreader.pull_samples()
+        self._convert_samples(samples)
+        if not samples:
+            return {}
+        return {'data': samples,
+                'overflows': self.ffreader.get_last_overflows()}
+
+def load_config_prefix(config):
+    return I2CStream(config)
@@ -41,6 +41,8 @@ class IdleTimeout:
         self.timeout_timer = self.reactor.register_timer(self.timeout_handler)
         self.printer.register_event_handler("toolhead:sync_print_time",
                                             self.handle_sync_print_time)
+        self.printer.register_event_handler("toolhead:flush_idle",
+                                            self.handle_flush_idle)
     def transition_idle_state(self, eventtime):
         self.state = "Printing"
         try:
@@ -80,8 +82,9 @@ class IdleTimeout:
             eventtime)
         buffer_time = min(2., print_time - est_print_time)
         if not lookahead_empty:
-            # Toolhead is busy
-            return eventtime + READY_TIMEOUT + max(0., buffer_time)
+            # Toolhead is busy - the toolhead:flush_idle event will
+            # wake this timer once all its moves have been flushed
+            return self.reactor.NEVER
         if buffer_time > -READY_TIMEOUT:
             # Wait for ready timeout
             return eventtime + READY_TIMEOUT + buffer_time
@@ -103,6 +106,9 @@ class IdleTimeout:
         self.reactor.update_timer(self.timeout_timer, curtime + check_time)
         self.printer.send_event("idle_timeout:printing",
                                 est_print_time + PIN_MIN_TIME)
+    def handle_flush_idle(self, flush_time):
+        if self.state == "Printing":
+            self.reactor.update_timer(self.timeout_timer, self.reactor.NOW)
     cmd_SET_IDLE_TIMEOUT_help = "Set the idle timeout in seconds"
     def cmd_SET_IDLE_TIMEOUT(self, gcmd):
         timeout = gcmd.get_float('TIMEOUT', self.idle_timeout, above=0.)
@@ -4,7 +4,7 @@
 # Copyright (C) 2020  Dmitry Butyugin <dmbutyugin@google.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import collections
+import collections, logging
 import chelper
 from . import shaper_defs
 
@@ -41,6 +41,13 @@ class InputShaperParams:
             A, T = self.shapers[self.shaper_type](
                     self.shaper_freq, self.damping_ratio)
         return len(A), A, T
+    def get_max_accel(self, scv):
+        # Report the max_accel recommended for this shaper (if any)
+        if not self.shaper_freq:
+            return None
+        A, T = self.shapers[self.shaper_type](self.shaper_freq,
+                                              self.damping_ratio)
+        return shaper_defs.get_shaper_max_accel((A, T), scv) or None
     def get_status(self):
         return collections.OrderedDict([
             ('shaper_type', self.shaper_type),
@@ -57,18 +64,28 @@ class AxisInputShaper:
         return 'shaper_' + self.axis
     def get_shaper(self):
         return self.n, self.A, self.T
+    def get_max_accel(self, scv):
+        if self.saved is not None:
+            # Shaping is disabled
+            return None
+        return self.params.get_max_accel(scv)
     def update(self, gcmd):
         self.params.update(gcmd)
         self.n, self.A, self.T = self.params.get_shaper()
-    def set_shaper_kinematics(self, sk):
-        ffi_main, ffi_lib = chelper.get_ffi()
-        success = ffi_lib.input_shaper_set_shaper_params(
-                sk, self.axis.encode(), self.n, self.A, self.T) == 0
+    def _set_shaper_params(self, set_params, sk):
+        success = set_params(sk, self.axis.encode(),
+                             self.n, self.A, self.T) == 0
         if not success:
             self.disable_shaping()
-            ffi_lib.input_shaper_set_shaper_params(
-                    sk, self.axis.encode(), self.n, self.A, self.T)
+            set_params(sk, self.axis.encode(), self.n, self.A, self.T)
         return success
+    def set_shaper_kinematics(self, sk):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        return self._set_shaper_params(ffi_lib.input_shaper_set_shaper_params,
+                                       sk)
+    def set_extruder_kinematics(self, sk):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        return self._set_shaper_params(ffi_lib.extruder_set_shaper_params, sk)
     def disable_shaping(self):
         if self.saved is None and self.n:
             self.saved = (self.n, self.A, self.T)
@@ -94,6 +111,9 @@ class InputShaper:
                         AxisInputShaper('y', config)]
         self.input_shaper_stepper_kinematics = []
         self.orig_stepper_kinematics = []
+        self.extruder_names = config.getlist('enabled_extruders', [])
+        self.extruder_steppers = []
+        self.limit_axis_accel = config.getboolean('limit_axis_accel', False)
         # Register gcode commands
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command("SET_INPUT_SHAPER",
@@ -103,6 +123,15 @@ class InputShaper:
         return self.shapers
     def connect(self):
         self.toolhead = self.printer.lookup_object("toolhead")
+        # Lookup extruders that should follow the toolhead shaping
+        for name in self.extruder_names:
+            extruder = self.printer.lookup_object(name, None)
+            es = getattr(extruder, 'extruder_stepper', None)
+            if es is None:
+                raise self.printer.config_error(
+                    "Invalid extruder '%s' in input_shaper enabled_extruders"
+                    % (name,))
+            self.extruder_steppers.append(es)
         # Configure initial values
         self._update_input_shaping(error=self.printer.config_error)
     def _get_input_shaper_stepper_kinematics(self, stepper):
@@ -144,10 +173,32 @@ class InputShaper:
             if old_delay != new_delay:
                 self.toolhead.note_step_generation_scan_time(new_delay,
                                                              old_delay)
+        for es in self.extruder_steppers:
+            sk = es.get_stepper_kinematics()
+            old_delay = ffi_lib.extruder_get_step_generation_window(sk)
+            for shaper in self.shapers:
+                if shaper in failed_shapers:
+                    continue
+                if not shaper.set_extruder_kinematics(sk):
+                    failed_shapers.append(shaper)
+            new_delay = ffi_lib.extruder_get_step_generation_window(sk)
+            if old_delay != new_delay:
+                self.toolhead.note_step_generation_scan_time(new_delay,
+                                                             old_delay)
         if failed_shapers:
             error = error or self.printer.command_error
             raise error("Failed to configure shaper(s) %s with given parameters"
                         % (', '.join([s.get_name() for s in failed_shapers])))
+        if self.limit_axis_accel:
+            self._update_axis_accel()
+    def _update_axis_accel(self):
+        eventtime = self.printer.get_reactor().monotonic()
+        status = self.toolhead.get_status(eventtime)
+        scv = status['square_corner_velocity']
+        accel_x, accel_y = [s.get_max_accel(scv) for s in self.shapers]
+        self.toolhead.set_axis_max_accel(accel_x, accel_y)
+        logging.info("input_shaper: axis max_accel x=%s y=%s",
+                     accel_x, accel_y)
     def disable_shaping(self):
         for shaper in self.shapers:
             shaper.disable_shaping()
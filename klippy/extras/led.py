@@ -5,6 +5,7 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, ast
 from .display import display
+from . import gcode_macro
 
 # Time between each led template update
 RENDER_TIME = 0.500
@@ -81,12 +82,13 @@ class PrinterLED:
         self.printer = config.get_printer()
         self.led_helpers = {}
         self.active_templates = {}
+        self.render_cache = gcode_macro.TemplateRenderCache(self.printer)
         self.render_timer = None
         # Load templates
         dtemplates = display.lookup_display_templates(config)
         self.templates = dtemplates.get_display_templates()
-        gcode_macro = self.printer.lookup_object("gcode_macro")
-        self.create_template_context = gcode_macro.create_template_context
+        pgcode_macro = self.printer.lookup_object("gcode_macro")
+        self.create_template_context = pgcode_macro.create_template_context
         # Register handlers
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command("SET_LED_TEMPLATE", self.cmd_SET_LED_TEMPLATE,
@@ -121,6 +123,21 @@ class PrinterLED:
         def render(name, **kwargs):
             return self.templates[name].render(context, **kwargs)
         context['render'] = render
+        render_cache = self.render_cache
+        render_cache.start(context, eventtime)
+        def render_color(template, lparams):
+            try:
+                text = template.render(context, **lparams)
+                parts = [max(0., min(1., float(f)))
+                         for f in text.split(',', 4)]
+                can_cache = True
+            except Exception as e:
+                logging.exception("led template render error")
+                parts = []
+                can_cache = False
+            if len(parts) < 4:
+                parts += [0.] * (4 - len(parts))
+            return tuple(parts), can_cache
         # Render all templates
         need_transmit = {}
         rendered = {}
@@ -128,18 +145,12 @@ class PrinterLED:
         for (led_helper, index), (uid, template, lparams) in template_info:
             color = rendered.get(uid)
             if color is None:
-                try:
-                    text = template.render(context, **lparams)
-                    parts = [max(0., min(1., float(f)))
-                             for f in text.split(',', 4)]
-                except Exception as e:
-                    logging.exception("led template render error")
-                    parts = []
-                if len(parts) < 4:
-                    parts += [0.] * (4 - len(parts))
-                rendered[uid] = color = tuple(parts)
+                color = render_cache.render(
+                    uid, lambda: render_color(template, lparams))
+                rendered[uid] = color
             need_transmit[led_helper] = 1
             led_helper.set_color(index, color)
+        render_cache.finish()
         context.clear() # Remove circular references for better gc
         # Transmit pending changes
         for led_helper in need_transmit.keys():
@@ -21,6 +21,8 @@ class ManualStepper:
         self.velocity = config.getfloat('velocity', 5., above=0.)
         self.accel = self.homing_accel = config.getfloat('accel', 0., minval=0.)
         self.next_cmd_time = 0.
+        self.commanded_pos = 0.
+        self.pending_moves = 0
         # Setup iterative solver
         ffi_main, ffi_lib = chelper.get_ffi()
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
@@ -54,16 +56,20 @@ class ManualStepper:
                 se.motor_disable(self.next_cmd_time)
         self.sync_print_time()
     def do_set_position(self, setpos):
+        if self.pending_moves:
+            # Wait for queued moves to be added to the trapq
+            toolhead = self.printer.lookup_object('toolhead')
+            toolhead.get_last_move_time()
         self.rail.set_position([setpos, 0., 0.])
-    def do_move(self, movepos, speed, accel, sync=True):
-        self.sync_print_time()
-        cp = self.rail.get_commanded_position()
-        dist = movepos - cp
-        axis_r, accel_t, cruise_t, cruise_v = force_move.calc_move_time(
-            dist, speed, accel)
+        self.commanded_pos = setpos
+    def _queue_move(self, print_time, start_pos, axis_r,
+                    accel_t, cruise_t, cruise_v, accel):
+        # Start after prior toolhead moves and prior moves of this stepper
+        self.pending_moves -= 1
+        self.next_cmd_time = max(self.next_cmd_time, print_time)
         self.trapq_append(self.trapq, self.next_cmd_time,
                           accel_t, cruise_t, accel_t,
-                          cp, 0., 0., axis_r, 0., 0.,
+                          start_pos, 0., 0., axis_r, 0., 0.,
                           0., cruise_v, accel)
         self.next_cmd_time = self.next_cmd_time + accel_t + cruise_t + accel_t
         self.rail.generate_steps(self.next_cmd_time)
@@ -71,6 +77,18 @@ class ManualStepper:
                                   self.next_cmd_time + 99999.9)
         toolhead = self.printer.lookup_object('toolhead')
         toolhead.note_mcu_movequeue_activity(self.next_cmd_time)
+    def do_move(self, movepos, speed, accel, sync=True):
+        start_pos = self.commanded_pos
+        axis_r, accel_t, cruise_t, cruise_v = force_move.calc_move_time(
+            movepos - start_pos, speed, accel)
+        self.commanded_pos = movepos
+        # Schedule the move once prior toolhead moves are planned (this
+        # does not force a flush of the toolhead lookahead queue)
+        self.pending_moves += 1
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.register_lookahead_callback(
+            (lambda pt: self._queue_move(pt, start_pos, axis_r, accel_t,
+                                         cruise_t, cruise_v, accel)))
         if sync:
             self.sync_print_time()
     def do_homing_move(self, movepos, speed, accel, triggered, check_trigger):
@@ -108,7 +126,7 @@ class ManualStepper:
     def flush_step_generation(self):
         self.sync_print_time()
     def get_position(self):
-        return [self.rail.get_commanded_position(), 0., 0., 0.]
+        return [self.commanded_pos, 0., 0., 0.]
     def set_position(self, newpos, homing_axes=()):
         self.do_set_position(newpos[0])
     def get_last_move_time(self):
@@ -3,7 +3,7 @@
 # Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging
+import logging, struct, sys
 import chelper
 from . import bulk_sensor
 
@@ -15,7 +15,7 @@ class DumpStepper:
         self.last_batch_clock = 0
         self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
                                                       self._process_batch)
-        api_resp = {'header': ('interval', 'count', 'add')}
+        api_resp = {'header': ('interval', 'count', 'add', 'add2')}
         self.batch_bulk.add_mux_endpoint("motion_report/dump_stepper", "name",
                                          mcu_stepper.get_name(), api_resp)
     def get_step_queue(self, start_clock, end_clock):
@@ -39,9 +39,9 @@ class DumpStepper:
                    % (self.mcu_stepper.get_name(),
                       self.mcu_stepper.get_mcu().get_name(), len(data)))
         for i, s in enumerate(data):
-            out.append("queue_step %d: t=%d p=%d i=%d c=%d a=%d"
+            out.append("queue_step %d: t=%d p=%d i=%d c=%d a=%d a2=%d"
                        % (i, s.first_clock, s.start_position, s.interval,
-                          s.step_count, s.add))
+                          s.step_count, s.add, s.add2))
         logging.info('\n'.join(out))
     def _process_batch(self, eventtime):
         data, cdata = self.get_step_queue(self.last_batch_clock, 1<<63)
@@ -56,13 +56,85 @@ class DumpStepper:
         mcu_pos = first.start_position
         start_position = self.mcu_stepper.mcu_to_commanded_position(mcu_pos)
         step_dist = self.mcu_stepper.get_step_dist()
-        d = [(s.interval, s.step_count, s.add) for s in data]
+        d = [(s.interval, s.step_count, s.add, s.add2) for s in data]
         return {"data": d, "start_position": start_position,
                 "start_mcu_position": mcu_pos, "step_distance": step_dist,
                 "first_clock": first_clock, "first_step_time": first_time,
                 "last_clock": last_clock, "last_step_time": last_time}
 
+# Report step timing quality from the stepcompress history
+STEP_TIMING_WINDOW = 0.100
+
+def calc_min_interval(s):
+    # Find the smallest step interval of a queue_step command
+    count = abs(s.step_count)
+    interval, add, add2 = s.interval, s.add, s.add2
+    cand = [0, count - 1]
+    if add2:
+        k = int(.5 - float(add) / add2)
+        cand.extend([min(max(k, 0), count - 1), min(max(k + 1, 0), count - 1)])
+    return min([interval + k * add + add2 * (k * (k - 1) // 2) for k in cand])
+
+class DumpStepTiming:
+    def __init__(self, printer, dstepper):
+        self.printer = printer
+        self.dstepper = dstepper
+        self.mcu_stepper = mcu_stepper = dstepper.mcu_stepper
+        self.last_batch_clock = 0
+        self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
+                                                      self._process_batch)
+        api_resp = {'header': ('time', 'steps', 'max_step_rate', 'max_error')}
+        self.batch_bulk.add_mux_endpoint("motion_report/dump_step_timing",
+                                         "name", mcu_stepper.get_name(),
+                                         api_resp)
+    def _process_batch(self, eventtime):
+        mcu = self.mcu_stepper.get_mcu()
+        clock_to_print_time = mcu.clock_to_print_time
+        mcu_freq = mcu.seconds_to_clock(1.)
+        # Summarize the newly generated steps in fixed time windows
+        data, cdata = self.dstepper.get_step_queue(self.last_batch_clock,
+                                                   1<<63)
+        if not data:
+            return {}
+        self.last_batch_clock = data[-1].last_clock
+        windows = []
+        win_end_time = -1.
+        for s in data:
+            if not s.step_count:
+                continue
+            first_time = clock_to_print_time(s.first_clock)
+            if first_time >= win_end_time:
+                win_time = first_time
+                win_end_time = win_time + STEP_TIMING_WINDOW
+                windows.append([win_time, 0, 0., 0.])
+            win = windows[-1]
+            win[1] += abs(s.step_count)
+            min_interval = calc_min_interval(s)
+            if min_interval > 0:
+                win[2] = max(win[2], mcu_freq / min_interval)
+            win[3] = max(win[3], s.max_error / mcu_freq)
+        if not windows:
+            return {}
+        # Determine the steps queued ahead of the mcu
+        print_time = mcu.estimated_print_time(eventtime)
+        now_clock = mcu.print_time_to_clock(print_time)
+        pending, cdata = self.dstepper.get_step_queue(now_clock, 1<<63)
+        pending = [s for s in pending if s.step_count]
+        buffer_time = 0.
+        if pending:
+            buffer_time = clock_to_print_time(pending[-1].last_clock)
+            buffer_time = max(0., buffer_time - print_time)
+        return {"data": [[round(w[0], 6), w[1], round(w[2], 1),
+                          round(w[3], 9)] for w in windows],
+                "print_time": round(print_time, 6),
+                "pending_msgs": len(pending),
+                "buffer_time": round(buffer_time, 6)}
+
 NEVER_TIME = 9999999999999999.
+PULL_MOVE_FIELDS = 10
+
+def unpack_trapq_row(v):
+    return (v[0], v[1], v[2], v[3], v[4:7], v[7:10])
 
 # Extract trapezoidal motion queue (trapq)
 class DumpTrapQ:
@@ -70,6 +142,7 @@ class DumpTrapQ:
         self.printer = printer
         self.name = name
         self.trapq = trapq
+        self.last_batch_row = b''
         self.last_batch_msg = (0., 0.)
         self.batch_bulk = bulk_sensor.BatchBulkHelper(printer,
                                                       self._process_batch)
@@ -77,7 +150,7 @@ class DumpTrapQ:
                                'acceleration', 'start_position', 'direction')}
         self.batch_bulk.add_mux_endpoint("motion_report/dump_trapq",
                                          "name", name, api_resp)
-    def extract_trapq(self, start_time, end_time):
+    def _extract_chunks(self, start_time, end_time):
         ffi_main, ffi_lib = chelper.get_ffi()
         res = []
         while 1:
@@ -91,6 +164,9 @@ class DumpTrapQ:
                 break
             end_time = data[count-1].print_time
         res.reverse()
+        return res
+    def extract_trapq(self, start_time, end_time):
+        res = self._extract_chunks(start_time, end_time)
         return ([d[i] for d, cnt in res for i in range(cnt-1, -1, -1)], res)
     def log_trapq(self, data):
         if not data:
@@ -117,16 +193,29 @@ class DumpTrapQ:
         return pos, velocity
     def _process_batch(self, eventtime):
         qtime = self.last_batch_msg[0] + min(self.last_batch_msg[1], 0.100)
-        data, cdata = self.extract_trapq(qtime, NEVER_TIME)
-        d = [(m.print_time, m.move_t, m.start_v, m.accel,
-              (m.start_x, m.start_y, m.start_z), (m.x_r, m.y_r, m.z_r))
-             for m in data]
-        if d and d[0] == self.last_batch_msg:
-            d.pop(0)
-        if not d:
+        cdata = self._extract_chunks(qtime, NEVER_TIME)
+        # Copy the raw pull_move structs (in chronological order)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        row_bytes = ffi_main.sizeof('struct pull_move')
+        rows = []
+        for d, count in cdata:
+            buf = ffi_main.buffer(d, count * row_bytes)[:]
+            rows.extend([buf[i*row_bytes:(i+1)*row_bytes]
+                         for i in range(count-1, -1, -1)])
+        if rows and rows[0] == self.last_batch_row:
+            rows.pop(0)
+        if not rows:
             return {}
-        self.last_batch_msg = d[-1]
-        return {"data": d}
+        self.last_batch_row = rows[-1]
+        last_move = cdata[-1][0][0]
+        self.last_batch_msg = (last_move.print_time, last_move.move_t)
+        packed = b''.join(rows)
+        if sys.byteorder != 'little':
+            count = len(packed) // 8
+            packed = struct.pack('<%dd' % (count,),
+                                 *struct.unpack('=%dd' % (count,), packed))
+        return {"data": bulk_sensor.PackedBatchData(packed, PULL_MOVE_FIELDS,
+                                                    unpack_trapq_row)}
 
 STATUS_REFRESH_TIME = 0.250
 
@@ -134,14 +223,19 @@ class PrinterMotionReport:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.steppers = {}
+        self.step_timing = {}
         self.trapqs = {}
+        # Optional export of trapq moves to shared memory
+        self.shm_moves = config.getint('shared_memory_moves', 0, minval=0)
+        self.shm_prefix = config.get('shared_memory_prefix',
+                                     '/dev/shm/klipper_trapq_')
         # get_status information
         self.next_status_time = 0.
         gcode = self.printer.lookup_object('gcode')
         self.last_status = {
             'live_position': gcode.Coord(0., 0., 0., 0.),
             'live_velocity': 0., 'live_extruder_velocity': 0.,
-            'steppers': [], 'trapq': [],
+            'steppers': [], 'trapq': [], 'step_generation': {},
         }
         # Register handlers
         self.printer.register_event_handler("klippy:connect", self._connect)
@@ -149,6 +243,8 @@ class PrinterMotionReport:
     def register_stepper(self, config, mcu_stepper):
         ds = DumpStepper(self.printer, mcu_stepper)
         self.steppers[mcu_stepper.get_name()] = ds
+        dst = DumpStepTiming(self.printer, ds)
+        self.step_timing[mcu_stepper.get_name()] = dst
     def _connect(self):
         # Lookup toolhead trapq
         toolhead = self.printer.lookup_object("toolhead")
@@ -164,6 +260,16 @@ class PrinterMotionReport:
                 break
             etrapq = extruder.get_trapq()
             self.trapqs[ename] = DumpTrapQ(self.printer, ename, etrapq)
+        # Export trapq moves to shared memory (if requested)
+        if self.shm_moves:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            for name, dtrapq in self.trapqs.items():
+                filename = self.shm_prefix + name
+                ret = ffi_lib.trapq_shm_open(dtrapq.trapq, filename.encode(),
+                                             self.shm_moves)
+                if ret:
+                    raise self.printer.config_error(
+                        "Unable to create shared memory file %s" % (filename,))
         # Populate 'trapq' and 'steppers' in get_status result
         self.last_status['steppers'] = list(sorted(self.steppers.keys()))
         self.last_status['trapq'] = list(sorted(self.trapqs.keys()))
@@ -227,7 +333,24 @@ class PrinterMotionReport:
         self.last_status['live_position'] = toolhead.Coord(*(xyzpos + epos))
         self.last_status['live_velocity'] = xyzvelocity
         self.last_status['live_extruder_velocity'] = evelocity
+        self.last_status['step_generation'] = self._get_step_gen_stats()
         return self.last_status
+    def _get_step_gen_stats(self):
+        return {name: ds.mcu_stepper.get_step_gen_stats()
+                for name, ds in self.steppers.items()}
+    def stats(self, eventtime):
+        out = []
+        for name, st in sorted(self._get_step_gen_stats().items()):
+            if not st['gen_calls']:
+                continue
+            out.append("%s: gen_calls=%d gen_iterations=%d gen_iter_steps=%d"
+                       " gen_time=%.3f steps=%d step_msgs=%d step_bytes=%d"
+                       " compress_time=%.3f"
+                       % (name, st['gen_calls'], st['gen_iterations'],
+                          st['gen_iter_steps'], st['gen_time'], st['steps'],
+                          st['step_msgs'], st['step_bytes'],
+                          st['compress_time']))
+        return False, ' '.join(out)
 
 def load_config(config):
     return PrinterMotionReport(config)
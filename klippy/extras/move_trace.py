@@ -0,0 +1,65 @@
+# Trace timing of moves through the host motion pipeline
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import time, array
+
+TRACE_EVENTS = ['move', 'lookahead_flush', 'trapq_append', 'step_gen',
+                'steps_queued']
+RECORD_SIZE = 4
+
+class MoveTrace:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.reactor = self.printer.get_reactor()
+        self.mcu = None
+        self.event_ids = {name: float(i)
+                          for i, name in enumerate(TRACE_EVENTS)}
+        size = config.getint('size', 65536, minval=16)
+        self.data = array.array('d', [0.]) * (size * RECORD_SIZE)
+        self.pos = 0
+        self.is_wrapped = False
+        self.printer.register_event_handler("klippy:connect",
+                                            self._handle_connect)
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("MOVE_TRACE_DUMP", self.cmd_MOVE_TRACE_DUMP,
+                               desc=self.cmd_MOVE_TRACE_DUMP_help)
+    def _handle_connect(self):
+        self.mcu = self.printer.lookup_object('mcu')
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.set_trace_callback(self._note_event)
+    def _note_event(self, event, print_time):
+        eventtime = self.reactor.monotonic()
+        data = self.data
+        pos = self.pos
+        data[pos] = self.event_ids[event]
+        data[pos+1] = eventtime
+        data[pos+2] = print_time
+        data[pos+3] = self.mcu.estimated_print_time(eventtime)
+        pos += RECORD_SIZE
+        if pos >= len(data):
+            pos = 0
+            self.is_wrapped = True
+        self.pos = pos
+    def get_records(self):
+        # Return the stored records in chronological order
+        if self.is_wrapped:
+            return self.data[self.pos:] + self.data[:self.pos]
+        return self.data[:self.pos]
+    cmd_MOVE_TRACE_DUMP_help = "Write the move trace buffer to a file"
+    def cmd_MOVE_TRACE_DUMP(self, gcmd):
+        name = gcmd.get("NAME", time.strftime("%Y%m%d_%H%M%S"))
+        if not name.replace('-', '').replace('_', '').isalnum():
+            raise gcmd.error("Invalid NAME parameter")
+        filename = "/tmp/move_trace-%s.bin" % (name,)
+        records = self.get_records()
+        f = open(filename, "wb")
+        f.write(("# move_trace records=event,eventtime,print_time,"
+                 "est_print_time events=%s\n"
+                 % (",".join(TRACE_EVENTS),)).encode())
+        records.tofile(f)
+        f.close()
+        gcmd.respond_info("Wrote %d move trace records to %s"
+                          % (len(records) // RECORD_SIZE, filename))
+
+def load_config(config):
+    return MoveTrace(config)
@@ -46,6 +46,8 @@ class PrinterNeoPixel:
         self.color_data = bytearray(len(self.color_map))
         self.update_color_data(self.led_helper.get_status()['color_data'])
         self.old_color_data = bytearray([d ^ 1 for d in self.color_data])
+        self.pending_led_state = None
+        self.update_seq = self.sent_seq = 0
         # Register callbacks
         printer.register_event_handler("klippy:connect", self.send_data)
     def build_config(self):
@@ -100,9 +102,25 @@ class PrinterNeoPixel:
         else:
             logging.info("Neopixel update did not succeed")
     def update_leds(self, led_state, print_time):
+        self.update_seq += 1
+        seq = self.update_seq
+        if print_time is None:
+            # Merge unsynchronized updates that have not been sent yet
+            is_pending = self.pending_led_state is not None
+            self.pending_led_state = (led_state, seq)
+            if is_pending:
+                return
         def reactor_bgfunc(eventtime):
             with self.mutex:
-                self.update_color_data(led_state)
+                state, state_seq = led_state, seq
+                if print_time is None:
+                    state, state_seq = self.pending_led_state
+                    self.pending_led_state = None
+                if state_seq < self.sent_seq:
+                    # A newer state has already been sent
+                    return
+                self.sent_seq = state_seq
+                self.update_color_data(state)
                 self.send_data(print_time)
         self.printer.get_reactor().register_callback(reactor_bgfunc)
     def get_status(self, eventtime=None):
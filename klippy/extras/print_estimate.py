@@ -0,0 +1,357 @@
+# Estimate the print time of a G-Code file by pre-scanning it
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import math, os, logging, bisect, multiprocessing, traceback
+import chelper
+
+CHECKPOINT_COUNT = 1000
+LOOKAHEAD_FLUSH_COUNT = 256
+DEFAULT_SPEED = 25.
+POLL_TIME = 1.
+
+
+######################################################################
+# Lightweight G-Code time model
+######################################################################
+
+# Track the time of each move using the toolhead look-ahead code
+class GCodeTimeModel:
+    def __init__(self, limits):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.lookahead = ffi_main.gc(ffi_lib.lookahead_alloc(),
+                                     ffi_lib.lookahead_free)
+        self.lookahead_add_move = ffi_lib.lookahead_add_move
+        self.lookahead_flush = ffi_lib.lookahead_flush
+        self.lookahead_remove_moves = ffi_lib.lookahead_remove_moves
+        self.junctions = ffi_main.new('double[]', 3 * LOOKAHEAD_FLUSH_COUNT)
+        # Pending moves (move_d, accel, file_offset)
+        self.queue = []
+        self.prev_kinematic = False
+        self.max_velocity = limits['max_velocity']
+        self.max_accel = limits['max_accel']
+        self.square_corner_velocity = limits['square_corner_velocity']
+        self.min_cruise_ratio = limits['minimum_cruise_ratio']
+        self._calc_junction_deviation()
+        # Estimated time of flushed moves
+        self.print_time = 0.
+        self.checkpoints = [(0, 0.)]
+        self.checkpoint_step = 1
+        self.next_checkpoint = 1
+    def _calc_junction_deviation(self):
+        scv2 = self.square_corner_velocity**2
+        self.junction_deviation = scv2 * (math.sqrt(2.) - 1.) / self.max_accel
+        self.max_accel_to_decel = self.max_accel * (1. - self.min_cruise_ratio)
+    def set_limits(self, velocity=None, accel=None, scv=None, mcr=None):
+        if velocity is not None:
+            self.max_velocity = velocity
+        if accel is not None:
+            self.max_accel = accel
+        if scv is not None:
+            self.square_corner_velocity = scv
+        if mcr is not None:
+            self.min_cruise_ratio = mcr
+        self._calc_junction_deviation()
+    def set_file_size(self, file_size):
+        self.checkpoint_step = max(1, file_size // CHECKPOINT_COUNT)
+        self.next_checkpoint = self.checkpoint_step
+    def _flush(self, lazy):
+        queue = self.queue
+        if not queue:
+            return
+        junctions = self.junctions
+        flush_count = self.lookahead_flush(self.lookahead, lazy, junctions)
+        print_time = self.print_time
+        for i in range(flush_count):
+            move_d, accel, offset = queue[i]
+            start_v2 = junctions[i*3]
+            cruise_v2 = junctions[i*3+1]
+            end_v2 = junctions[i*3+2]
+            half_inv_accel = .5 / accel
+            accel_d = (cruise_v2 - start_v2) * half_inv_accel
+            decel_d = (cruise_v2 - end_v2) * half_inv_accel
+            cruise_d = move_d - accel_d - decel_d
+            start_v = math.sqrt(start_v2)
+            cruise_v = math.sqrt(cruise_v2)
+            end_v = math.sqrt(end_v2)
+            if offset >= self.next_checkpoint:
+                # Note the time that the move (at this file offset) starts
+                self.checkpoints.append((offset, print_time))
+                self.next_checkpoint = offset + self.checkpoint_step
+            print_time += (accel_d / ((start_v + cruise_v) * 0.5)
+                           + cruise_d / cruise_v
+                           + decel_d / ((end_v + cruise_v) * 0.5))
+        self.print_time = print_time
+        del queue[:flush_count]
+        self.lookahead_remove_moves(self.lookahead, flush_count)
+    def flush(self):
+        self._flush(False)
+        self.prev_kinematic = False
+    def dwell(self, delay, offset):
+        self.flush()
+        self.print_time += delay
+    def add_move(self, axes_d, speed, offset):
+        dx, dy, dz, de = axes_d
+        move_d = math.sqrt(dx*dx + dy*dy + dz*dz)
+        accel = self.max_accel
+        velocity = min(speed, self.max_velocity)
+        is_kinematic = True
+        if move_d < .000000001:
+            # Extrude only move
+            move_d = abs(de)
+            if not move_d:
+                return
+            dx = dy = dz = 0.
+            accel = 99999999.9
+            velocity = speed
+            is_kinematic = False
+        inv_move_d = 1. / move_d
+        max_cruise_v2 = velocity * velocity
+        extruder_v2 = 0.
+        if is_kinematic and self.prev_kinematic:
+            extruder_v2 = max_cruise_v2
+        self.prev_kinematic = is_kinematic
+        self.lookahead_add_move(
+            self.lookahead, move_d, accel, self.junction_deviation,
+            max_cruise_v2, 2. * move_d * accel,
+            2. * move_d * self.max_accel_to_decel, is_kinematic,
+            dx * inv_move_d, dy * inv_move_d, dz * inv_move_d, extruder_v2)
+        self.queue.append((move_d, accel, offset))
+        if len(self.queue) >= LOOKAHEAD_FLUSH_COUNT:
+            self._flush(True)
+            if len(self.queue) >= LOOKAHEAD_FLUSH_COUNT:
+                self._flush(False)
+
+# Interpret the G-Code commands that impact the print time
+class GCodeScanner:
+    def __init__(self, limits):
+        self.model = GCodeTimeModel(limits)
+        self.position = [0., 0., 0., 0.]
+        self.absolute_coord = self.absolute_extrude = True
+        self.speed = DEFAULT_SPEED
+        self.handlers = {
+            'G0': self._move, 'G1': self._move, 'G2': self._arc,
+            'G3': self._arc, 'G4': self._dwell, 'G28': self._home,
+            'G90': self._absolute, 'G91': self._relative,
+            'M82': self._absolute_extrude, 'M83': self._relative_extrude,
+            'G92': self._set_position, 'M204': self._set_accel,
+            'SET_VELOCITY_LIMIT': self._set_velocity_limit,
+        }
+    def _parse_params(self, parts):
+        params = {}
+        for part in parts:
+            try:
+                if '=' in part:
+                    key, val = part.split('=', 1)
+                    params[key.upper()] = float(val)
+                else:
+                    params[part[0].upper()] = float(part[1:])
+            except ValueError:
+                pass
+        return params
+    def _new_position(self, params):
+        newpos = list(self.position)
+        for pos, axis in enumerate('XYZE'):
+            if axis not in params:
+                continue
+            v = params[axis]
+            absolute = self.absolute_coord
+            if axis == 'E':
+                absolute = absolute and self.absolute_extrude
+            if absolute:
+                newpos[pos] = v
+            else:
+                newpos[pos] += v
+        if 'F' in params and params['F'] > 0.:
+            self.speed = params['F'] / 60.
+        return newpos
+    def _move(self, params, offset):
+        newpos = self._new_position(params)
+        axes_d = [np - op for np, op in zip(newpos, self.position)]
+        self.position = newpos
+        self.model.add_move(axes_d, self.speed, offset)
+    def _arc(self, params, offset):
+        startpos = self.position
+        newpos = self._new_position(params)
+        # Approximate the arc with a single move of the arc length
+        cx = startpos[0] + params.get('I', 0.)
+        cy = startpos[1] + params.get('J', 0.)
+        radius = math.hypot(startpos[0] - cx, startpos[1] - cy)
+        start_a = math.atan2(startpos[1] - cy, startpos[0] - cx)
+        end_a = math.atan2(newpos[1] - cy, newpos[0] - cx)
+        angle = end_a - start_a
+        if params.get('#CW'):
+            angle = -angle
+        if angle <= 0.:
+            angle += 2. * math.pi
+        arc_d = radius * angle
+        chord_x, chord_y = newpos[0] - startpos[0], newpos[1] - startpos[1]
+        chord_d = math.hypot(chord_x, chord_y)
+        if chord_d:
+            chord_x *= arc_d / chord_d
+            chord_y *= arc_d / chord_d
+        else:
+            chord_x = arc_d
+        axes_d = [chord_x, chord_y, newpos[2] - startpos[2],
+                  newpos[3] - startpos[3]]
+        self.position = newpos
+        self.model.add_move(axes_d, self.speed, offset)
+    def _dwell(self, params, offset):
+        self.model.dwell(params.get('P', 0.) / 1000., offset)
+    def _home(self, params, offset):
+        self.model.flush()
+        axes = [pos for pos, axis in enumerate('XYZ') if axis in params]
+        if not axes:
+            axes = [0, 1, 2]
+        for pos in axes:
+            self.position[pos] = 0.
+    def _absolute(self, params, offset):
+        self.absolute_coord = True
+    def _relative(self, params, offset):
+        self.absolute_coord = False
+    def _absolute_extrude(self, params, offset):
+        self.absolute_extrude = True
+    def _relative_extrude(self, params, offset):
+        self.absolute_extrude = False
+    def _set_position(self, params, offset):
+        for pos, axis in enumerate('XYZE'):
+            if axis in params:
+                self.position[pos] = params[axis]
+    def _set_accel(self, params, offset):
+        accel = params.get('S')
+        if accel is None and 'P' in params and 'T' in params:
+            accel = min(params['P'], params['T'])
+        if accel is not None and accel > 0.:
+            self.model.set_limits(accel=accel)
+    def _set_velocity_limit(self, params, offset):
+        self.model.set_limits(params.get('VELOCITY'), params.get('ACCEL'),
+                              params.get('SQUARE_CORNER_VELOCITY'),
+                              params.get('MINIMUM_CRUISE_RATIO'))
+    def scan_file(self, filename):
+        from . import virtual_sdcard
+        f, fsize = virtual_sdcard.open_gcode_file(filename)
+        self.model.set_file_size(fsize)
+        handlers = self.handlers
+        offset = 0
+        for line in f:
+            line_offset = offset
+            offset += len(line)
+            line = line.split(b';', 1)[0]
+            parts = line.decode('ascii', 'ignore').split()
+            if not parts:
+                continue
+            cmd = parts[0].upper()
+            if cmd[0] == 'N' and cmd[1:].isdigit() and len(parts) > 1:
+                # Skip line numbers
+                cmd = parts[1].upper()
+                parts = parts[1:]
+            hdl = handlers.get(cmd)
+            if hdl is None:
+                continue
+            params = self._parse_params(parts[1:])
+            if cmd == 'G2':
+                params['#CW'] = 1.
+            hdl(params, line_offset)
+        f.close()
+        self.model.flush()
+        model = self.model
+        model.checkpoints.append((offset, model.print_time))
+        return model.print_time, model.checkpoints
+
+def estimate_file(filename, limits):
+    try:
+        os.nice(10)
+    except OSError:
+        pass
+    return GCodeScanner(limits).scan_file(filename)
+
+
+######################################################################
+# Background estimation of the print time of the current file
+######################################################################
+
+class PrintTimeEstimate:
+    def __init__(self, printer):
+        self.printer = printer
+        self.reactor = printer.get_reactor()
+        self.calc_proc = self.parent_conn = None
+        self.poll_timer = None
+        self.total_time = None
+        self.checkpoint_offsets = []
+        self.checkpoint_times = []
+    def _get_limits(self):
+        toolhead = self.printer.lookup_object('toolhead')
+        status = toolhead.get_status(self.reactor.monotonic())
+        return {'max_velocity': status['max_velocity'],
+                'max_accel': status['max_accel'],
+                'square_corner_velocity': status['square_corner_velocity'],
+                'minimum_cruise_ratio': status['minimum_cruise_ratio']}
+    def start(self, filename):
+        import queuelogger
+        self.cancel()
+        limits = self._get_limits()
+        self.parent_conn, child_conn = multiprocessing.Pipe()
+        def wrapper():
+            queuelogger.clear_bg_logging()
+            try:
+                res = estimate_file(filename, limits)
+            except:
+                child_conn.send((True, traceback.format_exc()))
+                child_conn.close()
+                return
+            child_conn.send((False, res))
+            child_conn.close()
+        self.calc_proc = multiprocessing.Process(target=wrapper)
+        self.calc_proc.daemon = True
+        self.calc_proc.start()
+        self.poll_timer = self.reactor.register_timer(
+            self._poll_result, self.reactor.monotonic() + POLL_TIME)
+    def cancel(self):
+        self.total_time = None
+        self.checkpoint_offsets = []
+        self.checkpoint_times = []
+        if self.poll_timer is not None:
+            self.reactor.unregister_timer(self.poll_timer)
+            self.poll_timer = None
+        if self.calc_proc is not None:
+            if self.calc_proc.is_alive():
+                self.calc_proc.terminate()
+            self.calc_proc.join()
+            self.parent_conn.close()
+            self.calc_proc = self.parent_conn = None
+    def _poll_result(self, eventtime):
+        calc_proc = self.calc_proc
+        if not self.parent_conn.poll():
+            if calc_proc.is_alive():
+                return eventtime + POLL_TIME
+            logging.info("Print time estimation exited without a result")
+        else:
+            is_err, res = self.parent_conn.recv()
+            if is_err:
+                logging.info("Error in print time estimation: %s", res)
+            else:
+                self.total_time, checkpoints = res
+                self.checkpoint_offsets = [c[0] for c in checkpoints]
+                self.checkpoint_times = [c[1] for c in checkpoints]
+                logging.info("Estimated print time: %.1f seconds",
+                             self.total_time)
+        calc_proc.join()
+        self.parent_conn.close()
+        self.calc_proc = self.parent_conn = None
+        return self.reactor.NEVER
+    def get_total_time(self):
+        return self.total_time
+    def get_time_left(self, file_position):
+        if self.total_time is None:
+            return None
+        offsets, times = self.checkpoint_offsets, self.checkpoint_times
+        pos = bisect.bisect_right(offsets, file_position)
+        if pos <= 0:
+            return self.total_time
+        if pos >= len(offsets):
+            return 0.
+        prev_offset, next_offset = offsets[pos-1], offsets[pos]
+        prev_time, next_time = times[pos-1], times[pos]
+        factor = float(file_position - prev_offset) / (next_offset
+                                                       - prev_offset)
+        est_time = prev_time + (next_time - prev_time) * factor
+        return max(0., self.total_time - est_time)
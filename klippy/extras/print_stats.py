@@ -3,12 +3,173 @@
 # Copyright (C) 2020  Eric Callahan <arksine.code@gmail.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
+import chelper
+
+MOTION_STATS_INTERVAL = 1.
+STOP_VELOCITY = .001
+
+# Accumulate toolhead motion statistics per layer and per object
+class MotionStats:
+    def __init__(self, printer):
+        self.printer = printer
+        self.reactor = printer.get_reactor()
+        self.toolhead = self.trapq = None
+        self.cur_layer = self.cur_object = None
+        # Label changes in print_time order: (print_time, layer, object)
+        self.boundaries = []
+        self.trapq_label = (None, None)
+        self.last_move_time = -1.
+        self.last_move_end = 0.
+        self.last_counters = (0., 0., 0)
+        self.layers = {}
+        self.objects = {}
+        self.status = {'layers': {}, 'objects': {}}
+        printer.register_event_handler("klippy:connect", self._handle_connect)
+        printer.register_event_handler("exclude_object:current_object",
+                                       self.note_object)
+    def _handle_connect(self):
+        self.toolhead = self.printer.lookup_object('toolhead')
+        self.trapq = self.toolhead.get_trapq()
+        self.last_counters = self.toolhead.get_lookahead_stats()
+        self.reactor.register_timer(self._process_timer, self.reactor.NOW)
+    def _lookup(self, layer, obj):
+        # Stats: [accel_t, cruise_t, decel_t, idle_t, dist,
+        #         requested_dist, requested_t, flush_stops, stops]
+        res = []
+        if layer is not None:
+            st = self.layers.get(layer)
+            if st is None:
+                st = self.layers[layer] = [0.] * 9
+            res.append(st)
+        if obj is not None:
+            st = self.objects.get(obj)
+            if st is None:
+                st = self.objects[obj] = [0.] * 9
+            res.append(st)
+        return res
+    # Label tracking
+    def _update_requested(self):
+        # Requested motion is accounted for at the time moves are queued
+        dist, move_t, flushes = self.toolhead.get_lookahead_stats()
+        last_dist, last_move_t, last_flushes = self.last_counters
+        self.last_counters = (dist, move_t, flushes)
+        for st in self._lookup(self.cur_layer, self.cur_object):
+            st[5] += dist - last_dist
+            st[6] += move_t - last_move_t
+            st[7] += flushes - last_flushes
+    def _note_label_change(self, layer, obj):
+        if self.toolhead is None:
+            return
+        self._update_requested()
+        self.cur_layer = layer
+        self.cur_object = obj
+        # Actual motion is attributed by print_time from the trapq
+        self.toolhead.register_lookahead_callback(
+            (lambda pt: self.boundaries.append((pt, layer, obj))))
+    def note_layer(self, layer):
+        if layer != self.cur_layer:
+            self._note_label_change(layer, self.cur_object)
+    def note_object(self, obj):
+        if obj != self.cur_object:
+            self._note_label_change(self.cur_layer, obj)
+    def reset(self):
+        # Discard pending motion from any earlier print
+        del self.boundaries[:]
+        self.trapq_label = (None, None)
+        self._note_label_change(None, None)
+        self.layers.clear()
+        self.objects.clear()
+        self.status = {'layers': {}, 'objects': {}}
+    # Trapq processing
+    def _extract_moves(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        res = []
+        end_time = self.reactor.NEVER
+        while 1:
+            data = ffi_main.new('struct pull_move[128]')
+            count = ffi_lib.trapq_extract_old(self.trapq, data, len(data),
+                                              self.last_move_time, end_time)
+            if not count:
+                break
+            res.append((data, count))
+            if count < len(data):
+                break
+            end_time = data[count-1].print_time
+        res.reverse()
+        return res
+    def _process_trapq(self):
+        boundaries = self.boundaries
+        last_move_time = self.last_move_time
+        last_move_end = self.last_move_end
+        stats = self._lookup(*self.trapq_label)
+        for data, count in self._extract_moves():
+            for i in range(count-1, -1, -1):
+                m = data[i]
+                print_time = m.print_time
+                if print_time <= last_move_time:
+                    continue
+                last_move_time = print_time
+                while boundaries and boundaries[0][0] <= print_time:
+                    self.trapq_label = boundaries.pop(0)[1:]
+                    stats = self._lookup(*self.trapq_label)
+                move_t, start_v, accel = m.move_t, m.start_v, m.accel
+                idle_t = 0.
+                if last_move_end:
+                    idle_t = max(0., print_time - last_move_end)
+                last_move_end = print_time + move_t
+                if not stats:
+                    continue
+                dist = (start_v + .5 * accel * move_t) * move_t
+                if accel > 0.:
+                    slot = 0
+                elif accel < 0.:
+                    slot = 2
+                elif start_v:
+                    slot = 1
+                else:
+                    slot = 3
+                stop = slot == 2 and start_v + accel * move_t < STOP_VELOCITY
+                for st in stats:
+                    st[3] += idle_t
+                    st[slot] += move_t
+                    st[4] += dist
+                    if stop:
+                        st[8] += 1
+        self.last_move_time = last_move_time
+        self.last_move_end = last_move_end
+    def _build_status(self, st):
+        move_t = st[0] + st[1] + st[2]
+        avg_speed = req_speed = 0.
+        if move_t:
+            avg_speed = st[4] / move_t
+        if st[6]:
+            req_speed = st[5] / st[6]
+        return {'accel_time': round(st[0], 3), 'cruise_time': round(st[1], 3),
+                'decel_time': round(st[2], 3), 'idle_time': round(st[3], 3),
+                'distance': round(st[4], 3),
+                'average_speed': round(avg_speed, 3),
+                'requested_speed': round(req_speed, 3),
+                'stops': int(st[8]), 'flush_stops': int(st[7])}
+    def _process_timer(self, eventtime):
+        self._update_requested()
+        self._process_trapq()
+        self.status = {
+            'layers': {l: self._build_status(st)
+                       for l, st in self.layers.items()},
+            'objects': {o: self._build_status(st)
+                        for o, st in self.objects.items()}}
+        return eventtime + MOTION_STATS_INTERVAL
+    def get_status(self, eventtime):
+        return self.status
 
 class PrintStats:
     def __init__(self, config):
         printer = config.get_printer()
         self.gcode_move = printer.load_object(config, 'gcode_move')
         self.reactor = printer.get_reactor()
+        self.motion_stats = None
+        if config.getboolean('motion_stats', False):
+            self.motion_stats = MotionStats(printer)
         self.reset()
         # Register commands
         self.gcode = printer.lookup_object('gcode')
@@ -82,6 +243,8 @@ class PrintStats:
                 current_layer is not None and \
                 current_layer != self.info_current_layer:
             self.info_current_layer = min(current_layer, self.info_total_layer)
+        if self.motion_stats is not None:
+            self.motion_stats.note_layer(self.info_current_layer)
     def reset(self):
         self.filename = self.error_message = ""
         self.state = "standby"
@@ -91,6 +254,8 @@ class PrintStats:
         self.init_duration = 0.
         self.info_total_layer = None
         self.info_current_layer = None
+        if self.motion_stats is not None:
+            self.motion_stats.reset()
     def get_status(self, eventtime):
         time_paused = self.prev_pause_duration
         if self.print_start_time is not None:
@@ -105,7 +270,7 @@ class PrintStats:
                 # Track duration prior to extrusion
                 self.init_duration = self.total_duration - time_paused
         print_duration = self.total_duration - self.init_duration - time_paused
-        return {
+        res = {
             'filename': self.filename,
             'total_duration': self.total_duration,
             'print_duration': print_duration,
@@ -115,6 +280,9 @@ class PrintStats:
             'info': {'total_layer': self.info_total_layer,
                      'current_layer': self.info_current_layer}
         }
+        if self.motion_stats is not None:
+            res['motion'] = self.motion_stats.get_status(eventtime)
+        return res
 
 def load_config(config):
     return PrintStats(config)
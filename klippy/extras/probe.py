@@ -424,7 +424,7 @@ class ProbePointsHelper:
         def_move_z = self.default_horizontal_move_z
         self.horizontal_move_z = gcmd.get_float('HORIZONTAL_MOVE_Z',
                                                 def_move_z)
-        if probe is None or method != 'automatic':
+        if probe is None or method not in ('automatic', 'rapid_scan'):
             # Manual probe
             self.lift_speed = self.speed
             self.probe_offsets = (0., 0., 0.)
@@ -436,6 +436,9 @@ class ProbePointsHelper:
         if self.horizontal_move_z < self.probe_offsets[2]:
             raise gcmd.error("horizontal_move_z can't be less than"
                              " probe's z_offset")
+        if method == 'rapid_scan':
+            self._rapid_scan(gcmd, probe)
+            return
         probe.multi_probe_begin()
         while 1:
             done = self._move_next()
@@ -444,6 +447,39 @@ class ProbePointsHelper:
             pos = probe.run_probe(gcmd)
             self.results.append(pos)
         probe.multi_probe_end()
+    def _rapid_scan(self, gcmd, probe):
+        mcu_probe = probe.mcu_probe
+        if not hasattr(mcu_probe, 'rapid_scan_results'):
+            raise gcmd.error("Probe does not support METHOD=rapid_scan")
+        toolhead = self.printer.lookup_object('toolhead')
+        twist_comp = self.printer.lookup_object('axis_twist_compensation',
+                                                None)
+        probe.multi_probe_begin()
+        while 1:
+            # Travel over all points without stopping, noting the time
+            # the toolhead passes over each point
+            toolhead.manual_move([None, None, self.horizontal_move_z],
+                                 self.speed)
+            scan_points = []
+            for point in self.probe_points:
+                nextpos = list(point)
+                if self.use_offsets:
+                    nextpos[0] -= self.probe_offsets[0]
+                    nextpos[1] -= self.probe_offsets[1]
+                toolhead.manual_move(nextpos, self.speed)
+                pos = toolhead.get_position()
+                toolhead.register_lookahead_callback(
+                    (lambda pt, pos=pos: scan_points.append((pt, pos))))
+            toolhead.get_last_move_time()
+            # Correlate sensor readings with toolhead positions
+            self.results = mcu_probe.rapid_scan_results(scan_points)
+            if twist_comp is not None:
+                for pos in self.results:
+                    pos[2] += twist_comp.get_z_compensation_value(pos)
+            res = self.finalize_callback(self.probe_offsets, self.results)
+            if res != "retry":
+                break
+        probe.multi_probe_end()
     def _manual_probe_start(self):
         done = self._move_next()
         if not done:
@@ -192,6 +192,8 @@ class EddyEndstopWrapper:
         self._mcu = sensor_helper.get_mcu()
         self._calibration = calibration
         self._z_offset = config.getfloat('z_offset', minval=0.)
+        self._scan_sample_time = config.getfloat('scan_sample_time', 0.020,
+                                                 above=0.)
         self._dispatch = mcu.TriggerDispatch(self._mcu)
         self._samples = []
         self._is_sampling = self._start_from_home = self._need_stop = False
@@ -267,16 +269,7 @@ class EddyEndstopWrapper:
         # Wait for samples to arrive
         start_time = self._trigger_time + 0.050
         end_time = start_time + 0.100
-        reactor = self._printer.get_reactor()
-        while 1:
-            if self._samples and self._samples[-1]['data'][-1][0] >= end_time:
-                break
-            systime = reactor.monotonic()
-            est_print_time = self._mcu.estimated_print_time(systime)
-            if est_print_time > self._trigger_time + 1.0:
-                raise self._printer.command_error(
-                    "probe_eddy_current sensor outage")
-            reactor.pause(systime + 0.010)
+        self._wait_samples(end_time, self._trigger_time + 1.0)
         # Find position since trigger
         samples = self._samples
         self._samples = []
@@ -301,6 +294,54 @@ class EddyEndstopWrapper:
         new_pos = toolhead.get_position()
         new_pos[2] += self._z_offset - halt_z
         return new_pos
+    def _wait_samples(self, end_time, timeout_time):
+        reactor = self._printer.get_reactor()
+        while 1:
+            if self._samples and self._samples[-1]['data'][-1][0] >= end_time:
+                break
+            systime = reactor.monotonic()
+            est_print_time = self._mcu.estimated_print_time(systime)
+            if est_print_time > timeout_time:
+                raise self._printer.command_error(
+                    "probe_eddy_current sensor outage")
+            reactor.pause(systime + 0.010)
+    # Interface for ProbePointsHelper rapid scanning
+    def rapid_scan_results(self, scan_points):
+        # 'scan_points' is a time ordered list of (print_time, toolhead_pos)
+        # noting when the toolhead passed over each probe point
+        if not scan_points:
+            return []
+        half_time = .5 * self._scan_sample_time
+        end_time = scan_points[-1][0] + half_time
+        self._wait_samples(end_time, end_time + 1.0)
+        samples = self._samples
+        self._samples = []
+        data = [(time, z) for msg in samples for time, freq, z in msg['data']]
+        results = []
+        pos = 0
+        for print_time, toolhead_pos in scan_points:
+            start_time = print_time - half_time
+            end_time = print_time + half_time
+            while pos < len(data) and data[pos][0] < start_time:
+                pos += 1
+            samp_sum = 0.
+            samp_count = 0
+            for time, z in data[pos:]:
+                if time > end_time:
+                    break
+                samp_sum += z
+                samp_count += 1
+            if not samp_count:
+                raise self._printer.command_error(
+                    "Unable to obtain probe_eddy_current sensor readings")
+            sensor_z = samp_sum / samp_count
+            if abs(sensor_z) >= 99.9:
+                raise self._printer.command_error(
+                    "probe_eddy_current reading out of calibrated range"
+                    " during scan (is horizontal_move_z too high?)")
+            results.append([toolhead_pos[0], toolhead_pos[1],
+                            toolhead_pos[2] + self._z_offset - sensor_z])
+        return results
     def multi_probe_begin(self):
         if not self._calibration.is_calibrated():
             raise self._printer.command_error(
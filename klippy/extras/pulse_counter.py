@@ -4,14 +4,23 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 
+# Polling interval of hardware counters (limits 16-bit counter overflow)
+HW_COUNTER_POLL_TIME = 0.100
+
 class MCU_counter:
-    def __init__(self, printer, pin, sample_time, poll_time):
+    def __init__(self, printer, pin, sample_time, poll_time,
+                 hw_counter=False):
+        self._printer = printer
         ppins = printer.lookup_object('pins')
         pin_params = ppins.lookup_pin(pin, can_pullup=True)
         self._mcu = pin_params['chip']
         self._oid = self._mcu.create_oid()
         self._pin = pin_params['pin']
         self._pullup = pin_params['pullup']
+        self._hw_counter = hw_counter
+        if hw_counter:
+            # Edges are counted by the mcu so only the count is polled
+            poll_time = min(sample_time, HW_COUNTER_POLL_TIME)
         self._poll_time = poll_time
         self._poll_ticks = 0
         self._sample_time = sample_time
@@ -20,8 +29,19 @@ class MCU_counter:
         self._mcu.register_config_callback(self.build_config)
 
     def build_config(self):
-        self._mcu.add_config_cmd("config_counter oid=%d pin=%s pull_up=%d"
-            % (self._oid, self._pin, self._pullup))
+        if self._hw_counter:
+            cmd = "config_hw_counter oid=%c pin=%u pull_up=%c"
+            if self._mcu.try_lookup_command(cmd) is None:
+                raise self._printer.config_error(
+                    "MCU '%s' does not support hardware counters"
+                    % (self._mcu.get_name(),))
+            self._mcu.add_config_cmd(
+                "config_hw_counter oid=%d pin=%s pull_up=%d"
+                % (self._oid, self._pin, self._pullup))
+        else:
+            self._mcu.add_config_cmd(
+                "config_counter oid=%d pin=%s pull_up=%d"
+                % (self._oid, self._pin, self._pullup))
         clock = self._mcu.get_query_slot(self._oid)
         self._poll_ticks = self._mcu.seconds_to_clock(self._poll_time)
         sample_ticks = self._mcu.seconds_to_clock(self._sample_time)
@@ -52,11 +72,13 @@ class MCU_counter:
             self._callback(time, count, count_time)
 
 class FrequencyCounter:
-    def __init__(self, printer, pin, sample_time, poll_time):
+    def __init__(self, printer, pin, sample_time, poll_time,
+                 hw_counter=False):
         self._callback = None
         self._last_time = self._last_count = None
         self._freq = 0.
-        self._counter = MCU_counter(printer, pin, sample_time, poll_time)
+        self._counter = MCU_counter(printer, pin, sample_time, poll_time,
+                                    hw_counter)
         self._counter.setup_callback(self._counter_callback)
 
     def _counter_callback(self, time, count, count_time):
@@ -3,7 +3,7 @@
 # Copyright (C) 2017-2023  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import chelper
+import math, chelper
 
 MAX_SCHEDULE_TIME = 5.0
 
@@ -27,9 +27,10 @@ class MCU_queued_pwm:
         self._invert = pin_params['invert']
         self._start_value = self._shutdown_value = float(self._invert)
         self._last_clock = self._last_value = self._default_value = 0
-        self._duration_ticks = 0
+        self._duration_ticks = self._cycle_ticks = 0
         self._pwm_max = 0.
-        self._set_cmd_tag = None
+        self._set_cmd_tag = self._set_ramp_cmd_tag = None
+        self._want_ramp = False
         self._toolhead = None
         printer = self._mcu.get_printer()
         printer.register_event_handler("klippy:connect", self._handle_connect)
@@ -42,6 +43,8 @@ class MCU_queued_pwm:
     def setup_cycle_time(self, cycle_time, hardware_pwm=False):
         self._cycle_time = cycle_time
         self._hardware_pwm = hardware_pwm
+    def setup_ramp(self):
+        self._want_ramp = True
     def setup_start_value(self, start_value, shutdown_value):
         if self._invert:
             start_value = 1. - start_value
@@ -57,7 +60,8 @@ class MCU_queued_pwm:
         curtime = self._mcu.get_printer().get_reactor().monotonic()
         printtime = self._mcu.estimated_print_time(curtime)
         self._last_clock = self._mcu.print_time_to_clock(printtime + 0.200)
-        cycle_ticks = self._mcu.seconds_to_clock(self._cycle_time)
+        self._cycle_ticks = cycle_ticks = self._mcu.seconds_to_clock(
+            self._cycle_time)
         if cycle_ticks >= 1<<31:
             raise config_error("PWM pin cycle time too large")
         self._duration_ticks = self._mcu.seconds_to_clock(self._max_duration)
@@ -82,8 +86,17 @@ class MCU_queued_pwm:
             self._set_cmd_tag = self._mcu.lookup_command(
                 "queue_pwm_out oid=%c clock=%u value=%hu",
                 cq=cmd_queue).get_command_tag()
+            if self._want_ramp:
+                ramp_cmd = self._mcu.try_lookup_command(
+                    "queue_pwm_ramp oid=%c clock=%u interval=%u count=%hu"
+                    " value=%hu add=%hi", cq=cmd_queue)
+                if ramp_cmd is None:
+                    raise config_error("MCU does not support pwm ramps")
+                self._set_ramp_cmd_tag = ramp_cmd.get_command_tag()
             return
         # Software PWM
+        if self._want_ramp:
+            raise config_error("PWM ramps require hardware_pwm")
         if self._shutdown_value not in [0., 1.]:
             raise config_error("shutdown value must be 0.0 or 1.0 on soft pwm")
         self._mcu.add_config_cmd(
@@ -103,27 +116,66 @@ class MCU_queued_pwm:
         self._set_cmd_tag = self._mcu.lookup_command(
             "queue_digital_out oid=%c clock=%u on_ticks=%u",
             cq=cmd_queue).get_command_tag()
-    def _send_update(self, clock, val):
+    def _send_update(self, clock, val, ramp=None):
         self._last_clock = clock = max(self._last_clock, clock)
-        self._last_value = val
-        data = (self._set_cmd_tag, self._oid, clock & 0xffffffff, val)
+        if ramp is None:
+            self._last_value = val
+            data = (self._set_cmd_tag, self._oid, clock & 0xffffffff, val)
+        else:
+            interval, count, add = ramp
+            self._last_clock += interval * count
+            self._last_value = val + add * count
+            data = (self._set_ramp_cmd_tag, self._oid, clock & 0xffffffff,
+                    interval, count, val, add & 0xffffffff)
         ret = self._stepcompress_queue_mq_msg(self._stepqueue, clock,
                                               data, len(data))
         if ret:
             raise error("Internal error in stepcompress")
         # Notify toolhead so that it will flush this update
-        wakeclock = clock
+        wakeclock = self._last_clock
         if self._last_value != self._default_value:
             # Continue flushing to resend time
             wakeclock += self._duration_ticks
         wake_print_time = self._mcu.clock_to_print_time(wakeclock)
         self._toolhead.note_mcu_movequeue_activity(wake_print_time)
-    def set_pwm(self, print_time, value):
-        clock = self._mcu.print_time_to_clock(print_time)
+    def _calc_value(self, value):
         if self._invert:
             value = 1. - value
-        v = int(max(0., min(1., value)) * self._pwm_max + 0.5)
-        self._send_update(clock, v)
+        return int(max(0., min(1., value)) * self._pwm_max + 0.5)
+    def set_pwm(self, print_time, value):
+        clock = self._mcu.print_time_to_clock(print_time)
+        self._send_update(clock, self._calc_value(value))
+    def set_pwm_ramp(self, print_time, ramp_time, start_value, end_value):
+        # Linearly change the output from start_value to end_value using
+        # a single mcu command (requires a prior call to setup_ramp())
+        clock = max(self._last_clock, self._mcu.print_time_to_clock(
+            print_time))
+        end_clock = self._mcu.print_time_to_clock(print_time + ramp_time)
+        start_v = self._calc_value(start_value)
+        end_v = self._calc_value(end_value)
+        diff = end_v - start_v
+        # Don't update faster than the pwm cycle time
+        ticks = end_clock - clock
+        slots = min(abs(diff), ticks // self._cycle_ticks)
+        if slots <= 0:
+            self._send_update(clock, end_v)
+            return
+        step = -(-abs(diff) // slots)
+        if step > 0x7fff:
+            # Ramp too short for the requested change
+            self._send_update(clock, end_v)
+            return
+        count = abs(diff) // step
+        add = step if diff > 0 else -step
+        if count * step != abs(diff):
+            # Reserve a final update to reach the exact end value
+            slots = count + 1
+        else:
+            slots = count
+        interval = ticks // slots
+        self._send_update(clock, start_v, (interval, count, add))
+        if self._last_value != end_v:
+            self._send_update(end_clock, end_v)
     def _flush_notification(self, print_time, clock):
         if self._last_value != self._default_value:
             while clock >= self._last_clock + self._duration_ticks:
@@ -154,19 +206,65 @@ class PrinterOutputPin:
         self.shutdown_value = config.getfloat(
             'shutdown_value', 0., minval=0., maxval=self.scale) / self.scale
         self.mcu_pin.setup_start_value(self.last_value, self.shutdown_value)
+        # Optional scaling of the output by the toolhead velocity
+        self.last_output = self.last_value
+        self.last_ratio = 0.
+        self.velocity_scaling = config.getboolean('velocity_scaling', False)
+        if self.velocity_scaling:
+            self.mcu_pin.setup_ramp()
+            self.printer.register_event_handler("klippy:connect",
+                                                self._handle_connect)
         # Register commands
         pin_name = config.get_name().split()[1]
         gcode = self.printer.lookup_object('gcode')
         gcode.register_mux_command("SET_PIN", "PIN", pin_name,
                                    self.cmd_SET_PIN,
                                    desc=self.cmd_SET_PIN_help)
+    def _handle_connect(self):
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.register_move_listener(self._note_move)
     def get_status(self, eventtime):
         return {'value': self.last_value}
+    def _set_output(self, print_time, value):
+        if value == self.last_output:
+            return
+        self.mcu_pin.set_pwm(print_time, value)
+        self.last_output = value
+    def _set_ramp(self, print_time, ramp_time, start_value, end_value):
+        if start_value == end_value:
+            self._set_output(print_time, start_value)
+            return
+        self.mcu_pin.set_pwm_ramp(print_time, ramp_time,
+                                  start_value, end_value)
+        self.last_output = end_value
+    def _note_move(self, print_time, move):
+        # Scale the output by the toolhead velocity relative to the
+        # requested velocity of the move
+        value = self.last_value
+        inv_speed = 1. / math.sqrt(move.max_cruise_v2)
+        end_ratio = move.end_v * inv_speed
+        self.last_ratio = end_ratio
+        if not value and self.last_output == 0.:
+            return
+        cruise_value = value * min(1., move.cruise_v * inv_speed)
+        cruise_time = print_time + move.accel_t
+        if move.accel_t:
+            self._set_ramp(print_time, move.accel_t,
+                           value * move.start_v * inv_speed, cruise_value)
+        self._set_output(cruise_time, cruise_value)
+        decel_time = cruise_time + move.cruise_t
+        if move.decel_t:
+            self._set_ramp(decel_time, move.decel_t,
+                           cruise_value, value * end_ratio)
+        self.last_print_time = decel_time + move.decel_t
     def _set_pin(self, print_time, value):
         if value == self.last_value:
             return
         print_time = max(print_time, self.last_print_time)
-        self.mcu_pin.set_pwm(print_time, value)
+        if self.velocity_scaling:
+            self._set_output(print_time, value * self.last_ratio)
+        else:
+            self.mcu_pin.set_pwm(print_time, value)
         self.last_value = value
         self.last_print_time = print_time
     cmd_SET_PIN_help = "Set the value of an output pin"
@@ -4,13 +4,22 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, logging, ast, configparser
+import os, logging, ast, configparser, io, threading
+import queuelogger
 
 class SaveVariables:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.filename = os.path.expanduser(config.get('filename'))
         self.allVariables = {}
+        # Background file writing
+        self.lock = threading.Lock()
+        self.have_pending = threading.Condition(self.lock)
+        self.pending_data = None
+        self.write_stop = False
+        self.write_thread = None
+        self.printer.register_event_handler("klippy:disconnect",
+                                            self._handle_disconnect)
         try:
             if not os.path.exists(self.filename):
                 open(self.filename, "w").close()
@@ -42,21 +51,64 @@ class SaveVariables:
         except ValueError as e:
             raise gcmd.error("Unable to parse '%s' as a literal" % (value,))
         newvars = dict(self.allVariables)
-        newvars[varname] = value
-        # Write file
+        newvars[varname.lower()] = value
+        # Generate file contents
         varfile = configparser.ConfigParser()
         varfile.add_section('Variables')
         for name, val in sorted(newvars.items()):
             varfile.set('Variables', name, repr(val))
-        try:
-            f = open(self.filename, "w")
-            varfile.write(f)
-            f.close()
-        except:
-            msg = "Unable to save variable"
-            logging.exception(msg)
-            raise gcmd.error(msg)
-        self.loadVariables()
+        data = io.StringIO()
+        varfile.write(data)
+        self.allVariables = {name: ast.literal_eval(val)
+                             for name, val in varfile.items('Variables')}
+        # Queue file write (only the most recent contents are written)
+        with self.lock:
+            self.pending_data = data.getvalue()
+            self.have_pending.notify()
+        if self.write_thread is None:
+            self.write_thread = threading.Thread(target=self._write_thread)
+            self.write_thread.daemon = True
+            queuelogger.inherit_thread_logging(self.write_thread)
+            self.write_thread.start()
+    # Background file writing
+    def _write_file(self, data):
+        # Write to a temporary file and rename it so that the variable
+        # file is never left partially written
+        tmpname = self.filename + ".tmp"
+        f = open(tmpname, "w")
+        f.write(data)
+        f.flush()
+        os.fsync(f.fileno())
+        f.close()
+        os.rename(tmpname, self.filename)
+    def _write_thread(self):
+        while 1:
+            with self.lock:
+                while self.pending_data is None and not self.write_stop:
+                    self.have_pending.wait()
+                data = self.pending_data
+                self.pending_data = None
+            if data is None:
+                break
+            try:
+                self._write_file(data)
+            except:
+                logging.exception("Unable to save variable file")
+                reactor = self.printer.get_reactor()
+                reactor.register_async_callback(self._note_write_error)
+    def _note_write_error(self, eventtime):
+        gcode = self.printer.lookup_object('gcode')
+        gcode.respond_raw("!! Unable to save variable file %s"
+                          % (self.filename,))
+    def _handle_disconnect(self):
+        # Wait for any pending write to complete
+        if self.write_thread is None:
+            return
+        with self.lock:
+            self.write_stop = True
+            self.have_pending.notify()
+        self.write_thread.join()
+        self.write_thread = None
     def get_status(self, eventtime):
         return {'variables': self.allVariables}
 
@@ -57,6 +57,91 @@ CalibrationResult = collections.namedtuple(
         'CalibrationResult',
         ('name', 'freq', 'vals', 'vibrs', 'smoothing', 'score', 'max_accel'))
 
+# Welch PSD calculation of streamed accelerometer samples. The reactor
+# thread only stores the samples in compact arrays; the FFT work is done
+# by get_calibration_data() in the process_accelerometer_data() background
+# process.
+class PSDAccumulator:
+    def __init__(self, shaper_calibrate):
+        self.shaper_calibrate = shaper_calibrate
+        self.numpy = shaper_calibrate.numpy
+        self.blocks = []
+        self.sample_count = 0
+        self.first_time = self.last_time = 0.
+    def add_samples(self, samples):
+        if not samples:
+            return
+        if not self.sample_count:
+            self.first_time = samples[0][0]
+        self.last_time = samples[-1][0]
+        self.sample_count += len(samples)
+        self.blocks.append(self.numpy.array([s[1:] for s in samples]))
+    def _process_blocks(self, nfft, window):
+        # Accumulate the windowed power of each axis one block at a time
+        # so that all the samples never need to be held in one array
+        np = self.numpy
+        overlap = nfft // 2
+        step = nfft - overlap
+        leftover = None
+        psd_sum = None
+        window_count = 0
+        pending = []
+        pending_count = 0
+        blocks = self.blocks
+        self.blocks = []
+        for i, block in enumerate(blocks):
+            blocks[i] = None
+            pending.append(block)
+            pending_count += block.shape[0]
+            if pending_count < nfft and i + 1 < len(blocks):
+                continue
+            if leftover is not None:
+                pending.insert(0, leftover)
+            data = np.concatenate(pending)
+            pending = []
+            pending_count = 0
+            n_windows = (data.shape[0] - overlap) // step
+            if n_windows <= 0:
+                leftover = data
+                continue
+            psd = []
+            for axis in range(3):
+                x = self.shaper_calibrate._split_into_windows(
+                        data[:, axis], nfft, overlap)[:, :n_windows]
+                x = window[:, None] * (x - np.mean(x, axis=0))
+                result = np.fft.rfft(x, n=nfft, axis=0)
+                psd.append((np.conjugate(result) * result).real.sum(axis=-1))
+            if psd_sum is None:
+                psd_sum = psd
+            else:
+                for total, p in zip(psd_sum, psd):
+                    total += p
+            window_count += n_windows
+            leftover = data[n_windows * step:].copy()
+        return psd_sum, window_count
+    def get_calibration_data(self):
+        T = self.last_time - self.first_time
+        if T <= 0.:
+            return None
+        np = self.numpy
+        # Same window size selection as ShaperCalibrate.calc_freq_response()
+        sampling_freq = self.sample_count / T
+        nfft = 1 << int(sampling_freq * WINDOW_T_SEC - 1).bit_length()
+        window = np.kaiser(nfft, 6.)
+        psd_sum, window_count = self._process_blocks(nfft, window)
+        if not window_count:
+            return None
+        scale = 1.0 / (window**2).sum()
+        psds = []
+        for psd in psd_sum:
+            psd = psd * (scale / (sampling_freq * window_count))
+            # Double the one-sided response (except 'DC' and Nyquist terms)
+            psd[1:-1] *= 2.
+            psds.append(psd)
+        freqs = np.fft.rfftfreq(nfft, 1. / sampling_freq)
+        px, py, pz = psds
+        return CalibrationData(freqs, px+py+pz, px, py, pz)
+
 class ShaperCalibrate:
     def __init__(self, printer):
         self.printer = printer
@@ -149,6 +234,8 @@ class ShaperCalibrate:
         np = self.numpy
         if raw_values is None:
             return None
+        if isinstance(raw_values, PSDAccumulator):
+            return raw_values.get_calibration_data()
         if isinstance(raw_values, np.ndarray):
             data = raw_values
         else:
@@ -172,6 +259,10 @@ class ShaperCalibrate:
         fz, pz = self._psd(data[:,3], SAMPLING_FREQ, M)
         return CalibrationData(fx, px+py+pz, px, py, pz)
 
+    def stream_accelerometer_data(self, aclient):
+        psd_accumulator = PSDAccumulator(self)
+        aclient.set_stream_callback(psd_accumulator.add_samples)
+        return psd_accumulator
     def process_accelerometer_data(self, data):
         calibration_data = self.background_process_exec(
                 self.calc_freq_response, (data,))
@@ -181,29 +272,32 @@ class ShaperCalibrate:
         calibration_data.set_numpy(self.numpy)
         return calibration_data
 
-    def _estimate_shaper(self, shaper, test_damping_ratio, test_freqs):
+    def _estimate_shaper(self, shaper, test_damping_ratios, test_freqs):
         np = self.numpy
 
         A, T = np.array(shaper[0]), np.array(shaper[1])
         inv_D = 1. / A.sum()
 
-        omega = 2. * math.pi * test_freqs
-        damping = test_damping_ratio * omega
-        omega_d = omega * math.sqrt(1. - test_damping_ratio**2)
-        W = A * np.exp(np.outer(-damping, (T[-1] - T)))
-        S = W * np.sin(np.outer(omega_d, T))
-        C = W * np.cos(np.outer(omega_d, T))
-        return np.sqrt(S.sum(axis=1)**2 + C.sum(axis=1)**2) * inv_D
-
-    def _estimate_remaining_vibrations(self, shaper, test_damping_ratio,
+        # All damping ratios are evaluated at once, the arrays below are
+        # indexed as [damping ratio, test frequency, shaper impulse]
+        dr = np.array(test_damping_ratios).reshape(-1, 1, 1)
+        omega = (2. * math.pi * test_freqs).reshape(1, -1, 1)
+        damping = dr * omega
+        omega_d = omega * np.sqrt(1. - dr**2)
+        W = A * np.exp(-damping * (T[-1] - T))
+        S = W * np.sin(omega_d * T)
+        C = W * np.cos(omega_d * T)
+        return np.sqrt(S.sum(axis=-1)**2 + C.sum(axis=-1)**2) * inv_D
+
+    def _estimate_remaining_vibrations(self, shaper, test_damping_ratios,
                                        freq_bins, psd):
-        vals = self._estimate_shaper(shaper, test_damping_ratio, freq_bins)
+        vals = self._estimate_shaper(shaper, test_damping_ratios, freq_bins)
         # The input shaper can only reduce the amplitude of vibrations by
         # SHAPER_VIBRATION_REDUCTION times, so all vibrations below that
         # threshold can be igonred
         vibr_threshold = psd.max() / shaper_defs.SHAPER_VIBRATION_REDUCTION
         remaining_vibrations = self.numpy.maximum(
-                vals * psd - vibr_threshold, 0).sum()
+                vals * psd - vibr_threshold, 0).sum(axis=-1)
         all_vibrations = self.numpy.maximum(psd - vibr_threshold, 0).sum()
         return (remaining_vibrations / all_vibrations, vals)
 
@@ -255,20 +349,16 @@ class ShaperCalibrate:
         best_res = None
         results = []
         for test_freq in test_freqs[::-1]:
-            shaper_vibrations = 0.
-            shaper_vals = np.zeros(shape=freq_bins.shape)
             shaper = shaper_cfg.init_func(test_freq, damping_ratio)
             shaper_smoothing = self._get_shaper_smoothing(shaper, scv=scv)
             if max_smoothing and shaper_smoothing > max_smoothing and best_res:
                 return best_res
             # Exact damping ratio of the printer is unknown, pessimizing
             # remaining vibrations over possible damping values
-            for dr in test_damping_ratios:
-                vibrations, vals = self._estimate_remaining_vibrations(
-                        shaper, dr, freq_bins, psd)
-                shaper_vals = np.maximum(shaper_vals, vals)
-                if vibrations > shaper_vibrations:
-                    shaper_vibrations = vibrations
+            vibrations, vals = self._estimate_remaining_vibrations(
+                    shaper, test_damping_ratios, freq_bins, psd)
+            shaper_vals = vals.max(axis=0)
+            shaper_vibrations = vibrations.max()
             max_accel = self.find_shaper_max_accel(shaper, scv)
             # The score trying to minimize vibrations, but also accounting
             # the growth of smoothing. The formula itself does not have any
@@ -291,31 +381,8 @@ class ShaperCalibrate:
                 selected = res
         return selected
 
-    def _bisect(self, func):
-        left = right = 1.
-        if not func(1e-9):
-            return 0.
-        while not func(left):
-            right = left
-            left *= .5
-        if right == left:
-            while func(right):
-                right *= 2.
-        while right - left > 1e-8:
-            middle = (left + right) * .5
-            if func(middle):
-                left = middle
-            else:
-                right = middle
-        return left
-
     def find_shaper_max_accel(self, shaper, scv):
-        # Just some empirically chosen value which produces good projections
-        # for max_accel without much smoothing
-        TARGET_SMOOTHING = 0.12
-        max_accel = self._bisect(lambda test_accel: self._get_shaper_smoothing(
-            shaper, test_accel, scv) <= TARGET_SMOOTHING)
-        return max_accel
+        return shaper_defs.get_shaper_max_accel(shaper, scv)
 
     def find_best_shaper(self, calibration_data, shapers=None,
                          damping_ratio=None, scv=None, shaper_freqs=None,
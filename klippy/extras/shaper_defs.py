@@ -100,3 +100,34 @@ INPUT_SHAPERS = [
     InputShaperCfg('2hump_ei', get_2hump_ei_shaper, min_freq=39.),
     InputShaperCfg('3hump_ei', get_3hump_ei_shaper, min_freq=48.),
 ]
+
+# Find the max_accel that keeps the shaper smoothing within a target
+def get_shaper_max_accel(shaper, scv):
+    # Just some empirically chosen value which produces good projections
+    # for max_accel without much smoothing
+    TARGET_SMOOTHING = 0.12
+    # The smoothing offsets calculated in shaper_calibrate.py are
+    # linear functions of the acceleration, so the max_accel that
+    # hits TARGET_SMOOTHING can be calculated directly
+    A, T = shaper
+    inv_D = 1. / sum(A)
+    n = len(T)
+    ts = sum([A[i] * T[i] for i in range(n)]) * inv_D
+    # offset_90 = base_90 + half_accel * coeff_90
+    # offset_180 = half_accel * coeff_180
+    base_90 = coeff_90 = coeff_180 = 0.
+    for i in range(n):
+        if T[i] >= ts:
+            base_90 += A[i] * scv * (T[i]-ts)
+            coeff_90 += A[i] * (T[i]-ts)**2
+        coeff_180 += A[i] * (T[i]-ts)**2
+    base_90 *= inv_D * math.sqrt(2.)
+    coeff_90 *= inv_D * math.sqrt(2.)
+    coeff_180 *= inv_D
+    if base_90 > TARGET_SMOOTHING:
+        return 0.
+    half_accel = TARGET_SMOOTHING / coeff_180
+    if coeff_90 > 0.:
+        half_accel = min(half_accel,
+                         (TARGET_SMOOTHING - base_90) / coeff_90)
+    return 2. * half_accel
@@ -24,6 +24,7 @@ class PrinterSkew:
         self.xy_factor = 0.
         self.xz_factor = 0.
         self.yz_factor = 0.
+        self.skew_active = False
         self.skew_profiles = {}
         self._load_storage(config)
         self.printer.register_event_handler("klippy:connect",
@@ -67,12 +68,20 @@ class PrinterSkew:
     def get_position(self):
         return self.calc_unskew(self.next_transform.get_position())
     def move(self, newpos, speed):
+        if not self.skew_active:
+            # No skew set - pass moves through unaltered
+            self.next_transform.move(newpos, speed)
+            return
         corrected_pos = self.calc_skew(newpos)
         self.next_transform.move(corrected_pos, speed)
+    def _note_skew_change(self):
+        self.skew_active = bool(self.xy_factor or self.xz_factor
+                                or self.yz_factor)
     def _update_skew(self, xy_factor, xz_factor, yz_factor):
         self.xy_factor = xy_factor
         self.xz_factor = xz_factor
         self.yz_factor = yz_factor
+        self._note_skew_change()
         gcode_move = self.printer.lookup_object('gcode_move')
         gcode_move.reset_last_position()
     cmd_GET_CURRENT_SKEW_help = "Report current printer skew"
@@ -113,6 +122,7 @@ class PrinterSkew:
                         "plane [%s]\n%s" % (plane, gcmd.get_commandline()))
                 factor = plane.lower() + '_factor'
                 setattr(self, factor, calc_skew_factor(*lengths))
+        self._note_skew_change()
     cmd_SKEW_PROFILE_help = "Profile management for skew_correction"
     def cmd_SKEW_PROFILE(self, gcmd):
         if gcmd.get('LOAD', None) is not None:
@@ -4,6 +4,9 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import os, time, logging
+import chelper
+
+MAX_MEMPOOLS = 16
 
 class PrinterSysStats:
     def __init__(self, config):
@@ -11,6 +14,8 @@ class PrinterSysStats:
         self.last_process_time = self.total_process_time = 0.
         self.last_load_avg = 0.
         self.last_mem_avail = 0
+        self.memory = {}
+        self.thread_times = {}
         self.mem_file = None
         try:
             self.mem_file = open("/proc/meminfo", "r")
@@ -21,6 +26,56 @@ class PrinterSysStats:
         if self.mem_file is not None:
             self.mem_file.close()
             self.mem_file = None
+    def _get_thread_times(self):
+        # Sum the cpu time of each host thread (grouped by thread name)
+        try:
+            tids = os.listdir("/proc/self/task")
+        except OSError:
+            return {}
+        pid = os.getpid()
+        ticks = float(os.sysconf('SC_CLK_TCK'))
+        threads = []
+        main_name = None
+        for tid in tids:
+            try:
+                with open("/proc/self/task/%s/stat" % (tid,), "r") as f:
+                    data = f.read()
+            except (IOError, OSError):
+                # Thread exited
+                continue
+            name = data[data.find('(')+1:data.rfind(')')]
+            fields = data[data.rfind(')')+2:].split()
+            cputime = (int(fields[11]) + int(fields[12])) / ticks
+            if int(tid) == pid:
+                main_name = name
+                name = "main"
+            threads.append((name, cputime))
+        times = {}
+        for name, cputime in threads:
+            if name == main_name:
+                # Unnamed (eg, python) threads inherit the process name
+                name = "python"
+            name = name.replace(' ', '_')
+            times[name] = times.get(name, 0.) + cputime
+        return times
+    def _get_memory(self):
+        # Report process memory usage (in bytes) and C object pool usage
+        memory = {}
+        try:
+            with open("/proc/self/statm", "r") as f:
+                data = f.read().split()
+            memory['rss'] = int(data[1]) * os.sysconf('SC_PAGE_SIZE')
+        except (IOError, OSError, IndexError, ValueError):
+            pass
+        ffi_main, ffi_lib = chelper.get_ffi()
+        pools = ffi_main.new('struct pull_mempool[]', MAX_MEMPOOLS)
+        count = ffi_lib.mempool_get_stats(pools, MAX_MEMPOOLS)
+        for i in range(count):
+            p = pools[i]
+            name = ffi_main.string(p.name).decode()
+            memory[name] = p.size * (p.live + p.free)
+            memory[name + "_peak"] = p.size * p.peak
+        return memory
     def stats(self, eventtime):
         # Get core usage stats
         ptime = time.process_time()
@@ -31,6 +86,10 @@ class PrinterSysStats:
         self.last_load_avg = os.getloadavg()[0]
         msg = "sysload=%.2f cputime=%.3f" % (self.last_load_avg,
                                              self.total_process_time)
+        # Get per-thread cpu usage
+        self.thread_times = self._get_thread_times()
+        for name, cputime in sorted(self.thread_times.items()):
+            msg += " cputime_%s=%.3f" % (name, cputime)
         # Get available system memory
         if self.mem_file is not None:
             try:
@@ -43,11 +102,17 @@ class PrinterSysStats:
                         break
             except:
                 pass
+        # Get process memory breakdown
+        self.memory = self._get_memory()
+        if 'rss' in self.memory:
+            msg = "%s memrss=%d" % (msg, self.memory['rss'] // 1024)
         return (False, msg)
     def get_status(self, eventtime):
         return {'sysload': self.last_load_avg,
                 'cputime': self.total_process_time,
-                'memavail': self.last_mem_avail}
+                'memavail': self.last_mem_avail,
+                'thread_cputime': self.thread_times,
+                'memory': self.memory}
 
 class PrinterStats:
     def __init__(self, config):
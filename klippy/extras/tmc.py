@@ -262,9 +262,7 @@ class TMCCommandHelper:
                                    desc=self.cmd_SET_TMC_CURRENT_help)
     def _init_registers(self, print_time=None):
         # Send registers
-        for reg_name in list(self.fields.registers.keys()):
-            val = self.fields.registers[reg_name] # Val may change during loop
-            self.mcu_tmc.set_register(reg_name, val, print_time)
+        self.mcu_tmc.set_registers(self.fields.registers, print_time)
     cmd_INIT_TMC_help = "Initialize TMC stepper driver registers"
     def cmd_INIT_TMC(self, gcmd):
         logging.info("INIT_TMC %s", self.name)
@@ -461,6 +459,28 @@ class TMCCommandHelper:
 # TMC virtual pins
 ######################################################################
 
+# Endstop wrapper that filters unreliable stallguard triggers
+class TMCVirtualEndstop:
+    def __init__(self, mcu_endstop, blanking_time, sample_count):
+        self.mcu_endstop = mcu_endstop
+        self.blanking_time = blanking_time
+        self.sample_count = sample_count
+        # Wrappers
+        self.get_mcu = mcu_endstop.get_mcu
+        self.add_stepper = mcu_endstop.add_stepper
+        self.get_steppers = mcu_endstop.get_steppers
+        self.home_wait = mcu_endstop.home_wait
+        self.query_endstop = mcu_endstop.query_endstop
+    def home_start(self, print_time, sample_time, sample_count, rest_time,
+                   triggered=True):
+        # Ignore the diag pin while the stepper accelerates (the driver
+        # stall detection is not reliable at low speeds)
+        if self.sample_count:
+            sample_count = self.sample_count
+        return self.mcu_endstop.home_start(
+            print_time + self.blanking_time, sample_time, sample_count,
+            rest_time, triggered)
+
 # Helper class for "sensorless homing"
 class TMCVirtualPinHelper:
     def __init__(self, config, mcu_tmc):
@@ -477,6 +497,10 @@ class TMCVirtualPinHelper:
         else:
             self.diag_pin = config.get('diag_pin', None)
             self.diag_pin_field = None
+        self.diag_blanking_time = config.getfloat('diag_blanking_time', 0.,
+                                                  minval=0., maxval=1.)
+        self.diag_sample_count = config.getint('diag_sample_count', 0,
+                                               minval=0, maxval=255)
         self.mcu_endstop = None
         self.en_pwm = False
         self.pwmthrs = self.coolthrs = self.thigh = 0
@@ -499,6 +523,10 @@ class TMCVirtualPinHelper:
         self.printer.register_event_handler("homing:homing_move_end",
                                             self.handle_homing_move_end)
         self.mcu_endstop = ppins.setup_pin('endstop', self.diag_pin)
+        if self.diag_blanking_time or self.diag_sample_count:
+            self.mcu_endstop = TMCVirtualEndstop(
+                self.mcu_endstop, self.diag_blanking_time,
+                self.diag_sample_count)
         return self.mcu_endstop
     def handle_homing_move_begin(self, hmove):
         if self.mcu_endstop not in hmove.get_mcu_endstops():
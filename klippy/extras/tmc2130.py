@@ -272,6 +272,9 @@ class MCU_TMC_SPI:
                     return
         raise self.printer.command_error(
             "Unable to write tmc spi '%s' register %s" % (self.name, reg_name))
+    def set_registers(self, registers, print_time=None):
+        for reg_name in list(registers.keys()):
+            self.set_register(reg_name, registers[reg_name], print_time)
     def get_tmc_frequency(self):
         return self.tmc_frequency
 
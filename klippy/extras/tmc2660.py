@@ -221,6 +221,9 @@ class MCU_TMC2660_SPI:
         msg = [((val >> 16) | reg) & 0xff, (val >> 8) & 0xff, val & 0xff]
         with self.mutex:
             self.spi.spi_send(msg, minclock)
+    def set_registers(self, registers, print_time=None):
+        for reg_name in list(registers.keys()):
+            self.set_register(reg_name, registers[reg_name], print_time)
     def get_tmc_frequency(self):
         return None
 
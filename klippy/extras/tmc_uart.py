@@ -251,5 +251,24 @@ class MCU_TMC_uart:
                     return
         raise self.printer.command_error(
             "Unable to write tmc uart '%s' register %s" % (self.name, reg_name))
+    def set_registers(self, registers, print_time=None):
+        # Write several registers and verify them with one IFCNT query
+        if self.printer.get_start_args().get('debugoutput') is not None:
+            return
+        reg_names = list(registers.keys())
+        with self.mutex:
+            ifcnt = self.ifcnt
+            if ifcnt is None:
+                self.ifcnt = ifcnt = self._do_get_register("IFCNT")
+            for reg_name in reg_names:
+                reg = self.name_to_reg[reg_name]
+                self.mcu_uart.reg_write(self.instance_id, self.addr, reg,
+                                        registers[reg_name], print_time)
+            self.ifcnt = self._do_get_register("IFCNT")
+            if self.ifcnt == (ifcnt + len(reg_names)) & 0xff:
+                return
+        # A write was lost - resend each register with individual checks
+        for reg_name in reg_names:
+            self.set_register(reg_name, registers[reg_name], print_time)
     def get_tmc_frequency(self):
         return self.tmc_frequency
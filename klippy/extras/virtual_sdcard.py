@@ -3,9 +3,15 @@
 # Copyright (C) 2018-2024  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, sys, logging, io
+import os, sys, logging, io, gzip, struct, threading, queue
+import queuelogger
+from . import print_estimate
 
 VALID_GCODE_EXTS = ['gcode', 'g', 'gco']
+COMPRESSED_GCODE_EXTS = ['gz', 'zst']
+READ_CHUNK_SIZE = 8192
+READ_AHEAD_CHUNKS = 32
+READER_STOP_TIMEOUT = 0.500
 
 DEFAULT_ERROR_GCODE = """
 {% if 'heaters' in printer %}
@@ -13,6 +19,135 @@ DEFAULT_ERROR_GCODE = """
 {% endif %}
 """
 
+# Check if a str only contains ascii characters
+def str_is_ascii(s):
+    if hasattr(s, 'isascii'):
+        return s.isascii()
+    return len(s.encode()) == len(s)
+
+# Check if a filename has a (possibly compressed) gcode extension
+def is_gcode_filename(fname):
+    parts = fname.rsplit('.', 2)
+    if len(parts) > 2 and parts[2] in COMPRESSED_GCODE_EXTS:
+        parts.pop()
+    return len(parts) > 1 and parts[-1] in VALID_GCODE_EXTS
+
+# Open a gcode file for binary reading, decompressing it if needed.
+# Returns the file object and the size of the uncompressed contents.
+def open_gcode_file(fname):
+    ext = fname[fname.rfind('.')+1:]
+    if ext == 'gz':
+        # The gzip trailer stores the uncompressed size (modulo 2^32).
+        # Gcode always compresses, so add multiples of 4GiB until the
+        # size is at least the compressed size (an estimate for very
+        # large files).
+        with open(fname, 'rb') as f:
+            f.seek(-4, os.SEEK_END)
+            csize = f.tell() + 4
+            fsize = struct.unpack('<I', f.read(4))[0]
+        while fsize < csize:
+            fsize += 1 << 32
+        gzfile = gzip.GzipFile(fname, 'rb')
+        if sys.version_info.major < 3:
+            # Python2 GzipFile does not implement read1()
+            gzfile = io.BufferedReader(gzfile)
+        return gzfile, fsize
+    if ext == 'zst':
+        try:
+            import zstandard
+        except ImportError:
+            raise IOError("Reading zstd files requires the python"
+                          " 'zstandard' package")
+        f = open(fname, 'rb')
+        fsize = zstandard.frame_content_size(f.read(18))
+        f.seek(0)
+        reader = zstandard.ZstdDecompressor().stream_reader(f)
+        return io.BufferedReader(reader), max(0, fsize)
+    f = io.open(fname, 'rb')
+    f.seek(0, os.SEEK_END)
+    fsize = f.tell()
+    f.seek(0)
+    return f, fsize
+
+# Read a gcode file from a background thread into a read-ahead buffer
+class GCodeFileReader:
+    def __init__(self, reactor, fname):
+        self.reactor = reactor
+        self.name = fname
+        self.file = self.file_size = None
+        self._open()
+        self.chunks = self.stop_event = self.thread = None
+    def _open(self):
+        bfile, self.file_size = open_gcode_file(self.name)
+        self.file = io.TextIOWrapper(bfile, newline='')
+    def _read_thread(self, file, chunks, stop_event):
+        while not stop_event.is_set():
+            try:
+                data = file.read(READ_CHUNK_SIZE)
+            except Exception as e:
+                data = e
+            while not stop_event.is_set():
+                try:
+                    chunks.put(data, timeout=0.100)
+                    break
+                except queue.Full:
+                    pass
+            if not data or isinstance(data, Exception):
+                break
+    def _stop_thread(self):
+        if self.thread is None:
+            return
+        self.stop_event.set()
+        self.thread.join(READER_STOP_TIMEOUT)
+        if self.thread.is_alive():
+            # Reader is blocked - abandon it along with its file object
+            logging.warning("Abandoning blocked reader of file %s",
+                            self.name)
+            self._open()
+        self.chunks = self.stop_event = self.thread = None
+    def _seek(self, pos):
+        if self.file.seekable():
+            self.file.seek(pos)
+            return
+        # Streams that can't seek can only be restarted from the beginning
+        if pos:
+            raise IOError("Unable to seek in file %s" % (self.name,))
+        self.file.close()
+        self._open()
+    def seek(self, pos):
+        self._stop_thread()
+        self._seek(pos)
+        self.chunks = queue.Queue(READ_AHEAD_CHUNKS)
+        self.stop_event = threading.Event()
+        self.thread = threading.Thread(target=self._read_thread,
+                                       args=(self.file, self.chunks,
+                                             self.stop_event))
+        self.thread.daemon = True
+        queuelogger.inherit_thread_logging(self.thread)
+        self.thread.start()
+    def read(self):
+        # Wait (without blocking the reactor) for the next chunk
+        while 1:
+            chunks = self.chunks
+            if chunks is None:
+                raise IOError("File reader not active")
+            try:
+                data = chunks.get_nowait()
+                break
+            except queue.Empty:
+                self.reactor.pause(self.reactor.monotonic() + 0.005)
+        if isinstance(data, Exception):
+            raise data
+        return data
+    def read_at(self, pos, count):
+        # Synchronous read (used for debugging output)
+        self._stop_thread()
+        self._seek(pos)
+        return self.file.read(count)
+    def close(self):
+        self._stop_thread()
+        self.file.close()
+
 class VirtualSD:
     def __init__(self, config):
         self.printer = config.get_printer()
@@ -25,6 +160,10 @@ class VirtualSD:
         self.file_position = self.file_size = 0
         # Print Stat Tracking
         self.print_stats = self.printer.load_object(config, 'print_stats')
+        self.print_estimate = None
+        if config.getboolean('estimate_print_time', False):
+            self.print_estimate = print_estimate.PrintTimeEstimate(
+                self.printer)
         # Work timer
         self.reactor = self.printer.get_reactor()
         self.must_pause_work = self.cmd_from_sd = False
@@ -52,8 +191,7 @@ class VirtualSD:
             try:
                 readpos = max(self.file_position - 1024, 0)
                 readcount = self.file_position - readpos
-                self.current_file.seek(readpos)
-                data = self.current_file.read(readcount + 128)
+                data = self.current_file.read_at(readpos, readcount + 128)
             except:
                 logging.exception("virtual_sdcard shutdown read")
                 return
@@ -70,8 +208,7 @@ class VirtualSD:
             for root, dirs, files in os.walk(
                     self.sdcard_dirname, followlinks=True):
                 for name in files:
-                    ext = name[name.rfind('.')+1:]
-                    if ext not in VALID_GCODE_EXTS:
+                    if not is_gcode_filename(name):
                         continue
                     full_path = os.path.join(root, name)
                     r_path = full_path[len(self.sdcard_dirname) + 1:]
@@ -96,6 +233,8 @@ class VirtualSD:
             'is_active': self.is_active(),
             'file_position': self.file_position,
             'file_size': self.file_size,
+            'estimated_print_time': self.estimated_print_time(),
+            'estimated_time_left': self.estimated_time_left(),
         }
     def file_path(self):
         if self.current_file:
@@ -108,6 +247,14 @@ class VirtualSD:
             return 0.
     def is_active(self):
         return self.work_timer is not None
+    def estimated_print_time(self):
+        if self.print_estimate is None or self.current_file is None:
+            return None
+        return self.print_estimate.get_total_time()
+    def estimated_time_left(self):
+        if self.print_estimate is None or self.current_file is None:
+            return None
+        return self.print_estimate.get_time_left(self.file_position)
     def do_pause(self):
         if self.work_timer is not None:
             self.must_pause_work = True
@@ -134,6 +281,8 @@ class VirtualSD:
             self.do_pause()
             self.current_file.close()
             self.current_file = None
+        if self.print_estimate is not None:
+            self.print_estimate.cancel()
         self.file_position = self.file_size = 0
         self.print_stats.reset()
         self.printer.send_event("virtual_sdcard:reset_file")
@@ -183,10 +332,8 @@ class VirtualSD:
             if fname not in flist:
                 fname = files_by_lower[fname.lower()]
             fname = os.path.join(self.sdcard_dirname, fname)
-            f = io.open(fname, 'r', newline='')
-            f.seek(0, os.SEEK_END)
-            fsize = f.tell()
-            f.seek(0)
+            f = GCodeFileReader(self.reactor, fname)
+            fsize = f.file_size
         except:
             logging.exception("virtual_sdcard file open")
             raise gcmd.error("Unable to open file")
@@ -196,6 +343,8 @@ class VirtualSD:
         self.file_position = 0
         self.file_size = fsize
         self.print_stats.set_current_file(filename)
+        if self.print_estimate is not None:
+            self.print_estimate.start(fname)
     def cmd_M24(self, gcmd):
         # Start/resume SD print
         self.do_resume()
@@ -240,7 +389,7 @@ class VirtualSD:
             if not lines:
                 # Read more data
                 try:
-                    data = self.current_file.read(8192)
+                    data = self.current_file.read()
                 except:
                     logging.exception("virtual_sdcard read")
                     break
@@ -252,6 +401,10 @@ class VirtualSD:
                     self.gcode.respond_raw("Done printing file")
                     break
                 lines = data.split('\n')
+                # Byte length of each line is its str length if ascii
+                is_ascii = (sys.version_info.major < 3
+                            or (str_is_ascii(data)
+                                and str_is_ascii(partial_input)))
                 lines[0] = partial_input + lines[0]
                 partial_input = lines.pop()
                 lines.reverse()
@@ -264,10 +417,10 @@ class VirtualSD:
             # Dispatch command
             self.cmd_from_sd = True
             line = lines.pop()
-            if sys.version_info.major >= 3:
-                next_file_position = self.file_position + len(line.encode()) + 1
-            else:
+            if is_ascii:
                 next_file_position = self.file_position + len(line) + 1
+            else:
+                next_file_position = self.file_position + len(line.encode()) + 1
             self.next_file_position = next_file_position
             try:
                 self.gcode.run_script(line)
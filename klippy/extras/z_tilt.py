@@ -3,9 +3,9 @@
 # Copyright (C) 2018-2019  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging
-import mathutil
-from . import probe
+import logging, math
+import mathutil, chelper, toolhead as toolhead_mod
+from . import probe, force_move
 
 class ZAdjustHelper:
     def __init__(self, config, z_count):
@@ -25,7 +25,17 @@ class ZAdjustHelper:
         if len(z_steppers) < 2:
             raise self.printer.config_error(
                 "%s requires multiple z steppers" % (self.name,))
+        for s in z_steppers:
+            if s.shares_step_timer():
+                raise self.printer.config_error(
+                    "%s may not be used with share_step_timer on %s" % (
+                        self.name, s.get_name()))
         self.z_steppers = z_steppers
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.trapqs = [ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
+                       for s in z_steppers]
+        self.trapq_append = ffi_lib.trapq_append
+        self.trapq_finalize_moves = ffi_lib.trapq_finalize_moves
     def adjust_steppers(self, adjustments, speed):
         toolhead = self.printer.lookup_object('toolhead')
         gcode = self.printer.lookup_object('gcode')
@@ -35,35 +45,44 @@ class ZAdjustHelper:
                     for s, a in zip(self.z_steppers, adjustments)]
         msg = "Making the following Z adjustments:\n%s" % ("\n".join(stepstrs),)
         gcode.respond_info(msg)
-        # Disable Z stepper movements
+        # Each z stepper is raised relative to the stepper with the
+        # lowest adjustment - all steppers move together in one move
+        min_adjust = min(adjustments)
+        move_d = max(adjustments) - min_adjust
+        if move_d < .000000001:
+            return
+        newpos = list(curpos)
+        newpos[2] += move_d
+        move = toolhead_mod.Move(toolhead, curpos, newpos, speed)
+        toolhead.get_kinematics().check_move(move)
+        axis_r, accel_t, cruise_t, cruise_v = force_move.calc_move_time(
+            move_d, math.sqrt(move.max_cruise_v2), move.accel)
+        # Queue the move on a private trapq for each z stepper
         toolhead.flush_step_generation()
-        for s in self.z_steppers:
-            s.set_trapq(None)
-        # Move each z stepper (sorted from lowest to highest) until they match
-        positions = [(-a, s) for a, s in zip(adjustments, self.z_steppers)]
-        positions.sort(key=(lambda k: k[0]))
-        first_stepper_offset, first_stepper = positions[0]
-        z_low = curpos[2] - first_stepper_offset
-        for i in range(len(positions)-1):
-            stepper_offset, stepper = positions[i]
-            next_stepper_offset, next_stepper = positions[i+1]
-            toolhead.flush_step_generation()
-            stepper.set_trapq(toolhead.get_trapq())
-            curpos[2] = z_low + next_stepper_offset
-            try:
-                toolhead.move(curpos, speed)
-                toolhead.set_position(curpos)
-            except:
-                logging.exception("ZAdjustHelper adjust_steppers")
-                toolhead.flush_step_generation()
-                for s in self.z_steppers:
-                    s.set_trapq(toolhead.get_trapq())
-                raise
-        # Z should now be level - do final cleanup
-        last_stepper_offset, last_stepper = positions[-1]
+        print_time = toolhead.get_last_move_time()
+        move_t = accel_t + cruise_t + accel_t
+        end_time = print_time + move_t
+        try:
+            for s, a, tq in zip(self.z_steppers, adjustments, self.trapqs):
+                s.set_trapq(tq)
+                self.trapq_append(tq, print_time, accel_t, cruise_t, accel_t,
+                                  curpos[0], curpos[1], curpos[2],
+                                  0., 0., (a - min_adjust) / move_d,
+                                  0., cruise_v, move.accel)
+                s.generate_steps(end_time)
+        except:
+            logging.exception("ZAdjustHelper adjust_steppers")
+            raise
+        finally:
+            for s, tq in zip(self.z_steppers, self.trapqs):
+                self.trapq_finalize_moves(tq, end_time + 99999.9,
+                                          end_time + 99999.9)
+                s.set_trapq(toolhead.get_trapq())
+        toolhead.note_mcu_movequeue_activity(end_time)
+        toolhead.dwell(move_t)
         toolhead.flush_step_generation()
-        last_stepper.set_trapq(toolhead.get_trapq())
-        curpos[2] += first_stepper_offset
+        # Z should now be level - do final cleanup
+        curpos[2] -= min_adjust
         toolhead.set_position(curpos)
 
 class ZAdjustStatus:
@@ -144,22 +163,19 @@ class ZTilt:
         self.retry_helper.start(gcmd)
         self.probe_helper.start_probe(gcmd)
     def probe_finalize(self, offsets, positions):
-        # Setup for coordinate descent analysis
+        # Setup for least squares analysis
         z_offset = offsets[2]
         logging.info("Calculating bed tilt with: %s", positions)
         params = { 'x_adjust': 0., 'y_adjust': 0., 'z_adjust': z_offset }
-        # Perform coordinate descent
+        # Perform least squares analysis
         def adjusted_height(pos, params):
             x, y, z = pos
             return (z - x*params['x_adjust'] - y*params['y_adjust']
                     - params['z_adjust'])
-        def errorfunc(params):
-            total_error = 0.
-            for pos in positions:
-                total_error += adjusted_height(pos, params)**2
-            return total_error
-        new_params = mathutil.coordinate_descent(
-            params.keys(), params, errorfunc)
+        def residuals(params):
+            return [adjusted_height(pos, params) for pos in positions]
+        new_params = mathutil.least_squares(
+            params.keys(), params, residuals)
         # Apply results
         speed = self.probe_helper.get_lift_speed()
         logging.info("Calculated bed tilt parameters: %s", new_params)
@@ -366,11 +366,15 @@ class GCodeDispatch:
         gcmd.respond_info("\n".join(cmdhelp), log=False)
 
 # Support reading gcode from a pseudo-tty interface
+GCODE_READ_SIZE = 32768
+
 class GCodeIO:
     def __init__(self, printer):
         self.printer = printer
         printer.register_event_handler("klippy:ready", self._handle_ready)
         printer.register_event_handler("klippy:shutdown", self._handle_shutdown)
+        printer.register_event_handler("klippy:disconnect",
+                                       self._flush_output)
         self.gcode = printer.lookup_object('gcode')
         self.gcode_mutex = self.gcode.get_mutex()
         self.fd = printer.get_start_args().get("gcode_fd")
@@ -386,6 +390,7 @@ class GCodeIO:
                                                       self._process_data)
         self.partial_input = ""
         self.pending_commands = []
+        self.pending_output = []
         self.bytes_read = 0
         self.input_log = collections.deque([], 50)
     def _handle_ready(self):
@@ -410,7 +415,7 @@ class GCodeIO:
     def _process_data(self, eventtime):
         # Read input, separate by newline, and add to pending_commands
         try:
-            data = str(os.read(self.fd, 4096).decode())
+            data = str(os.read(self.fd, GCODE_READ_SIZE).decode())
         except (os.error, UnicodeDecodeError):
             logging.exception("Read g-code")
             return
@@ -431,11 +436,10 @@ class GCodeIO:
             pending_commands.append("")
         # Handle case where multiple commands pending
         if self.is_processing_data or len(pending_commands) > 1:
-            if len(pending_commands) < 20:
-                # Check for M112 out-of-order
-                for line in lines:
-                    if self.m112_r.match(line) is not None:
-                        self.gcode.cmd_M112(None)
+            # Check for M112 out-of-order
+            for line in lines:
+                if '112' in line and self.m112_r.match(line) is not None:
+                    self.gcode.cmd_M112(None)
             if self.is_processing_data:
                 if len(pending_commands) >= 20:
                     # Stop reading input
@@ -453,13 +457,22 @@ class GCodeIO:
         if self.fd_handle is None:
             self.fd_handle = self.reactor.register_fd(self.fd,
                                                       self._process_data)
+    def _flush_output(self, eventtime=None):
+        output = "".join(self.pending_output).encode()
+        del self.pending_output[:]
+        try:
+            while output and self.pipe_is_active:
+                output = output[os.write(self.fd, output):]
+        except os.error:
+            logging.exception("Write g-code response")
+            self.pipe_is_active = False
     def _respond_raw(self, msg):
+        # Responses (eg, the "ok" of each command) are batched and
+        # written when the reactor next becomes idle
         if self.pipe_is_active:
-            try:
-                os.write(self.fd, (msg+"\n").encode())
-            except os.error:
-                logging.exception("Write g-code response")
-                self.pipe_is_active = False
+            if not self.pending_output:
+                self.reactor.register_callback(self._flush_output)
+            self.pending_output.append(msg + "\n")
     def stats(self, eventtime):
         return False, "gcodein=%d" % (self.bytes_read,)
 
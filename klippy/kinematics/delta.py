@@ -4,10 +4,12 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging
-import stepper, mathutil
+import stepper, mathutil, chelper
 
 # Slow moves once the ratio of tower to XY movement exceeds SLOW_RATIO
 SLOW_RATIO = 3.
+# Never slow moves by more than this factor
+MIN_SLOW_SCALE = .25
 
 class DeltaKinematics:
     def __init__(self, toolhead, config):
@@ -80,14 +82,19 @@ class DeltaKinematics:
                                       - half_min_step_dist**2)
                     + half_min_step_dist - radius)
         self.slow_xy2 = ratio_to_xy(SLOW_RATIO)**2
-        self.very_slow_xy2 = ratio_to_xy(2. * SLOW_RATIO)**2
         self.max_xy2 = min(print_radius, min_arm_length - radius,
                            ratio_to_xy(4. * SLOW_RATIO))**2
         max_xy = math.sqrt(self.max_xy2)
-        logging.info("Delta max build radius %.2fmm (moves slowed past %.2fmm"
-                     " and %.2fmm)"
-                     % (max_xy, math.sqrt(self.slow_xy2),
-                        math.sqrt(self.very_slow_xy2)))
+        logging.info("Delta max build radius %.2fmm (moves may be slowed"
+                     " past %.2fmm)" % (max_xy, math.sqrt(self.slow_xy2)))
+        # Per-move tower velocity limits (calculated in C code)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.limits = ffi_main.gc(
+            ffi_lib.delta_limits_alloc(SLOW_RATIO, MIN_SLOW_SCALE),
+            ffi_lib.delta_limits_free)
+        for i, (arm2, t) in enumerate(zip(self.arm2, self.towers)):
+            ffi_lib.delta_limits_set_tower(self.limits, i, arm2, t[0], t[1])
+        self.calc_scale = ffi_lib.delta_limits_calc_scale
         self.axes_min = toolhead.Coord(-max_xy, -max_xy, self.min_z, 0.)
         self.axes_max = toolhead.Coord(max_xy, max_xy, self.max_z, 0.)
         self.set_position([0., 0., 0.], ())
@@ -141,14 +148,17 @@ class DeltaKinematics:
             move.limit_speed(self.max_z_velocity * z_ratio,
                              self.max_z_accel * z_ratio)
             limit_xy2 = -1.
-        # Limit the speed/accel of this move if is is at the extreme
-        # end of the build envelope
-        extreme_xy2 = max(end_xy2, move.start_pos[0]**2 + move.start_pos[1]**2)
+        # Limit the speed/accel of this move if it could result in
+        # excessive tower movement
+        start_pos = move.start_pos
+        extreme_xy2 = max(end_xy2, start_pos[0]**2 + start_pos[1]**2)
         if extreme_xy2 > self.slow_xy2:
-            r = 0.5
-            if extreme_xy2 > self.very_slow_xy2:
-                r = 0.25
-            move.limit_speed(self.max_velocity * r, self.max_accel * r)
+            axes_r = move.axes_r
+            r = self.calc_scale(self.limits, start_pos[0], start_pos[1],
+                                end_pos[0], end_pos[1],
+                                axes_r[0], axes_r[1], axes_r[2])
+            if r < 1.:
+                move.limit_speed(self.max_velocity * r, self.max_accel * r)
             limit_xy2 = -1.
         self.limit_xy2 = min(limit_xy2, self.slow_xy2)
     def get_status(self, eventtime):
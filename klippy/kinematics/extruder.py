@@ -6,6 +6,9 @@
 import math, logging
 import stepper, chelper
 
+# Time window (in seconds) used to calculate the extrusion flow rate
+FLOW_RATE_WINDOW = 1.0
+
 class ExtruderStepper:
     def __init__(self, config):
         self.printer = config.get_printer()
@@ -42,6 +45,8 @@ class ExtruderStepper:
         toolhead = self.printer.lookup_object('toolhead')
         toolhead.register_step_generator(self.stepper.generate_steps)
         self._set_pressure_advance(self.config_pa, self.config_smooth_time)
+    def get_stepper_kinematics(self):
+        return self.sk_extruder
     def get_status(self, eventtime):
         return {'pressure_advance': self.pressure_advance,
                 'smooth_time': self.pressure_advance_smooth_time,
@@ -64,18 +69,18 @@ class ExtruderStepper:
         self.stepper.set_trapq(extruder.get_trapq())
         self.motion_queue = extruder_name
     def _set_pressure_advance(self, pressure_advance, smooth_time):
-        old_smooth_time = self.pressure_advance_smooth_time
-        if not self.pressure_advance:
-            old_smooth_time = 0.
         new_smooth_time = smooth_time
         if not pressure_advance:
             new_smooth_time = 0.
         toolhead = self.printer.lookup_object("toolhead")
-        toolhead.note_step_generation_scan_time(new_smooth_time * .5,
-                                                old_delay=old_smooth_time * .5)
+        toolhead.flush_step_generation()
         ffi_main, ffi_lib = chelper.get_ffi()
+        get_window = ffi_lib.extruder_get_step_generation_window
+        old_delay = get_window(self.sk_extruder)
         espa = ffi_lib.extruder_set_pressure_advance
         espa(self.sk_extruder, pressure_advance, new_smooth_time)
+        toolhead.note_step_generation_scan_time(get_window(self.sk_extruder),
+                                                old_delay=old_delay)
         self.pressure_advance = pressure_advance
         self.pressure_advance_smooth_time = smooth_time
     cmd_SET_PRESSURE_ADVANCE_help = "Set pressure advance parameters"
@@ -161,10 +166,19 @@ class PrinterExtruder:
             'max_extrude_only_distance', 50., minval=0.)
         self.instant_corner_v = config.getfloat(
             'instantaneous_corner_velocity', 1., minval=0.)
+        # Optional volumetric flow limit (possibly temperature dependent)
+        self.max_flow = config.getfloat('max_volumetric_flow', 0., minval=0.)
+        self.max_flow_temps = sorted(config.getlists(
+            'max_volumetric_flow_temps', (), seps=(',', '\n'), parser=float,
+            count=2))
+        for temp, flow in self.max_flow_temps:
+            if flow <= 0.:
+                raise config.error("Invalid max_volumetric_flow_temps flow"
+                                   " %.3f in section '%s'" % (flow, self.name))
         # Setup extruder trapq (trapezoidal motion queue)
         ffi_main, ffi_lib = chelper.get_ffi()
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
-        self.trapq_append = ffi_lib.trapq_append
+        self.trapq_append_batch = ffi_lib.trapq_append_batch
         self.trapq_finalize_moves = ffi_lib.trapq_finalize_moves
         # Setup extruder stepper
         self.extruder_stepper = None
@@ -182,8 +196,33 @@ class PrinterExtruder:
         gcode.register_mux_command("ACTIVATE_EXTRUDER", "EXTRUDER",
                                    self.name, self.cmd_ACTIVATE_EXTRUDER,
                                    desc=self.cmd_ACTIVATE_EXTRUDER_help)
+        self.printer.register_event_handler("extruder:activate_extruder",
+                                            self._handle_activate_extruder)
+    def _handle_activate_extruder(self):
+        # An inactive extruder no longer receives update_move_time()
+        toolhead = self.printer.lookup_object('toolhead')
+        if toolhead.get_extruder() is not self:
+            self.heater.note_flow_rate(0., 0.)
+    def _get_trapq_position(self, print_time):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        data = ffi_main.new('struct pull_move[1]')
+        count = ffi_lib.trapq_extract_old(self.trapq, data, 1, 0., print_time)
+        if not count:
+            return None
+        move = data[0]
+        move_time = max(0., min(move.move_t, print_time - move.print_time))
+        return move.start_x + (move.start_v + .5 * move.accel * move_time
+                               ) * move_time
     def update_move_time(self, flush_time, clear_history_time):
         self.trapq_finalize_moves(self.trapq, flush_time, clear_history_time)
+        # Report the extrusion rate of the moves about to be stepped
+        start_pos = self._get_trapq_position(flush_time - FLOW_RATE_WINDOW)
+        flow_rate = 0.
+        if start_pos is not None:
+            end_pos = self._get_trapq_position(flush_time)
+            flow_rate = ((end_pos - start_pos) * self.filament_area
+                         / FLOW_RATE_WINDOW)
+        self.heater.note_flow_rate(max(0., flow_rate), flush_time)
     def get_status(self, eventtime):
         sts = self.heater.get_status(eventtime)
         sts['can_extrude'] = self.heater.can_extrude
@@ -198,12 +237,37 @@ class PrinterExtruder:
         return self.trapq
     def stats(self, eventtime):
         return self.heater.stats(eventtime)
+    def _get_max_flow(self):
+        max_flow, flow_temps = self.max_flow, self.max_flow_temps
+        if not flow_temps:
+            return max_flow
+        # Interpolate the flow limit at the current hotend temperature
+        eventtime = self.printer.get_reactor().monotonic()
+        temp = self.heater.get_temp(eventtime)[0]
+        prev_temp, flow = flow_temps[0]
+        for next_temp, next_flow in flow_temps[1:]:
+            if temp <= prev_temp:
+                break
+            if temp < next_temp:
+                flow += ((next_flow - flow) * (temp - prev_temp)
+                         / (next_temp - prev_temp))
+                break
+            prev_temp, flow = next_temp, next_flow
+        if max_flow:
+            return min(max_flow, flow)
+        return flow
     def check_move(self, move):
         axis_r = move.axes_r[3]
         if not self.heater.can_extrude:
             raise self.printer.command_error(
                 "Extrude below minimum temp\n"
                 "See the 'min_extrude_temp' config option for details")
+        if ((self.max_flow or self.max_flow_temps) and axis_r > 0.
+            and (move.axes_d[0] or move.axes_d[1])):
+            # Limit the cruise speed to the maximum volumetric flow
+            max_flow = self._get_max_flow()
+            move.limit_speed(max_flow / (axis_r * self.filament_area),
+                             move.accel)
         if (not move.axes_d[0] and not move.axes_d[1]) or axis_r < 0.:
             # Extrude only move (or retraction move) - limit accel and velocity
             if abs(move.axes_d[3]) > self.max_e_dist:
@@ -230,21 +294,25 @@ class PrinterExtruder:
         if diff_r:
             return (self.instant_corner_v / abs(diff_r))**2
         return move.max_cruise_v2
-    def move(self, print_time, move):
-        axis_r = move.axes_r[3]
-        accel = move.accel * axis_r
-        start_v = move.start_v * axis_r
-        cruise_v = move.cruise_v * axis_r
-        can_pressure_advance = False
-        if axis_r > 0. and (move.axes_d[0] or move.axes_d[1]):
-            can_pressure_advance = True
+    def process_moves(self, moves):
         # Queue movement (x is extruder movement, y is pressure advance flag)
-        self.trapq_append(self.trapq, print_time,
-                          move.accel_t, move.cruise_t, move.decel_t,
-                          move.start_pos[3], 0., 0.,
-                          1., can_pressure_advance, 0.,
-                          start_v, cruise_v, accel)
-        self.last_position = move.end_pos[3]
+        data = []
+        for print_time, move in moves:
+            axis_r = move.axes_r[3]
+            can_pressure_advance = False
+            if axis_r > 0. and (move.axes_d[0] or move.axes_d[1]):
+                can_pressure_advance = True
+            data.extend((print_time, move.accel_t, move.cruise_t, move.decel_t,
+                         move.start_pos[3], 0., 0.,
+                         1., can_pressure_advance, 0.,
+                         move.start_v * axis_r, move.cruise_v * axis_r,
+                         move.accel * axis_r))
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.trapq_append_batch(self.trapq, ffi_main.new('double[]', data),
+                                len(moves))
+        self.last_position = moves[-1][1].end_pos[3]
+    def move(self, print_time, move):
+        self.process_moves([(print_time, move)])
     def find_past_position(self, print_time):
         if self.extruder_stepper is None:
             return 0.
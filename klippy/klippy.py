@@ -5,7 +5,8 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import sys, os, gc, optparse, logging, time, collections, importlib
-import util, reactor, queuelogger, msgproto
+import threading
+import util, reactor, queuelogger, msgproto, chelper
 import gcode, configfile, pins, mcu, toolhead, webhooks
 
 message_ready = "Printer is ready"
@@ -295,8 +296,72 @@ def arg_dictionary(option, opt_str, value, parser):
         parser.values.dictionary = {}
     parser.values.dictionary[key] = fname
 
+def run_printer(start_args, bglogger, versions, gc_coordinator=None):
+    # Start Printer() class
+    while 1:
+        if bglogger is not None:
+            bglogger.clear_rollover_info()
+            bglogger.set_rollover_info('versions', versions)
+        if gc_coordinator is None:
+            gc.collect()
+        main_reactor = reactor.Reactor(gc_checking=True,
+                                       gc_coordinator=gc_coordinator)
+        printer = Printer(main_reactor, bglogger, start_args)
+        res = printer.run()
+        if gc_coordinator is not None:
+            gc_coordinator.unregister_reactor(main_reactor)
+        if res in ['exit', 'error_exit']:
+            break
+        time.sleep(1.)
+        main_reactor.finalize()
+        main_reactor = printer = None
+        logging.info("Restarting printer")
+        start_args['start_reason'] = res
+    return res
+
+# Run one of several printers hosted by this process
+class PrinterThread:
+    def __init__(self, name, start_args, versions, gc_coordinator):
+        self.name = name
+        self.start_args = start_args
+        self.versions = versions
+        self.gc_coordinator = gc_coordinator
+        self.result = None
+        self.thread = threading.Thread(target=self._run,
+                                       name="printer " + name)
+    def start(self):
+        self.thread.start()
+    def join(self):
+        self.thread.join()
+        return self.result
+    def _run(self):
+        bglogger = None
+        log_file = self.start_args.get('log_file')
+        if log_file is not None:
+            bglogger = queuelogger.add_thread_bg_logging(log_file)
+            logging.info(self.versions)
+        logging.info("Starting printer '%s'", self.name)
+        try:
+            self.result = run_printer(self.start_args, bglogger,
+                                      self.versions, self.gc_coordinator)
+        except:
+            logging.exception("Unhandled exception in printer '%s'",
+                              self.name)
+            self.result = 'error_exit'
+        logging.info("Printer '%s' exited (%s)", self.name, self.result)
+        if bglogger is not None:
+            queuelogger.MainQueueHandler.set_thread_queue(None)
+            bglogger.stop()
+
+def instance_filename(filename, name):
+    # Add a printer name to a file name (eg, /tmp/klippy-name.log)
+    if filename is None or name is None:
+        return filename
+    base, ext = os.path.splitext(filename)
+    return "%s-%s%s" % (base, name, ext)
+
 def main():
-    usage = "%prog [options] <config file>"
+    usage = "%prog [options] <config file> [<config file> ...]"
     opts = optparse.OptionParser(usage)
     opts.add_option("-i", "--debuginput", dest="debuginput",
                     help="read commands from file instead of from tty port")
@@ -319,27 +384,49 @@ def main():
     options, args = opts.parse_args()
     if options.import_test:
         import_test()
-    if len(args) != 1:
+    if not args:
         opts.error("Incorrect number of arguments")
-    start_args = {'config_file': args[0], 'apiserver': options.apiserver,
-                  'start_reason': 'startup'}
+    # Determine the name of each printer (when hosting several printers)
+    names = [None]
+    if len(args) > 1:
+        if options.debuginput or options.debugoutput:
+            opts.error("Only one config file may be used in batch mode")
+        names = [os.path.splitext(os.path.basename(a))[0] for a in args]
+        if len(set(names)) != len(names):
+            opts.error("Config file names must be unique")
+    all_start_args = []
+    for config_file, name in zip(args, names):
+        start_args = {'config_file': config_file,
+                      'apiserver': instance_filename(options.apiserver,
+                                                     name),
+                      'start_reason': 'startup'}
+        if name is not None:
+            start_args['printer_name'] = name
+        if options.debuginput:
+            start_args['debuginput'] = options.debuginput
+            debuginput = open(options.debuginput, 'rb')
+            start_args['gcode_fd'] = debuginput.fileno()
+        else:
+            start_args['gcode_fd'] = util.create_pty(
+                instance_filename(options.inputtty, name))
+        if options.debugoutput:
+            start_args['debugoutput'] = options.debugoutput
+            start_args.update(options.dictionary)
+        if options.logfile:
+            start_args['log_file'] = instance_filename(options.logfile, name)
+        all_start_args.append(start_args)
 
     debuglevel = logging.INFO
     if options.verbose:
         debuglevel = logging.DEBUG
-    if options.debuginput:
-        start_args['debuginput'] = options.debuginput
-        debuginput = open(options.debuginput, 'rb')
-        start_args['gcode_fd'] = debuginput.fileno()
-    else:
-        start_args['gcode_fd'] = util.create_pty(options.inputtty)
-    if options.debugoutput:
-        start_args['debugoutput'] = options.debugoutput
-        start_args.update(options.dictionary)
     bglogger = None
     if options.logfile:
-        start_args['log_file'] = options.logfile
-        bglogger = queuelogger.setup_bg_logging(options.logfile, debuglevel)
+        if len(args) > 1:
+            bglogger = queuelogger.setup_thread_bg_logging(options.logfile,
+                                                           debuglevel)
+        else:
+            bglogger = queuelogger.setup_bg_logging(options.logfile,
+                                                    debuglevel)
     else:
         logging.getLogger().setLevel(debuglevel)
     logging.info("Starting Klippy...")
@@ -365,37 +452,38 @@ def main():
     extra_git_desc += "\nBranch: %s" % (git_info["branch"])
     extra_git_desc += "\nRemote: %s" % (git_info["remote"])
     extra_git_desc += "\nTracked URL: %s" % (git_info["url"])
-    start_args['software_version'] = git_vers
-    start_args['cpu_info'] = util.get_cpu_info()
+    cpu_info = util.get_cpu_info()
+    for start_args in all_start_args:
+        start_args['software_version'] = git_vers
+        start_args['cpu_info'] = cpu_info
+    versions = "\n".join([
+        "Args: %s" % (sys.argv,),
+        "Git version: %s%s" % (repr(git_vers), extra_git_desc),
+        "CPU: %s" % (cpu_info,),
+        "Python: %s" % (repr(sys.version),)])
     if bglogger is not None:
-        versions = "\n".join([
-            "Args: %s" % (sys.argv,),
-            "Git version: %s%s" % (repr(start_args['software_version']),
-                                   extra_git_desc),
-            "CPU: %s" % (start_args['cpu_info'],),
-            "Python: %s" % (repr(sys.version),)])
         logging.info(versions)
     elif not options.debugoutput:
         logging.warning("No log file specified!"
                         " Severe timing issues may result!")
     gc.disable()
 
-    # Start Printer() class
-    while 1:
-        if bglogger is not None:
-            bglogger.clear_rollover_info()
-            bglogger.set_rollover_info('versions', versions)
-        gc.collect()
-        main_reactor = reactor.Reactor(gc_checking=True)
-        printer = Printer(main_reactor, bglogger, start_args)
-        res = printer.run()
-        if res in ['exit', 'error_exit']:
-            break
-        time.sleep(1.)
-        main_reactor.finalize()
-        main_reactor = printer = None
-        logging.info("Restarting printer")
-        start_args['start_reason'] = res
+    if len(all_start_args) == 1:
+        res = run_printer(all_start_args[0], bglogger, versions)
+    else:
+        # Run each printer in its own thread (sharing the interpreter,
+        # loaded modules, and C helper library of this process)
+        chelper.get_ffi()
+        # Python garbage collection only runs when all printers are idle
+        gc_coordinator = reactor.GCCoordinator()
+        printers = [PrinterThread(name, start_args, versions, gc_coordinator)
+                    for name, start_args in zip(names, all_start_args)]
+        for pt in printers:
+            pt.start()
+        results = [pt.join() for pt in printers]
+        res = 'exit'
+        if 'error_exit' in results:
+            res = 'error_exit'
 
     if bglogger is not None:
         bglogger.stop()
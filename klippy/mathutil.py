@@ -47,14 +47,114 @@ def coordinate_descent(adj_params, params, error_func):
                  best_err, rounds)
     return params
 
-# Helper to run the coordinate descent function in a background
-# process so that it does not block the main thread.
-def background_coordinate_descent(printer, adj_params, params, error_func):
+
+######################################################################
+# Least squares (Levenberg-Marquardt)
+######################################################################
+
+# Solve the linear system 'a * x = b' using Gaussian elimination
+def _solve_linear(a, b):
+    n = len(b)
+    m = [list(row) + [v] for row, v in zip(a, b)]
+    for col in range(n):
+        pivot = max(range(col, n), key=lambda r: abs(m[r][col]))
+        if abs(m[pivot][col]) < 1e-300:
+            return None
+        m[col], m[pivot] = m[pivot], m[col]
+        for r in range(col + 1, n):
+            f = m[r][col] / m[col][col]
+            if f:
+                for c in range(col, n + 1):
+                    m[r][c] -= f * m[col][c]
+    x = [0.] * n
+    for r in range(n - 1, -1, -1):
+        v = m[r][n] - sum([m[r][c] * x[c] for c in range(r + 1, n)])
+        x[r] = v / m[r][r]
+    return x
+
+# Helper code that minimizes the sum of the squares of the values
+# returned by residual_func() using the Levenberg-Marquardt algorithm.
+# The residual_func() may raise ValueError for invalid parameters.
+def least_squares(adj_params, params, residual_func):
+    params = dict(params)
+    adj_params = list(adj_params)
+    def calc_residuals(p):
+        try:
+            return list(residual_func(p))
+        except ValueError:
+            return None
+    res = calc_residuals(params)
+    if res is None:
+        raise ValueError("Invalid initial parameters for least squares")
+    best_err = sum([r*r for r in res])
+    logging.info("Least squares initial error: %s", best_err)
+    damping = .001
+    rounds = evals = 0
+    while rounds < 200:
+        rounds += 1
+        # Estimate the Jacobian with forward differences
+        jac = []
+        for param_name in adj_params:
+            orig = params[param_name]
+            step = 1e-6 * max(1., abs(orig))
+            params[param_name] = orig + step
+            res2 = calc_residuals(params)
+            if res2 is None:
+                step = -step
+                params[param_name] = orig + step
+                res2 = calc_residuals(params)
+            params[param_name] = orig
+            evals += 1
+            if res2 is None:
+                jac.append([0.] * len(res))
+                continue
+            jac.append([(r2 - r) / step for r2, r in zip(res2, res)])
+        # Build the normal equations
+        jtj = [[sum([a*b for a, b in zip(ji, jj)]) for jj in jac]
+               for ji in jac]
+        jtr = [-sum([a*r for a, r in zip(ji, res)]) for ji in jac]
+        # Find a damped step that reduces the error
+        while damping < 1e12:
+            a = [list(row) for row in jtj]
+            for i in range(len(a)):
+                a[i][i] += damping * (jtj[i][i] or 1.)
+            delta = _solve_linear(a, jtr)
+            if delta is not None:
+                trial = dict(params)
+                for param_name, d in zip(adj_params, delta):
+                    trial[param_name] += d
+                trial_res = calc_residuals(trial)
+                evals += 1
+                if trial_res is not None:
+                    trial_err = sum([r*r for r in trial_res])
+                    if trial_err < best_err:
+                        break
+            damping *= 10.
+        else:
+            # No further improvement possible
+            break
+        improvement = best_err - trial_err
+        params, res, best_err = trial, trial_res, trial_err
+        damping = max(damping * .1, 1e-12)
+        if improvement <= 1e-14 * max(best_err, 1e-300) or best_err < 1e-30:
+            break
+    logging.info("Least squares best_err: %s  rounds: %d  evaluations: %d",
+                 best_err, rounds, evals)
+    return params
+
+
+######################################################################
+# Background calculations
+######################################################################
+
+# Helper to run a calculation function in a background process so
+# that it does not block the main thread.
+def _background_calc(printer, name, calc_func, *args):
     parent_conn, child_conn = multiprocessing.Pipe()
     def wrapper():
         queuelogger.clear_bg_logging()
         try:
-            res = coordinate_descent(adj_params, params, error_func)
+            res = calc_func(*args)
         except:
             child_conn.send((True, traceback.format_exc()))
             child_conn.close()
@@ -77,11 +177,22 @@ def background_coordinate_descent(printer, adj_params, params, error_func):
     # Return results
     is_err, res = parent_conn.recv()
     if is_err:
-        raise Exception("Error in coordinate descent: %s" % (res,))
+        raise Exception("Error in %s: %s" % (name, res))
     calc_proc.join()
     parent_conn.close()
     return res
 
+# Helper to run the coordinate descent function in a background
+# process so that it does not block the main thread.
+def background_coordinate_descent(printer, adj_params, params, error_func):
+    return _background_calc(printer, "coordinate descent", coordinate_descent,
+                            adj_params, params, error_func)
+
+# Helper to run the least squares function in a background process
+def background_least_squares(printer, adj_params, params, residual_func):
+    return _background_calc(printer, "least squares", least_squares,
+                            adj_params, params, residual_func)
+
 
 ######################################################################
 # Trilateration
@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2023  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, zlib, logging, math
+import sys, os, zlib, logging, math, struct
 import serialhdl, msgproto, pins, chelper, clocksync
 
 class error(Exception):
@@ -88,7 +88,15 @@ class CommandWrapper:
             cmd_queue = serial.get_default_command_queue()
         self._cmd_queue = cmd_queue
         self._msgtag = msgparser.lookup_msgtag(msgformat) & 0xffffffff
+        # Commands with only integer parameters are encoded in C
+        self._int_param_count = None
+        if all([t.is_int for t in self._cmd.param_types]):
+            self._int_param_count = len(self._cmd.param_types)
     def send(self, data=(), minclock=0, reqclock=0):
+        if len(data) == self._int_param_count:
+            self._serial.raw_send_encode(self._cmd.msgtag, data,
+                                         minclock, reqclock, self._cmd_queue)
+            return
         cmd = self._cmd.encode(data)
         self._serial.raw_send(cmd, minclock, reqclock, self._cmd_queue)
     def send_wait_ack(self, data=(), minclock=0, reqclock=0):
@@ -114,7 +122,8 @@ class MCU_trsync:
         self._steppers = []
         self._trdispatch_mcu = None
         self._oid = mcu.create_oid()
-        self._cmd_queue = mcu.alloc_command_queue()
+        # Trigger messages are sent ahead of bulk (eg, step) messages
+        self._cmd_queue = mcu.alloc_command_queue(priority=1)
         self._trsync_start_cmd = self._trsync_set_timeout_cmd = None
         self._trsync_trigger_cmd = self._trsync_query_cmd = None
         self._stepper_stop_cmd = None
@@ -545,6 +554,8 @@ class MCU_adc:
 # Main MCU class
 ######################################################################
 
+MOVE_FREE_REPORT_MARGIN = 0.005
+
 class MCU:
     error = error
     def __init__(self, config, clocksync):
@@ -556,20 +567,30 @@ class MCU:
             self._name = self._name[4:]
         # Serial port
         wp = "mcu '%s': " % (self._name)
-        self._serial = serialhdl.SerialReader(self._reactor, warn_prefix=wp)
+        # Printers hosted by one process share a serial thread by default
+        multi_printer = 'printer_name' in printer.get_start_args()
+        shared_thread = config.getboolean('shared_serial_thread',
+                                          multi_printer)
+        self._serial = serialhdl.SerialReader(self._reactor, warn_prefix=wp,
+                                              shared_thread=shared_thread)
         self._baud = 0
+        self._usb_bulk = False
         self._canbus_iface = None
+        self._canbus_timestamps = False
         canbus_uuid = config.get('canbus_uuid', None)
         if canbus_uuid is not None:
             self._serialport = canbus_uuid
             self._canbus_iface = config.get('canbus_interface', 'can0')
             cbid = self._printer.load_object(config, 'canbus_ids')
             cbid.add_uuid(config, canbus_uuid, self._canbus_iface)
+            self._canbus_timestamps = config.getboolean('canbus_timestamps',
+                                                        False)
         else:
             self._serialport = config.get('serial')
             if not (self._serialport.startswith("/dev/rpmsg_")
                     or self._serialport.startswith("/tmp/klipper_host_")):
                 self._baud = config.getint('baud', 250000, minval=2400)
+            self._usb_bulk = config.getboolean('usb_bulk_transport', False)
         # Restarts
         restart_methods = [None, 'arduino', 'cheetah', 'command', 'rpi_usb']
         self._restart_method = 'command'
@@ -595,16 +616,26 @@ class MCU:
         ffi_main, self._ffi_lib = chelper.get_ffi()
         self._max_stepper_error = config.getfloat('max_stepper_error', 0.000025,
                                                   minval=0.)
+        self._batch_time = config.getfloat('message_batch_time', 0.,
+                                           minval=0., maxval=0.100)
+        self._thread_priority = config.getint('serial_thread_priority', 0,
+                                              minval=0, maxval=99)
         self._reserved_move_slots = 0
         self._stepqueues = []
         self._steppersync = None
         self._flush_callbacks = []
+        self._last_flush_time = 0.
+        self._last_move_free_report = None
+        self._move_free_deficits = 0
         # Stats
         self._get_status_info = {}
         self._stats_sumsq_base = 0.
         self._mcu_tick_avg = 0.
         self._mcu_tick_stddev = 0.
         self._mcu_tick_awake = 0.
+        self._timing_hist_cmd = None
+        self._timing_hists = {}
+        self._timing_hist_types = 0
         # Register handlers
         printer.register_event_handler("klippy:firmware_restart",
                                        self._firmware_restart)
@@ -624,6 +655,18 @@ class MCU:
         diff = count*tick_sumsq - tick_sum**2
         self._mcu_tick_stddev = c * math.sqrt(max(0., diff))
         self._mcu_tick_awake = tick_sum / self._mcu_freq
+    def _handle_timing_histogram(self, params):
+        htype = params['type']
+        if htype >= self._timing_hist_types:
+            return
+        data = params['data']
+        counts = struct.unpack('<%dI' % (len(data) // 4,), data)
+        hist = self._timing_hists.setdefault(htype, [])
+        offset = params['offset']
+        if len(hist) < offset + len(counts):
+            hist.extend([0] * (offset + len(counts) - len(hist)))
+        for i, c in enumerate(counts):
+            hist[offset + i] += c
     def _handle_shutdown(self, params):
         if self._is_shutdown:
             return
@@ -767,12 +810,20 @@ class MCU:
                                       move_count-self._reserved_move_slots),
             ffi_lib.steppersync_free)
         ffi_lib.steppersync_set_time(self._steppersync, 0., self._mcu_freq)
+        ffi_lib.serialqueue_set_batch_time(self._serial.get_serialqueue(),
+                                           self._batch_time)
+        if self._thread_priority:
+            ret = ffi_lib.serialqueue_set_thread_priority(
+                self._serial.get_serialqueue(), self._thread_priority)
+            if ret:
+                logging.warning("Unable to set realtime priority on mcu '%s'"
+                                " serial thread", self._name)
         # Log config information
         move_msg = "Configured MCU '%s' (%d moves)" % (self._name, move_count)
         logging.info(move_msg)
         log_info = self._log_info() + "\n" + move_msg
         self._printer.set_rollover_info(self._name, log_info, log=False)
-    def _mcu_identify(self):
+    def _connect_serial(self, main_sync_wait=None):
         if self.is_fileoutput():
             self._connect_file()
         else:
@@ -784,8 +835,12 @@ class MCU:
                 if self._canbus_iface is not None:
                     cbid = self._printer.lookup_object('canbus_ids')
                     nodeid = cbid.get_nodeid(self._serialport)
+                    canbus_fd = cbid.use_canbus_fd(self._serialport)
                     self._serial.connect_canbus(self._serialport, nodeid,
-                                                self._canbus_iface)
+                                                self._canbus_iface, canbus_fd,
+                                                self._canbus_timestamps)
+                elif self._usb_bulk:
+                    self._serial.connect_usb(self._serialport)
                 elif self._baud:
                     # Cheetah boards require RTS to be deasserted
                     # else a reset will trigger the built-in bootloader.
@@ -793,9 +848,13 @@ class MCU:
                     self._serial.connect_uart(self._serialport, self._baud, rts)
                 else:
                     self._serial.connect_pipe(self._serialport)
+                if main_sync_wait is not None and main_sync_wait():
+                    # Main mcu failed to connect - error reported there
+                    return
                 self._clocksync.connect(self._serial)
             except serialhdl.error as e:
                 raise error(str(e))
+    def _mcu_identify(self):
         logging.info(self._log_info())
         ppins = self._printer.lookup_object('pins')
         pin_resolver = ppins.get_pin_resolver(self._name)
@@ -824,6 +883,13 @@ class MCU:
         self.register_response(self._handle_shutdown, 'shutdown')
         self.register_response(self._handle_shutdown, 'is_shutdown')
         self.register_response(self._handle_mcu_stats, 'stats')
+        self._timing_hist_cmd = self.try_lookup_command(
+            "get_timing_histogram type=%c")
+        if self._timing_hist_cmd is not None:
+            self.register_response(self._handle_timing_histogram,
+                                   'timing_histogram')
+            self._timing_hist_types = msgparser.get_constant_int(
+                'TIMING_HISTOGRAM_TYPES', 4)
     def _ready(self):
         if self.is_fileoutput():
             return
@@ -873,17 +939,19 @@ class MCU:
         return self._name
     def register_response(self, cb, msg, oid=None):
         self._serial.register_response(cb, msg, oid)
-    def alloc_command_queue(self):
-        return self._serial.alloc_command_queue()
+    def alloc_command_queue(self, priority=0):
+        return self._serial.alloc_command_queue(priority)
+    def get_serialqueue(self):
+        return self._serial.get_serialqueue()
     def lookup_command(self, msgformat, cq=None):
         return CommandWrapper(self._serial, msgformat, cq)
     def lookup_query_command(self, msgformat, respformat, oid=None,
                              cq=None, is_async=False):
         return CommandQueryWrapper(self._serial, msgformat, respformat, oid,
                                    cq, is_async, self._printer.command_error)
-    def try_lookup_command(self, msgformat):
+    def try_lookup_command(self, msgformat, cq=None):
         try:
-            return self.lookup_command(msgformat)
+            return self.lookup_command(msgformat, cq)
         except self._serial.get_msgparser().error as e:
             return None
     def get_enumerations(self):
@@ -898,6 +966,8 @@ class MCU:
         return self._clocksync.clock_to_print_time(clock)
     def estimated_print_time(self, eventtime):
         return self._clocksync.estimated_print_time(eventtime)
+    def get_recent_rtt(self):
+        return self._clocksync.get_recent_rtt()
     def clock32_to_clock64(self, clock32):
         return self._clocksync.clock32_to_clock64(clock32)
     # Restarts
@@ -962,6 +1032,22 @@ class MCU:
         self._reserved_move_slots += 1
     def register_flush_callback(self, callback):
         self._flush_callbacks.append(callback)
+    def _check_move_free_report(self):
+        # Verify the move queue tracking against the mcu reported counts
+        report = self._clocksync.get_move_free_report()
+        if report is None or report is self._last_move_free_report:
+            return
+        self._last_move_free_report = report
+        rclock, move_free = report
+        # Allow for moves that complete just before the report
+        rclock -= self.seconds_to_clock(MOVE_FREE_REPORT_MARGIN)
+        deficit = self._ffi_lib.steppersync_note_mcu_free_moves(
+            self._steppersync, max(0, rclock), move_free)
+        if deficit > 0:
+            if not self._move_free_deficits:
+                logging.info("MCU '%s' reported %d fewer free move queue"
+                             " items than expected", self._name, deficit)
+            self._move_free_deficits += 1
     def flush_moves(self, print_time, clear_history_time):
         if self._steppersync is None:
             return
@@ -970,6 +1056,8 @@ class MCU:
             return
         for cb in self._flush_callbacks:
             cb(print_time, clock)
+        self._last_flush_time = print_time
+        self._check_move_free_report()
         clear_history_clock = \
             max(0, self.print_time_to_clock(clear_history_time))
         ret = self._ffi_lib.steppersync_flush(self._steppersync, clock,
@@ -997,8 +1085,32 @@ class MCU:
         return self._is_shutdown
     def get_shutdown_clock(self):
         return self._shutdown_clock
+    def _get_buffer_health(self, eventtime):
+        # Report the amount of motion and message data queued for the mcu
+        res = {'queue_time': 0., 'free_moves': 0,
+               'ready_bytes': 0, 'upcoming_bytes': 0,
+               'free_move_deficits': self._move_free_deficits}
+        if self._steppersync is None or not self._mcu_freq:
+            return res
+        ffi_main, ffi_lib = chelper.get_ffi()
+        print_time = self.estimated_print_time(eventtime)
+        res['queue_time'] = max(0., self._last_flush_time - print_time)
+        clock = max(0, self.print_time_to_clock(print_time))
+        res['free_moves'] = ffi_lib.steppersync_get_free_moves(
+            self._steppersync, clock)
+        serialqueue = self._serial.get_serialqueue()
+        if serialqueue is not None:
+            counts = ffi_main.new('int[2]')
+            ffi_lib.serialqueue_get_buffer_stats(serialqueue, counts,
+                                                 counts + 1)
+            res['ready_bytes'], res['upcoming_bytes'] = counts[0], counts[1]
+        return res
     def get_status(self, eventtime=None):
-        return dict(self._get_status_info)
+        res = dict(self._get_status_info)
+        if eventtime is None:
+            eventtime = self._reactor.monotonic()
+        res['buffer_health'] = self._get_buffer_health(eventtime)
+        return res
     def stats(self, eventtime):
         load = "mcu_awake=%.03f mcu_task_avg=%.06f mcu_task_stddev=%.06f" % (
             self._mcu_tick_awake, self._mcu_tick_avg, self._mcu_tick_stddev)
@@ -1007,8 +1119,21 @@ class MCU:
         parts = [s.split('=', 1) for s in stats.split()]
         last_stats = {k:(float(v) if '.' in v else int(v)) for k, v in parts}
         self._get_status_info['last_stats'] = last_stats
+        if self._timing_hist_cmd is not None and not self._is_shutdown:
+            # Report histograms collected since the previous request
+            hists, self._timing_hists = self._timing_hists, {}
+            types = TIMING_HISTOGRAMS[:self._timing_hist_types]
+            for htype, name in enumerate(types):
+                if htype in hists:
+                    stats += ' %s=%s' % (
+                        name, ','.join([str(c) for c in hists[htype]]))
+                self._timing_hist_cmd.send([htype])
         return False, '%s: %s' % (self._name, stats)
 
+# Histogram names (in "get_timing_histogram" type order)
+TIMING_HISTOGRAMS = ["hist_timer_latency", "hist_stepper_time",
+                     "hist_timer_time", "hist_task_time", "hist_timer_batch"]
+
 Common_MCU_errors = {
     ("Timer too close",): """
 This often indicates the host computer is overloaded. Check
@@ -1037,14 +1162,40 @@ def error_help(msg):
                 return help_msg
     return ""
 
+# Connect to all the micro-controllers concurrently
+def connect_mcus(printer, mcus):
+    reactor = printer.get_reactor()
+    def connect(mcu, main_sync_wait=None):
+        def connect_cb(eventtime):
+            try:
+                mcu._connect_serial(main_sync_wait)
+            except Exception as e:
+                return e
+            return None
+        return reactor.register_callback(connect_cb)
+    # The secondary mcus can only synchronize their clocks once the
+    # main mcu clock is known
+    main_completion = connect(mcus[0])
+    completions = [main_completion] + [
+        connect(m, main_completion.wait) for m in mcus[1:]]
+    errors = [c.wait() for c in completions]
+    for e in errors:
+        if e is not None:
+            raise e
+
 def add_printer_objects(config):
     printer = config.get_printer()
     reactor = printer.get_reactor()
+    mcus = []
+    # Must be registered ahead of the per-mcu "klippy:mcu_identify" handlers
+    printer.register_event_handler("klippy:mcu_identify",
+                                   lambda: connect_mcus(printer, mcus))
     mainsync = clocksync.ClockSync(reactor)
-    printer.add_object('mcu', MCU(config.getsection('mcu'), mainsync))
+    mcus.append(MCU(config.getsection('mcu'), mainsync))
+    printer.add_object('mcu', mcus[0])
     for s in config.get_prefix_sections('mcu '):
-        printer.add_object(s.section, MCU(
-            s, clocksync.SecondarySync(reactor, mainsync)))
+        mcus.append(MCU(s, clocksync.SecondarySync(reactor, mainsync)))
+        printer.add_object(s.section, mcus[-1])
 
 def get_printer_mcu(printer, name):
     if name == 'mcu':
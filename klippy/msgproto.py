@@ -39,6 +39,7 @@ class PT_uint32:
     is_dynamic_string = False
     max_length = 5
     signed = False
+    c_type = 'u'
     def encode(self, out, v):
         if v >= 0xc000000 or v < -0x4000000: out.append((v>>28) & 0x7f | 0x80)
         if v >= 0x180000 or v < -0x80000:    out.append((v>>21) & 0x7f | 0x80)
@@ -61,6 +62,7 @@ class PT_uint32:
 
 class PT_int32(PT_uint32):
     signed = True
+    c_type = 'i'
 class PT_uint16(PT_uint32):
     max_length = 3
 class PT_int16(PT_int32):
@@ -73,6 +75,7 @@ class PT_string:
     is_int = False
     is_dynamic_string = True
     max_length = 64
+    c_type = 's'
     def encode(self, out, v):
         out.append(len(v))
         out.extend(bytearray(v))
@@ -99,6 +102,7 @@ class Enumeration:
     def __init__(self, pt, enum_name, enums):
         self.pt = pt
         self.max_length = pt.max_length
+        self.c_type = pt.c_type
         self.enum_name = enum_name
         self.enums = enums
         self.reverse_enums = {v: k for k, v in enums.items()}
@@ -159,9 +163,34 @@ def convert_msg_format(msgformat):
         msgformat = msgformat.replace(c, '%s')
     return msgformat
 
+# Message ids are encoded on the wire like an integer parameter of the
+# "msgtag" (ids 96-127 use a negative msgtag so that they fit in one byte)
+def msgid_to_msgtag(msgid):
+    if msgid >= 96 and msgid < 128:
+        return msgid - 128
+    return msgid
+
+def msgtag_to_msgid(msgtag):
+    if msgtag >= -32 and msgtag < 0:
+        return msgtag + 128
+    return msgtag
+
+def encode_msgid(msgid):
+    out = []
+    PT_int32().encode(out, msgid_to_msgtag(msgid))
+    return out
+
+def parse_msgid(s, pos):
+    if not s[pos] & 0x80:
+        return s[pos], pos + 1
+    msgtag, pos = PT_int32().parse(s, pos)
+    return msgtag_to_msgid(msgtag), pos
+
 class MessageFormat:
     def __init__(self, msgid, msgformat, enumerations={}):
         self.msgid = msgid
+        self.msgtag = msgid_to_msgtag(msgid)
+        self.msgid_bytes = encode_msgid(msgid)
         self.msgformat = msgformat
         self.debugformat = convert_msg_format(msgformat)
         self.name = msgformat.split()[0]
@@ -169,19 +198,17 @@ class MessageFormat:
         self.param_types = [t for name, t in self.param_names]
         self.name_to_type = dict(self.param_names)
     def encode(self, params):
-        out = []
-        out.append(self.msgid)
+        out = list(self.msgid_bytes)
         for i, t in enumerate(self.param_types):
             t.encode(out, params[i])
         return out
     def encode_by_name(self, **params):
-        out = []
-        out.append(self.msgid)
+        out = list(self.msgid_bytes)
         for name, t in self.param_names:
             t.encode(out, params[name])
         return out
     def parse(self, s, pos):
-        pos += 1
+        pos += len(self.msgid_bytes)
         out = {}
         for name, t in self.param_names:
             v, pos = t.parse(s, pos)
@@ -200,11 +227,12 @@ class OutputFormat:
     name = '#output'
     def __init__(self, msgid, msgformat):
         self.msgid = msgid
+        self.msgid_len = len(encode_msgid(msgid))
         self.msgformat = msgformat
         self.debugformat = convert_msg_format(msgformat)
         self.param_types = lookup_output_params(msgformat)
     def parse(self, s, pos):
-        pos += 1
+        pos += self.msgid_len
         out = []
         for t in self.param_types:
             v, pos = t.parse(s, pos)
@@ -266,7 +294,7 @@ class MessageParser:
         out = ["seq: %02x" % (msgseq,)]
         pos = MESSAGE_HEADER_SIZE
         while 1:
-            msgid = s[pos]
+            msgid, _ = parse_msgid(s, pos)
             mid = self.messages_by_id.get(msgid, self.unknown)
             params, pos = mid.parse(s, pos)
             out.append(mid.format_params(params))
@@ -283,7 +311,7 @@ class MessageParser:
             return "%s %s" % (name, msg)
         return str(params)
     def parse(self, s):
-        msgid = s[MESSAGE_HEADER_SIZE]
+        msgid, _ = parse_msgid(s, MESSAGE_HEADER_SIZE)
         mid = self.messages_by_id.get(msgid, self.unknown)
         params, pos = mid.parse(s, MESSAGE_HEADER_SIZE)
         if pos != len(s)-MESSAGE_TRAILER_SIZE:
@@ -380,10 +408,10 @@ class MessageParser:
             elif msgtag in output_tags:
                 msgtype = 'output'
             self.messages.append((msgtag, msgtype, msgformat))
-            if msgtag < -32 or msgtag > 95:
-                self._error("Multi-byte msgtag not supported")
+            if msgtag < -32:
+                self._error("Invalid msgtag %d", msgtag)
             self.msgtag_by_format[msgformat] = msgtag
-            msgid = msgtag & 0x7f
+            msgid = msgtag_to_msgid(msgtag)
             if msgtype == 'output':
                 self.messages_by_id[msgid] = OutputFormat(msgid, msgformat)
             else:
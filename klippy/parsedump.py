@@ -4,7 +4,7 @@
 # Copyright (C) 2016  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, sys, logging
+import os, sys, optparse, logging
 import msgproto
 
 def read_dictionary(filename):
@@ -13,33 +13,285 @@ def read_dictionary(filename):
     dfile.close()
     return dictionary
 
+# Decode message blocks using the chelper code (if it is available)
+class StreamDecoder:
+    def __init__(self, mp):
+        self.mp = mp
+        try:
+            import chelper
+            self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        except Exception:
+            logging.info("Using python parser (chelper unavailable)")
+            self.ffi_main = None
+            self.read_size = 4096
+            return
+        self.read_size = 256 * 1024
+        self.data_max = 64 * 1024
+        self.values = self.ffi_main.new('int64_t[]', self.data_max)
+        self.consumed = self.ffi_main.new('int *')
+        self.formats = {}
+        self.type_strings = []
+        self.c_formats = self.ffi_main.new('char *[]', 128)
+        for msgid, mid in mp.messages_by_id.items():
+            if not isinstance(mid, msgproto.MessageFormat) or msgid >= 128:
+                # Multi-byte message ids are handled by the python parser
+                continue
+            c_types = ''.join([t.c_type for t in mid.param_types])
+            types = self.ffi_main.new('char[]', c_types.encode())
+            self.type_strings.append(types)
+            self.c_formats[msgid] = types
+            enums = [i for i, t in enumerate(mid.param_types)
+                     if isinstance(t, msgproto.Enumeration)]
+            buffers = [i for i, t in enumerate(mid.param_types)
+                       if t.c_type == 's']
+            self.formats[msgid] = (mid, len(c_types), buffers, enums)
+    def _decode_python(self, data, msgs):
+        # Decode a single block using the python parser
+        mp = self.mp
+        l = mp.check_packet(data)
+        if l <= 0:
+            return l
+        pos = msgproto.MESSAGE_HEADER_SIZE
+        while pos < l - msgproto.MESSAGE_TRAILER_SIZE:
+            msgid, _ = msgproto.parse_msgid(data, pos)
+            mid = mp.messages_by_id.get(msgid, mp.unknown)
+            params, pos = mid.parse(data[:l], pos)
+            if isinstance(mid, msgproto.MessageFormat):
+                msgs.append((mid, [params[name]
+                                   for name, t in mid.param_names]))
+            else:
+                msgs.append((None, [mid.format_params(params)]))
+        return l
+    def decode(self, data, msgs):
+        # Decode complete blocks in data, returning the bytes consumed
+        # (or the negative number of invalid bytes).  Each decoded
+        # message is added to 'msgs' as (MessageFormat, params) or, if
+        # decoded in python, as (None, list_of_text_lines).
+        if self.ffi_main is None:
+            return self._decode_python(data, msgs)
+        buf = self.ffi_main.from_buffer(data)
+        count = self.ffi_lib.msgblock_decode_stream(
+            buf, len(data), self.c_formats, self.values, self.data_max,
+            self.consumed)
+        consumed = self.consumed[0]
+        if not consumed:
+            return self._decode_python(data, msgs)
+        values = self.ffi_main.unpack(self.values, count)
+        formats = self.formats
+        pos = 0
+        while pos < count:
+            mid, num, buffers, enums = formats[values[pos]]
+            params = values[pos+1:pos+1+num]
+            pos += 1 + num
+            for i in buffers:
+                v = params[i]
+                offset = v >> 8
+                params[i] = bytes(data[offset:offset + (v & 0xff)])
+            for i in enums:
+                v = params[i]
+                tv = mid.param_types[i].reverse_enums.get(v)
+                if tv is None:
+                    tv = "?%d" % (v,)
+                params[i] = tv
+            msgs.append((mid, params))
+        return consumed
+
+def format_message(mid, params):
+    out = list(params)
+    for i, t in enumerate(mid.param_types):
+        if t.is_dynamic_string:
+            out[i] = repr(out[i])
+    return mid.debugformat % tuple(out)
+
+# Track the step times of each stepper oid
+class StepperTracker:
+    def __init__(self, oid, csv_file):
+        self.oid = oid
+        self.csv_file = csv_file
+        self.clock = None
+        self.dir = 0
+        self.step_msgs = self.steps = self.resets = 0
+        self.min_interval = None
+        self.first_clock = self.last_clock = None
+    def reset_clock(self, clock32):
+        self.resets += 1
+        if self.clock is None:
+            self.clock = clock32
+            return
+        diff = (clock32 - self.clock) & 0xffffffff
+        if diff & 0x80000000:
+            diff -= 1 << 32
+        self.clock += diff
+    def set_dir(self, direction):
+        self.dir = direction
+    def add_move(self, interval, count, add, add2):
+        if self.clock is None:
+            self.clock = 0
+        self.step_msgs += 1
+        self.steps += count
+        # Find the smallest interval in the sequence
+        cand = [0, count - 1]
+        if add2:
+            k = int(.5 - float(add) / add2)
+            cand.extend([min(max(k, 0), count - 1),
+                         min(max(k + 1, 0), count - 1)])
+        min_interval = min([interval + k * add + add2 * (k * (k - 1) // 2)
+                            for k in cand])
+        if self.min_interval is None or min_interval < self.min_interval:
+            self.min_interval = min_interval
+        # Determine the time of each step
+        clock = self.clock
+        if self.csv_file is None:
+            clock += (count * interval + add * (count * (count - 1) // 2)
+                      + add2 * ((count * (count - 1) * (count - 2)) // 6))
+        else:
+            lines = []
+            prefix = "%d," % (self.oid,)
+            suffix = ",%d\n" % (self.dir,)
+            for i in range(count):
+                clock += interval
+                interval += add
+                add += add2
+                lines.append(prefix + str(clock) + suffix)
+            self.csv_file.write(''.join(lines))
+        if self.first_clock is None:
+            self.first_clock = self.clock
+        self.clock = self.last_clock = clock
+
+# Track and summarize the step commands in the data dump
+class StepStats:
+    def __init__(self, mp, csv_file):
+        self.mcu_freq = mp.get_constant_float('CLOCK_FREQ', 1.)
+        self.csv_file = csv_file
+        if csv_file is not None:
+            csv_file.write("oid,clock,dir\n")
+        self.steppers = {}
+        self.handlers = {
+            'queue_step': self._handle_queue_step,
+            'queue_step_add2': self._handle_queue_step_add2,
+            'queue_steps': self._handle_queue_steps,
+            'queue_steps_dir': self._handle_queue_steps_dir,
+            'reset_step_clock': self._handle_reset_step_clock,
+            'set_next_step_dir': self._handle_set_next_step_dir,
+        }
+    def _lookup(self, oid):
+        st = self.steppers.get(oid)
+        if st is None:
+            st = self.steppers[oid] = StepperTracker(oid, self.csv_file)
+        return st
+    def _handle_queue_step(self, params):
+        oid, interval, count, add = params
+        self._lookup(oid).add_move(interval, count, add, 0)
+    def _handle_queue_step_add2(self, params):
+        oid, interval, count, add, add2 = params
+        self._lookup(oid).add_move(interval, count, add, add2)
+    def _handle_queue_steps(self, params, has_dir=False):
+        oid, data = params
+        st = self._lookup(oid)
+        data = bytearray(data)
+        pt = msgproto.PT_int32()
+        pos = next_interval = 0
+        while pos < len(data):
+            count_flag, pos = pt.parse(data, pos)
+            delta, pos = pt.parse(data, pos)
+            add, pos = pt.parse(data, pos)
+            add2 = 0
+            if count_flag & 1:
+                add2, pos = pt.parse(data, pos)
+            count_flag &= 0xffffffff
+            if has_dir:
+                st.set_dir((count_flag >> 1) & 1)
+                count_flag = ((count_flag >> 1) & ~1) | (count_flag & 1)
+            count = count_flag >> 1
+            add = ((add + 0x8000) & 0xffff) - 0x8000
+            add2 = ((add2 + 0x8000) & 0xffff) - 0x8000
+            interval = (next_interval + delta) & 0xffffffff
+            st.add_move(interval, count, add, add2)
+            next_interval = (interval + count * add
+                             + add2 * (count * (count - 1) // 2)) & 0xffffffff
+    def _handle_queue_steps_dir(self, params):
+        self._handle_queue_steps(params, has_dir=True)
+    def _handle_reset_step_clock(self, params):
+        oid, clock = params
+        self._lookup(oid).reset_clock(clock)
+    def _handle_set_next_step_dir(self, params):
+        oid, direction = params
+        self._lookup(oid).set_dir(direction)
+    def note_message(self, mid, params):
+        hdl = self.handlers.get(mid.name)
+        if hdl is not None:
+            hdl(params)
+    def get_summary(self):
+        out = ["%-5s %10s %12s %10s %12s %14s" % (
+            "oid", "step_msgs", "steps", "resets", "min_interval",
+            "max_steps/sec")]
+        for oid, st in sorted(self.steppers.items()):
+            max_rate = 0.
+            if st.min_interval:
+                max_rate = self.mcu_freq / st.min_interval
+            out.append("%-5d %10d %12d %10d %12s %14.0f" % (
+                oid, st.step_msgs, st.steps, st.resets, st.min_interval,
+                max_rate))
+        return '\n'.join(out) + '\n'
+
 def main():
-    dict_filename, data_filename = sys.argv[1:]
+    usage = "%prog [options] <dictionary file> <data file>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-s", "--summary", action="store_true",
+                    help="report a summary of the step commands per oid")
+    opts.add_option("-c", "--csv", type="string", dest="csv",
+                    help="write the time of every step to a csv file")
+    options, args = opts.parse_args()
+    if len(args) != 2:
+        opts.error("Incorrect number of arguments")
+    dict_filename, data_filename = args
 
     dictionary = read_dictionary(dict_filename)
 
     mp = msgproto.MessageParser()
     mp.process_identify(dictionary, decompress=False)
+    decoder = StreamDecoder(mp)
+    track_steps = options.summary or options.csv
+    csv_file = None
+    if options.csv:
+        csv_file = open(options.csv, 'w')
+    stats = StepStats(mp, csv_file)
 
     f = open(data_filename, 'rb')
     fd = f.fileno()
     data = bytearray()
     while 1:
-        newdata = os.read(fd, 4096)
+        newdata = os.read(fd, decoder.read_size)
         if not newdata:
             break
         data += bytearray(newdata)
+        pos = 0
         while 1:
-            l = mp.check_packet(data)
+            msgs = []
+            l = decoder.decode(data[pos:], msgs)
             if l == 0:
                 break
             if l < 0:
                 logging.error("Invalid data")
-                data = data[-l:]
+                pos += -l
                 continue
-            msgs = mp.dump(data[:l])
-            sys.stdout.write('\n'.join(msgs[1:]) + '\n')
-            data = data[l:]
+            pos += l
+            out = []
+            for mid, params in msgs:
+                if track_steps:
+                    if mid is not None:
+                        stats.note_message(mid, params)
+                elif mid is None:
+                    out.extend(params)
+                else:
+                    out.append(format_message(mid, params))
+            if out:
+                sys.stdout.write('\n'.join(out) + '\n')
+        data = data[pos:]
+    if options.summary:
+        sys.stdout.write(stats.get_summary())
+    if csv_file is not None:
+        csv_file.close()
 
 if __name__ == '__main__':
     main()
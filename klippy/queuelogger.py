@@ -3,23 +3,52 @@
 # Copyright (C) 2016-2019  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, logging.handlers, threading, queue, time
+import logging, logging.handlers, threading, queue, time, weakref
+
+# Argument types that may be formatted later from the background thread
+DEFER_TYPES = {str, bytes, int, float, bool, type(None)}
 
 # Class to forward all messages through a queue to a background thread
 class QueueHandler(logging.Handler):
     def __init__(self, queue):
         logging.Handler.__init__(self)
         self.queue = queue
+    def get_queue(self):
+        return self.queue
     def emit(self, record):
         try:
+            queue = self.get_queue()
+            args = record.args
+            if (not record.exc_info and type(args) is tuple
+                and not [1 for a in args if type(a) not in DEFER_TYPES]):
+                # Arguments can't change - format in background thread
+                queue.put_nowait(record)
+                return
             self.format(record)
             record.msg = record.message
             record.args = None
             record.exc_info = None
-            self.queue.put_nowait(record)
+            queue.put_nowait(record)
         except Exception:
             self.handleError(record)
 
+# Forward messages to a queue selected by the calling thread (used
+# when several printers are run from a single process)
+class ThreadQueueHandler(QueueHandler):
+    def __init__(self, queue):
+        QueueHandler.__init__(self, queue)
+        self.thread_queues = weakref.WeakKeyDictionary()
+    def set_thread_queue(self, queue, thread=None):
+        if thread is None:
+            thread = threading.current_thread()
+        if queue is None:
+            self.thread_queues.pop(thread, None)
+            return
+        self.thread_queues[thread] = queue
+    def get_queue(self):
+        thread = threading.current_thread()
+        return self.thread_queues.get(thread, self.queue)
+
 # Class to poll a queue in a background thread and log each message
 class QueueListener(logging.handlers.TimedRotatingFileHandler):
     def __init__(self, filename):
@@ -66,6 +95,28 @@ def setup_bg_logging(filename, debuglevel):
     root.setLevel(debuglevel)
     return ql
 
+def setup_thread_bg_logging(filename, debuglevel):
+    global MainQueueHandler
+    ql = QueueListener(filename)
+    MainQueueHandler = ThreadQueueHandler(ql.bg_queue)
+    root = logging.getLogger()
+    root.addHandler(MainQueueHandler)
+    root.setLevel(debuglevel)
+    return ql
+
+def add_thread_bg_logging(filename):
+    # Log messages from the current thread to a separate file
+    ql = QueueListener(filename)
+    MainQueueHandler.set_thread_queue(ql.bg_queue)
+    return ql
+
+def inherit_thread_logging(thread):
+    # Log messages from 'thread' to the same file as the current thread
+    if isinstance(MainQueueHandler, ThreadQueueHandler):
+        queue = MainQueueHandler.get_queue()
+        if queue is not MainQueueHandler.queue:
+            MainQueueHandler.set_thread_queue(queue, thread)
+
 def clear_bg_logging():
     global MainQueueHandler
     if MainQueueHandler is not None:
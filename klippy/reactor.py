@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, gc, select, math, time, logging, queue
+import os, gc, select, math, time, logging, queue, heapq, threading
 import greenlet
 import chelper, util
 
@@ -14,6 +14,7 @@ class ReactorTimer:
     def __init__(self, callback, waketime):
         self.callback = callback
         self.waketime = waketime
+        self.is_registered = True
 
 class ReactorCompletion:
     class sentinel: pass
@@ -91,18 +92,44 @@ class ReactorMutex:
         self.next_pending = True
         self.reactor.update_timer(self.queue[0].timer, self.reactor.NOW)
 
+# Coordinate Python garbage collection between several reactors that
+# run in different threads of one process.  A collection holds the
+# interpreter lock, so it is only run when no reactor has a timer due.
+class GCCoordinator:
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._idle_until = {}
+    def register_reactor(self, reactor):
+        with self._lock:
+            self._idle_until[reactor] = _NOW
+    def unregister_reactor(self, reactor):
+        with self._lock:
+            self._idle_until.pop(reactor, None)
+    def note_busy(self, reactor):
+        self._idle_until[reactor] = _NOW
+    def note_idle(self, reactor, idle_until):
+        self._idle_until[reactor] = idle_until
+    def all_idle(self, eventtime):
+        with self._lock:
+            return all(t > eventtime for t in self._idle_until.values())
+
 class SelectReactor:
     NOW = _NOW
     NEVER = _NEVER
-    def __init__(self, gc_checking=False):
+    def __init__(self, gc_checking=False, gc_coordinator=None):
         # Main code
         self._process = False
         self.monotonic = chelper.get_ffi()[1].get_monotonic
         # Python garbage collection
         self._check_gc = gc_checking
+        self._gc_coordinator = gc_coordinator
+        if gc_coordinator is not None:
+            gc_coordinator.register_reactor(self)
         self._last_gc_times = [0., 0., 0.]
         # Timers
         self._timers = []
+        self._timer_heap = []
+        self._timer_seq = 0
         self._next_timer = self.NEVER
         # Callbacks
         self._pipe_fds = None
@@ -117,28 +144,48 @@ class SelectReactor:
     def get_gc_stats(self):
         return tuple(self._last_gc_times)
     # Timers
+    def _push_timer(self, timer_handler, waketime):
+        # Every registered timer with a pending waketime has an entry in
+        # the heap for that waketime.  Entries are not removed when a
+        # timer is rescheduled - stale entries are skipped when popped.
+        if waketime >= self.NEVER:
+            return
+        heap = self._timer_heap
+        if len(heap) > 2 * len(self._timers) + 32:
+            # Discard accumulated stale entries
+            heap = [e for e in heap
+                    if e[0] == e[2].waketime and e[2].is_registered]
+            heapq.heapify(heap)
+            self._timer_heap = heap
+        self._timer_seq += 1
+        heapq.heappush(heap, (waketime, self._timer_seq, timer_handler))
+        self._next_timer = min(self._next_timer, waketime)
     def update_timer(self, timer_handler, waketime):
+        if waketime == timer_handler.waketime:
+            return
         timer_handler.waketime = waketime
-        self._next_timer = min(self._next_timer, waketime)
+        if timer_handler.is_registered:
+            self._push_timer(timer_handler, waketime)
     def register_timer(self, callback, waketime=NEVER):
         timer_handler = ReactorTimer(callback, waketime)
-        timers = list(self._timers)
-        timers.append(timer_handler)
-        self._timers = timers
-        self._next_timer = min(self._next_timer, waketime)
+        self._timers.append(timer_handler)
+        self._push_timer(timer_handler, waketime)
         return timer_handler
     def unregister_timer(self, timer_handler):
         timer_handler.waketime = self.NEVER
-        timers = list(self._timers)
-        timers.pop(timers.index(timer_handler))
-        self._timers = timers
+        timer_handler.is_registered = False
+        self._timers.remove(timer_handler)
     def _check_timers(self, eventtime, busy):
+        gc_coordinator = self._gc_coordinator
         if eventtime < self._next_timer:
             if busy:
                 return 0.
+            if gc_coordinator is not None:
+                gc_coordinator.note_idle(self, self._next_timer)
             if self._check_gc:
                 gi = gc.get_count()
-                if gi[0] >= 700:
+                if gi[0] >= 700 and (gc_coordinator is None
+                                     or gc_coordinator.all_idle(eventtime)):
                     # Reactor looks idle and gc is due - run it
                     gc_level = 0
                     if gi[1] >= 10:
@@ -149,18 +196,35 @@ class SelectReactor:
                     gc.collect(gc_level)
                     return 0.
             return min(1., max(.001, self._next_timer - eventtime))
-        self._next_timer = self.NEVER
+        if gc_coordinator is not None:
+            gc_coordinator.note_busy(self)
         g_dispatch = self._g_dispatch
-        for t in self._timers:
-            waketime = t.waketime
-            if eventtime >= waketime:
-                t.waketime = self.NEVER
-                t.waketime = waketime = t.callback(eventtime)
-                if g_dispatch is not self._g_dispatch:
-                    self._next_timer = min(self._next_timer, waketime)
-                    self._end_greenlet(g_dispatch)
-                    return 0.
-            self._next_timer = min(self._next_timer, waketime)
+        last_seq = self._timer_seq
+        while 1:
+            heap = self._timer_heap
+            if not heap or heap[0][0] > eventtime:
+                break
+            waketime, seq, t = heap[0]
+            if seq > last_seq and waketime == t.waketime:
+                # Timer (re)scheduled during this pass - run on next pass
+                break
+            heapq.heappop(heap)
+            if waketime != t.waketime or not t.is_registered:
+                # Stale entry (timer was rescheduled or unregistered)
+                continue
+            t.waketime = self.NEVER
+            waketime = t.callback(eventtime)
+            if t.is_registered:
+                self.update_timer(t, waketime)
+            if g_dispatch is not self._g_dispatch:
+                self._next_timer = self.NOW
+                self._end_greenlet(g_dispatch)
+                return 0.
+        heap = self._timer_heap
+        if heap:
+            self._next_timer = heap[0][0]
+        else:
+            self._next_timer = self.NEVER
         return 0.
     # Callbacks and Completions
     def completion(self):
@@ -307,8 +371,8 @@ class SelectReactor:
             self._pipe_fds = None
 
 class PollReactor(SelectReactor):
-    def __init__(self, gc_checking=False):
-        SelectReactor.__init__(self, gc_checking)
+    def __init__(self, gc_checking=False, gc_coordinator=None):
+        SelectReactor.__init__(self, gc_checking, gc_coordinator)
         self._poll = select.poll()
         self._fds = {}
     # File descriptors
@@ -358,8 +422,8 @@ class PollReactor(SelectReactor):
         self._g_dispatch = None
 
 class EPollReactor(SelectReactor):
-    def __init__(self, gc_checking=False):
-        SelectReactor.__init__(self, gc_checking)
+    def __init__(self, gc_checking=False, gc_coordinator=None):
+        SelectReactor.__init__(self, gc_checking, gc_coordinator)
         self._epoll = select.epoll()
         self._fds = {}
     # File descriptors
@@ -6,20 +6,70 @@
 import logging, threading, os
 import serial
 
-import msgproto, chelper, util
+import msgproto, chelper, util, queuelogger
 
 class error(Exception):
     pass
 
+PULL_BATCH_SIZE = 16
+
+# Decode received messages using the chelper code
+class MessageDecoder:
+    def __init__(self, msgparser, ffi_main, ffi_lib):
+        self.msgparser = msgparser
+        self.ffi_main = ffi_main
+        self.decode_params = ffi_lib.msgblock_decode_params
+        self.values = ffi_main.new('int64_t[]', msgproto.MESSAGE_PAYLOAD_MAX)
+        self.formats = {}
+        for msgid, mp in msgparser.messages_by_id.items():
+            if not isinstance(mp, msgproto.MessageFormat):
+                continue
+            names = [name for name, t in mp.param_names]
+            c_types = ''.join([t.c_type for t in mp.param_types]).encode()
+            buffers = [name for name, t in mp.param_names if t.c_type == 's']
+            enums = [(name, t.reverse_enums) for name, t in mp.param_names
+                     if isinstance(t, msgproto.Enumeration)]
+            self.formats[msgid] = (mp.name, names, c_types, buffers, enums)
+    def parse(self, response):
+        count = response.len
+        msgid, _ = msgproto.parse_msgid(response.msg,
+                                        msgproto.MESSAGE_HEADER_SIZE)
+        fmt = self.formats.get(msgid)
+        if fmt is None:
+            # Output and unknown messages use the python parser
+            return self.msgparser.parse(response.msg[0:count])
+        name, names, c_types, buffers, enums = fmt
+        num = self.decode_params(response.msg, count, c_types, self.values)
+        if num < 0:
+            # Invalid message - let the python parser report the error
+            return self.msgparser.parse(response.msg[0:count])
+        params = dict(zip(names, self.ffi_main.unpack(self.values, num)))
+        params['#name'] = name
+        for bname in buffers:
+            v = params[bname]
+            offset = v >> 8
+            params[bname] = self.ffi_main.buffer(response.msg, count)[
+                offset:offset + (v & 0xff)]
+        for ename, reverse_enums in enums:
+            v = params[ename]
+            tv = reverse_enums.get(v)
+            if tv is None:
+                tv = "?%d" % (v,)
+            params[ename] = tv
+        return params
+
 class SerialReader:
-    def __init__(self, reactor, warn_prefix=""):
+    def __init__(self, reactor, warn_prefix="", shared_thread=False):
         self.reactor = reactor
         self.warn_prefix = warn_prefix
+        self.shared_thread = shared_thread
         # Serial port
         self.serial_dev = None
         self.msgparser = msgproto.MessageParser(warn_prefix=warn_prefix)
         # C interface
         self.ffi_main, self.ffi_lib = chelper.get_ffi()
+        self.msgdecoder = MessageDecoder(self.msgparser, self.ffi_main,
+                                         self.ffi_lib)
         self.serialqueue = None
         self.default_cmd_queue = self.alloc_command_queue()
         self.stats_buf = self.ffi_main.new('char[4096]')
@@ -34,36 +84,47 @@ class SerialReader:
         self.last_notify_id = 0
         self.pending_notifications = {}
     def _bg_thread(self):
-        response = self.ffi_main.new('struct pull_queue_message *')
+        responses = self.ffi_main.new('struct pull_queue_message[%d]'
+                                      % (PULL_BATCH_SIZE,))
         while 1:
-            self.ffi_lib.serialqueue_pull(self.serialqueue, response)
-            count = response.len
-            if count < 0:
+            # Obtain all pending messages in a single call (to reduce
+            # the number of times the GIL and self.lock are acquired)
+            count = self.ffi_lib.serialqueue_pull_batch(
+                self.serialqueue, responses, PULL_BATCH_SIZE)
+            is_exit = responses[count - 1].len < 0
+            if is_exit:
+                count -= 1
+            with self.lock:
+                for i in range(count):
+                    try:
+                        self._process_response(responses[i])
+                    except:
+                        logging.exception("%sException in serial callback",
+                                          self.warn_prefix)
+            if is_exit:
                 break
-            if response.notify_id:
-                params = {'#sent_time': response.sent_time,
-                          '#receive_time': response.receive_time}
-                completion = self.pending_notifications.pop(response.notify_id)
-                self.reactor.async_complete(completion, params)
-                continue
-            params = self.msgparser.parse(response.msg[0:count])
-            params['#sent_time'] = response.sent_time
-            params['#receive_time'] = response.receive_time
-            hdl = (params['#name'], params.get('oid'))
-            try:
-                with self.lock:
-                    hdl = self.handlers.get(hdl, self.handle_default)
-                    hdl(params)
-            except:
-                logging.exception("%sException in serial callback",
-                                  self.warn_prefix)
+    def _process_response(self, response):
+        if response.notify_id:
+            params = {'#sent_time': response.sent_time,
+                      '#receive_time': response.receive_time}
+            completion = self.pending_notifications.pop(response.notify_id)
+            self.reactor.async_complete(completion, params)
+            return
+        params = self.msgdecoder.parse(response)
+        params['#sent_time'] = response.sent_time
+        params['#receive_time'] = response.receive_time
+        hdl = (params['#name'], params.get('oid'))
+        hdl = self.handlers.get(hdl, self.handle_default)
+        hdl(params)
     def _error(self, msg, *params):
         raise error(self.warn_prefix + (msg % params))
     def _get_identify_data(self, eventtime):
         # Query the "data dictionary" from the micro-controller
         identify_data = b""
+        # Largest chunk that fits in a response (msgid, offset, length)
+        count = msgproto.MESSAGE_PAYLOAD_MAX - 5
         while 1:
-            msg = "identify offset=%d count=%d" % (len(identify_data), 40)
+            msg = "identify offset=%d count=%d" % (len(identify_data), count)
             try:
                 params = self.send_with_response(msg, 'identify_response')
             except error as e:
@@ -78,11 +139,18 @@ class SerialReader:
                 identify_data += msgdata
     def _start_session(self, serial_dev, serial_fd_type=b'u', client_id=0):
         self.serial_dev = serial_dev
-        self.serialqueue = self.ffi_main.gc(
-            self.ffi_lib.serialqueue_alloc(serial_dev.fileno(),
-                                           serial_fd_type, client_id),
-            self.ffi_lib.serialqueue_free)
+        sq_alloc = self.ffi_lib.serialqueue_alloc
+        if self.shared_thread:
+            sq_alloc = self.ffi_lib.serialqueue_alloc_shared
+        sq = sq_alloc(serial_dev.fileno(), serial_fd_type, client_id)
+        if sq == self.ffi_main.NULL:
+            logging.info("%sUnable to start serial session", self.warn_prefix)
+            self.serial_dev = None
+            serial_dev.close()
+            return False
+        self.serialqueue = self.ffi_main.gc(sq, self.ffi_lib.serialqueue_free)
         self.background_thread = threading.Thread(target=self._bg_thread)
+        queuelogger.inherit_thread_logging(self.background_thread)
         self.background_thread.start()
         # Obtain and load the data dictionary from the firmware
         completion = self.reactor.register_callback(self._get_identify_data)
@@ -93,6 +161,8 @@ class SerialReader:
             return False
         msgparser = msgproto.MessageParser(warn_prefix=self.warn_prefix)
         msgparser.process_identify(identify_data)
+        self.msgdecoder = MessageDecoder(msgparser, self.ffi_main,
+                                         self.ffi_lib)
         self.msgparser = msgparser
         self.register_response(self.handle_unknown, '#unknown')
         # Setup baud adjust
@@ -108,10 +178,27 @@ class SerialReader:
             self.ffi_lib.serialqueue_set_receive_window(
                 self.serialqueue, receive_window)
         return True
-    def connect_canbus(self, canbus_uuid, canbus_nodeid, canbus_iface="can0"):
+    def _setup_canbus_fd(self):
+        # Switch to CAN FD frames if the mcu supports them
+        msgparser = self.msgparser
+        data_freq = msgparser.get_constant_float('CANBUS_FD_DATA_FREQUENCY',
+                                                 None)
+        if data_freq is None:
+            logging.warning("%sMCU does not support CAN FD - using classic"
+                            " CAN frames", self.warn_prefix)
+            return
+        logging.info("%sUsing CAN FD frames (data rate %.0f)",
+                     self.warn_prefix, data_freq)
+        self.ffi_lib.serialqueue_set_canbus_fd(self.serialqueue, data_freq)
+    def connect_canbus(self, canbus_uuid, canbus_nodeid, canbus_iface="can0",
+                       canbus_fd=False, canbus_timestamps=False):
         import can # XXX
         txid = canbus_nodeid * 2 + 256
         filters = [{"can_id": txid+1, "can_mask": 0x7ff, "extended": False}]
+        if canbus_timestamps:
+            # Also receive the echo of frames sent by this host
+            filters.append({"can_id": txid, "can_mask": 0x7ff,
+                            "extended": False})
         # Prep for SET_NODEID command
         try:
             uuid = int(canbus_uuid, 16)
@@ -132,9 +219,12 @@ class SerialReader:
             if self.reactor.monotonic() > start_time + 90.:
                 self._error("Unable to connect")
             try:
+                bus_args = {}
+                if canbus_fd:
+                    bus_args['fd'] = True
                 bus = can.interface.Bus(channel=canbus_iface,
                                         can_filters=filters,
-                                        bustype='socketcan')
+                                        bustype='socketcan', **bus_args)
                 bus.send(set_id_msg)
             except (can.CanError, os.error) as e:
                 logging.warning("%sUnable to open CAN port: %s",
@@ -145,6 +235,11 @@ class SerialReader:
             ret = self._start_session(bus, b'c', txid)
             if not ret:
                 continue
+            if canbus_fd:
+                self._setup_canbus_fd()
+            if canbus_timestamps:
+                self.ffi_lib.serialqueue_set_canbus_timestamps(
+                    self.serialqueue, 1)
             # Verify correct canbus_nodeid to canbus_uuid mapping
             try:
                 params = self.send_with_response('get_canbus_id', 'canbus_id')
@@ -174,6 +269,46 @@ class SerialReader:
             ret = self._start_session(serial_dev)
             if ret:
                 break
+    def _lookup_usb_device(self, serialport):
+        # Find the usbfs device and cdc "data" interface of a tty device
+        tty = os.path.basename(os.path.realpath(serialport))
+        ifpath = os.path.realpath("/sys/class/tty/%s/device" % (tty,))
+        devpath = os.path.dirname(ifpath)
+        with open(os.path.join(devpath, "busnum")) as f:
+            busnum = int(f.read())
+        with open(os.path.join(devpath, "devnum")) as f:
+            devnum = int(f.read())
+        prefix = os.path.basename(devpath) + ":"
+        for name in sorted(os.listdir(devpath)):
+            if not name.startswith(prefix):
+                continue
+            ifdir = os.path.join(devpath, name)
+            with open(os.path.join(ifdir, "bInterfaceClass")) as f:
+                if f.read().strip() != "0a":
+                    continue
+            with open(os.path.join(ifdir, "bInterfaceNumber")) as f:
+                ifno = int(f.read(), 16)
+            return "/dev/bus/usb/%03d/%03d" % (busnum, devnum), ifno
+        raise OSError("No usb data interface found for %s" % (serialport,))
+    def connect_usb(self, serialport):
+        logging.info("%sStarting usb bulk connect", self.warn_prefix)
+        start_time = self.reactor.monotonic()
+        while 1:
+            if self.reactor.monotonic() > start_time + 90.:
+                self._error("Unable to connect")
+            try:
+                usbdev, ifno = self._lookup_usb_device(serialport)
+                fd = os.open(usbdev, os.O_RDWR)
+            except (OSError, IOError) as e:
+                logging.warning("%sUnable to open usb device: %s",
+                                self.warn_prefix, e)
+                self.reactor.pause(self.reactor.monotonic() + 5.)
+                continue
+            serial_dev = os.fdopen(fd, 'rb+', 0)
+            ret = self._start_session(serial_dev, b'b', ifno)
+            if ret:
+                break
+            self.reactor.pause(self.reactor.monotonic() + 1.)
     def connect_uart(self, serialport, baud, rts=True):
         # Initial connection
         logging.info("%sStarting serial connect", self.warn_prefix)
@@ -199,6 +334,8 @@ class SerialReader:
     def connect_file(self, debugoutput, dictionary, pace=False):
         self.serial_dev = debugoutput
         self.msgparser.process_identify(dictionary, decompress=False)
+        self.msgdecoder = MessageDecoder(self.msgparser, self.ffi_main,
+                                         self.ffi_lib)
         self.serialqueue = self.ffi_main.gc(
             self.ffi_lib.serialqueue_alloc(self.serial_dev.fileno(), b'f', 0),
             self.ffi_lib.serialqueue_free)
@@ -242,6 +379,10 @@ class SerialReader:
     def raw_send(self, cmd, minclock, reqclock, cmd_queue):
         self.ffi_lib.serialqueue_send(self.serialqueue, cmd_queue,
                                       cmd, len(cmd), minclock, reqclock, 0)
+    def raw_send_encode(self, msgtag, data, minclock, reqclock, cmd_queue):
+        self.ffi_lib.serialqueue_send_encode(self.serialqueue, cmd_queue,
+                                             msgtag, data, len(data),
+                                             minclock, reqclock, 0)
     def raw_send_wait_ack(self, cmd, minclock, reqclock, cmd_queue):
         self.last_notify_id += 1
         nid = self.last_notify_id
@@ -260,9 +401,12 @@ class SerialReader:
         cmd = self.msgparser.create_command(msg)
         src = SerialRetryCommand(self, response)
         return src.get_response([cmd], self.default_cmd_queue)
-    def alloc_command_queue(self):
-        return self.ffi_main.gc(self.ffi_lib.serialqueue_alloc_commandqueue(),
-                                self.ffi_lib.serialqueue_free_commandqueue)
+    def alloc_command_queue(self, priority=0):
+        cq = self.ffi_main.gc(self.ffi_lib.serialqueue_alloc_commandqueue(),
+                              self.ffi_lib.serialqueue_free_commandqueue)
+        if priority:
+            self.ffi_lib.serialqueue_set_commandqueue_priority(cq, priority)
+        return cq
     # Dumping debug lists
     def dump_debug(self):
         out = []
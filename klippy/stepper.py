@@ -16,6 +16,9 @@ class error(Exception):
 
 MIN_BOTH_EDGE_DURATION = 0.000000200
 
+# Step compression methods (see stepcompress.h)
+SC_METHOD_BISECT, SC_METHOD_GREEDY = 0, 1
+
 # Interface to low-level mcu and chelper code
 class MCU_stepper:
     def __init__(self, name, step_pin_params, dir_pin_params,
@@ -50,6 +53,8 @@ class MCU_stepper:
         self._itersolve_generate_steps = ffi_lib.itersolve_generate_steps
         self._itersolve_check_active = ffi_lib.itersolve_check_active
         self._trapq = ffi_main.NULL
+        self._step_leader = None
+        self._step_followers = []
         self._mcu.get_printer().register_event_handler('klippy:connect',
                                                        self._query_mcu_position)
     def get_mcu(self):
@@ -67,6 +72,26 @@ class MCU_stepper:
         if self._step_pulse_duration is None:
             self._step_pulse_duration = pulse_duration
         self._req_step_both_edge = step_both_edge
+    def set_compress_method(self, method):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.stepcompress_set_compress_method(self._stepqueue, method)
+    def set_reserved_moves(self, count):
+        # Reserve mcu move queue items for this stepper's exclusive use
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.stepcompress_set_reserved_moves(self._stepqueue, count)
+        for i in range(count):
+            self._mcu.request_move_queue_slot()
+    def set_step_leader(self, leader):
+        # Generate step pulses from the step timer of another stepper
+        if leader.get_mcu() is not self._mcu:
+            raise self._mcu.get_printer().config_error(
+                "Stepper %s must be on same mcu as %s to share step timer"
+                % (self._name, leader.get_name()))
+        self._step_leader = leader
+        leader._step_followers.append(self)
+    def shares_step_timer(self):
+        # A stepper in a share_step_timer group can not move on its own
+        return self._step_leader is not None or bool(self._step_followers)
     def setup_itersolve(self, alloc_func, *params):
         ffi_main, ffi_lib = chelper.get_ffi()
         sk = ffi_main.gc(getattr(ffi_lib, alloc_func)(*params), ffi_lib.free)
@@ -103,6 +128,40 @@ class MCU_stepper:
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.stepcompress_fill(self._stepqueue, max_error_ticks,
                                   step_cmd_tag, dir_cmd_tag)
+        step_add2_cmd = self._mcu.try_lookup_command(
+            "queue_step_add2 oid=%c interval=%u count=%hu add=%hi add2=%hi")
+        if step_add2_cmd is not None:
+            ffi_lib.stepcompress_fill_add2(self._stepqueue,
+                                           step_add2_cmd.get_command_tag())
+        steps_cmd = self._mcu.try_lookup_command(
+            "queue_steps_dir oid=%c data=%*s")
+        has_dir = steps_cmd is not None
+        if not has_dir:
+            steps_cmd = self._mcu.try_lookup_command(
+                "queue_steps oid=%c data=%*s")
+        if steps_cmd is not None:
+            ffi_lib.stepcompress_fill_queue_steps(
+                self._stepqueue, steps_cmd.get_command_tag(), has_dir)
+        if self._step_leader is not None:
+            self._build_follower_config()
+    def _build_follower_config(self):
+        leader = self._step_leader
+        printer = self._mcu.get_printer()
+        if self._mcu.try_lookup_command(
+                "stepper_add_follower oid=%c follower_oid=%c"
+                " invert_dir=%c") is None:
+            raise printer.config_error(
+                "MCU does not support share_step_timer on stepper %s"
+                % (self._name,))
+        if (self.get_pulse_duration() != leader.get_pulse_duration()
+            or self._step_dist != leader.get_step_dist()):
+            raise printer.config_error(
+                "Stepper %s must use the same step settings as %s"
+                " to share step timer" % (self._name, leader.get_name()))
+        invert_dir = self._invert_dir != leader.get_dir_inverted()[0]
+        self._mcu.add_config_cmd(
+            "stepper_add_follower oid=%d follower_oid=%d invert_dir=%d"
+            % (leader.get_oid(), self._oid, invert_dir))
     def get_oid(self):
         return self._oid
     def get_step_dist(self):
@@ -152,6 +211,12 @@ class MCU_stepper:
         ffi_main, ffi_lib = chelper.get_ffi()
         pos = ffi_lib.stepcompress_find_past_position(self._stepqueue, clock)
         return int(pos)
+    def get_past_mcu_position_frac(self, print_time):
+        # Past position interpolated between the surrounding step times
+        clock = self._mcu.print_time_to_clock(print_time)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        return ffi_lib.stepcompress_find_past_position_frac(self._stepqueue,
+                                                            clock)
     def mcu_to_commanded_position(self, mcu_pos):
         return mcu_pos * self._step_dist - self._mcu_position_offset
     def dump_steps(self, count, start_clock, end_clock):
@@ -160,6 +225,22 @@ class MCU_stepper:
         count = ffi_lib.stepcompress_extract_old(self._stepqueue, data, count,
                                                  start_clock, end_clock)
         return (data, count)
+    def get_step_gen_stats(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        scs = ffi_main.new('struct stepcompress_stats *')
+        ffi_lib.stepcompress_get_stats(self._stepqueue, scs)
+        res = {'steps': scs.steps, 'step_msgs': scs.messages,
+               'step_bytes': scs.bytes, 'compress_time': scs.compress_time,
+               'gen_calls': 0, 'gen_iterations': 0, 'gen_iter_steps': 0,
+               'gen_time': 0.}
+        if self._stepper_kinematics is not None:
+            iss = ffi_main.new('struct itersolve_stats *')
+            ffi_lib.itersolve_get_stats(self._stepper_kinematics, iss)
+            res.update({'gen_calls': iss.calls,
+                        'gen_iterations': iss.iterations,
+                        'gen_iter_steps': iss.iter_steps,
+                        'gen_time': iss.gen_time})
+        return res
     def get_stepper_kinematics(self):
         return self._stepper_kinematics
     def set_stepper_kinematics(self, sk):
@@ -248,6 +329,12 @@ def PrinterStepper(config, units_in_radians=False):
     mcu_stepper = MCU_stepper(name, step_pin_params, dir_pin_params,
                               rotation_dist, steps_per_rotation,
                               step_pulse_duration, units_in_radians)
+    methods = {'bisect': SC_METHOD_BISECT, 'greedy': SC_METHOD_GREEDY}
+    mcu_stepper.set_compress_method(
+        config.getchoice('step_compress_method', methods, 'bisect'))
+    reserved_moves = config.getint('reserved_move_slots', 0, minval=0)
+    if reserved_moves:
+        mcu_stepper.set_reserved_moves(reserved_moves)
     # Register with helper modules
     for mname in ['stepper_enable', 'force_move', 'motion_report']:
         m = printer.load_object(config, mname)
@@ -374,6 +461,12 @@ class PrinterRail:
     def add_extra_stepper(self, config):
         stepper = PrinterStepper(config, self.stepper_units_in_radians)
         self.steppers.append(stepper)
+        if config.getboolean('share_step_timer', False):
+            if config.get('endstop_pin', None) is not None:
+                raise config.error(
+                    "share_step_timer may not be used with an endstop_pin"
+                    " in section '%s'" % (config.get_name(),))
+            stepper.set_step_leader(self.steppers[0])
         if self.endstops and config.get('endstop_pin', None) is None:
             # No endstop defined - use primary endstop
             self.endstops[0][0].add_stepper(stepper)
@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging, importlib
-import mcu, chelper, kinematics.extruder
+import mcu, chelper, stepper, kinematics.extruder
 
 # Common suffixes: _d is distance (in mm), _v is velocity (in
 #   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
@@ -19,10 +19,14 @@ class Move:
         self.accel = toolhead.max_accel
         self.junction_deviation = toolhead.junction_deviation
         self.timing_callbacks = []
+        self.parallel_moves = []
         velocity = min(speed, toolhead.max_velocity)
         self.is_kinematic_move = True
-        self.axes_d = axes_d = [end_pos[i] - start_pos[i] for i in (0, 1, 2, 3)]
-        self.move_d = move_d = math.sqrt(sum([d*d for d in axes_d[:3]]))
+        dx = end_pos[0] - start_pos[0]
+        dy = end_pos[1] - start_pos[1]
+        dz = end_pos[2] - start_pos[2]
+        self.axes_d = axes_d = [dx, dy, dz, end_pos[3] - start_pos[3]]
+        self.move_d = move_d = math.sqrt(dx*dx + dy*dy + dz*dz)
         if move_d < .000000001:
             # Extrude only move
             self.end_pos = (start_pos[0], start_pos[1], start_pos[2],
@@ -37,16 +41,22 @@ class Move:
             self.is_kinematic_move = False
         else:
             inv_move_d = 1. / move_d
-        self.axes_r = [d * inv_move_d for d in axes_d]
+        self.axes_r = axes_r = [d * inv_move_d for d in axes_d]
         self.min_move_t = move_d / velocity
         # Junction speeds are tracked in velocity squared.  The
         # delta_v2 is the maximum amount of this squared-velocity that
         # can change in this move.
-        self.max_start_v2 = 0.
-        self.max_cruise_v2 = velocity**2
+        self.max_cruise_v2 = velocity * velocity
         self.delta_v2 = 2.0 * move_d * self.accel
-        self.max_smoothed_v2 = 0.
         self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
+        inv_axis_accel = toolhead.inv_axis_accel
+        if inv_axis_accel is not None and self.is_kinematic_move:
+            # Apply the direction dependent (elliptical) XY accel limit
+            rx = axes_r[0] * inv_axis_accel[0]
+            ry = axes_r[1] * inv_axis_accel[1]
+            inv_accel = math.sqrt(rx*rx + ry*ry)
+            if inv_accel:
+                self.limit_speed(velocity, 1. / inv_accel)
     def limit_speed(self, speed, accel):
         speed2 = speed**2
         if speed2 < self.max_cruise_v2:
@@ -59,37 +69,6 @@ class Move:
         ep = self.end_pos
         m = "%s: %.3f %.3f %.3f [%.3f]" % (msg, ep[0], ep[1], ep[2], ep[3])
         return self.toolhead.printer.command_error(m)
-    def calc_junction(self, prev_move):
-        if not self.is_kinematic_move or not prev_move.is_kinematic_move:
-            return
-        # Allow extruder to calculate its maximum junction
-        extruder_v2 = self.toolhead.extruder.calc_junction(prev_move, self)
-        # Find max velocity using "approximated centripetal velocity"
-        axes_r = self.axes_r
-        prev_axes_r = prev_move.axes_r
-        junction_cos_theta = -(axes_r[0] * prev_axes_r[0]
-                               + axes_r[1] * prev_axes_r[1]
-                               + axes_r[2] * prev_axes_r[2])
-        if junction_cos_theta > 0.999999:
-            return
-        junction_cos_theta = max(junction_cos_theta, -0.999999)
-        sin_theta_d2 = math.sqrt(0.5*(1.0-junction_cos_theta))
-        R_jd = sin_theta_d2 / (1. - sin_theta_d2)
-        # Approximated circle must contact moves no further away than mid-move
-        tan_theta_d2 = sin_theta_d2 / math.sqrt(0.5*(1.0+junction_cos_theta))
-        move_centripetal_v2 = .5 * self.move_d * tan_theta_d2 * self.accel
-        prev_move_centripetal_v2 = (.5 * prev_move.move_d * tan_theta_d2
-                                    * prev_move.accel)
-        # Apply limits
-        self.max_start_v2 = min(
-            R_jd * self.junction_deviation * self.accel,
-            R_jd * prev_move.junction_deviation * prev_move.accel,
-            move_centripetal_v2, prev_move_centripetal_v2,
-            extruder_v2, self.max_cruise_v2, prev_move.max_cruise_v2,
-            prev_move.max_start_v2 + prev_move.delta_v2)
-        self.max_smoothed_v2 = min(
-            self.max_start_v2
-            , prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
     def set_junction(self, start_v2, cruise_v2, end_v2):
         # Determine accel, cruise, and decel portions of the move distance
         half_inv_accel = .5 / self.accel
@@ -107,80 +86,89 @@ class Move:
         self.decel_t = decel_d / ((end_v + cruise_v) * 0.5)
 
 LOOKAHEAD_FLUSH_TIME = 0.250
+LOOKAHEAD_FLUSH_REASONS = ['lazy', 'buffer_low', 'priming', 'input_idle',
+                           'drip', 'sync']
 
 # Class to track a list of pending move requests and to facilitate
-# "look-ahead" across moves to reduce acceleration between moves.
+# "look-ahead" across moves to reduce acceleration between moves.  The
+# velocity planning itself is done in C code (klippy/chelper/lookahead.c).
 class LookAheadQueue:
     def __init__(self, toolhead):
         self.toolhead = toolhead
         self.queue = []
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.clookahead = ffi_main.gc(ffi_lib.lookahead_alloc(),
+                                      ffi_lib.lookahead_free)
+        self.lookahead_add_move = ffi_lib.lookahead_add_move
+        # Statistics on queued moves (for print_stats)
+        self.queued_dist = self.queued_time = 0.
+        self.forced_flushes = 0
+        self.flush_reasons = {r: 0 for r in LOOKAHEAD_FLUSH_REASONS}
+        # Next extruding move must start from a stop (see extrude_parallel)
+        self.need_extrude_stop = False
     def reset(self):
         del self.queue[:]
+        self.need_extrude_stop = False
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.lookahead_reset(self.clookahead)
     def set_flush_time(self, flush_time):
         self.junction_flush = flush_time
     def get_last(self):
         if self.queue:
             return self.queue[-1]
         return None
-    def flush(self, lazy=False):
+    def flush(self, lazy=False, reason='sync'):
         self.junction_flush = LOOKAHEAD_FLUSH_TIME
-        update_flush_count = lazy
         queue = self.queue
-        flush_count = len(queue)
-        # Traverse queue from last to first move and determine maximum
-        # junction speed assuming the robot comes to a complete stop
-        # after the last move.
-        delayed = []
-        next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
-        for i in range(flush_count-1, -1, -1):
-            move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
-            start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
-            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
-            if smoothed_v2 < reachable_smoothed_v2:
-                # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
-                    # This move can decelerate or this is a full accel
-                    # move after a full decel move
-                    if update_flush_count and peak_cruise_v2:
-                        flush_count = i
-                        update_flush_count = False
-                    peak_cruise_v2 = min(move.max_cruise_v2, (
-                        smoothed_v2 + reachable_smoothed_v2) * .5)
-                    if delayed:
-                        # Propagate peak_cruise_v2 to any delayed moves
-                        if not update_flush_count and i < flush_count:
-                            mc_v2 = peak_cruise_v2
-                            for m, ms_v2, me_v2 in reversed(delayed):
-                                mc_v2 = min(mc_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
-                        del delayed[:]
-                if not update_flush_count and i < flush_count:
-                    cruise_v2 = min((start_v2 + reachable_start_v2) * .5
-                                    , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
-            else:
-                # Delay calculating this move until peak_cruise_v2 is known
-                delayed.append((move, start_v2, next_end_v2))
-            next_end_v2 = start_v2
-            next_smoothed_v2 = smoothed_v2
-        if update_flush_count or not flush_count:
+        if not queue:
             return
+        # Determine the junction speeds of the moves ready to be flushed
+        ffi_main, ffi_lib = chelper.get_ffi()
+        junctions = ffi_main.new('double[]', 3 * len(queue))
+        flush_count = ffi_lib.lookahead_flush(self.clookahead, lazy, junctions)
+        if not flush_count:
+            return
+        if lazy:
+            reason = 'lazy'
+        else:
+            self.forced_flushes += 1
+        self.flush_reasons[reason] += 1
+        for i in range(flush_count):
+            queue[i].set_junction(junctions[i*3], junctions[i*3+1],
+                                  junctions[i*3+2])
         # Generate step times for all moves ready to be flushed
         self.toolhead._process_moves(queue[:flush_count])
         # Remove processed moves from the queue
         del queue[:flush_count]
+        ffi_lib.lookahead_remove_moves(self.clookahead, flush_count)
+    def note_parallel_extrude(self):
+        self.need_extrude_stop = True
     def add_move(self, move):
+        extruder_v2 = 0.
+        if self.queue:
+            prev_move = self.queue[-1]
+            if move.is_kinematic_move and prev_move.is_kinematic_move:
+                # Allow extruder to calculate its maximum junction
+                extruder = self.toolhead.extruder
+                extruder_v2 = extruder.calc_junction(prev_move, move)
+                if self.need_extrude_stop and move.axes_d[3]:
+                    extruder_v2 = 0.
+        if move.axes_d[3]:
+            self.need_extrude_stop = False
         self.queue.append(move)
+        if move.is_kinematic_move:
+            self.queued_dist += move.move_d
+            self.queued_time += move.min_move_t
+        axes_r = move.axes_r
+        self.lookahead_add_move(
+            self.clookahead, move.move_d, move.accel, move.junction_deviation,
+            move.max_cruise_v2, move.delta_v2, move.smooth_delta_v2,
+            move.is_kinematic_move, axes_r[0], axes_r[1], axes_r[2],
+            extruder_v2)
         if len(self.queue) == 1:
             return
-        move.calc_junction(self.queue[-2])
         self.junction_flush -= move.min_move_t
         if self.junction_flush <= 0.:
             # Enough moves have been queued to reach the target flush time.
@@ -189,6 +177,7 @@ class LookAheadQueue:
 BUFFER_TIME_LOW = 1.0
 BUFFER_TIME_HIGH = 2.0
 BUFFER_TIME_START = 0.250
+BUFFER_TIME_INTERACTIVE = 0.150
 BGFLUSH_LOW_TIME = 0.200
 BGFLUSH_BATCH_TIME = 0.200
 BGFLUSH_EXTRA_TIME = 0.250
@@ -203,6 +192,50 @@ DRIP_TIME = 0.100
 class DripModeEndSignal(Exception):
     pass
 
+BUFFER_TUNE_CHECK_TIME = 0.250
+BUFFER_TUNE_DECAY = 1. / 240.
+# Latency (host jitter plus mcu round-trip-time) that the default
+# buffer times are scaled to (5ms or less uses the minimum scale)
+BUFFER_TUNE_LATENCY_REF = 0.010
+BUFFER_TUNE_MIN_SCALE = 0.5
+BUFFER_TUNE_MAX_SCALE = 2.0
+BUFFER_TUNE_HYSTERESIS = 0.10
+
+# Scale the toolhead buffer times from observed host and mcu link latency
+class BufferTimeTuner:
+    def __init__(self, toolhead):
+        self.toolhead = toolhead
+        self.reactor = toolhead.reactor
+        self.host_jitter = self.link_latency = 0.
+        self.scale = 1.
+        self.next_waketime = 0.
+        self.check_timer = self.reactor.register_timer(self._check_event)
+        toolhead.printer.register_event_handler("klippy:ready",
+                                                self._handle_ready)
+    def _handle_ready(self):
+        self.next_waketime = self.reactor.monotonic() + BUFFER_TUNE_CHECK_TIME
+        self.reactor.update_timer(self.check_timer, self.next_waketime)
+    def _check_event(self, eventtime):
+        # Host scheduling jitter is the delay in running this timer;
+        # track a fast rising and slowly decaying peak of it.
+        lateness = max(0., self.reactor.monotonic() - self.next_waketime)
+        self.host_jitter = max(lateness,
+                               self.host_jitter * (1. - BUFFER_TUNE_DECAY))
+        self.link_latency = max([m.get_recent_rtt()
+                                 for m in self.toolhead.all_mcus])
+        latency = self.host_jitter + self.link_latency
+        scale = min(max(latency / BUFFER_TUNE_LATENCY_REF,
+                        BUFFER_TUNE_MIN_SCALE), BUFFER_TUNE_MAX_SCALE)
+        # Only apply changes that exceed the hysteresis band
+        if abs(scale - self.scale) > BUFFER_TUNE_HYSTERESIS * self.scale:
+            logging.info("Buffer time scale %.2f (host_jitter=%.6f"
+                         " link_latency=%.6f)", scale, self.host_jitter,
+                         self.link_latency)
+            self.scale = scale
+            self.toolhead.set_buffer_time_scale(scale)
+        self.next_waketime = eventtime + BUFFER_TUNE_CHECK_TIME
+        return self.next_waketime
+
 # Main code to track events (and their timing) on the printer toolhead
 class ToolHead:
     def __init__(self, config):
@@ -212,7 +245,8 @@ class ToolHead:
             m for n, m in self.printer.lookup_objects(module='mcu')]
         self.mcu = self.all_mcus[0]
         self.lookahead = LookAheadQueue(self)
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self._calc_buffer_times(1.)
+        self.lookahead.set_flush_time(self.buffer_time_high)
         self.commanded_pos = [0., 0., 0., 0.]
         # Velocity and acceleration control
         self.max_velocity = config.getfloat('max_velocity', above=0.)
@@ -232,6 +266,7 @@ class ToolHead:
             'square_corner_velocity', 5., minval=0.)
         self.junction_deviation = self.max_accel_to_decel = 0.
         self._calc_junction_deviation()
+        self.inv_axis_accel = None
         # Input stall detection
         self.check_stall_time = 0.
         self.print_stall = 0
@@ -242,6 +277,7 @@ class ToolHead:
         self.need_check_pause = -1.
         # Print time tracking
         self.print_time = 0.
+        self.buffer_time_start = self.buffer_time_prime
         self.special_queuing_state = "NeedPrime"
         self.priming_timer = None
         self.drip_completion = None
@@ -249,16 +285,35 @@ class ToolHead:
         self.flush_timer = self.reactor.register_timer(self._flush_handler)
         self.do_kick_flush_timer = True
         self.last_flush_time = self.min_restart_time = 0.
+        self.parallel_extrude_time = 0.
         self.need_flush_time = self.step_gen_time = self.clear_history_time = 0.
         # Kinematic step generation scan window time tracking
         self.kin_flush_delay = SDS_CHECK_TIME
         self.kin_flush_times = []
+        # Optional tracing of moves through the motion pipeline
+        self.trace_callback = None
+        # Optional runtime tuning of the buffer times
+        self.buffer_tuner = None
+        if config.getboolean('buffer_time_auto', False) and self.can_pause:
+            self.buffer_tuner = BufferTimeTuner(self)
         # Setup iterative solver
         ffi_main, ffi_lib = chelper.get_ffi()
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
-        self.trapq_append = ffi_lib.trapq_append
+        self.trapq_append_batch = ffi_lib.trapq_append_batch
         self.trapq_finalize_moves = ffi_lib.trapq_finalize_moves
         self.step_generators = []
+        self.move_listeners = []
+        # Motion history retained for past position lookups
+        self.move_history_time = config.getfloat(
+            'move_history_time', MOVE_HISTORY_EXPIRE, minval=1.)
+        # Setup parallel step generation (disabled by default)
+        step_gen_threads = config.getint('step_generation_threads', 0,
+                                         minval=0)
+        self.step_gen_pool = ffi_main.gc(
+            ffi_lib.itersolve_pool_alloc(step_gen_threads),
+            ffi_lib.itersolve_pool_free)
+        self.itersolve_pool_begin = ffi_lib.itersolve_pool_begin
+        self.itersolve_pool_finish = ffi_lib.itersolve_pool_finish
         # Create kinematics class
         gcode = self.printer.lookup_object('gcode')
         self.Coord = gcode.Coord
@@ -290,25 +345,50 @@ class ToolHead:
         for module_name in modules:
             self.printer.load_object(config, module_name)
     # Print time and flush tracking
+    def _calc_buffer_times(self, scale):
+        self.buffer_time_low = BUFFER_TIME_LOW * scale
+        self.buffer_time_high = BUFFER_TIME_HIGH * scale
+        self.buffer_time_prime = BUFFER_TIME_START * scale
+        self.buffer_time_interactive = BUFFER_TIME_INTERACTIVE * scale
+        self.bgflush_low_time = BGFLUSH_LOW_TIME * scale
+    def set_buffer_time_scale(self, scale):
+        old_high = self.buffer_time_high
+        self._calc_buffer_times(scale)
+        self.buffer_time_start = self.buffer_time_prime
+        if self.special_queuing_state:
+            # The pending lookahead flush counts down from buffer_time_high
+            lookahead = self.lookahead
+            lookahead.set_flush_time(lookahead.junction_flush
+                                     + self.buffer_time_high - old_high)
     def _advance_flush_time(self, flush_time):
         flush_time = max(flush_time, self.last_flush_time)
         # Generate steps via itersolve
         sg_flush_want = min(flush_time + STEPCOMPRESS_FLUSH_TIME,
                             self.print_time - self.kin_flush_delay)
         sg_flush_time = max(sg_flush_want, flush_time)
-        for sg in self.step_generators:
-            sg(sg_flush_time)
+        self.itersolve_pool_begin(self.step_gen_pool)
+        try:
+            for sg in self.step_generators:
+                sg(sg_flush_time)
+        finally:
+            ret = self.itersolve_pool_finish(self.step_gen_pool)
+        if ret:
+            raise stepper.error("Internal error in stepcompress")
+        if self.trace_callback is not None:
+            self.trace_callback('step_gen', sg_flush_time)
         self.min_restart_time = max(self.min_restart_time, sg_flush_time)
         # Free trapq entries that are no longer needed
         clear_history_time = self.clear_history_time
         if not self.can_pause:
-            clear_history_time = flush_time - MOVE_HISTORY_EXPIRE
+            clear_history_time = flush_time - self.move_history_time
         free_time = sg_flush_time - self.kin_flush_delay
         self.trapq_finalize_moves(self.trapq, free_time, clear_history_time)
         self.extruder.update_move_time(free_time, clear_history_time)
         # Flush stepcompress and mcu steppersync
         for m in self.all_mcus:
             m.flush_moves(flush_time, clear_history_time)
+        if self.trace_callback is not None:
+            self.trace_callback('steps_queued', flush_time)
         self.last_flush_time = flush_time
     def _advance_move_time(self, next_print_time):
         pt_delay = self.kin_flush_delay + STEPCOMPRESS_FLUSH_TIME
@@ -325,7 +405,7 @@ class ToolHead:
         est_print_time = self.mcu.estimated_print_time(curtime)
         kin_time = max(est_print_time + MIN_KIN_TIME, self.min_restart_time)
         kin_time += self.kin_flush_delay
-        min_print_time = max(est_print_time + BUFFER_TIME_START, kin_time)
+        min_print_time = max(est_print_time + self.buffer_time_start, kin_time)
         if min_print_time > self.print_time:
             self.print_time = min_print_time
             self.printer.send_event("toolhead:sync_print_time",
@@ -338,34 +418,65 @@ class ToolHead:
                 self.special_queuing_state = ""
                 self.need_check_pause = -1.
             self._calc_print_time()
+        if self.trace_callback is not None:
+            self.trace_callback('lookahead_flush', self.print_time)
         # Queue moves into trapezoid motion queue (trapq)
         next_move_time = self.print_time
+        kin_data = []
+        kin_count = 0
+        extruder_moves = []
+        move_listeners = self.move_listeners
         for move in moves:
+            if move.axes_d[3]:
+                # Wait for any parallel extruder move to complete (the
+                # lookahead ensures this move starts from a stop)
+                next_move_time = max(next_move_time,
+                                     self.parallel_extrude_time)
+                extruder_moves.append((next_move_time, move))
             if move.is_kinematic_move:
-                self.trapq_append(
-                    self.trapq, next_move_time,
-                    move.accel_t, move.cruise_t, move.decel_t,
+                kin_data.extend((
+                    next_move_time, move.accel_t, move.cruise_t, move.decel_t,
                     move.start_pos[0], move.start_pos[1], move.start_pos[2],
                     move.axes_r[0], move.axes_r[1], move.axes_r[2],
-                    move.start_v, move.cruise_v, move.accel)
-            if move.axes_d[3]:
-                self.extruder.move(next_move_time, move)
+                    move.start_v, move.cruise_v, move.accel))
+                kin_count += 1
+                for ml in move_listeners:
+                    ml(next_move_time, move)
             next_move_time = (next_move_time + move.accel_t
                               + move.cruise_t + move.decel_t)
+            for pmove in move.parallel_moves:
+                pstart = max(next_move_time, self.parallel_extrude_time)
+                extruder_moves.append((pstart, pmove))
+                self.parallel_extrude_time = (pstart + pmove.accel_t
+                                              + pmove.cruise_t + pmove.decel_t)
             for cb in move.timing_callbacks:
                 cb(next_move_time)
+        if kin_count:
+            ffi_main, ffi_lib = chelper.get_ffi()
+            self.trapq_append_batch(self.trapq, ffi_main.new('double[]',
+                                                             kin_data),
+                                    kin_count)
+        if extruder_moves:
+            self.extruder.process_moves(extruder_moves)
+        if self.trace_callback is not None:
+            self.trace_callback('trapq_append', next_move_time)
         # Generate steps for moves
         if self.special_queuing_state:
             self._update_drip_move_time(next_move_time)
-        self.note_mcu_movequeue_activity(next_move_time + self.kin_flush_delay,
+        mq_time = max(next_move_time, self.parallel_extrude_time)
+        self.note_mcu_movequeue_activity(mq_time + self.kin_flush_delay,
                                          set_step_gen_time=True)
         self._advance_move_time(next_move_time)
-    def _flush_lookahead(self):
+    def _flush_parallel_extrude(self):
+        if self.print_time < self.parallel_extrude_time:
+            self._advance_move_time(self.parallel_extrude_time)
+    def _flush_lookahead(self, reason='sync'):
         # Transit from "NeedPrime"/"Priming"/"Drip"/main state to "NeedPrime"
-        self.lookahead.flush()
+        self.lookahead.flush(reason=reason)
+        self._flush_parallel_extrude()
         self.special_queuing_state = "NeedPrime"
         self.need_check_pause = -1.
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self.lookahead.set_flush_time(self.buffer_time_high)
         self.check_stall_time = 0.
     def flush_step_generation(self):
         self._flush_lookahead()
@@ -377,6 +488,7 @@ class ToolHead:
             self._calc_print_time()
         else:
             self.lookahead.flush()
+            self._flush_parallel_extrude()
         return self.print_time
     def _check_pause(self):
         eventtime = self.reactor.monotonic()
@@ -394,11 +506,11 @@ class ToolHead:
             if self.priming_timer is None:
                 self.priming_timer = self.reactor.register_timer(
                     self._priming_handler)
-            wtime = eventtime + max(0.100, buffer_time - BUFFER_TIME_LOW)
+            wtime = eventtime + max(0.100, buffer_time - self.buffer_time_low)
             self.reactor.update_timer(self.priming_timer, wtime)
         # Check if there are lots of queued moves and pause if so
         while 1:
-            pause_time = buffer_time - BUFFER_TIME_HIGH
+            pause_time = buffer_time - self.buffer_time_high
             if pause_time <= 0.:
                 break
             if not self.can_pause:
@@ -409,18 +521,31 @@ class ToolHead:
             buffer_time = self.print_time - est_print_time
         if not self.special_queuing_state:
             # In main state - defer pause checking until needed
-            self.need_check_pause = est_print_time + BUFFER_TIME_HIGH + 0.100
+            self.need_check_pause = (est_print_time + self.buffer_time_high
+                                     + 0.100)
     def _priming_handler(self, eventtime):
         self.reactor.unregister_timer(self.priming_timer)
         self.priming_timer = None
         try:
             if self.special_queuing_state == "Priming":
-                self._flush_lookahead()
+                self._flush_lookahead('priming')
                 self.check_stall_time = self.print_time
         except:
             logging.exception("Exception in priming_handler")
             self.printer.invoke_shutdown("Exception in priming_handler")
         return self.reactor.NEVER
+    def note_input_idle(self):
+        # The input source (eg, an interactive request) has no further
+        # commands pending - start any moves waiting in "Priming" state
+        # now with a reduced start buffer
+        if self.special_queuing_state != "Priming":
+            return
+        self.buffer_time_start = self.buffer_time_interactive
+        try:
+            self._flush_lookahead('input_idle')
+        finally:
+            self.buffer_time_start = self.buffer_time_prime
+        self.check_stall_time = self.print_time
     def _flush_handler(self, eventtime):
         try:
             est_print_time = self.mcu.estimated_print_time(eventtime)
@@ -428,11 +553,11 @@ class ToolHead:
                 # In "main" state - flush lookahead if buffer runs low
                 print_time = self.print_time
                 buffer_time = print_time - est_print_time
-                if buffer_time > BUFFER_TIME_LOW:
+                if buffer_time > self.buffer_time_low:
                     # Running normally - reschedule check
-                    return eventtime + buffer_time - BUFFER_TIME_LOW
+                    return eventtime + buffer_time - self.buffer_time_low
                 # Under ran low buffer mark - flush lookahead queue
-                self._flush_lookahead()
+                self._flush_lookahead('buffer_low')
                 if print_time != self.print_time:
                     self.check_stall_time = self.print_time
             # In "NeedPrime"/"Priming" state - flush queues if needed
@@ -440,11 +565,14 @@ class ToolHead:
                 end_flush = self.need_flush_time + BGFLUSH_EXTRA_TIME
                 if self.last_flush_time >= end_flush:
                     self.do_kick_flush_timer = True
+                    self.printer.send_event("toolhead:flush_idle",
+                                            self.last_flush_time)
                     return self.reactor.NEVER
                 buffer_time = self.last_flush_time - est_print_time
-                if buffer_time > BGFLUSH_LOW_TIME:
-                    return eventtime + buffer_time - BGFLUSH_LOW_TIME
-                ftime = est_print_time + BGFLUSH_LOW_TIME + BGFLUSH_BATCH_TIME
+                bgflush_low_time = self.bgflush_low_time
+                if buffer_time > bgflush_low_time:
+                    return eventtime + buffer_time - bgflush_low_time
+                ftime = est_print_time + bgflush_low_time + BGFLUSH_BATCH_TIME
                 self._advance_flush_time(min(end_flush, ftime))
         except:
             logging.exception("Exception in flush_handler")
@@ -471,8 +599,33 @@ class ToolHead:
             self.extruder.check_move(move)
         self.commanded_pos[:] = move.end_pos
         self.lookahead.add_move(move)
+        if self.trace_callback is not None:
+            self.trace_callback('move', self.print_time)
         if self.print_time > self.need_check_pause:
             self._check_pause()
+    def extrude_parallel(self, e_dist, speed):
+        # Queue an extrude only move that runs alongside the following
+        # kinematic moves (eg, a retraction during a travel move)
+        newpos = list(self.commanded_pos)
+        newpos[3] += e_dist
+        move = Move(self, self.commanded_pos, newpos, speed)
+        if not move.move_d:
+            return
+        self.extruder.check_move(move)
+        move.set_junction(0., min(move.max_cruise_v2, .5 * move.delta_v2), 0.)
+        self.commanded_pos[3] = newpos[3]
+        self.lookahead.note_parallel_extrude()
+        last_move = self.lookahead.get_last()
+        if last_move is not None:
+            last_move.parallel_moves.append(move)
+            return
+        print_time = self.get_last_move_time()
+        self.extruder.process_moves([(print_time, move)])
+        self.parallel_extrude_time = (print_time + move.accel_t
+                                      + move.cruise_t + move.decel_t)
+        self.note_mcu_movequeue_activity(self.parallel_extrude_time
+                                         + self.kin_flush_delay,
+                                         set_step_gen_time=True)
     def manual_move(self, coord, speed):
         curpos = list(self.commanded_pos)
         for i in range(len(coord)):
@@ -517,12 +670,12 @@ class ToolHead:
     def drip_move(self, newpos, speed, drip_completion):
         self.dwell(self.kin_flush_delay)
         # Transition from "NeedPrime"/"Priming"/main state to "Drip" state
-        self.lookahead.flush()
+        self.lookahead.flush(reason='drip')
         self.special_queuing_state = "Drip"
         self.need_check_pause = self.reactor.NEVER
         self.reactor.update_timer(self.flush_timer, self.reactor.NEVER)
         self.do_kick_flush_timer = False
-        self.lookahead.set_flush_time(BUFFER_TIME_HIGH)
+        self.lookahead.set_flush_time(self.buffer_time_high)
         self.check_stall_time = 0.
         self.drip_completion = drip_completion
         # Submit move
@@ -534,7 +687,7 @@ class ToolHead:
             raise
         # Transmit move in "drip" mode
         try:
-            self.lookahead.flush()
+            self.lookahead.flush(reason='drip')
         except DripModeEndSignal as e:
             self.lookahead.reset()
             self.trapq_finalize_moves(self.trapq, self.reactor.NEVER, 0)
@@ -547,7 +700,7 @@ class ToolHead:
         for m in self.all_mcus:
             m.check_active(max_queue_time, eventtime)
         est_print_time = self.mcu.estimated_print_time(eventtime)
-        self.clear_history_time = est_print_time - MOVE_HISTORY_EXPIRE
+        self.clear_history_time = est_print_time - self.move_history_time
         buffer_time = self.print_time - est_print_time
         is_active = buffer_time > -60. or not self.special_queuing_state
         if self.special_queuing_state == "Drip":
@@ -562,9 +715,18 @@ class ToolHead:
         print_time = self.print_time
         estimated_print_time = self.mcu.estimated_print_time(eventtime)
         res = dict(self.kin.get_status(eventtime))
+        buffer_time = max(0., print_time - estimated_print_time)
+        if self.special_queuing_state == "Drip":
+            buffer_time = 0.
+        la = self.lookahead
         res.update({ 'print_time': print_time,
                      'stalls': self.print_stall,
                      'estimated_print_time': estimated_print_time,
+                     'buffer_time': buffer_time,
+                     'lookahead_moves': len(la.queue),
+                     'lookahead_flushes': dict(la.flush_reasons),
+                     'buffer_time_low': self.buffer_time_low,
+                     'buffer_time_high': self.buffer_time_high,
                      'extruder': self.extruder.get_name(),
                      'position': self.Coord(*self.commanded_pos),
                      'max_velocity': self.max_velocity,
@@ -579,8 +741,25 @@ class ToolHead:
         return self.kin
     def get_trapq(self):
         return self.trapq
+    def set_axis_max_accel(self, accel_x, accel_y):
+        # Limit the XY acceleration by the move direction (a value of
+        # None disables the limit for that axis)
+        if accel_x is None and accel_y is None:
+            self.inv_axis_accel = None
+            return
+        self.inv_axis_accel = (1. / accel_x if accel_x else 0.,
+                               1. / accel_y if accel_y else 0.)
+    def get_lookahead_stats(self):
+        la = self.lookahead
+        return la.queued_dist, la.queued_time, la.forced_flushes
     def register_step_generator(self, handler):
         self.step_generators.append(handler)
+    def register_move_listener(self, handler):
+        # The handler is called with the start time of each kinematic
+        # move as it is queued (prior to the move's timing callbacks)
+        self.move_listeners.append(handler)
+    def set_trace_callback(self, callback):
+        self.trace_callback = callback
     def note_step_generation_scan_time(self, delay, old_delay=0.):
         self.flush_step_generation()
         if old_delay:
@@ -7,6 +7,8 @@ import logging, socket, os, sys, errno, json, collections
 import gcode
 
 REQUEST_LOG_SIZE = 20
+SEND_CHUNK_SIZE = 64 * 1024
+SEND_QUEUE_MAX = 16 * 1024 * 1024
 
 # Json decodes strings as unicode types in Python 2.x.  This doesn't
 # play well with some parts of Klipper (particuarly displays), so we
@@ -164,13 +166,18 @@ class ServerSocket:
 
     def stats(self, eventtime):
         # Called once per second - check for idle clients
+        send_queue_size = 0
         for client in list(self.clients.values()):
             if client.is_blocking:
                 client.blocking_count -= 1
                 if client.blocking_count < 0:
                     logging.info("Closing unresponsive client %s", client.uid)
                     client.close()
-        return False, ""
+                    continue
+            send_queue_size += client.send_queue_size
+        if not send_queue_size:
+            return False, ""
+        return False, "webhooks_send_queue=%d" % (send_queue_size,)
 
 class ClientConnection:
     def __init__(self, server, sock):
@@ -182,7 +189,9 @@ class ClientConnection:
         self.sock = sock
         self.fd_handle = self.reactor.register_fd(
             self.sock.fileno(), self.process_received, self._do_send)
-        self.partial_data = self.send_buffer = b""
+        self.partial_data = b""
+        self.send_queue = collections.deque()
+        self.send_queue_size = 0
         self.is_blocking = False
         self.blocking_count = 0
         self.set_client_info("?", "New connection")
@@ -213,6 +222,8 @@ class ClientConnection:
         self.set_client_info(None, "Disconnected")
         self.reactor.unregister_fd(self.fd_handle)
         self.fd_handle = None
+        self.send_queue.clear()
+        self.send_queue_size = 0
         try:
             self.sock.close()
         except socket.error:
@@ -268,29 +279,52 @@ class ClientConnection:
         self.send(result)
 
     def send(self, data):
+        if self.fd_handle is None:
+            return
         try:
             jmsg = json.dumps(data, separators=(',', ':'))
-            self.send_buffer += jmsg.encode() + b"\x03"
+            msg = jmsg.encode() + b"\x03"
         except (TypeError, ValueError) as e:
             msg = ("json encoding error: %s" % (str(e),))
             logging.exception(msg)
             self.printer.invoke_shutdown(msg)
             return
+        if self.send_queue_size + len(msg) > SEND_QUEUE_MAX:
+            logging.info("Closing client %s: send queue limit exceeded",
+                         self.uid)
+            self.close()
+            return
+        # Coalesce small messages, but don't copy large pending data
+        send_queue = self.send_queue
+        if send_queue and len(send_queue[-1]) < SEND_CHUNK_SIZE:
+            send_queue[-1] += msg
+        else:
+            send_queue.append(msg)
+        self.send_queue_size += len(msg)
         if not self.is_blocking:
             self._do_send()
 
     def _do_send(self, eventtime=None):
         if self.fd_handle is None:
             return
-        try:
-            sent = self.sock.send(self.send_buffer)
-        except socket.error as e:
-            if e.errno not in [errno.EAGAIN, errno.EWOULDBLOCK]:
-                logging.info("webhooks: socket write error %d" % (self.uid,))
-                self.close()
-                return
-            sent = 0
-        if sent < len(self.send_buffer):
+        send_queue = self.send_queue
+        while send_queue:
+            data = send_queue[0]
+            try:
+                sent = self.sock.send(data)
+            except socket.error as e:
+                if e.errno not in [errno.EAGAIN, errno.EWOULDBLOCK]:
+                    logging.info("webhooks: socket write error %d"
+                                 % (self.uid,))
+                    self.close()
+                    return
+                sent = 0
+            self.send_queue_size -= sent
+            if sent < len(data):
+                send_queue[0] = data[sent:]
+                break
+            send_queue.popleft()
+        if send_queue:
             if not self.is_blocking:
                 self.reactor.set_fd_wake(self.fd_handle, False, True)
                 self.is_blocking = True
@@ -298,7 +332,6 @@ class ClientConnection:
         elif self.is_blocking:
             self.reactor.set_fd_wake(self.fd_handle, True, False)
             self.is_blocking = False
-        self.send_buffer = self.send_buffer[sent:]
 
 class WebHooks:
     def __init__(self, printer):
@@ -433,7 +466,14 @@ class GCodeHelper:
     def _handle_help(self, web_request):
         web_request.send(self.gcode.get_command_help())
     def _handle_script(self, web_request):
-        self.gcode.run_script(web_request.get_str('script'))
+        script = web_request.get_str('script')
+        with self.gcode.get_mutex():
+            self.gcode.run_script_from_command(script)
+            # No further commands from this request - avoid waiting
+            # for additional moves before starting queued movement
+            toolhead = self.printer.lookup_object('toolhead', None)
+            if toolhead is not None:
+                toolhead.note_input_idle()
     def _handle_restart(self, web_request):
         self.gcode.run_script('restart')
     def _handle_firmware_restart(self, web_request):
@@ -499,10 +539,17 @@ class QueryStatusHelper:
                     if req_items:
                         subscription[obj_name] = req_items
                 lres = last_query.get(obj_name, {})
+                if res is lres and not is_query:
+                    # Object returned the same (unchanged) status dict
+                    continue
                 cres = {}
                 for ri in req_items:
                     rd = res.get(ri, None)
-                    if is_query or rd != lres.get(ri):
+                    if is_query:
+                        cres[ri] = rd
+                        continue
+                    lrd = lres.get(ri)
+                    if rd is not lrd and rd != lrd:
                         cres[ri] = rd
                 if cres or is_query:
                     cquery[obj_name] = cres
@@ -0,0 +1,279 @@
+#!/usr/bin/env python
+# Benchmark of the host motion pipeline using klippy batch mode
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, math, re, resource, subprocess
+
+TEMP_CONFIG_FILE = "_bench_.cfg"
+TEMP_GCODE_FILE = "_bench_.gcode"
+TEMP_LOG_FILE = "_bench_.log"
+TEMP_OUTPUT_FILE = "_bench_output"
+
+# Example config and bed center for each kinematics
+KINEMATICS = {
+    'cartesian': ('example-cartesian.cfg', (100., 100.)),
+    'corexy': ('example-corexy.cfg', (100., 100.)),
+    'corexz': ('example-corexz.cfg', (100., 100.)),
+    'hybrid-corexy': ('example-hybrid-corexy.cfg', (100., 100.)),
+    'hybrid-corexz': ('example-hybrid-corexz.cfg', (100., 100.)),
+    'delta': ('example-delta.cfg', (0., 0.)),
+}
+DEFAULT_KINEMATICS = "cartesian,corexy,delta"
+
+# Extra config sections added to every test
+CONFIG_EXTRA = """
+[gcode_arcs]
+
+[gcode_macro BENCHMARK_REPORT]
+gcode:
+  {% set sg = printer.motion_report.step_generation %}
+  {% for name in sg %}
+    {% set st = sg[name] %}
+    {action_respond_info("BENCHMARK %s steps=%d step_bytes=%d"
+                         " gen_time=%.6f compress_time=%.6f"
+                         % (name, st.steps, st.step_bytes, st.gen_time,
+                            st.compress_time))}
+  {% endfor %}
+"""
+
+CONFIG_SHAPER_PA = """
+[input_shaper]
+shaper_freq_x: 50
+shaper_freq_y: 50
+"""
+
+
+######################################################################
+# Workloads
+######################################################################
+
+# Track the commanded toolhead position while generating G-Code
+class GCodeWriter:
+    def __init__(self, center, z, setup_cmds):
+        self.center = center
+        self.pos = (center[0], center[1], z)
+        self.distance = 0.
+        self.moves = 0
+        self.lines = ["G28", "G90", "M83"] + setup_cmds + [
+            "G1 X%.3f Y%.3f Z%.3f F6000" % self.pos]
+    def move(self, x, y, z=None, e=0., speed=100.):
+        cx, cy = self.center
+        x += cx
+        y += cy
+        if z is None:
+            z = self.pos[2]
+        px, py, pz = self.pos
+        self.distance += math.sqrt((x-px)**2 + (y-py)**2 + (z-pz)**2)
+        self.moves += 1
+        self.pos = (x, y, z)
+        self.lines.append("G1 X%.3f Y%.3f Z%.3f E%.5f F%d"
+                          % (x, y, z, e, speed * 60.))
+    def arc(self, i, j, e, speed=100.):
+        # Full circle around the offset (i, j) from the current position
+        radius = math.sqrt(i**2 + j**2)
+        self.distance += 2. * math.pi * radius
+        self.moves += 1
+        x, y, z = self.pos
+        self.lines.append("G2 X%.3f Y%.3f I%.3f J%.3f E%.5f F%d"
+                          % (x, y, i, j, e, speed * 60.))
+    def get_gcode(self):
+        # The dwell allows pending step generation to complete
+        return '\n'.join(self.lines + [
+            "M400", "G4 P1000", "BENCHMARK_REPORT", ""])
+
+E_PER_MM = 0.033
+
+def gen_arcs(gw):
+    for i in range(100):
+        radius = 5. + (i % 20)
+        gw.move(-radius, 0.)
+        gw.arc(radius, 0., 2. * math.pi * radius * E_PER_MM)
+
+def gen_tiny_segments(gw):
+    seg_len = 0.1
+    for i in range(20):
+        radius = 10. + i * 0.5
+        count = int(2. * math.pi * radius / seg_len)
+        for j in range(count + 1):
+            a = 2. * math.pi * j / count
+            gw.move(radius * math.cos(a), radius * math.sin(a),
+                    e=seg_len * E_PER_MM)
+
+def gen_vase(gw):
+    radius = 20.
+    segs = 200
+    layer = 0.2
+    z = gw.pos[2]
+    seg_len = 2. * math.pi * radius / segs
+    for i in range(50 * segs):
+        a = 2. * math.pi * i / segs
+        gw.move(radius * math.cos(a), radius * math.sin(a),
+                z + layer * i / segs, e=seg_len * E_PER_MM, speed=60.)
+
+def gen_infill(gw):
+    width = 40.
+    for i in range(400):
+        y = -width * .5 + (i % 200) * 0.2
+        x = width * .5 if i & 1 else -width * .5
+        gw.move(x, y, e=width * E_PER_MM, speed=200.)
+
+WORKLOADS = {
+    'arcs': gen_arcs, 'tiny_segments': gen_tiny_segments,
+    'vase': gen_vase, 'infill': gen_infill,
+}
+
+
+######################################################################
+# Test runner
+######################################################################
+
+class error(Exception):
+    pass
+
+class Benchmark:
+    def __init__(self, options):
+        self.dictionary = options.dictionary
+        self.configdir = options.configdir
+        self.tempdir = options.tempdir
+        self.keepfiles = options.keepfiles
+    def relpath(self, fname):
+        return os.path.join(self.tempdir, fname)
+    def write_file(self, fname, data):
+        f = open(fname, 'w')
+        f.write(data)
+        f.close()
+    def parse_report(self, logname):
+        res = {'steps': 0, 'step_bytes': 0, 'gen_time': 0.,
+               'compress_time': 0.}
+        r = re.compile(r"BENCHMARK (\S+) steps=(\d+) step_bytes=(\d+)"
+                       r" gen_time=(\S+) compress_time=(\S+)")
+        f = open(logname, 'r')
+        found = False
+        for line in f:
+            m = r.search(line)
+            if m is None:
+                continue
+            found = True
+            res['steps'] += int(m.group(2))
+            res['step_bytes'] += int(m.group(3))
+            res['gen_time'] += float(m.group(4))
+            res['compress_time'] += float(m.group(5))
+        f.close()
+        if not found:
+            raise error("No benchmark report found in %s" % (logname,))
+        return res
+    def run(self, kin, workload, shaper_pa):
+        cfgname, center = KINEMATICS[kin]
+        cfgpath = os.path.abspath(os.path.join(self.configdir, cfgname))
+        config = "[include %s]\n%s" % (cfgpath, CONFIG_EXTRA)
+        setup_cmds = []
+        if shaper_pa:
+            config += CONFIG_SHAPER_PA
+            setup_cmds = ["SET_PRESSURE_ADVANCE ADVANCE=0.04"]
+        gw = GCodeWriter(center, 5., setup_cmds)
+        WORKLOADS[workload](gw)
+        config_fname = self.relpath(TEMP_CONFIG_FILE)
+        gcode_fname = self.relpath(TEMP_GCODE_FILE)
+        log_fname = self.relpath(TEMP_LOG_FILE)
+        output_fname = self.relpath(TEMP_OUTPUT_FILE)
+        self.write_file(config_fname, config)
+        self.write_file(gcode_fname, gw.get_gcode())
+        # Call klippy
+        args = [sys.executable, './klippy/klippy.py', config_fname,
+                '-i', gcode_fname, '-o', output_fname, '-d', self.dictionary,
+                '-l', log_fname]
+        start_usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+        ret = subprocess.call(args)
+        end_usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+        if ret:
+            raise error("klippy failed (see %s)" % (log_fname,))
+        res = self.parse_report(log_fname)
+        res['cpu_time'] = (end_usage.ru_utime - start_usage.ru_utime
+                           + end_usage.ru_stime - start_usage.ru_stime)
+        res['moves'] = gw.moves
+        res['distance'] = gw.distance
+        # Do cleanup
+        if not self.keepfiles:
+            for fname in os.listdir(self.tempdir):
+                if fname.startswith(TEMP_OUTPUT_FILE):
+                    os.unlink(os.path.join(self.tempdir, fname))
+            for fname in [config_fname, gcode_fname, log_fname]:
+                os.unlink(fname)
+        return res
+
+def format_result(kin, workload, variant, res):
+    steps = max(res['steps'], 1)
+    cpu_time = max(res['cpu_time'], .000001)
+    return ("%-14s %-14s %-10s %9.0f %11.0f %9.3f %9.3f %8.3f %7.2f" % (
+        kin, workload, variant, res['moves'] / cpu_time,
+        res['steps'] / cpu_time, res['gen_time'] * 1000000. / steps,
+        res['compress_time'] * 1000000. / steps,
+        res['step_bytes'] / max(res['distance'], 1.), res['cpu_time']))
+
+
+######################################################################
+# Startup
+######################################################################
+
+def main():
+    # Parse args
+    usage = "%prog [options] <dictionary file>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-k", "--kinematics", dest="kinematics",
+                    default=DEFAULT_KINEMATICS,
+                    help="comma separated list of kinematics (or 'all')")
+    opts.add_option("-w", "--workloads", dest="workloads",
+                    default=','.join(sorted(WORKLOADS)),
+                    help="comma separated list of workloads")
+    opts.add_option("-c", "--configdir", dest="configdir", default="config",
+                    help="directory containing the example configs")
+    opts.add_option("-t", "--tempdir", dest="tempdir", default=".",
+                    help="directory for temporary files")
+    opts.add_option("-r", "--repeat", dest="repeat", type="int", default=1,
+                    help="number of runs per test (best cpu time is kept)")
+    opts.add_option("--no-shaper", action="store_true", dest="no_shaper",
+                    help="skip runs with input shaper and pressure advance")
+    opts.add_option("--keep", action="store_true", dest="keepfiles",
+                    help="do not remove temporary files")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    options.dictionary = args[0]
+    kinematics = options.kinematics.split(',')
+    if options.kinematics == 'all':
+        kinematics = sorted(KINEMATICS)
+    workloads = options.workloads.split(',')
+    for kin in kinematics:
+        if kin not in KINEMATICS:
+            opts.error("Unknown kinematics '%s'" % (kin,))
+    for workload in workloads:
+        if workload not in WORKLOADS:
+            opts.error("Unknown workload '%s'" % (workload,))
+    variants = [('plain', False)]
+    if not options.no_shaper:
+        variants.append(('shaper_pa', True))
+
+    # Run each benchmark
+    bench = Benchmark(options)
+    sys.stdout.write("%-14s %-14s %-10s %9s %11s %9s %9s %8s %7s\n" % (
+        "kinematics", "workload", "variant", "moves/s", "steps/s",
+        "gen_us", "comp_us", "bytes/mm", "cpu_s"))
+    for kin in kinematics:
+        for workload in workloads:
+            for variant, shaper_pa in variants:
+                best = None
+                for i in range(options.repeat):
+                    try:
+                        res = bench.run(kin, workload, shaper_pa)
+                    except error as e:
+                        sys.stderr.write("\n%s %s %s FAILED (%s)\n"
+                                         % (kin, workload, variant, str(e)))
+                        sys.exit(-1)
+                    if best is None or res['cpu_time'] < best['cpu_time']:
+                        best = res
+                sys.stdout.write(format_result(kin, workload, variant, best)
+                                 + "\n")
+                sys.stdout.flush()
+
+if __name__ == '__main__':
+    main()
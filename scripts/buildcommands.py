@@ -246,6 +246,9 @@ Handlers.append(Handle_arm_irq())
 # Wire protocol commands and responses
 ######################################################################
 
+# Message ids over 127 are encoded in two bytes
+MAX_MSGID = 1<<12
+
 # Dynamic command and response registration
 class HandleCommandGeneration:
     def __init__(self):
@@ -289,12 +292,10 @@ class HandleCommandGeneration:
             if msg not in self.msg_to_id:
                 msgid += 1
                 self.msg_to_id[msg] = msgid
-        if msgid >= 128:
-            # The mcu currently assumes all message ids encode to one byte
+        if msgid >= MAX_MSGID:
             error("Too many message ids")
     def update_data_dictionary(self, data):
-        # Handle message ids over 96 (they are decoded as negative numbers)
-        msg_to_tag = {msg: msgid if msgid < 96 else msgid - 128
+        msg_to_tag = {msg: msgproto.msgid_to_msgtag(msgid)
                       for msg, msgid in self.msg_to_id.items()}
         command_tags = [msg_to_tag[msg]
                         for msgname, msg in self.messages_by_name.items()
@@ -330,14 +331,15 @@ class HandleCommandGeneration:
     .msg_id=%d,
     .num_params=%d,
     .param_types = %s,
-""" % (comment, msgid, len(types), params)
+""" % (comment, msgproto.msgid_to_msgtag(msgid), len(types), params)
         if msgtype == 'response':
             num_args = (len(types) + types.count('PT_progmem_buffer')
                         + types.count('PT_buffer'))
             out += "    .num_args=%d," % (num_args,)
         else:
+            msgid_len = len(msgproto.encode_msgid(msgid))
             max_size = min(msgproto.MESSAGE_MAX,
-                           (msgproto.MESSAGE_MIN + 1
+                           (msgproto.MESSAGE_MIN + msgid_len
                             + sum([t.max_length for t in param_types])))
             out += "    .max_size=%d," % (max_size,)
         return out
@@ -398,6 +400,9 @@ ctr_lookup_output(const char *str)
             funcname, flags, msgname = cmd_by_id[msgid]
             msg = self.messages_by_name[msgname]
             externs[funcname] = 1
+            param_types = [t for name, t in msgproto.lookup_params(msg)]
+            if not [t for t in param_types if t.is_dynamic_string]:
+                flags = "(%s) | HF_INT_PARAMS" % (flags,)
             parsercode = self.build_parser(msgid, msg, 'response')
             index.append(" {%s\n    .flags=%s,\n    .func=%s\n}," % (
                 parsercode, flags, funcname))
@@ -411,7 +416,7 @@ const struct command_parser command_index[] PROGMEM = {
 %s
 };
 
-const uint8_t command_index_size PROGMEM = ARRAY_SIZE(command_index);
+const uint16_t command_index_size PROGMEM = ARRAY_SIZE(command_index);
 """
         return fmt % (externs, index)
     def generate_param_code(self):
@@ -6,7 +6,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 from __future__ import print_function
-import importlib, optparse, os, sys
+import importlib, multiprocessing, optparse, os, sys
 from textwrap import wrap
 import numpy as np, matplotlib
 sys.path.append(os.path.join(os.path.dirname(os.path.realpath(__file__)),
@@ -15,7 +15,16 @@ shaper_calibrate = importlib.import_module('.shaper_calibrate', 'extras')
 
 MAX_TITLE_LENGTH=65
 
+def parse_raw_npy(logname):
+    # Raw accelerometer data in numpy ".npy" format
+    data = np.load(logname)
+    if data.dtype.names:
+        data = np.column_stack([data[n] for n in data.dtype.names])
+    return data.astype(float)
+
 def parse_log(logname):
+    if logname.endswith('.npy'):
+        return parse_raw_npy(logname)
     with open(logname) as f:
         for header in f:
             if not header.startswith('#'):
@@ -71,6 +80,60 @@ def calibrate_shaper(datas, csv_output, *, shapers, damping_ratio, scv,
                 csv_output, calibration_data, all_shapers)
     return shaper.name, all_shapers, calibration_data
 
+######################################################################
+# Batch analysis of many capture files
+######################################################################
+
+# Analyze a single file (run in a worker process)
+def batch_calibrate_file(task):
+    logname, params = task
+    try:
+        data = parse_log(logname)
+        helper = shaper_calibrate.ShaperCalibrate(printer=None)
+        if isinstance(data, shaper_calibrate.CalibrationData):
+            calibration_data = data
+        else:
+            calibration_data = helper.process_accelerometer_data(data)
+            calibration_data.normalize_to_frequencies()
+        shaper, all_shapers = helper.find_best_shaper(
+                calibration_data, **params)
+    except Exception as e:
+        return logname, None, "%s: %s" % (type(e).__name__, e)
+    if not shaper:
+        return logname, None, "no recommended shaper"
+    return logname, (shaper.name, shaper.freq, shaper.vibrs, shaper.smoothing,
+                     shaper.max_accel), None
+
+def batch_calibrate(lognames, csv_output, jobs, params):
+    tasks = [(logname, params) for logname in lognames]
+    pool = multiprocessing.Pool(jobs)
+    try:
+        results = pool.map(batch_calibrate_file, tasks, chunksize=1)
+    finally:
+        pool.close()
+        pool.join()
+    fields = ["file", "shaper", "freq", "vibrations", "smoothing",
+              "max_accel"]
+    rows = []
+    for logname, res, error in results:
+        if res is None:
+            rows.append([logname, "error", error, "", "", ""])
+            continue
+        name, freq, vibrs, smoothing, max_accel = res
+        rows.append([logname, name, "%.1f" % (freq,),
+                     "%.1f%%" % (vibrs * 100.,), "%.3f" % (smoothing,),
+                     "%.0f" % (round(max_accel / 100.) * 100.,)])
+    if csv_output is not None:
+        with open(csv_output, "w") as csvfile:
+            for row in [fields] + rows:
+                csvfile.write(",".join([v.replace(",", ";") for v in row])
+                              + "\n")
+    widths = [max([len(r[i]) for r in [fields] + rows])
+              for i in range(len(fields))]
+    for row in [fields] + rows:
+        print("  ".join([v.ljust(w) for v, w in zip(row, widths)]).rstrip())
+    return not [1 for r in results if r[1] is None]
+
 ######################################################################
 # Plot frequency response and suggested input shapers
 ######################################################################
@@ -168,6 +231,12 @@ def main():
                     dest="test_damping_ratios", default=None,
                     help="a comma-separated liat of damping ratios to test " +
                     "input shaper for")
+    opts.add_option("-b", "--batch", action="store_true", dest="batch",
+                    help="analyze each log separately (in parallel) and " +
+                    "report a summary table")
+    opts.add_option("-j", "--jobs", type="int", dest="jobs", default=None,
+                    help="number of worker processes in batch mode " +
+                    "(default is the number of cpus)")
     options, args = opts.parse_args()
     if len(args) < 1:
         opts.error("Incorrect number of arguments")
@@ -219,6 +288,16 @@ def main():
     else:
         shapers = options.shapers.lower().split(',')
 
+    if options.batch:
+        params = {'shapers': shapers, 'damping_ratio': options.damping_ratio,
+                  'scv': options.scv, 'shaper_freqs': shaper_freqs,
+                  'max_smoothing': options.max_smoothing,
+                  'test_damping_ratios': test_damping_ratios,
+                  'max_freq': max_freq}
+        if not batch_calibrate(args, options.csv, options.jobs, params):
+            sys.exit(1)
+        return
+
     # Parse data
     datas = [parse_log(fn) for fn in args]
 
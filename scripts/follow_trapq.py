@@ -0,0 +1,77 @@
+#!/usr/bin/env python
+# Follow the moves exported by the motion_report shared_memory_moves option
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, mmap, struct, sys, time
+
+TRAPQ_SHM_MAGIC = 0x71706174
+TRAPQ_SHM_VERSION = 1
+HEADER_FORMAT = "=IIIIQ"
+RECORD_FORMAT = "=Q10d"
+
+class TrapQReader:
+    def __init__(self, filename):
+        f = open(filename, 'rb')
+        self.mem = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        f.close()
+        self.header_size = struct.calcsize(HEADER_FORMAT)
+        magic, version, rsize, rcount, head = self._read_header()
+        if magic != TRAPQ_SHM_MAGIC or version != TRAPQ_SHM_VERSION:
+            raise ValueError("%s is not a trapq shared memory file"
+                             % (filename,))
+        if rsize != struct.calcsize(RECORD_FORMAT):
+            raise ValueError("Unsupported record size %d" % (rsize,))
+        self.record_size = rsize
+        self.record_count = rcount
+        self.next_seq = max(0, head - rcount)
+    def _read_header(self):
+        return struct.unpack_from(HEADER_FORMAT, self.mem, 0)
+    def _read_record(self, seq):
+        offset = (self.header_size
+                  + (seq % self.record_count) * self.record_size)
+        data = struct.unpack_from(RECORD_FORMAT, self.mem, offset)
+        lock2 = struct.unpack_from("=Q", self.mem, offset)[0]
+        if data[0] != 2*seq + 2 or lock2 != data[0]:
+            # Record was overwritten (or is being written)
+            return None
+        return data[1:]
+    def read_moves(self):
+        # Return (lost_count, moves) for all records added since last call
+        head = self._read_header()[4]
+        lost = 0
+        if head - self.next_seq > self.record_count:
+            lost = head - self.record_count - self.next_seq
+            self.next_seq = head - self.record_count
+        moves = []
+        while self.next_seq < head:
+            move = self._read_record(self.next_seq)
+            if move is None:
+                lost += 1
+            else:
+                moves.append(move)
+            self.next_seq += 1
+        return lost, moves
+
+def main():
+    usage = "%prog [options] <shared memory file>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-i", "--interval", type="float", dest="interval",
+                    default=0.100, help="polling interval (default 0.100)")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    reader = TrapQReader(args[0])
+    while 1:
+        lost, moves = reader.read_moves()
+        if lost:
+            sys.stdout.write("lost %d records\n" % (lost,))
+        for m in moves:
+            pt, mt, sv, accel, sx, sy, sz, xr, yr, zr = m
+            sys.stdout.write("pt=%.6f mt=%.6f sv=%.3f a=%.3f"
+                             " sp=(%.3f,%.3f,%.3f) ar=(%.6f,%.6f,%.6f)\n"
+                             % (pt, mt, sv, accel, sx, sy, sz, xr, yr, zr))
+        sys.stdout.flush()
+        time.sleep(options.interval)
+
+if __name__ == '__main__':
+    main()
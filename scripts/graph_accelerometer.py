@@ -14,7 +14,16 @@ shaper_calibrate = importlib.import_module('.shaper_calibrate', 'extras')
 
 MAX_TITLE_LENGTH=65
 
+def parse_raw_npy(logname):
+    # Raw accelerometer data in numpy ".npy" format
+    data = np.load(logname)
+    if data.dtype.names:
+        data = np.column_stack([data[n] for n in data.dtype.names])
+    return data.astype(float)
+
 def parse_log(logname, opts):
+    if logname.endswith('.npy'):
+        return parse_raw_npy(logname)
     with open(logname) as f:
         for header in f:
             if header.startswith('#'):
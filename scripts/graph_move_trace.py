@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+# Script to graph the output of the MOVE_TRACE_DUMP command
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, array, sys
+import matplotlib
+
+BUFFER_TIME_LOW = 1.0
+RECORD_SIZE = 4
+
+def parse_trace(filename):
+    f = open(filename, 'rb')
+    header = f.readline().decode().split()
+    if not header or header[:2] != ['#', 'move_trace']:
+        raise ValueError("Not a move trace file")
+    events = []
+    for h in header[2:]:
+        if h.startswith('events='):
+            events = h[7:].split(',')
+    data = array.array('d')
+    rest = f.read()
+    f.close()
+    if hasattr(data, 'frombytes'):
+        data.frombytes(rest)
+    else:
+        data.fromstring(rest)
+    records = []
+    for i in range(0, len(data) - RECORD_SIZE + 1, RECORD_SIZE):
+        event_id, eventtime, print_time, est_print_time = data[i:i+4]
+        records.append((events[int(event_id)], eventtime, print_time,
+                        est_print_time))
+    return events, records
+
+def summarize(events, records):
+    # Report the minimum "buffer time" (time between when an action
+    # occurred and when the mcu reaches its print_time) for each event
+    sys.stdout.write("%-16s %8s %12s %12s\n" % (
+        "event", "count", "min_buffer", "below_low"))
+    for event in events:
+        buffers = [pt - ept for ev, et, pt, ept in records if ev == event]
+        if not buffers:
+            continue
+        low = len([b for b in buffers if b < BUFFER_TIME_LOW])
+        sys.stdout.write("%-16s %8d %12.3f %12d\n" % (
+            event, len(buffers), min(buffers), low))
+
+def plot_trace(events, records):
+    start_time = records[0][1]
+    fig, ax = matplotlib.pyplot.subplots()
+    ax.set_title("Move pipeline timing")
+    ax.set_xlabel('Time (s)')
+    ax.set_ylabel('Time until mcu reaches print_time (s)')
+    for event in events:
+        times = [et - start_time for ev, et, pt, ept in records if ev == event]
+        buffers = [pt - ept for ev, et, pt, ept in records if ev == event]
+        if times:
+            ax.plot(times, buffers, '.', label=event, alpha=0.6)
+    ax.axhline(BUFFER_TIME_LOW, color='red', linestyle='--',
+               label='BUFFER_TIME_LOW')
+    fontP = matplotlib.font_manager.FontProperties()
+    fontP.set_size('x-small')
+    ax.legend(loc='best', prop=fontP)
+    ax.grid(True)
+    return fig
+
+def setup_matplotlib(output_to_file):
+    global matplotlib
+    if output_to_file:
+        matplotlib.use('Agg')
+    import matplotlib.pyplot, matplotlib.font_manager
+
+def main():
+    # Parse command-line arguments
+    usage = "%prog [options] <trace file>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-o", "--output", type="string", dest="output",
+                    default=None, help="filename of output graph")
+    opts.add_option("-s", "--summary", action="store_true",
+                    help="only print a summary of the trace")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+
+    # Parse data
+    events, records = parse_trace(args[0])
+    if not records:
+        return
+    summarize(events, records)
+    if options.summary:
+        return
+
+    # Draw graph
+    setup_matplotlib(options.output is not None)
+    fig = plot_trace(events, records)
+    if options.output is None:
+        matplotlib.pyplot.show()
+    else:
+        fig.set_size_inches(8, 6)
+        fig.savefig(options.output)
+
+if __name__ == '__main__':
+    main()
@@ -15,7 +15,8 @@ TASK_MAX=0.0025
 APPLY_PREFIX = [
     'mcu_awake', 'mcu_task_avg', 'mcu_task_stddev', 'bytes_write',
     'bytes_read', 'bytes_retransmit', 'freq', 'adj',
-    'target', 'temp', 'pwm'
+    'target', 'temp', 'pwm', 'hist_timer_latency', 'hist_stepper_time',
+    'hist_timer_time', 'hist_task_time', 'hist_timer_batch'
 ]
 
 def parse_log(logname, mcu):
@@ -26,20 +27,19 @@ def parse_log(logname, mcu):
     f = open(logname, 'r')
     out = []
     for line in f:
-        parts = line.split()
-        if not parts or parts[0] not in ('Stats', 'INFO:root:Stats'):
-            #if parts and parts[0] == 'INFO:root:shutdown:':
-            #    break
+        # Quickly skip non-stats lines (most lines in a large log)
+        if not line.startswith(('Stats ', 'INFO:root:Stats ')):
             continue
+        parts = line.split()
         prefix = ""
         keyparts = {}
         for p in parts[2:]:
-            if '=' not in p:
+            name, sep, val = p.partition('=')
+            if not sep:
                 prefix = p
                 if prefix == mcu_prefix:
                     prefix = ''
                 continue
-            name, val = p.split('=', 1)
             if name in apply_prefix:
                 name = prefix + name
             keyparts[name] = val
@@ -247,6 +247,57 @@ def plot_mcu_frequency(data, mcu):
     ax1.grid(True)
     return fig
 
+HISTOGRAMS = [
+    ('hist_timer_latency', "Timer dispatch latency", True),
+    ('hist_stepper_time', "Stepper timer run time", True),
+    ('hist_timer_time', "Other timer run time", True),
+    ('hist_task_time', "Task run time", True),
+    ('hist_timer_batch', "Timers run per timer irq", False),
+]
+
+def plot_mcu_histograms(data, mcu):
+    # Sum the histograms reported over the whole log
+    totals = {}
+    freqs = []
+    for d in data:
+        if d.get('freq') not in (None, '0', '1'):
+            freqs.append(float(d['freq']))
+        for key, desc, is_time in HISTOGRAMS:
+            val = d.get(key)
+            if val is None:
+                continue
+            counts = [int(c) for c in val.split(',')]
+            total = totals.setdefault(key, [])
+            total.extend([0] * (len(counts) - len(total)))
+            for i, c in enumerate(counts):
+                total[i] += c
+    freq = 1.
+    units = 'ticks'
+    if freqs:
+        freq = (sum(freqs) / len(freqs)) / 1000000.
+        units = 'us'
+
+    # Build plot (bucket N holds durations from 2^(N-1) to 2^N-1 ticks)
+    fig, axes = matplotlib.pyplot.subplots(len(HISTOGRAMS), 1)
+    fig.suptitle("MCU '%s' timing histograms" % (mcu,))
+    for ax, (key, desc, is_time) in zip(axes, HISTOGRAMS):
+        counts = totals.get(key, [])
+        if is_time:
+            labels = ["<%.3g" % ((1 << i) / freq,)
+                      for i in range(len(counts))]
+        else:
+            labels = ["<%d" % (1 << i,) for i in range(len(counts))]
+        ax.bar(range(len(counts)), counts, log=any(counts))
+        ax.set_xticks(range(len(counts)))
+        ax.set_xticklabels(labels, fontsize='x-small', rotation=45)
+        ax.set_ylabel('Count')
+        if is_time:
+            desc = "%s (%s)" % (desc, units)
+        ax.set_title(desc, fontsize='small')
+        ax.grid(True)
+    fig.tight_layout()
+    return fig
+
 def plot_temperature(data, heaters):
     fig, ax1 = matplotlib.pyplot.subplots()
     ax2 = ax1.twinx()
@@ -300,6 +351,8 @@ def main():
                     default=None, help="filename of output graph")
     opts.add_option("-t", "--temperature", type="string", dest="heater",
                     default=None, help="graph heater temperature")
+    opts.add_option("-g", "--histogram", action="store_true",
+                    help="graph mcu timing histograms")
     opts.add_option("-m", "--mcu", type="string", dest="mcu", default=None,
                     help="limit stats to the given mcu")
     options, args = opts.parse_args()
@@ -323,6 +376,8 @@ def main():
             fig = plot_mcu_frequencies(data)
     elif options.system:
         fig = plot_system(data)
+    elif options.histogram:
+        fig = plot_mcu_histograms(data, options.mcu or "mcu")
     else:
         fig = plot_mcu(data, MAXBANDWIDTH)
 
@@ -4,6 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, collections
+import numpy as np
 import readlog
 
 
@@ -40,12 +41,29 @@ class GenDerivative:
         return {'label': lname, 'units': units}
     def generate_data(self):
         inv_seg_time = 1. / self.amanager.get_segment_time()
-        data = self.amanager.get_datasets()[self.source]
-        deriv = [(data[i+1] - data[i]) * inv_seg_time
-                 for i in range(len(data)-1)]
-        return [deriv[0]] + deriv
+        data = self.amanager.get_dataset(self.source)
+        deriv = np.diff(data) * inv_seg_time
+        return np.concatenate((deriv[:1], deriv))
 AHandlers["derivative"] = GenDerivative
 
+# Evaluate y[i] = weight * y[i-1] + src[i] (with y[-1] = start)
+def weighted_cumsum(src, weight, start):
+    if weight < 1e-12:
+        return src.copy()
+    # Process in blocks so that weight**-i does not overflow
+    block_size = len(src)
+    if weight < 1.:
+        block_size = max(1, int(50. / -math.log10(weight)))
+    data = np.empty(len(src))
+    prev = start
+    for pos in range(0, len(src), block_size):
+        blk = src[pos:pos + block_size]
+        powers = weight ** np.arange(1, len(blk) + 1)
+        res = powers * (prev + np.cumsum(blk / powers))
+        data[pos:pos + len(blk)] = res
+        prev = res[-1]
+    return data
+
 # Calculate an integral (accel to velocity, or velocity to position)
 class GenIntegral:
     ParametersMin = 1
@@ -84,25 +102,19 @@ class GenIntegral:
         return {'label': lname, 'units': units}
     def generate_data(self):
         seg_time = self.amanager.get_segment_time()
-        src = self.amanager.get_datasets()[self.source]
-        offset = sum(src) / len(src)
-        total = 0.
-        ref = None
-        if self.ref is not None:
-            ref = self.amanager.get_datasets()[self.ref]
-            offset -= (ref[-1] - ref[0]) / (len(src) * seg_time)
-            total = ref[0]
-            src_weight = 1.
-            if self.half_life:
-                src_weight = math.exp(math.log(.5) * seg_time / self.half_life)
-            ref_weight = 1. - src_weight
-        data = [0.] * len(src)
-        for i, v in enumerate(src):
-            total += (v - offset) * seg_time
-            if ref is not None:
-                total = src_weight * total + ref_weight * ref[i]
-            data[i] = total
-        return data
+        src = self.amanager.get_dataset(self.source)
+        offset = np.mean(src)
+        if self.ref is None:
+            return np.cumsum((src - offset) * seg_time)
+        ref = self.amanager.get_dataset(self.ref)
+        offset -= (ref[-1] - ref[0]) / (len(src) * seg_time)
+        src_weight = 1.
+        if self.half_life:
+            src_weight = math.exp(math.log(.5) * seg_time / self.half_life)
+        ref_weight = 1. - src_weight
+        # total = src_weight * (total + delta) + ref_weight * ref
+        src = src_weight * (src - offset) * seg_time + ref_weight * ref
+        return weighted_cumsum(src, src_weight, ref[0])
 AHandlers["integral"] = GenIntegral
 
 # Calculate a pointwise 2-norm of several datasets (e.g. compute velocity or
@@ -145,17 +157,11 @@ class GenNorm2:
         lname += ' ' + data_name + ' norm2'
         return {'label': lname, 'units': units}
     def generate_data(self):
-        seg_time = self.amanager.get_segment_time()
-        data = []
+        total = 0.
         for dataset in self.datasets:
-            data.append(self.amanager.get_datasets()[dataset])
-        res = [0.] * len(data[0])
-        for i in range(len(data[0])):
-            norm2 = 0.
-            for dataset in data:
-                norm2 += dataset[i] * dataset[i]
-            res[i] = math.sqrt(norm2)
-        return res
+            data = self.amanager.get_dataset(dataset)
+            total = total + data * data
+        return np.sqrt(total)
 AHandlers["norm2"] = GenNorm2
 
 class GenSmoothed:
@@ -179,21 +185,27 @@ class GenSmoothed:
         return {'label': 'Smoothed ' + label['label'], 'units': label['units']}
     def generate_data(self):
         seg_time = self.amanager.get_segment_time()
-        src = self.amanager.get_datasets()[self.source]
+        src = self.amanager.get_dataset(self.source)
         n = len(src)
-        data = [0.] * n
         hst = 0.5 * self.smooth_time
-        seg_half_len = round(hst / seg_time)
-        inv_norm = 1. / sum([min(k + 1, seg_half_len + seg_half_len - k)
-                             for k in range(2 * seg_half_len)])
-        for i in range(n):
+        seg_half_len = int(round(hst / seg_time))
+        weights = np.array([min(k + 1, seg_half_len + seg_half_len - k)
+                            for k in range(2 * seg_half_len)], dtype=float)
+        inv_norm = 1. / np.sum(weights)
+        data = np.empty(n)
+        edges = range(n)
+        if n >= 2 * seg_half_len:
+            # Samples with a full window
+            interior = np.correlate(src, weights, 'valid')
+            data[seg_half_len:seg_half_len + len(interior)] = interior
+            edges = (list(range(seg_half_len))
+                     + list(range(seg_half_len + len(interior), n)))
+        # Samples with a window truncated by the start or end of the data
+        for i in edges:
             j = max(0, i - seg_half_len)
             je = min(n, i + seg_half_len)
-            avg_val = 0.
-            for k, v in enumerate(src[j:je]):
-                avg_val += v * min(k + 1, seg_half_len + seg_half_len - k)
-            data[i] = avg_val * inv_norm
-        return data
+            data[i] = np.dot(src[j:je], weights[:je-j])
+        return data * inv_norm
 AHandlers["smooth"] = GenSmoothed
 
 # Calculate a kinematic stepper position from the toolhead requested position
@@ -228,17 +240,15 @@ class GenKinematicPosition:
     def get_label(self):
         return {'label': 'Position', 'units': 'Position\n(mm)'}
     def generate_data_corexy_plus(self):
-        datasets = self.amanager.get_datasets()
-        data1 = datasets[self.source1]
-        data2 = datasets[self.source2]
-        return [d1 + d2 for d1, d2 in zip(data1, data2)]
+        data1 = self.amanager.get_dataset(self.source1)
+        data2 = self.amanager.get_dataset(self.source2)
+        return data1 + data2
     def generate_data_corexy_minus(self):
-        datasets = self.amanager.get_datasets()
-        data1 = datasets[self.source1]
-        data2 = datasets[self.source2]
-        return [d1 - d2 for d1, d2 in zip(data1, data2)]
+        data1 = self.amanager.get_dataset(self.source1)
+        data2 = self.amanager.get_dataset(self.source2)
+        return data1 - data2
     def generate_data_passthrough(self):
-        return self.amanager.get_datasets()[self.source1]
+        return self.amanager.get_dataset(self.source1)
 AHandlers["kin"] = GenKinematicPosition
 
 # Calculate a toolhead x/y position from corexy stepper positions
@@ -261,12 +271,11 @@ class GenCorexyPosition:
         return {'label': 'Derived %s position' % (axis,),
                 'units': 'Position\n(mm)'}
     def generate_data(self):
-        datasets = self.amanager.get_datasets()
-        data1 = datasets[self.source1]
-        data2 = datasets[self.source2]
+        data1 = self.amanager.get_dataset(self.source1)
+        data2 = self.amanager.get_dataset(self.source2)
         if self.is_plus:
-            return [.5 * (d1 + d2) for d1, d2 in zip(data1, data2)]
-        return [.5 * (d1 - d2) for d1, d2 in zip(data1, data2)]
+            return .5 * (data1 + data2)
+        return .5 * (data1 - data2)
 AHandlers["corexy"] = GenCorexyPosition
 
 # Calculate a position deviation
@@ -289,10 +298,9 @@ class GenDeviation:
         units = '\n'.join([parts[0]] + ['Deviation'] + parts[1:])
         return {'label': label1['label'] + ' deviation', 'units': units}
     def generate_data(self):
-        datasets = self.amanager.get_datasets()
-        data1 = datasets[self.source1]
-        data2 = datasets[self.source2]
-        return [d1 - d2 for d1, d2 in zip(data1, data2)]
+        data1 = self.amanager.get_dataset(self.source1)
+        data2 = self.amanager.get_dataset(self.source2)
+        return data1 - data2
 AHandlers["deviation"] = GenDeviation
 
 
@@ -317,13 +325,26 @@ class AnalyzerManager:
         self.raw_datasets = collections.OrderedDict()
         self.gen_datasets = collections.OrderedDict()
         self.datasets = {}
-        self.dataset_times = []
+        self.dataset_times = np.zeros(0)
         self.duration = 5.
     def set_duration(self, duration):
         self.duration = duration
     def get_segment_time(self):
         return self.segment_time
+    def get_dataset(self, name):
+        # Analyzer data is generated on first use and then cached
+        name = name.strip()
+        data = self.datasets.get(name)
+        if data is None:
+            hdl = self.gen_datasets.get(name)
+            if hdl is None:
+                raise self.error("Unknown dataset '%s'" % (name,))
+            data = self.datasets[name] = np.asarray(hdl.generate_data(),
+                                                    dtype=float)
+        return data
     def get_datasets(self):
+        for name in self.gen_datasets:
+            self.get_dataset(name)
         return self.datasets
     def get_dataset_times(self):
         return self.dataset_times
@@ -348,7 +369,6 @@ class AnalyzerManager:
                 raise self.error("Invalid parameters to dataset '%s'" % (name,))
             hdl = cls(self, name_parts)
             self.gen_datasets[name] = hdl
-        self.datasets[name] = []
         return hdl
     def get_label(self, dataset):
         hdl = self.raw_datasets.get(dataset)
@@ -359,16 +379,17 @@ class AnalyzerManager:
         return hdl.get_label()
     def generate_datasets(self):
         # Generate raw data
-        list_hdls = [(self.datasets[name], hdl)
-                     for name, hdl in self.raw_datasets.items()]
         initial_start_time = self.lmanager.get_initial_start_time()
-        start_time = t = self.lmanager.get_start_time()
-        end_time = start_time + self.duration
-        while t < end_time:
-            t += self.segment_time
-            self.dataset_times.append(t - initial_start_time)
-            for dl, hdl in list_hdls:
-                dl.append(hdl.pull_data(t))
-        # Generate analyzer data
-        for name, hdl in self.gen_datasets.items():
-            self.datasets[name] = hdl.generate_data()
+        start_time = self.lmanager.get_start_time()
+        count = int(math.ceil(self.duration / self.segment_time - 1e-9))
+        req_times = start_time + self.segment_time * np.arange(1, count + 1)
+        self.dataset_times = req_times - initial_start_time
+        req_times_list = req_times.tolist()
+        for name, hdl in self.raw_datasets.items():
+            pull_block = getattr(hdl, 'pull_block', None)
+            if pull_block is not None:
+                data = pull_block(req_times)
+            else:
+                pull_data = hdl.pull_data
+                data = [pull_data(t) for t in req_times_list]
+            self.datasets[name] = np.asarray(data, dtype=float)
@@ -3,7 +3,7 @@
 # Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import json, zlib
+import json, zlib, logging, collections
 
 class error(Exception):
     pass
@@ -63,25 +63,29 @@ class HandleTrapQ:
         ptypes = {}
         ptypes['velocity'] = {
             'label': '%s velocity' % (trapq_name,),
-            'units': 'Velocity\n(mm/s)', 'func': self._pull_velocity
+            'units': 'Velocity\n(mm/s)', 'func': self._pull_velocity,
+            'block': 'velocity'
         }
         ptypes['accel'] = {
             'label': '%s acceleration' % (trapq_name,),
-            'units': 'Acceleration\n(mm/s^2)', 'func': self._pull_accel
+            'units': 'Acceleration\n(mm/s^2)', 'func': self._pull_accel,
+            'block': 'accel'
         }
         for axis, name in enumerate("xyz"):
             ptypes['%s' % (name,)] = {
                 'label': '%s %s position' % (trapq_name, name), 'axis': axis,
-                'units': 'Position\n(mm)', 'func': self._pull_axis_position
+                'units': 'Position\n(mm)', 'func': self._pull_axis_position,
+                'block': 'position'
             }
             ptypes['%s_velocity' % (name,)] = {
                 'label': '%s %s velocity' % (trapq_name, name), 'axis': axis,
-                'units': 'Velocity\n(mm/s)', 'func': self._pull_axis_velocity
+                'units': 'Velocity\n(mm/s)', 'func': self._pull_axis_velocity,
+                'block': 'velocity'
             }
             ptypes['%s_accel' % (name,)] = {
                 'label': '%s %s acceleration' % (trapq_name, name),
                 'axis': axis, 'units': 'Acceleration\n(mm/s^2)',
-                'func': self._pull_axis_accel
+                'func': self._pull_axis_accel, 'block': 'accel'
             }
         pinfo = ptypes.get(datasel)
         if pinfo is None:
@@ -89,8 +93,48 @@ class HandleTrapQ:
         self.label = {'label': pinfo['label'], 'units': pinfo['units']}
         self.axis = pinfo.get('axis')
         self.pull_data = pinfo['func']
+        self.block_type = pinfo['block']
     def get_label(self):
         return self.label
+    def pull_block(self, req_times):
+        # Calculate the data for a sorted numpy array of times at once
+        import numpy as np
+        if not len(req_times):
+            return np.zeros(0)
+        # Gather all moves needed for the requested times
+        end_time = req_times[-1]
+        moves = self.cur_data[self.data_pos:]
+        while moves[-1][0] + moves[-1][1] < end_time:
+            jmsg = self.jdispatch.pull_msg(end_time, self.name)
+            if jmsg is None:
+                break
+            moves.extend(jmsg['data'])
+        self.cur_data = moves
+        self.data_pos = len(moves) - 1
+        # Find the first move ending at or after each requested time
+        print_time = np.array([m[0] for m in moves])
+        move_t = np.array([m[1] for m in moves])
+        idx = np.searchsorted(print_time + move_t, req_times, 'left')
+        past_end = idx >= len(moves)
+        idx = np.minimum(idx, len(moves) - 1)
+        mtime = req_times - print_time[idx]
+        in_range = (mtime >= 0.) & ~past_end
+        start_v = np.array([m[2] for m in moves])[idx]
+        accel = np.array([m[3] for m in moves])[idx]
+        if self.axis is not None:
+            axis_r = np.array([m[5][self.axis] for m in moves])[idx]
+        else:
+            axis_r = 1.
+        if self.block_type == 'position':
+            mtime = np.clip(mtime, 0., move_t[idx])
+            dist = (start_v + .5 * accel * mtime) * mtime
+            start_pos = np.array([m[4][self.axis] for m in moves])[idx]
+            return start_pos + axis_r * dist
+        if self.block_type == 'velocity':
+            res = (start_v + accel * mtime) * axis_r
+        else:
+            res = accel * axis_r
+        return np.where(in_range, res, 0.)
     def _find_move(self, req_time):
         data_pos = self.data_pos
         while 1:
@@ -219,7 +263,9 @@ class HandleStepQ:
         step_pos = jmsg['start_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos, step_pos)
-        for interval, raw_count, add in jmsg['data']:
+        for qs in jmsg['data']:
+            interval, raw_count, add = qs[:3]
+            add2 = qs[3] if len(qs) > 3 else 0
             qs_dist = step_dist
             count = raw_count
             if count < 0:
@@ -228,6 +274,7 @@ class HandleStepQ:
             for i in range(count):
                 step_clock += interval
                 interval += add
+                add += add2
                 step_time = first_time + (step_clock - first_clock) * inv_freq
                 step_halfpos = step_pos + .5 * qs_dist
                 step_pos += qs_dist
@@ -320,7 +367,9 @@ class HandleStepPhase:
         step_pos = jmsg['start_mcu_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos)
-        for interval, raw_count, add in jmsg['data']:
+        for qs in jmsg['data']:
+            interval, raw_count, add = qs[:3]
+            add2 = qs[3] if len(qs) > 3 else 0
             qs_dist = 1
             count = raw_count
             if count < 0:
@@ -329,6 +378,7 @@ class HandleStepPhase:
             for i in range(count):
                 step_clock += interval
                 interval += add
+                add += add2
                 step_time = first_time + (step_clock - first_clock) * inv_freq
                 step_pos += qs_dist
                 step_data.append((step_time, step_pos))
@@ -515,14 +565,30 @@ class JsonLogReader:
         self.file = open(filename, "rb")
         self.comp = zlib.decompressobj(31)
         self.msgs = [b""]
+        self.msg_pos = 0
+        self.wanted_ids = None
     def seek(self, pos):
         self.file.seek(pos)
         self.comp = zlib.decompressobj(-15)
+    def set_wanted_ids(self, wanted_ids):
+        # Only decode async messages with a "q" field in wanted_ids
+        self.wanted_ids = {('{"q":"%s"' % (qid,)).encode(): 1
+                           for qid in wanted_ids}
+    def _is_wanted(self, msg):
+        if not msg.startswith(b'{"q":"'):
+            return True
+        idend = msg.find(b'"', 6)
+        return msg[:idend+1] in self.wanted_ids
     def pull_msg(self):
         msgs = self.msgs
+        wanted_ids = self.wanted_ids
         while 1:
-            if len(msgs) > 1:
-                msg = msgs.pop(0)
+            if self.msg_pos < len(msgs) - 1:
+                msg = msgs[self.msg_pos]
+                self.msg_pos += 1
+                if wanted_ids is not None and not self._is_wanted(msg):
+                    # Skip decoding of datasets that are not needed
+                    continue
                 try:
                     json_msg = json.loads(msg)
                 except:
@@ -534,8 +600,9 @@ class JsonLogReader:
                 return None
             data = self.comp.decompress(raw_data)
             parts = data.split(b'\x03')
-            parts[0] = msgs[0] + parts[0]
+            parts[0] = msgs[-1] + parts[0]
             self.msgs = msgs = parts
+            self.msg_pos = 0
 
 # Store messages in per-subscription queues until handlers are ready for them
 class JsonDispatcher:
@@ -548,13 +615,14 @@ class JsonDispatcher:
     def check_end_of_data(self):
         return self.is_eof and not any(self.queues.values())
     def add_handler(self, name, subscription_id):
-        self.names[name] = q = []
+        self.names[name] = q = collections.deque()
         self.queues.setdefault(subscription_id, []).append(q)
+        self.log_reader.set_wanted_ids(['status'] + list(self.queues.keys()))
     def pull_msg(self, req_time, name):
         q = self.names[name]
         while 1:
             if q:
-                return q.pop(0)
+                return q.popleft()
             if req_time + 1. < self.last_read_time:
                 return None
             json_msg = self.log_reader.pull_msg()
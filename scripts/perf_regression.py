@@ -0,0 +1,380 @@
+#!/usr/bin/env python
+# End-to-end performance regression test using the host simulator
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, math, re, json, time, pty, tty, select
+import errno, signal, subprocess
+import benchmark_motion
+
+TEMP_CONFIG_FILE = "_perf_.cfg"
+TEMP_LOG_FILE = "_perf_.log"
+TEMP_INPUT_TTY = "_perf_printer"
+
+MAX_VELOCITY = 300.
+MAX_ACCEL = 3000.
+
+# The simulator has no heaters or endstops - define a plain cartesian
+# printer on the simulator "gpio" pins and skip homing
+CONFIG = """
+[mcu]
+serial: %s
+restart_method: command
+
+[printer]
+kinematics: cartesian
+max_velocity: %.0f
+max_accel: %.0f
+max_z_velocity: 25
+max_z_accel: 300
+
+[stepper_x]
+step_pin: gpio0
+dir_pin: gpio1
+enable_pin: !gpio2
+microsteps: 16
+rotation_distance: 40
+endstop_pin: gpio20
+position_endstop: 0
+position_max: 200
+
+[stepper_y]
+step_pin: gpio3
+dir_pin: gpio4
+enable_pin: !gpio5
+microsteps: 16
+rotation_distance: 40
+endstop_pin: gpio21
+position_endstop: 0
+position_max: 200
+
+[stepper_z]
+step_pin: gpio6
+dir_pin: gpio7
+enable_pin: !gpio8
+microsteps: 16
+rotation_distance: 8
+endstop_pin: gpio22
+position_endstop: 0
+position_max: 200
+
+[force_move]
+enable_force_move: True
+
+[gcode_arcs]
+"""
+
+# Timing of the short moves used to measure the command latency
+PROBE_COUNT = 20
+PROBE_DISTANCE = 1.
+PROBE_SPEED = 100.
+
+# Metrics checked against a baseline (larger values are worse)
+METRICS = [
+    ('cpu_us_per_move', "cpu_us/mv"), ('bytes_per_move', "bytes/mv"),
+    ('move_latency_ms', "lat_ms"), ('move_latency_max_ms', "lat_max"),
+    ('timer_late_p99_us', "late_p99"), ('timer_late_max_us', "late_max"),
+]
+
+class error(Exception):
+    pass
+
+
+######################################################################
+# G-Code input tty
+######################################################################
+
+class GCodeTTY:
+    def __init__(self, filename, timeout):
+        self.timeout = timeout
+        end_time = time.time() + timeout
+        while not os.path.exists(filename):
+            if time.time() > end_time:
+                raise error("Timeout waiting for %s" % (filename,))
+            time.sleep(.100)
+        self.fd = os.open(filename, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        self.data = b""
+    def close(self):
+        os.close(self.fd)
+    def _read_lines(self, wait):
+        res = select.select([self.fd], [], [], wait)
+        if not res[0]:
+            return []
+        try:
+            data = os.read(self.fd, 4096)
+        except OSError as e:
+            if e.errno == errno.EIO:
+                raise error("Klippy closed the input tty")
+            raise
+        lines = (self.data + data).split(b'\n')
+        self.data = lines.pop()
+        return [l.strip().decode() for l in lines]
+    def run(self, lines):
+        # Send G-Code lines and wait for an "ok" from each of them
+        out = ''.join([l + '\n' for l in lines]).encode()
+        pending = len(lines)
+        errors = []
+        end_time = time.time() + self.timeout
+        while pending:
+            if out:
+                res = select.select([self.fd], [self.fd], [], 1.)
+                if res[1]:
+                    count = os.write(self.fd, out[:4096])
+                    out = out[count:]
+                if not res[0]:
+                    continue
+            for line in self._read_lines(1.):
+                if line.startswith('!!'):
+                    errors.append(line)
+                elif line.startswith('ok'):
+                    pending -= 1
+            if time.time() > end_time:
+                raise error("Timeout waiting for G-Code response")
+        return errors
+    def wait_ready(self):
+        end_time = time.time() + self.timeout
+        while self.run(["M400"]):
+            if time.time() > end_time:
+                raise error("Timeout waiting for printer ready")
+            time.sleep(.500)
+
+
+######################################################################
+# Log parsing
+######################################################################
+
+def calc_move_time(dist, speed, accel):
+    # Duration of a move that starts and ends at a stop
+    if dist >= speed**2 / accel:
+        return dist / speed + speed / accel
+    return 2. * math.sqrt(dist / accel)
+
+def hist_percentile(counts, freq, pct):
+    # Bucket 'i' holds durations from 2^(i-1) to 2^i-1 ticks
+    total = sum(counts)
+    if not total:
+        return 0.
+    limit = total * pct
+    count = 0
+    for i, c in enumerate(counts):
+        count += c
+        if count >= limit:
+            return ((1 << i) - 1) * 1000000. / freq
+    return ((1 << len(counts)) - 1) * 1000000. / freq
+
+def parse_log(logname):
+    res = {'bytes_write': 0, 'bytes_read': 0, 'hist': None, 'freq': 0.}
+    f = open(logname, 'r')
+    for line in f:
+        if not line.startswith('Stats '):
+            continue
+        parts = dict([p.split('=', 1) for p in line.split() if '=' in p])
+        if 'bytes_write' in parts:
+            res['bytes_write'] = int(parts['bytes_write'])
+            res['bytes_read'] = int(parts['bytes_read'])
+        if 'freq' in parts:
+            res['freq'] = float(parts['freq'])
+        hist = parts.get('hist_timer_latency')
+        if hist is not None:
+            counts = [int(c) for c in hist.split(',')]
+            total = res['hist'] or []
+            total.extend([0] * (len(counts) - len(total)))
+            for i, c in enumerate(counts):
+                total[i] += c
+            res['hist'] = total
+    f.close()
+    return res
+
+
+######################################################################
+# Test runner
+######################################################################
+
+class PerfTest:
+    def __init__(self, options):
+        self.simulator = options.simulator
+        self.tempdir = options.tempdir
+        self.timeout = options.timeout
+        self.keepfiles = options.keepfiles
+    def relpath(self, fname):
+        return os.path.abspath(os.path.join(self.tempdir, fname))
+    def write_file(self, fname, data):
+        f = open(fname, 'w')
+        f.write(data)
+        f.close()
+    def gen_workload(self, workload):
+        # The simulated printer has no extruder - drop the extrusion
+        center = (100., 100.)
+        gw = benchmark_motion.GCodeWriter(center, 5., [])
+        benchmark_motion.WORKLOADS[workload](gw)
+        r = re.compile(r" E-?[0-9.]+")
+        lines = ["SET_KINEMATIC_POSITION X=0 Y=0 Z=0"]
+        for line in gw.lines[1:]:
+            lines.append(r.sub("", line))
+        return gw, lines + ["M400"]
+    def run_probes(self, gt, center):
+        latencies = []
+        move_time = calc_move_time(PROBE_DISTANCE, PROBE_SPEED, MAX_ACCEL)
+        x, y = center
+        for i in range(PROBE_COUNT):
+            x += PROBE_DISTANCE if i & 1 else -PROBE_DISTANCE
+            start_time = time.time()
+            errors = gt.run(["G1 X%.3f Y%.3f F%d" % (x, y, PROBE_SPEED * 60.),
+                             "M400"])
+            if errors:
+                raise error("Probe move failed: %s" % (errors[0],))
+            latencies.append(time.time() - start_time - move_time)
+        latencies.sort()
+        return latencies[len(latencies) // 2], latencies[-1]
+    def run(self, workload):
+        gw, lines = self.gen_workload(workload)
+        config_fname = self.relpath(TEMP_CONFIG_FILE)
+        log_fname = self.relpath(TEMP_LOG_FILE)
+        tty_fname = self.relpath(TEMP_INPUT_TTY)
+        for fname in [log_fname, tty_fname]:
+            if os.path.exists(fname):
+                os.unlink(fname)
+        # Start the simulator on a new pseudo-tty
+        master, slave = pty.openpty()
+        tty.setraw(slave)
+        sim = subprocess.Popen([self.simulator], stdin=master, stdout=master)
+        os.close(master)
+        self.write_file(config_fname, CONFIG % (
+            os.ttyname(slave), MAX_VELOCITY, MAX_ACCEL))
+        # Start klippy and wait for it to become ready
+        args = [sys.executable, './klippy/klippy.py', config_fname,
+                '-I', tty_fname, '-l', log_fname]
+        klippy = subprocess.Popen(args)
+        gt = None
+        try:
+            gt = GCodeTTY(tty_fname, self.timeout)
+            gt.wait_ready()
+            start_time = time.time()
+            errors = gt.run(lines)
+            wall_time = time.time() - start_time
+            if errors:
+                raise error("G-Code error: %s" % (errors[0],))
+            lat_median, lat_max = self.run_probes(gt, gw.pos[:2])
+            # Wait for a final statistics report
+            time.sleep(1.500)
+        finally:
+            if gt is not None:
+                gt.close()
+            klippy.send_signal(signal.SIGTERM)
+            pid, status, usage = os.wait4(klippy.pid, 0)
+            klippy.returncode = status
+            sim.kill()
+            sim.wait()
+            os.close(slave)
+        res = parse_log(log_fname)
+        if res['hist'] is None:
+            late_p99 = late_max = 0.
+        else:
+            freq = res['freq'] or 1000000.
+            late_p99 = hist_percentile(res['hist'], freq, .99)
+            late_max = hist_percentile(res['hist'], freq, 1.)
+        cpu_time = usage.ru_utime + usage.ru_stime
+        moves = max(gw.moves + PROBE_COUNT, 1)
+        result = {
+            'moves': moves, 'wall_time': wall_time, 'cpu_time': cpu_time,
+            'cpu_us_per_move': cpu_time * 1000000. / moves,
+            'bytes_per_move': float(res['bytes_write']) / moves,
+            'bytes_read': res['bytes_read'],
+            'move_latency_ms': lat_median * 1000.,
+            'move_latency_max_ms': lat_max * 1000.,
+            'timer_late_p99_us': late_p99, 'timer_late_max_us': late_max,
+        }
+        # Do cleanup
+        if not self.keepfiles:
+            for fname in [config_fname, log_fname]:
+                os.unlink(fname)
+        return result
+
+def format_result(workload, res):
+    out = ["%-14s %6d %7.2f" % (workload, res['moves'], res['wall_time'])]
+    for name, title in METRICS:
+        out.append("%9.1f" % (res[name],))
+    return ' '.join(out)
+
+def check_baseline(results, baseline, tolerance):
+    # Return a list of metrics that are worse than the baseline
+    regressions = []
+    for workload, res in sorted(results.items()):
+        base = baseline.get(workload)
+        if base is None:
+            continue
+        for name, title in METRICS:
+            if name not in base:
+                continue
+            limit = base[name] * (1. + tolerance)
+            if res[name] > limit and res[name] - base[name] > .1:
+                regressions.append("%s %s: %.1f (baseline %.1f)" % (
+                    workload, name, res[name], base[name]))
+    return regressions
+
+
+######################################################################
+# Startup
+######################################################################
+
+def main():
+    # Parse args
+    usage = "%prog [options] <simulator binary>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-w", "--workloads", dest="workloads",
+                    default=','.join(sorted(benchmark_motion.WORKLOADS)),
+                    help="comma separated list of workloads")
+    opts.add_option("-b", "--baseline", dest="baseline",
+                    help="json file with results to compare against")
+    opts.add_option("-o", "--output", dest="output",
+                    help="write the results to a json file")
+    opts.add_option("-p", "--tolerance", dest="tolerance", type="float",
+                    default=0.20, help="allowed fraction above the baseline"
+                    " before a metric is a regression (default 0.20)")
+    opts.add_option("-t", "--tempdir", dest="tempdir", default=".",
+                    help="directory for temporary files")
+    opts.add_option("--timeout", dest="timeout", type="float", default=60.,
+                    help="seconds to wait for klippy responses")
+    opts.add_option("--keep", action="store_true", dest="keepfiles",
+                    help="do not remove temporary files")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    options.simulator = args[0]
+    workloads = options.workloads.split(',')
+    for workload in workloads:
+        if workload not in benchmark_motion.WORKLOADS:
+            opts.error("Unknown workload '%s'" % (workload,))
+
+    # Run each test
+    test = PerfTest(options)
+    sys.stdout.write("%-14s %6s %7s %s\n" % (
+        "workload", "moves", "wall_s",
+        ' '.join(["%9s" % (title,) for name, title in METRICS])))
+    results = {}
+    for workload in workloads:
+        try:
+            res = test.run(workload)
+        except error as e:
+            sys.stderr.write("\n%s FAILED (%s)\n" % (workload, str(e)))
+            sys.exit(-1)
+        results[workload] = res
+        sys.stdout.write(format_result(workload, res) + "\n")
+        sys.stdout.flush()
+    if options.output:
+        f = open(options.output, 'w')
+        json.dump(results, f, indent=2, sort_keys=True)
+        f.close()
+    if options.baseline:
+        f = open(options.baseline, 'r')
+        baseline = json.load(f)
+        f.close()
+        regressions = check_baseline(results, baseline, options.tolerance)
+        if regressions:
+            sys.stdout.write("Performance regressions:\n  %s\n"
+                             % ('\n  '.join(regressions),))
+            sys.exit(1)
+        sys.stdout.write("No performance regressions found\n")
+
+if __name__ == '__main__':
+    main()
@@ -125,6 +125,7 @@ SDIO_SEND_CMD_RESPONSE = "sdio_send_command_response oid=%c error=%c " \
     "response=%*s"
 SDIO_READ_DATA="sdio_read_data oid=%c cmd=%c argument=%u"
 SDIO_READ_DATA_RESPONSE="sdio_read_data_response oid=%c error=%c read=%u"
+SDIO_READ_BLOCKS="sdio_read_blocks oid=%c cmd=%c argument=%u count=%c"
 SDIO_WRITE_DATA="sdio_write_data oid=%c cmd=%c argument=%u"
 SDIO_WRITE_DATA_RESPONSE="sdio_write_data_response oid=%c error=%c write=%u"
 SDIO_READ_DATA_BUFFER="sdio_read_data_buffer oid=%c offset=%u len=%c"
@@ -143,9 +144,12 @@ class MCUConfigError(SPIFlashError):
 class SPIDirect:
     def __init__(self, ser):
         self.oid = SPI_OID
+        self._ser = ser
         self._spi_send_cmd = mcu.CommandWrapper(ser, SPI_SEND_CMD)
         self._spi_transfer_cmd = mcu.CommandQueryWrapper(
             ser, SPI_XFER_CMD, SPI_XFER_RESPONSE, self.oid)
+        self._spi_transfer_raw = ser.get_msgparser().lookup_command(
+            SPI_XFER_CMD)
 
     def spi_send(self, data):
         self._spi_send_cmd.send([self.oid, data])
@@ -153,6 +157,30 @@ class SPIDirect:
     def spi_transfer(self, data):
         return self._spi_transfer_cmd.send([self.oid, data])
 
+    def spi_transfer_multi(self, data_list):
+        # Pipeline several transfers instead of waiting on each response
+        responses = []
+        ser = self._ser
+        ser.register_response(responses.append, "spi_transfer_response",
+                              self.oid)
+        try:
+            cmds = [self._spi_transfer_raw.encode([self.oid, data])
+                    for data in data_list]
+            cmd_queue = ser.get_default_command_queue()
+            for cmd in cmds[:-1]:
+                ser.raw_send(cmd, 0, 0, cmd_queue)
+            ser.raw_send_wait_ack(cmds[-1], 0, 0, cmd_queue)
+            reactor = ser.reactor
+            timeout = reactor.monotonic() + 1.
+            while len(responses) < len(cmds):
+                curtime = reactor.monotonic()
+                if curtime > timeout:
+                    raise SPIFlashError("Unable to obtain spi responses")
+                reactor.pause(curtime + .001)
+        finally:
+            ser.register_response(None, "spi_transfer_response", self.oid)
+        return responses
+
 class SDIODirect:
     def __init__(self, ser):
         self.oid = SDIO_OID
@@ -168,6 +196,12 @@ class SDIODirect:
         self._sdio_write_data_buffer = mcu.CommandWrapper(ser,
             SDIO_WRITE_DATA_BUFFER)
         self._sdio_set_speed = mcu.CommandWrapper(ser, SDIO_SET_SPEED)
+        # Multi-block reads are not available on older firmware
+        try:
+            self._sdio_read_blocks = mcu.CommandQueryWrapper(
+                ser, SDIO_READ_BLOCKS, SDIO_READ_DATA_RESPONSE, self.oid)
+        except Exception:
+            self._sdio_read_blocks = None
 
     def sdio_send_cmd(self, cmd, argument, wait):
         return self._sdio_send_cmd.send([self.oid, cmd, argument, wait])
@@ -175,6 +209,12 @@ class SDIODirect:
     def sdio_read_data(self, cmd, argument):
         return self._sdio_read_data.send([self.oid, cmd, argument])
 
+    def has_read_blocks(self):
+        return self._sdio_read_blocks is not None
+
+    def sdio_read_blocks(self, cmd, argument, count):
+        return self._sdio_read_blocks.send([self.oid, cmd, argument, count])
+
     def sdio_write_data(self, cmd, argument):
         return self._sdio_write_data.send([self.oid, cmd, argument])
 
@@ -203,6 +243,11 @@ STA_NO_INIT = 1 << 0
 STA_NO_DISK = 1 << 1
 STA_WRITE_PROTECT = 1 << 2
 SECTOR_SIZE = 512
+# Number of sectors to read per SDIO multi-block read (limited by the
+# size of the firmware's sdio data buffer)
+READ_AHEAD_SECTORS = 8
+# Largest sdio_read_data_buffer request that fits in a single message
+SDIO_BUFFER_CHUNK = 48
 
 # FAT16/32 File System Support
 class FatFS:
@@ -495,6 +540,7 @@ SD_COMMANDS = {
     'SEND_STATUS': 13,
     'SET_BLOCKLEN': 16,
     'READ_SINGLE_BLOCK': 17,
+    'READ_MULTIPLE_BLOCK': 18,
     'WRITE_BLOCK': 24,
     'APP_CMD': 55,
     'READ_OCR': 58,
@@ -774,16 +820,16 @@ class SDCardSPI:
                 bcount -= sent
             self._find_sd_token(0xFF)
             return None
+        # Read the block and its CRC with pipelined transfers
+        xfers = [[0xFF]*min(32, size - pos) for pos in range(0, size, 32)]
+        xfers.append([0xFF, 0xFF])
+        responses = self.spi.spi_transfer_multi(xfers)
         buf = bytearray()
-        while len(buf) < size:
-            count = min(32, size - len(buf))
-            params = self.spi.spi_transfer([0xFF]*count)
+        for params in responses[:-1]:
             buf += bytearray(params['response'])
-        # Get the CRC
-        params = self.spi.spi_transfer([0xFF, 0xFF])
         # Make sure we leave the busy state
         self._find_sd_token(0xFF)
-        crc = bytearray(params['response'])
+        crc = bytearray(responses[-1]['response'])
         crc_int = (crc[0] << 8) | crc[1]
         calculated_crc = calc_crc16(buf)
         if calculated_crc != crc_int:
@@ -857,6 +903,7 @@ class SDCardSDIO:
         self.write_protected = False
         self.total_sectors = 0
         self.card_info = collections.OrderedDict()
+        self.read_cache = {}
 
     def init_sd(self):
         def check_for_ocr_errors(reg):
@@ -957,6 +1004,7 @@ class SDCardSDIO:
                 except Exception:
                     logging.exception("Error resetting SD Card")
             self.initialized = False
+            self.read_cache.clear()
             self.sd_version = 0
             self.high_capacity = False
             self.total_sectors = 0
@@ -1091,35 +1139,52 @@ class SDCardSDIO:
             elif not self.initialized:
                 err_msg += ", SD Card not initialized"
             else:
-                offset = sector
-                if not self.high_capacity:
-                    offset = sector * SECTOR_SIZE
-
-                params = self.sdio.sdio_read_data(
-                    SD_COMMANDS['READ_SINGLE_BLOCK'], offset)
-                if params['error'] != 0:
-                    raise OSError(
-                        'Read data failed. Error code=%d' %(params['error'],) )
-                if params['read'] != SECTOR_SIZE:
-                    raise OSError(
-                        'Read data failed. Expected %d bytes but got %d.' %
-                        (SECTOR_SIZE, params['read']) )
-
-                buf = bytearray()
-                offset = 0
-                while SECTOR_SIZE-len(buf)>0:
-                    rest = min(SECTOR_SIZE-len(buf), 32)
-                    params = self.sdio.sdio_read_data_buffer(
-                        offset, length=rest)
-                    temp = bytearray(params['data'])
-                    if len(temp) == 0:
-                        raise OSError("Read zero bytes from buffer")
-                    buf += temp
-                    offset += len(temp)
+                buf = self.read_cache.pop(sector, None)
+                if buf is None:
+                    buf = self._read_sectors(sector)
             if buf is None:
                 raise OSError(err_msg)
             return buf
 
+    def _read_sectors(self, sector):
+        # Read the requested sector along with the following sectors
+        # (if the firmware supports multi-block reads) and cache the
+        # extra sectors for subsequent sequential reads
+        count = 1
+        if self.sdio.has_read_blocks():
+            count = min(READ_AHEAD_SECTORS, self.total_sectors - sector)
+        offset = sector
+        if not self.high_capacity:
+            offset = sector * SECTOR_SIZE
+        if count > 1:
+            params = self.sdio.sdio_read_blocks(
+                SD_COMMANDS['READ_MULTIPLE_BLOCK'], offset, count)
+        else:
+            params = self.sdio.sdio_read_data(
+                SD_COMMANDS['READ_SINGLE_BLOCK'], offset)
+        if params['error'] != 0:
+            raise OSError(
+                'Read data failed. Error code=%d' %(params['error'],) )
+        total = count * SECTOR_SIZE
+        if params['read'] != total:
+            raise OSError(
+                'Read data failed. Expected %d bytes but got %d.' %
+                (total, params['read']) )
+
+        buf = bytearray()
+        while total-len(buf)>0:
+            rest = min(total-len(buf), SDIO_BUFFER_CHUNK)
+            params = self.sdio.sdio_read_data_buffer(
+                len(buf), length=rest)
+            temp = bytearray(params['data'])
+            if len(temp) == 0:
+                raise OSError("Read zero bytes from buffer")
+            buf += temp
+        self.read_cache.clear()
+        for i in range(1, count):
+            self.read_cache[sector + i] = buf[i*SECTOR_SIZE:(i+1)*SECTOR_SIZE]
+        return buf[:SECTOR_SIZE]
+
     def write_sector(self, sector, data):
         with self.mutex:
             if not 0 <= sector < self.total_sectors:
@@ -1139,6 +1204,7 @@ class SDCardSDIO:
             offset = sector
             if not self.high_capacity:
                 offset = sector * SECTOR_SIZE
+            self.read_cache.clear()
 
             CHUNKSIZE = 32
             for i in range(0, SECTOR_SIZE, CHUNKSIZE):
@@ -0,0 +1,202 @@
+#!/usr/bin/env python2
+# Tool to automate the micro-controller step rate benchmark
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, logging
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', 'klippy'))
+import reactor, serialhdl, clocksync, mcu
+
+TEST_STEPS = 60000
+FINAL_INTERVAL = 3000
+MAX_TICKS = 1000000
+
+class error(Exception):
+    pass
+
+class StepBenchmark:
+    def __init__(self, reactor, options, pins):
+        self.reactor = reactor
+        self.options = options
+        self.pins = pins
+        self.ser = serialhdl.SerialReader(reactor)
+        self.clocksync = clocksync.ClockSync(reactor)
+        self.mcu_freq = 0.
+        self.get_config_cmd = self.get_position_cmd = None
+        self.positions = [0] * len(pins)
+    def connect(self):
+        options = self.options
+        if options.canbus_iface is not None:
+            self.ser.connect_canbus(options.serialport, options.canbus_nodeid,
+                                    options.canbus_iface)
+        elif options.baud:
+            self.ser.connect_uart(options.serialport, options.baud)
+        else:
+            self.ser.connect_pipe(options.serialport)
+        self.clocksync.connect(self.ser)
+        msgparser = self.ser.get_msgparser()
+        self.mcu_freq = msgparser.get_constant_float('CLOCK_FREQ')
+        self.get_config_cmd = mcu.CommandQueryWrapper(
+            self.ser, "get_config",
+            "config is_config=%c crc=%u is_shutdown=%c move_count=%hu")
+        self.get_position_cmd = mcu.CommandQueryWrapper(
+            self.ser, "stepper_get_position oid=%c",
+            "stepper_position oid=%c pos=%i")
+        params = self.get_config_cmd.send()
+        if params['is_config'] or params['is_shutdown']:
+            raise error("Micro-controller must be reset prior to running"
+                        " the benchmark")
+        # Configure steppers
+        pulse_ticks = options.step_pulse_ticks
+        invert_step = 0
+        both_edge = msgparser.get_constant_int('STEPPER_BOTH_EDGE', 0)
+        if pulse_ticks is None:
+            if both_edge:
+                pulse_ticks = 0
+                invert_step = -1
+            else:
+                pulse_ticks = int(self.mcu_freq * .000000100 + .5)
+        logging.info("MCU '%s' freq=%.0f step_pulse_ticks=%d invert_step=%d",
+                     msgparser.get_constant('MCU'), self.mcu_freq,
+                     pulse_ticks, invert_step)
+        self.ser.send("allocate_oids count=%d" % (len(self.pins),))
+        for oid, (step_pin, dir_pin) in enumerate(self.pins):
+            self.ser.send("config_stepper oid=%d step_pin=%s dir_pin=%s"
+                          " invert_step=%d step_pulse_ticks=%d"
+                          % (oid, step_pin, dir_pin, invert_step, pulse_ticks))
+        self.ser.send("finalize_config crc=0")
+        params = self.get_config_cmd.send()
+        if not params['is_config']:
+            raise error("Unable to configure micro-controller")
+        self.positions = [self._get_position(oid)
+                          for oid in range(len(self.pins))]
+    def _get_position(self, oid):
+        params = self.get_position_cmd.send([oid])
+        return params['pos']
+    def run_test(self, count, ticks):
+        # Schedule TEST_STEPS steps on 'count' steppers
+        eventtime = self.reactor.monotonic()
+        start_clock = self.clocksync.get_clock(eventtime) + int(
+            self.mcu_freq * .250)
+        for oid in range(count):
+            self.ser.send("reset_step_clock oid=%d clock=%d"
+                          % (oid, start_clock & 0xffffffff))
+            self.ser.send("set_next_step_dir oid=%d dir=0" % (oid,))
+            self.ser.send("queue_step oid=%d interval=%d count=%d add=0"
+                          % (oid, ticks, TEST_STEPS))
+            self.ser.send("set_next_step_dir oid=%d dir=1" % (oid,))
+            self.ser.send("queue_step oid=%d interval=%d count=1 add=0"
+                          % (oid, FINAL_INTERVAL))
+        # Wait for test to complete
+        end_clock = start_clock + ticks * TEST_STEPS + FINAL_INTERVAL
+        end_time = self.clocksync.estimate_clock_systime(end_clock)
+        self.reactor.pause(end_time + .100)
+        params = self.get_config_cmd.send()
+        is_shutdown = params['is_shutdown']
+        if is_shutdown:
+            self.ser.send("clear_shutdown")
+        # Verify all steps were taken
+        success = not is_shutdown
+        for oid in range(len(self.pins)):
+            pos = self._get_position(oid)
+            if oid < count and abs(pos - self.positions[oid]) != TEST_STEPS - 1:
+                success = False
+            self.positions[oid] = pos
+        return success
+    def check_ticks(self, count, ticks):
+        for i in range(self.options.repeat):
+            if not self.run_test(count, ticks):
+                logging.info("  steppers=%d ticks=%d: failed", count, ticks)
+                return False
+        logging.info("  steppers=%d ticks=%d: success", count, ticks)
+        return True
+    def find_ticks(self, count):
+        # Find a passing ticks value and then bisect to find the minimum
+        fail_ticks = 0
+        pass_ticks = self.options.ticks
+        while not self.check_ticks(count, pass_ticks):
+            fail_ticks = pass_ticks
+            pass_ticks *= 2
+            if pass_ticks > MAX_TICKS:
+                raise error("Unable to find a working ticks value")
+        while pass_ticks - fail_ticks > 1:
+            ticks = (pass_ticks + fail_ticks) // 2
+            if self.check_ticks(count, ticks):
+                pass_ticks = ticks
+            else:
+                fail_ticks = ticks
+        return pass_ticks, fail_ticks
+    def run(self, counts):
+        results = []
+        for count in counts:
+            pass_ticks, fail_ticks = self.find_ticks(count)
+            results.append((count, pass_ticks, fail_ticks))
+        sys.stdout.write("%-10s %8s %10s %14s\n" % (
+            "steppers", "ticks", "fail_ticks", "steps/second"))
+        for count, pass_ticks, fail_ticks in results:
+            sys.stdout.write("%-10d %8d %10d %13.0fK\n" % (
+                count, pass_ticks, fail_ticks,
+                count * self.mcu_freq / pass_ticks / 1000.))
+
+def main():
+    usage = "%prog [options] <serialdevice> <step_pin,dir_pin> ..."
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-v", action="store_true", dest="verbose",
+                    help="enable debug messages")
+    opts.add_option("-b", "--baud", type="int", dest="baud", help="baud rate")
+    opts.add_option("-c", "--canbus_iface", dest="canbus_iface",
+                    help="Use CAN bus interface; serialdevice is the chip UUID")
+    opts.add_option("-i", "--canbus_nodeid", type="int", dest="canbus_nodeid",
+                    default=64, help="The CAN nodeid to use (default 64)")
+    opts.add_option("-n", "--steppers", dest="steppers", default="1,3",
+                    help="comma separated list of active stepper counts")
+    opts.add_option("-t", "--ticks", type="int", dest="ticks", default=1000,
+                    help="initial ticks value (default 1000)")
+    opts.add_option("-r", "--repeat", type="int", dest="repeat", default=2,
+                    help="number of successful runs required (default 2)")
+    opts.add_option("-p", "--step-pulse-ticks", type="int",
+                    dest="step_pulse_ticks",
+                    help="step pulse duration (default 100ns or both edges)")
+    options, args = opts.parse_args()
+    if len(args) < 2:
+        opts.error("Incorrect number of arguments")
+    options.serialport = args[0]
+    pins = []
+    for arg in args[1:]:
+        parts = [p.strip() for p in arg.split(',')]
+        if len(parts) != 2:
+            opts.error("Invalid stepper pins '%s'" % (arg,))
+        pins.append(tuple(parts))
+    try:
+        counts = [int(c) for c in options.steppers.split(',')]
+    except ValueError:
+        opts.error("Invalid steppers parameter")
+    if max(counts) > len(pins) or min(counts) < 1:
+        opts.error("Not enough stepper pins for requested stepper counts")
+    if options.baud is None and not (
+            options.serialport.startswith("/dev/rpmsg_")
+            or options.serialport.startswith("/tmp/")):
+        options.baud = 250000
+
+    debuglevel = logging.INFO
+    if options.verbose:
+        debuglevel = logging.DEBUG
+    logging.basicConfig(level=debuglevel)
+
+    r = reactor.Reactor()
+    bench = StepBenchmark(r, options, pins)
+    def run_benchmark(eventtime):
+        try:
+            bench.connect()
+            bench.run(counts)
+        except (error, serialhdl.error) as e:
+            sys.stderr.write("\nBenchmark failed: %s\n" % (str(e),))
+        r.end()
+    r.register_callback(run_benchmark)
+    try:
+        r.run()
+    except KeyboardInterrupt:
+        sys.stdout.write("\n")
+    bench.ser.disconnect()
+
+if __name__ == '__main__':
+    main()
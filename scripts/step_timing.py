@@ -0,0 +1,187 @@
+#!/usr/bin/env python
+# Tool to report the step timing quality of a running printer
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, optparse, socket, select, json, errno, time
+
+ClientInfo = {'program': 'step_timing', 'version': 'v0.1'}
+
+def webhook_socket_create(uds_filename):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.setblocking(0)
+    sys.stderr.write("Waiting for connect to %s\n" % (uds_filename,))
+    while 1:
+        try:
+            sock.connect(uds_filename)
+        except socket.error as e:
+            if e.errno == errno.ECONNREFUSED:
+                time.sleep(0.1)
+                continue
+            sys.stderr.write("Unable to connect socket %s [%d,%s]\n"
+                             % (uds_filename, e.errno,
+                                errno.errorcode[e.errno]))
+            sys.exit(-1)
+        break
+    sys.stderr.write("Connection.\n")
+    return sock
+
+# Track the worst case step timing of a stepper
+class StepperSummary:
+    def __init__(self, name):
+        self.name = name
+        self.steps = self.batches = self.max_pending = 0
+        self.max_step_rate = self.max_error = 0.
+        self.min_buffer_time = None
+    def note_batch(self, params):
+        self.batches += 1
+        for win_time, steps, max_step_rate, max_error in params['data']:
+            self.steps += steps
+            self.max_step_rate = max(self.max_step_rate, max_step_rate)
+            self.max_error = max(self.max_error, max_error)
+        buffer_time = params['buffer_time']
+        if self.min_buffer_time is None or buffer_time < self.min_buffer_time:
+            self.min_buffer_time = buffer_time
+        self.max_pending = max(self.max_pending, params['pending_msgs'])
+    def get_summary(self):
+        return "%-16s %10d %12.0f %12.3f %14.3f %12d" % (
+            self.name, self.steps, self.max_step_rate, self.max_error * 1e6,
+            self.min_buffer_time or 0., self.max_pending)
+
+class StepTiming:
+    def __init__(self, uds_filename, steppers, csv_file, quiet):
+        self.webhook_socket = webhook_socket_create(uds_filename)
+        self.poll = select.poll()
+        self.poll.register(self.webhook_socket, select.POLLIN | select.POLLHUP)
+        self.socket_data = b""
+        self.req_steppers = steppers
+        self.csv_file = csv_file
+        self.quiet = quiet
+        if csv_file is not None:
+            csv_file.write("stepper,time,steps,max_step_rate,max_error,"
+                           "pending_msgs,buffer_time\n")
+        self.query_handlers = {}
+        self.async_handlers = {}
+        self.summaries = {}
+        self.send_query("info", "info", {"client_info": ClientInfo},
+                        self.handle_info)
+    def error(self, msg):
+        sys.stderr.write(msg + "\n")
+    def finish(self, msg):
+        self.error(msg)
+        if self.summaries:
+            out = ["%-16s %10s %12s %12s %14s %12s" % (
+                "stepper", "steps", "max_rate", "max_err_us",
+                "min_buffer_s", "max_pending")]
+            for name, summary in sorted(self.summaries.items()):
+                out.append(summary.get_summary())
+            sys.stdout.write('\n'.join(out) + '\n')
+        if self.csv_file is not None:
+            self.csv_file.close()
+        sys.exit(0)
+    # Unix Domain Socket IO
+    def send_query(self, msg_id, method, params, cb):
+        self.query_handlers[msg_id] = cb
+        msg = {"id": msg_id, "method": method, "params": params}
+        cm = json.dumps(msg, separators=(',', ':')).encode()
+        self.webhook_socket.send(cm + b"\x03")
+    def process_socket(self):
+        data = self.webhook_socket.recv(4096)
+        if not data:
+            self.finish("Socket closed")
+        parts = data.split(b"\x03")
+        parts[0] = self.socket_data + parts[0]
+        self.socket_data = parts.pop()
+        for part in parts:
+            try:
+                msg = json.loads(part)
+            except:
+                self.error("ERROR: Unable to parse line")
+                continue
+            msg_q = msg.get("q")
+            if msg_q is not None:
+                hdl = self.async_handlers.get(msg_q)
+                if hdl is not None:
+                    hdl(msg_q, msg["params"])
+                continue
+            msg_id = msg.get("id")
+            hdl = self.query_handlers.pop(msg_id, None)
+            if hdl is not None:
+                hdl(msg)
+                continue
+            self.error("ERROR: Message with unknown id")
+    def run(self):
+        try:
+            while 1:
+                res = self.poll.poll(1000.)
+                for fd, event in res:
+                    if fd == self.webhook_socket.fileno():
+                        self.process_socket()
+        except KeyboardInterrupt as e:
+            self.finish("Keyboard Interrupt")
+    # Query response handlers
+    def handle_info(self, msg):
+        if msg["result"]["state"] != "ready":
+            self.finish("Klipper not in ready state")
+        self.send_query("status", "objects/query",
+                        {"objects": {"motion_report": ["steppers"]}},
+                        self.handle_status)
+    def handle_status(self, msg):
+        status = msg["result"]["status"]
+        steppers = status.get("motion_report", {}).get("steppers", [])
+        if self.req_steppers:
+            for name in self.req_steppers:
+                if name not in steppers:
+                    self.finish("Unknown stepper '%s'" % (name,))
+            steppers = self.req_steppers
+        for name in steppers:
+            self.summaries[name] = StepperSummary(name)
+            self.async_handlers[name] = self.handle_batch
+            params = {"name": name, "response_template": {"q": name}}
+            self.send_query(name, "motion_report/dump_step_timing", params,
+                            self.handle_subscribe)
+    def handle_subscribe(self, msg):
+        if "result" not in msg:
+            self.finish("Unable to subscribe to '%s': %s"
+                        % (msg["id"], msg.get("error", {}).get("message", "")))
+    def handle_batch(self, name, params):
+        self.summaries[name].note_batch(params)
+        pending = params['pending_msgs']
+        buffer_time = params['buffer_time']
+        if self.csv_file is not None:
+            for win_time, steps, max_step_rate, max_error in params['data']:
+                self.csv_file.write("%s,%.6f,%d,%.1f,%.9f,%d,%.6f\n" % (
+                    name, win_time, steps, max_step_rate, max_error,
+                    pending, buffer_time))
+        if self.quiet:
+            return
+        steps = sum([d[1] for d in params['data']])
+        max_step_rate = max([d[2] for d in params['data']])
+        max_error = max([d[3] for d in params['data']])
+        sys.stdout.write("%.3f %s: steps=%d max_rate=%.0f max_err=%.3fus"
+                         " pending=%d buffer=%.3fs\n" % (
+                             params['print_time'], name, steps, max_step_rate,
+                             max_error * 1e6, pending, buffer_time))
+        sys.stdout.flush()
+
+def main():
+    usage = "%prog [options] <socket filename>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-s", "--steppers", type="string", dest="steppers",
+                    default="", help="comma separated list of steppers"
+                    " to report (default all)")
+    opts.add_option("-c", "--csv", type="string", dest="csv",
+                    help="write each step timing window to a csv file")
+    opts.add_option("-q", "--quiet", action="store_true",
+                    help="only report the summary on exit")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    steppers = [s.strip() for s in options.steppers.split(',') if s.strip()]
+    csv_file = None
+    if options.csv:
+        csv_file = open(options.csv, 'w')
+    st = StepTiming(args[0], steppers, csv_file, options.quiet)
+    st.run()
+
+if __name__ == '__main__':
+    main()
@@ -60,7 +60,7 @@ alloc_chunks(size_t size, size_t count, uint16_t *avail)
 
 static struct move_node *move_free_list;
 static void *move_list;
-static uint16_t move_count;
+static uint16_t move_count, move_free_count;
 static uint8_t move_item_size;
 
 // Is the config and move queue finalized?
@@ -78,6 +78,7 @@ move_free(void *m)
     struct move_node *mf = m;
     mf->next = move_free_list;
     move_free_list = mf;
+    move_free_count++;
 }
 
 // Allocate runtime storage
@@ -89,6 +90,7 @@ move_alloc(void)
     if (!mf)
         shutdown("Move queue overflow");
     move_free_list = mf->next;
+    move_free_count--;
     irq_restore(flag);
     return mf;
 }
@@ -163,6 +165,7 @@ move_reset(void)
     struct move_node *mf = move_list + (move_count - 1)*move_item_size;
     mf->next = NULL;
     move_free_list = move_list;
+    move_free_count = move_count;
 }
 DECL_SHUTDOWN(move_reset);
 
@@ -269,7 +272,7 @@ config_reset(uint32_t *args)
     oids = NULL;
     move_free_list = NULL;
     move_list = NULL;
-    move_count = move_item_size = 0;
+    move_count = move_free_count = move_item_size = 0;
     alloc_init();
     sched_timer_reset();
     sched_clear_shutdown();
@@ -284,7 +287,11 @@ config_reset(uint32_t *args)
 void
 command_get_clock(uint32_t *args)
 {
-    sendf("clock clock=%u", timer_read_time());
+    uint32_t cur = timer_read_time();
+    irqstatus_t flag = irq_save();
+    uint16_t move_free = move_free_count;
+    irq_restore(flag);
+    sendf("clock clock=%u move_free=%hu", cur, move_free);
 }
 DECL_COMMAND_FLAGS(command_get_clock, HF_IN_SHUTDOWN, "get_clock");
 
@@ -54,7 +54,7 @@ f4: *p++ = v & 0x7f;
 }
 
 // Parse an integer that was encoded as a "variable length quantity"
-static uint32_t
+static uint32_t __fastcode
 parse_int(uint8_t **pp)
 {
     uint8_t *p = *pp, c = *p++;
@@ -69,12 +69,40 @@ parse_int(uint8_t **pp)
     return v;
 }
 
+// Parse a "variable length quantity" from a command's buffer parameter
+uint32_t
+command_parse_vlq(uint8_t **pp)
+{
+    return parse_int(pp);
+}
+
+// Parse a message id (ids over 127 are encoded like an integer)
+uint_fast16_t
+command_parse_msgid(uint8_t **pp)
+{
+    uint8_t *p = *pp;
+    uint_fast16_t msgid = *p;
+    if (likely(!(msgid & 0x80))) {
+        *pp = p + 1;
+        return msgid;
+    }
+    return parse_int(pp);
+}
+
 // Parse an incoming command into 'args'
 uint8_t *
 command_parsef(uint8_t *p, uint8_t *maxend
                , const struct command_parser *cp, uint32_t *args)
 {
     uint_fast8_t num_params = READP(cp->num_params);
+    if (READP(cp->flags) & HF_INT_PARAMS) {
+        // Fast path - no need to check the type of each parameter
+        while (num_params--)
+            *args++ = parse_int(&p);
+        if (p > maxend)
+            goto error;
+        return p;
+    }
     const uint8_t *param_types = READP(cp->param_types);
     while (num_params--) {
         if (p > maxend)
@@ -119,7 +147,7 @@ command_encodef(uint8_t *buf, const struct command_encoder *ce, va_list args)
     uint8_t *maxend = &p[max_size - MESSAGE_MIN];
     uint_fast8_t num_params = READP(ce->num_params);
     const uint8_t *param_types = READP(ce->param_types);
-    *p++ = READP(ce->msg_id);
+    p = encode_int(p, (int16_t)READP(ce->msg_id));
     while (num_params--) {
         if (p > maxend)
             goto error;
@@ -227,7 +255,7 @@ DECL_SHUTDOWN(sendf_shutdown);
 
 // Find the command handler associated with a command
 static const struct command_parser *
-command_lookup_parser(uint_fast8_t cmdid)
+command_lookup_parser(uint_fast16_t cmdid)
 {
     if (!cmdid || cmdid >= READP(command_index_size))
         shutdown("Invalid command");
@@ -242,7 +270,7 @@ const struct command_encoder encode_acknak PROGMEM = {
 enum { CF_NEED_SYNC=1<<0, CF_NEED_VALID=1<<1 };
 
 // Find the next complete message block
-int_fast8_t
+int_fast8_t __fastcode
 command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
 {
     static uint8_t sync_state;
@@ -303,13 +331,13 @@ nak:
 }
 
 // Dispatch all the commands found in a message block
-void
+void __fastcode
 command_dispatch(uint8_t *buf, uint_fast8_t msglen)
 {
     uint8_t *p = &buf[MESSAGE_HEADER_SIZE];
     uint8_t *msgend = &buf[msglen-MESSAGE_TRAILER_SIZE];
     while (p < msgend) {
-        uint_fast8_t cmdid = *p++;
+        uint_fast16_t cmdid = command_parse_msgid(&p);
         const struct command_parser *cp = command_lookup_parser(cmdid);
         uint32_t args[READP(cp->num_args)];
         p = command_parsef(p, msgend, cp, args);
@@ -331,7 +359,7 @@ command_send_ack(void)
 }
 
 // Find a message block and then dispatch all the commands in it
-int_fast8_t
+int_fast8_t __fastcode
 command_find_and_dispatch(uint8_t *buf, uint_fast8_t buf_len
                           , uint_fast8_t *pop_count)
 {
@@ -0,0 +1,153 @@
+// Decoding of rotary encoders on the micro-controller
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "basecmd.h" // oid_alloc
+#include "board/gpio.h" // struct gpio_in
+#include "board/irq.h" // irq_disable
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // struct timer
+
+// Quadrature decoding state tables (see klippy/extras/buttons.py)
+enum { R_START = 0x0, R_DIR_CW = 0x10, R_DIR_CCW = 0x20, R_DIR_MSK = 0x30 };
+
+static const uint8_t full_step_states[7][4] = {
+    // R_START
+    { R_START, 0x2, 0x4, R_START },
+    // R_CW_FINAL
+    { 0x3, R_START, 0x1, R_START | R_DIR_CW },
+    // R_CW_BEGIN
+    { 0x3, 0x2, R_START, R_START },
+    // R_CW_NEXT
+    { 0x3, 0x2, 0x1, R_START },
+    // R_CCW_BEGIN
+    { 0x6, R_START, 0x4, R_START },
+    // R_CCW_FINAL
+    { 0x6, 0x5, R_START, R_START | R_DIR_CCW },
+    // R_CCW_NEXT
+    { 0x6, 0x5, 0x4, R_START },
+};
+
+static const uint8_t half_step_states[6][4] = {
+    // R_START (00)
+    { 0x3, 0x2, 0x1, R_START },
+    // R_CCW_BEGIN
+    { 0x3 | R_DIR_CCW, R_START, 0x1, R_START },
+    // R_CW_BEGIN
+    { 0x3 | R_DIR_CW, 0x2, R_START, R_START },
+    // R_START_M (11)
+    { 0x3, 0x5, 0x4, R_START },
+    // R_CW_BEGIN_M
+    { 0x3, 0x3, 0x4, R_START | R_DIR_CW },
+    // R_CCW_BEGIN_M
+    { 0x3, 0x5, 0x3, R_START | R_DIR_CCW },
+};
+
+struct encoder {
+    struct timer time;
+    uint32_t rest_ticks;
+    struct gpio_in pin1, pin2;
+    uint8_t invert, pressed, last_status, state, flags;
+    uint8_t report_ticks, report_wait;
+    uint16_t count;
+};
+
+enum { EF_HALF_STEP = 1<<0, EF_PENDING = 1<<1 };
+
+static struct task_wake encoder_wake;
+
+static uint_fast8_t
+encoder_event(struct timer *t)
+{
+    struct encoder *e = container_of(t, struct encoder, time);
+
+    // Read pins (a pin must be stable for two samples to be used)
+    uint8_t status = ((gpio_in_read(e->pin1) ? 0x1 : 0)
+                      | (gpio_in_read(e->pin2) ? 0x2 : 0)) ^ e->invert;
+    if (status == e->last_status && status != e->pressed) {
+        // Pins changed - advance quadrature state machine
+        e->pressed = status;
+        uint8_t es;
+        if (e->flags & EF_HALF_STEP)
+            es = half_step_states[e->state & 0xf][status];
+        else
+            es = full_step_states[e->state & 0xf][status];
+        e->state = es;
+        if ((es & R_DIR_MSK) == R_DIR_CW) {
+            e->count++;
+            e->flags |= EF_PENDING;
+        } else if ((es & R_DIR_MSK) == R_DIR_CCW) {
+            e->count--;
+            e->flags |= EF_PENDING;
+        }
+    }
+    e->last_status = status;
+
+    // Schedule a report of the accumulated count
+    if (e->report_wait) {
+        e->report_wait--;
+    } else if (e->flags & EF_PENDING) {
+        e->report_wait = e->report_ticks;
+        sched_wake_task(&encoder_wake);
+    }
+
+    // Reschedule timer
+    e->time.waketime += e->rest_ticks;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_encoder(uint32_t *args)
+{
+    struct encoder *e = oid_alloc(args[0], command_config_encoder, sizeof(*e));
+    e->pin1 = gpio_in_setup(args[1], args[2]);
+    e->pin2 = gpio_in_setup(args[3], args[4]);
+    if (args[5])
+        e->flags |= EF_HALF_STEP;
+    e->time.func = encoder_event;
+}
+DECL_COMMAND(command_config_encoder,
+             "config_encoder oid=%c pin1=%u pull_up1=%c pin2=%u pull_up2=%c"
+             " half_step=%c");
+
+void
+command_encoder_query(uint32_t *args)
+{
+    struct encoder *e = oid_lookup(args[0], command_config_encoder);
+    sched_del_timer(&e->time);
+    e->time.waketime = args[1];
+    e->rest_ticks = args[2];
+    e->report_ticks = args[3];
+    e->invert = args[4];
+    e->pressed = e->last_status = 0;
+    e->state = R_START;
+    e->report_wait = e->count = 0;
+    e->flags &= ~EF_PENDING;
+    if (! e->rest_ticks)
+        return;
+    sched_add_timer(&e->time);
+}
+DECL_COMMAND(command_encoder_query,
+             "encoder_query oid=%c clock=%u rest_ticks=%u report_ticks=%c"
+             " invert=%c");
+
+void
+encoder_task(void)
+{
+    if (!sched_check_wake(&encoder_wake))
+        return;
+    uint8_t oid;
+    struct encoder *e;
+    foreach_oid(oid, e, command_config_encoder) {
+        irq_disable();
+        if (!(e->flags & EF_PENDING)) {
+            irq_enable();
+            continue;
+        }
+        e->flags &= ~EF_PENDING;
+        uint16_t count = e->count;
+        irq_enable();
+        sendf("encoder_state oid=%c count=%hu", oid, count);
+    }
+}
+DECL_TASK(encoder_task);
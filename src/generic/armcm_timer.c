@@ -31,7 +31,7 @@ timer_is_before(uint32_t time1, uint32_t time2)
 }
 
 // Set the next irq time
-static void
+static void __fastcode
 timer_set_diff(uint32_t value)
 {
     SysTick->LOAD = value;
@@ -40,7 +40,7 @@ timer_set_diff(uint32_t value)
 }
 
 // Return the current time (in absolute clock ticks).
-uint32_t
+uint32_t __fastcode
 timer_read_time(void)
 {
     return DWT->CYCCNT;
@@ -115,23 +115,29 @@ static uint32_t timer_repeat_until;
 #define TIMER_IDLE_REPEAT_TICKS timer_from_us(500)
 #define TIMER_REPEAT_TICKS timer_from_us(100)
 
-#define TIMER_MIN_TRY_TICKS timer_from_us(2)
+// Timers due within this window are run from the current irq
+#define TIMER_MIN_TRY_TICKS timer_from_us(CONFIG_TIMER_COALESCE_US)
 #define TIMER_DEFER_REPEAT_TICKS timer_from_us(5)
 
 // Invoke timers
-static uint32_t
+static uint32_t __fastcode
 timer_dispatch_many(void)
 {
     uint32_t tru = timer_repeat_until;
+    uint32_t count = 0;
     for (;;) {
         // Run the next software timer
         uint32_t next = sched_timer_dispatch();
+        count++;
 
         uint32_t now = timer_read_time();
         int32_t diff = next - now;
-        if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
+        if (diff > (int32_t)TIMER_MIN_TRY_TICKS) {
             // Schedule next timer normally.
+            if (CONFIG_SCHED_TIMING_HISTOGRAM)
+                sched_timer_note_batch(count);
             return diff;
+        }
 
         if (unlikely(timer_is_before(tru, now))) {
             // Check if there are too many repeat timers
@@ -139,6 +145,8 @@ timer_dispatch_many(void)
                 try_shutdown("Rescheduled timer in the past");
             if (sched_tasks_busy()) {
                 timer_repeat_until = now + TIMER_REPEAT_TICKS;
+                if (CONFIG_SCHED_TIMING_HISTOGRAM)
+                    sched_timer_note_batch(count);
                 return TIMER_DEFER_REPEAT_TICKS;
             }
             timer_repeat_until = tru = now + TIMER_IDLE_REPEAT_TICKS;
@@ -153,7 +161,7 @@ timer_dispatch_many(void)
 }
 
 // IRQ handler
-void __visible __aligned(16) // aligning helps stabilize perf benchmarks
+void __visible __aligned(16) __fastcode // aligning stabilizes perf benchmarks
 SysTick_Handler(void)
 {
     irq_disable();
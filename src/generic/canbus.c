@@ -10,6 +10,9 @@
 #include "command.h" // DECL_CONSTANT
 
 DECL_CONSTANT("CANBUS_FREQUENCY", CONFIG_CANBUS_FREQUENCY);
+#if CONFIG_CANBUS_FD
+DECL_CONSTANT("CANBUS_FD_DATA_FREQUENCY", CONFIG_CANBUS_FD_DATA_FREQUENCY);
+#endif
 
 int
 canbus_send(struct canbus_msg *msg)
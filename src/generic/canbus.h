@@ -2,20 +2,60 @@
 #define __CANBUS_H__
 
 #include <stdint.h> // uint32_t
+#include "autoconf.h" // CONFIG_CANBUS_FD
+
+#if CONFIG_CANBUS_FD
+ #define CANMSG_DATA_MAX 64
+#else
+ #define CANMSG_DATA_MAX 8
+#endif
 
 struct canbus_msg {
     uint32_t id;
     uint32_t dlc;
     union {
-        uint8_t data[8];
-        uint32_t data32[2];
+        uint8_t data[CANMSG_DATA_MAX];
+        uint32_t data32[CANMSG_DATA_MAX / 4];
     };
 };
 
+#define CANMSG_ID_FDF (1<<29) // CAN FD frame (with bit rate switching)
 #define CANMSG_ID_RTR (1<<30)
 #define CANMSG_ID_EFF (1<<31)
 
-#define CANMSG_DATA_LEN(msg) ((msg)->dlc > 8 ? 8 : (msg)->dlc)
+// Convert a "data length code" to the number of bytes in the message
+static inline uint32_t
+canbus_dlc_to_len(uint32_t id, uint32_t dlc)
+{
+    if (dlc <= 8)
+        return dlc;
+    if (!CONFIG_CANBUS_FD || !(id & CANMSG_ID_FDF))
+        return 8;
+    static const uint8_t fd_lens[] = { 12, 16, 20, 24, 32, 48, 64 };
+    return fd_lens[(dlc & 0x0f) - 9];
+}
+
+// Find the largest CAN FD message size not greater than 'len' and
+// return its "data length code"
+static inline uint32_t
+canbus_fd_len_to_dlc(uint32_t len)
+{
+    if (len < 12)
+        return len > 8 ? 8 : len;
+    if (len < 16)
+        return 9;
+    if (len < 24)
+        return 8 + len / 4 - 2;
+    if (len < 32)
+        return 12;
+    if (len < 48)
+        return 13;
+    if (len < 64)
+        return 14;
+    return 15;
+}
+
+#define CANMSG_DATA_LEN(msg) canbus_dlc_to_len((msg)->id, (msg)->dlc)
 
 // callbacks provided by board specific code
 int canhw_send(struct canbus_msg *msg);
@@ -26,7 +26,7 @@ static struct canbus_data {
 
     // Tx data
     struct task_wake tx_wake;
-    uint8_t transmit_pos, transmit_max;
+    uint8_t transmit_pos, transmit_max, transmit_fd;
 
     // Rx data
     struct task_wake rx_wake;
@@ -62,12 +62,19 @@ canserial_tx_task(void)
     }
     struct canbus_msg msg;
     msg.id = id + 1;
+    int use_fd = CONFIG_CANBUS_FD && CanData.transmit_fd;
+    if (use_fd)
+        msg.id |= CANMSG_ID_FDF;
     uint32_t tpos = CanData.transmit_pos, tmax = CanData.transmit_max;
     for (;;) {
         int avail = tmax - tpos, now = avail > 8 ? 8 : avail;
         if (avail <= 0)
             break;
         msg.dlc = now;
+        if (use_fd) {
+            msg.dlc = canbus_fd_len_to_dlc(avail);
+            now = CANMSG_DATA_LEN(&msg);
+        }
         memcpy(msg.data, &CanData.transmit_buf[tpos], now);
         int ret = canbus_send(&msg);
         if (ret <= 0)
@@ -176,6 +183,7 @@ can_process_set_klipper_nodeid(struct canbus_msg *msg)
     if (can_check_uuid(msg)) {
         if (newid != CanData.assigned_id) {
             CanData.assigned_id = newid;
+            CanData.transmit_fd = 0;
             canbus_set_filter(CanData.assigned_id);
         }
     } else if (newid == CanData.assigned_id) {
@@ -224,16 +232,19 @@ canserial_notify_rx(void)
 DECL_CONSTANT("RECEIVE_WINDOW", ARRAY_SIZE(CanData.receive_buf));
 
 // Handle incoming data (called from IRQ handler)
-void
+int
 canserial_process_data(struct canbus_msg *msg)
 {
-    uint32_t id = msg->id;
+    uint32_t id = msg->id & ~CANMSG_ID_FDF;
     if (CanData.assigned_id && id == CanData.assigned_id) {
+        // Respond using the same frame format (classic or FD) as the host
+        if (CONFIG_CANBUS_FD)
+            CanData.transmit_fd = !!(msg->id & CANMSG_ID_FDF);
         // Add to incoming data buffer
         int rpos = CanData.receive_pos;
         uint32_t len = CANMSG_DATA_LEN(msg);
         if (len > sizeof(CanData.receive_buf) - rpos)
-            return;
+            return -1;
         memcpy(&CanData.receive_buf[rpos], msg->data, len);
         CanData.receive_pos = rpos + len;
         canserial_notify_rx();
@@ -243,12 +254,13 @@ canserial_process_data(struct canbus_msg *msg)
         uint32_t pushp = CanData.admin_push_pos;
         if (pushp >= CanData.admin_pull_pos + ARRAY_SIZE(CanData.admin_queue))
             // No space - drop message
-            return;
+            return 0;
         uint32_t pos = pushp % ARRAY_SIZE(CanData.admin_queue);
         memcpy(&CanData.admin_queue[pos], msg, sizeof(*msg));
         CanData.admin_push_pos = pushp + 1;
         canserial_notify_rx();
     }
+    return 0;
 }
 
 // Remove from the receive buffer the given number of bytes
@@ -275,6 +287,9 @@ console_pop_input(int len)
         irq_restore(flag);
         break;
     }
+    if (CONFIG_USBCANBUS)
+        // Bridge code may be waiting for space in receive_buf
+        canbus_notify_tx();
 }
 
 // Task to process incoming commands and admin messages
@@ -292,7 +307,7 @@ canserial_rx_task(void)
             break;
         uint32_t pos = pullp % ARRAY_SIZE(CanData.admin_queue);
         struct canbus_msg *msg = &CanData.admin_queue[pos];
-        uint32_t id = msg->id;
+        uint32_t id = msg->id & ~CANMSG_ID_FDF;
         if (CanData.assigned_id && id == CanData.assigned_id + 1)
             can_id_conflict();
         else if (id == CANBUS_ID_ADMIN)
@@ -3,6 +3,15 @@
 
 #include <stdarg.h> // va_list
 #include <stdint.h> // uint8_t
+#include "autoconf.h" // CONFIG_ARMCM_ITCM_FASTCODE
+#include "compiler.h" // __section
+
+// Place performance critical code in fast ram (if supported)
+#if CONFIG_ARMCM_ITCM_FASTCODE
+#define __fastcode __section(".fastcode." __FILE__ "." __stringify(__LINE__))
+#else
+#define __fastcode
+#endif
 
 struct command_encoder;
 void console_sendf(const struct command_encoder *ce, va_list args);
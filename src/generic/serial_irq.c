@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <string.h> // memmove
+#include <string.h> // memmove, memchr
 #include "autoconf.h" // CONFIG_SERIAL_BAUD
 #include "board/io.h" // readb
 #include "board/irq.h" // irq_save
@@ -34,6 +34,20 @@ serial_rx_byte(uint_fast8_t data)
     receive_buf[receive_pos++] = data;
 }
 
+// Rx dma - store a block of read data
+void
+serial_rx_data(uint8_t *data, uint_fast8_t len)
+{
+    if (memchr(data, MESSAGE_SYNC, len))
+        sched_wake_tasks();
+    uint_fast8_t rpos = receive_pos;
+    if (len > sizeof(receive_buf) - rpos)
+        // Serial overflow - ignore it as crc error will force retransmit
+        len = sizeof(receive_buf) - rpos;
+    memcpy(&receive_buf[rpos], data, len);
+    receive_pos = rpos + len;
+}
+
 // Tx interrupt - get next byte to transmit
 int
 serial_get_tx_byte(uint8_t *pdata)
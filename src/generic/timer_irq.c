@@ -33,7 +33,8 @@ static uint32_t timer_repeat_until;
 #define TIMER_IDLE_REPEAT_TICKS timer_from_us(500)
 #define TIMER_REPEAT_TICKS timer_from_us(100)
 
-#define TIMER_MIN_TRY_TICKS timer_from_us(2)
+// Timers due within this window are run from the current irq
+#define TIMER_MIN_TRY_TICKS timer_from_us(CONFIG_TIMER_COALESCE_US)
 #define TIMER_DEFER_REPEAT_TICKS timer_from_us(5)
 
 // Invoke timers - called from board irq code.
@@ -41,15 +42,20 @@ uint32_t
 timer_dispatch_many(void)
 {
     uint32_t tru = timer_repeat_until;
+    uint32_t count = 0;
     for (;;) {
         // Run the next software timer
         uint32_t next = sched_timer_dispatch();
+        count++;
 
         uint32_t now = timer_read_time();
         int32_t diff = next - now;
-        if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
+        if (diff > (int32_t)TIMER_MIN_TRY_TICKS) {
             // Schedule next timer normally.
+            if (CONFIG_SCHED_TIMING_HISTOGRAM)
+                sched_timer_note_batch(count);
             return next;
+        }
 
         if (unlikely(timer_is_before(tru, now))) {
             // Check if there are too many repeat timers
@@ -57,6 +63,8 @@ timer_dispatch_many(void)
                 try_shutdown("Rescheduled timer in the past");
             if (sched_tasks_busy()) {
                 timer_repeat_until = now + TIMER_REPEAT_TICKS;
+                if (CONFIG_SCHED_TIMING_HISTOGRAM)
+                    sched_timer_note_batch(count);
                 return now + TIMER_DEFER_REPEAT_TICKS;
             }
             timer_repeat_until = tru = now + TIMER_IDLE_REPEAT_TICKS;
@@ -110,12 +110,14 @@ static struct usbcan_data {
 
     // Canbus data from host
     uint8_t host_status;
-    uint32_t host_pull_pos, host_push_pos;
+    uint32_t host_pull_pos, host_local_pos, host_push_pos;
     struct gs_host_frame host_frames[16];
+    uint8_t host_routes[16];
 
-    // Data from physical canbus interface
+    // Data from physical canbus interface (sized to absorb traffic
+    // bursts from several nodes while the usb host is slow to poll)
     uint32_t canhw_pull_pos, canhw_push_pos;
-    struct canbus_msg canhw_queue[32];
+    struct canbus_msg canhw_queue[CONFIG_USBCANBUS_QUEUE_SIZE];
 } UsbCan;
 
 enum {
@@ -167,6 +169,11 @@ send_frame(struct canbus_msg *msg)
 static void
 drain_canhw_queue(void)
 {
+    if (UsbCan.notify_local) {
+        // Local responses have priority over forwarded frames
+        UsbCan.usb_send_busy = 0;
+        return;
+    }
     uint32_t pull_pos = UsbCan.canhw_pull_pos;
     for (;;) {
         uint32_t push_pos = readl(&UsbCan.canhw_push_pos);
@@ -205,6 +212,40 @@ fill_usb_host_queue(void)
     }
 }
 
+// Determine the destination of frames sent from host and deliver
+// frames for the local canserial code.  This occurs as soon as frames
+// arrive so that local traffic is not delayed by frames waiting for
+// space on the canbus.
+static void
+route_local_frames(void)
+{
+    uint32_t local_pos = UsbCan.host_local_pos;
+    uint32_t push_pos = UsbCan.host_push_pos;
+    for (; local_pos != push_pos; local_pos++) {
+        uint32_t qpos = local_pos % ARRAY_SIZE(UsbCan.host_frames);
+        struct gs_host_frame *gs = &UsbCan.host_frames[qpos];
+        uint32_t id = gs->can_id;
+        uint_fast8_t route = HS_TX_ECHO | HS_TX_HW;
+        if (id == CANBUS_ID_ADMIN)
+            route = HS_TX_ECHO | HS_TX_HW | HS_TX_LOCAL;
+        else if (UsbCan.assigned_id && UsbCan.assigned_id == id)
+            route = HS_TX_ECHO | HS_TX_LOCAL;
+        if (route & HS_TX_LOCAL) {
+            struct canbus_msg msg;
+            msg.id = id;
+            msg.dlc = gs->can_dlc;
+            msg.data32[0] = gs->data32[0];
+            msg.data32[1] = gs->data32[1];
+            int ret = canserial_process_data(&msg);
+            if (ret < 0)
+                // No space in local receive buffer - retry later
+                break;
+        }
+        UsbCan.host_routes[qpos] = route & ~HS_TX_LOCAL;
+    }
+    UsbCan.host_local_pos = local_pos;
+}
+
 void
 usbcan_task(void)
 {
@@ -217,29 +258,26 @@ usbcan_task(void)
     // Fill local queue with any USB messages arriving from host
     fill_usb_host_queue();
 
-    // Route messages received from host
-    uint32_t pull_pos = UsbCan.host_pull_pos, push_pos = UsbCan.host_push_pos;
+    // Deliver local messages received from host
+    route_local_frames();
+
+    // Route remaining messages received from host
+    uint32_t pull_pos = UsbCan.host_pull_pos, local_pos = UsbCan.host_local_pos;
     uint32_t pullp = pull_pos % ARRAY_SIZE(UsbCan.host_frames);
     struct gs_host_frame *gs = &UsbCan.host_frames[pullp];
     for (;;) {
         // See if previous host frame needs to be transmitted
         uint_fast8_t host_status = UsbCan.host_status;
-        if (host_status & (HS_TX_HW | HS_TX_LOCAL)) {
+        if (host_status & HS_TX_HW) {
             struct canbus_msg msg;
             msg.id = gs->can_id;
             msg.dlc = gs->can_dlc;
             msg.data32[0] = gs->data32[0];
             msg.data32[1] = gs->data32[1];
-            if (host_status & HS_TX_LOCAL) {
-                canserial_process_data(&msg);
-                UsbCan.host_status = host_status = host_status & ~HS_TX_LOCAL;
-            }
-            if (host_status & HS_TX_HW) {
-                int ret = canhw_send(&msg);
-                if (ret < 0)
-                    break;
-                UsbCan.host_status = host_status = host_status & ~HS_TX_HW;
-            }
+            int ret = canhw_send(&msg);
+            if (ret < 0)
+                break;
+            UsbCan.host_status = host_status = host_status & ~HS_TX_HW;
         }
 
         // Send any previous echo frames
@@ -255,16 +293,12 @@ usbcan_task(void)
         }
 
         // Process next frame from host
-        if (pull_pos == push_pos)
-            // No frame available - no more work to be done
+        if (pull_pos == local_pos)
+            // No routed frame available - no more work to be done
             break;
-        gs = &UsbCan.host_frames[pull_pos % ARRAY_SIZE(UsbCan.host_frames)];
-        uint32_t id = gs->can_id;
-        UsbCan.host_status = HS_TX_ECHO | HS_TX_HW;
-        if (id == CANBUS_ID_ADMIN)
-            UsbCan.host_status = HS_TX_ECHO | HS_TX_HW | HS_TX_LOCAL;
-        else if (UsbCan.assigned_id && UsbCan.assigned_id == id)
-            UsbCan.host_status = HS_TX_ECHO | HS_TX_LOCAL;
+        pullp = pull_pos % ARRAY_SIZE(UsbCan.host_frames);
+        gs = &UsbCan.host_frames[pullp];
+        UsbCan.host_status = UsbCan.host_routes[pullp];
     }
 
     // Wake up local message response handling (if usb is not busy)
@@ -281,7 +315,8 @@ canbus_send(struct canbus_msg *msg)
     int ret = send_frame(msg);
     if (ret < 0)
         goto retry_later;
-    if (UsbCan.notify_local && UsbCan.host_status)
+    if (UsbCan.notify_local)
+        // Resume forwarding of hw frames and echo frames
         canbus_notify_tx();
     UsbCan.notify_local = 0;
     return msg->dlc;
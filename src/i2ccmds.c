@@ -49,6 +49,27 @@ i2cdev_set_software_bus(struct i2cdev_s *i2c, struct i2c_software *is)
     i2c->flags |= IF_SOFTWARE;
 }
 
+// Write data to an i2c device (on either a hardware or software bus)
+void
+i2cdev_write(struct i2cdev_s *i2c, uint8_t write_len, uint8_t *data)
+{
+    if (CONFIG_WANT_SOFTWARE_I2C && i2c->flags & IF_SOFTWARE)
+        i2c_software_write(i2c->i2c_software, write_len, data);
+    else
+        i2c_write(i2c->i2c_config, write_len, data);
+}
+
+// Read data from an i2c device (on either a hardware or software bus)
+void
+i2cdev_read(struct i2cdev_s *i2c, uint8_t reg_len, uint8_t *reg
+            , uint8_t read_len, uint8_t *read)
+{
+    if (CONFIG_WANT_SOFTWARE_I2C && i2c->flags & IF_SOFTWARE)
+        i2c_software_read(i2c->i2c_software, reg_len, reg, read_len, read);
+    else
+        i2c_read(i2c->i2c_config, reg_len, reg, read_len, read);
+}
+
 void
 command_i2c_write(uint32_t *args)
 {
@@ -56,11 +77,7 @@ command_i2c_write(uint32_t *args)
     struct i2cdev_s *i2c = oid_lookup(oid, command_config_i2c);
     uint8_t data_len = args[1];
     uint8_t *data = command_decode_ptr(args[2]);
-    uint_fast8_t flags = i2c->flags;
-    if (CONFIG_WANT_SOFTWARE_I2C && flags & IF_SOFTWARE)
-        i2c_software_write(i2c->i2c_software, data_len, data);
-    else
-        i2c_write(i2c->i2c_config, data_len, data);
+    i2cdev_write(i2c, data_len, data);
 }
 DECL_COMMAND(command_i2c_write, "i2c_write oid=%c data=%*s");
 
@@ -73,11 +90,7 @@ command_i2c_read(uint32_t * args)
     uint8_t *reg = command_decode_ptr(args[2]);
     uint8_t data_len = args[3];
     uint8_t data[data_len];
-    uint_fast8_t flags = i2c->flags;
-    if (CONFIG_WANT_SOFTWARE_I2C && flags & IF_SOFTWARE)
-        i2c_software_read(i2c->i2c_software, reg_len, reg, data_len, data);
-    else
-        i2c_read(i2c->i2c_config, reg_len, reg, data_len, data);
+    i2cdev_read(i2c, reg_len, reg, data_len, data);
     sendf("i2c_read_response oid=%c response=%*s", oid, data_len, data);
 }
 DECL_COMMAND(command_i2c_read, "i2c_read oid=%c reg=%*s read_len=%u");
@@ -95,22 +108,13 @@ command_i2c_modify_bits(uint32_t *args)
     uint8_t data_len = clear_set_len/2;
     uint8_t *clear_set = command_decode_ptr(args[4]);
     uint8_t receive_data[reg_len + data_len];
-    uint_fast8_t flags = i2c->flags;
     memcpy(receive_data, reg, reg_len);
-    if (CONFIG_WANT_SOFTWARE_I2C && flags & IF_SOFTWARE)
-        i2c_software_read(
-            i2c->i2c_software, reg_len, reg, data_len, receive_data + reg_len);
-    else
-        i2c_read(
-            i2c->i2c_config, reg_len, reg, data_len, receive_data + reg_len);
+    i2cdev_read(i2c, reg_len, reg, data_len, receive_data + reg_len);
     for (int i = 0; i < data_len; i++) {
         receive_data[reg_len + i] &= ~clear_set[i];
         receive_data[reg_len + i] |= clear_set[data_len + i];
     }
-    if (CONFIG_WANT_SOFTWARE_I2C && flags & IF_SOFTWARE)
-        i2c_software_write(i2c->i2c_software, reg_len + data_len, receive_data);
-    else
-        i2c_write(i2c->i2c_config, reg_len + data_len, receive_data);
+    i2cdev_write(i2c, reg_len + data_len, receive_data);
 }
 DECL_COMMAND(command_i2c_modify_bits,
              "i2c_modify_bits oid=%c reg=%*s clear_set_bits=%*s");
@@ -12,5 +12,8 @@ struct i2cdev_s {
 
 struct i2cdev_s *i2cdev_oid_lookup(uint8_t oid);
 void i2cdev_set_software_bus(struct i2cdev_s *i2c, struct i2c_software *is);
+void i2cdev_write(struct i2cdev_s *i2c, uint8_t write_len, uint8_t *data);
+void i2cdev_read(struct i2cdev_s *i2c, uint8_t reg_len, uint8_t *reg
+                 , uint8_t read_len, uint8_t *read);
 
 #endif
@@ -117,3 +117,31 @@ spi_transfer(struct spi_config config, uint8_t receive_data
         }
     }
 }
+
+// Issue 'count' separate receive transfers (each 'len' bytes from
+// consecutive parts of 'data') with a single ioctl
+void
+spi_transfer_batch(struct spi_config config, uint8_t count
+                   , uint8_t len, uint16_t delay_us, uint8_t *data)
+{
+    if (!count || !len)
+        return;
+    struct spi_ioc_transfer transfers[count];
+    memset(transfers, 0, sizeof(transfers));
+    int i;
+    for (i=0; i<count; i++) {
+        struct spi_ioc_transfer *t = &transfers[i];
+        t->tx_buf = t->rx_buf = (uintptr_t)&data[i * len];
+        t->len = len;
+        t->speed_hz = config.rate;
+        t->bits_per_word = 8;
+        t->delay_usecs = delay_us;
+        // Release chip select between transfers (but not after the last)
+        t->cs_change = i < count - 1;
+    }
+    int ret = ioctl(config.fd, SPI_IOC_MESSAGE(count), transfers);
+    if (ret < 0) {
+        report_errno("spi ioctl", ret);
+        try_shutdown("Unable to issue spi ioctl");
+    }
+}
@@ -21,6 +21,8 @@ static struct {
     time_t start_sec;
     // Flags for tracking irq_enable()/irq_disable()
     uint32_t must_wake_timers;
+    // Timers closer than this are busy waited on instead of signaled
+    uint32_t busy_wait_ticks;
     // Time of next software timer (also used to convert from ticks to systime)
     uint32_t next_wake_counter;
     struct timespec next_wake;
@@ -127,11 +129,19 @@ timer_kick(void)
 
 #define TIMER_MIN_TRY_TICKS timer_from_us(2)
 
+// Set how far in the future a timer may be and still be busy waited on
+void
+timer_set_busy_wait(uint32_t us)
+{
+    TimerInfo.busy_wait_ticks = timer_from_us(us);
+}
+
 // Invoke timers
 static void
 timer_dispatch(void)
 {
     uint32_t repeat_count = TIMER_REPEAT_COUNT, next;
+    int32_t try_ticks = TIMER_MIN_TRY_TICKS + TimerInfo.busy_wait_ticks;
     for (;;) {
         // Run the next software timer
         next = sched_timer_dispatch();
@@ -144,7 +154,7 @@ timer_dispatch(void)
 
         uint32_t now = timer_read_time();
         int32_t diff = next - now;
-        if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
+        if (diff > try_ticks)
             // Schedule next timer normally.
             break;
 
@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_HAVE_GPIO_HW_COUNTER
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_in
 #include "board/irq.h" // irq_disable
@@ -18,6 +19,10 @@ struct counter {
     uint32_t count, last_count_time;
     uint8_t flags;
     struct gpio_in pin;
+#if CONFIG_HAVE_GPIO_HW_COUNTER
+    uint16_t last_hw_count;
+    struct gpio_counter hw;
+#endif
 };
 
 enum {
@@ -26,6 +31,20 @@ enum {
 
 static struct task_wake counter_wake;
 
+// Wake the counter task if a new sample is due and reschedule the timer
+static uint_fast8_t
+counter_check_sample(struct counter *c, uint32_t time)
+{
+    if (timer_is_before(c->next_sample_time, time)) {
+        c->flags |= CF_PENDING;
+        c->next_sample_time = time + c->sample_ticks;
+        sched_wake_task(&counter_wake);
+    }
+
+    c->timer.waketime += c->poll_ticks;
+    return SF_RESCHEDULE;
+}
+
 static uint_fast8_t
 counter_event(struct timer *timer)
 {
@@ -40,14 +59,7 @@ counter_event(struct timer *timer)
     }
     // useful invariant: c->count & 1 == value
 
-    if (timer_is_before(c->next_sample_time, time)) {
-        c->flags |= CF_PENDING;
-        c->next_sample_time = time + c->sample_ticks;
-        sched_wake_task(&counter_wake);
-    }
-
-    c->timer.waketime += c->poll_ticks;
-    return SF_RESCHEDULE;
+    return counter_check_sample(c, time);
 }
 
 void
@@ -61,6 +73,39 @@ command_config_counter(uint32_t *args)
 DECL_COMMAND(command_config_counter,
              "config_counter oid=%c pin=%u pull_up=%c");
 
+#if CONFIG_HAVE_GPIO_HW_COUNTER
+// Poll a hardware edge counter (it counts rising edges, but the
+// reported count tracks both edges to match the gpio sampling code)
+static uint_fast8_t
+counter_hw_event(struct timer *timer)
+{
+    struct counter *c = container_of(timer, struct counter, timer);
+
+    uint32_t time = c->timer.waketime;
+    uint16_t hw_count = gpio_counter_read(c->hw);
+    uint16_t delta = hw_count - c->last_hw_count;
+    if (delta) {
+        c->last_hw_count = hw_count;
+        c->count += 2 * delta;
+        c->last_count_time = time;
+    }
+
+    return counter_check_sample(c, time);
+}
+
+void
+command_config_hw_counter(uint32_t *args)
+{
+    struct counter *c = oid_alloc(
+        args[0], command_config_counter, sizeof(*c));
+    c->hw = gpio_counter_setup(args[1], args[2]);
+    c->last_hw_count = gpio_counter_read(c->hw);
+    c->timer.func = counter_hw_event;
+}
+DECL_COMMAND(command_config_hw_counter,
+             "config_hw_counter oid=%c pin=%u pull_up=%c");
+#endif
+
 void
 command_query_counter(uint32_t *args)
 {
@@ -4,6 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include "autoconf.h" // CONFIG_WANT_PWM_RAMP
 #include "basecmd.h" // oid_alloc
 #include "board/gpio.h" // struct gpio_pwm
 #include "board/irq.h" // irq_disable
@@ -23,6 +24,11 @@ struct pwm_move {
     struct move_node node;
     uint32_t waketime;
     uint16_t value;
+#if CONFIG_WANT_PWM_RAMP
+    uint32_t interval;
+    int16_t add;
+    uint16_t count;
+#endif
 };
 
 static uint_fast8_t
@@ -36,10 +42,20 @@ pwm_event(struct timer *timer)
 {
     // Apply next update and remove it from queue
     struct pwm_out_s *p = container_of(timer, struct pwm_out_s, timer);
-    struct move_node *mn = move_queue_pop(&p->mq);
+    struct move_node *mn = move_queue_first(&p->mq);
     struct pwm_move *m = container_of(mn, struct pwm_move, node);
     uint16_t value = m->value;
     gpio_pwm_write(p->pin, value);
+#if CONFIG_WANT_PWM_RAMP
+    if (m->count) {
+        // Step to the next value of a ramp
+        m->count--;
+        m->value = value + m->add;
+        p->timer.waketime += m->interval;
+        return SF_RESCHEDULE;
+    }
+#endif
+    move_queue_pop(&p->mq);
     move_free(m);
 
     // Check if more updates queued
@@ -79,14 +95,9 @@ DECL_COMMAND(command_config_pwm_out,
              "config_pwm_out oid=%c pin=%u cycle_ticks=%u value=%hu"
              " default_value=%hu max_duration=%u");
 
-void
-command_queue_pwm_out(uint32_t *args)
+static void
+pwm_queue_move(struct pwm_out_s *p, struct pwm_move *m)
 {
-    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
-    struct pwm_move *m = move_alloc();
-    m->waketime = args[1];
-    m->value = args[2];
-
     irq_disable();
     int need_add_timer = move_queue_push(&m->node, &p->mq);
     irq_enable();
@@ -102,8 +113,44 @@ command_queue_pwm_out(uint32_t *args)
     p->timer.waketime = m->waketime;
     sched_add_timer(&p->timer);
 }
+
+void
+command_queue_pwm_out(uint32_t *args)
+{
+    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
+    struct pwm_move *m = move_alloc();
+    m->waketime = args[1];
+    m->value = args[2];
+#if CONFIG_WANT_PWM_RAMP
+    m->count = 0;
+#endif
+    pwm_queue_move(p, m);
+}
 DECL_COMMAND(command_queue_pwm_out, "queue_pwm_out oid=%c clock=%u value=%hu");
 
+#if CONFIG_WANT_PWM_RAMP
+// Schedule 'count' further updates, each 'interval' ticks apart, that
+// change the pwm value by 'add'
+void
+command_queue_pwm_ramp(uint32_t *args)
+{
+    struct pwm_out_s *p = oid_lookup(args[0], command_config_pwm_out);
+    uint32_t interval = args[2];
+    if (p->max_duration && interval > p->max_duration)
+        shutdown("Scheduled pwm ramp will exceed max_duration");
+    struct pwm_move *m = move_alloc();
+    m->waketime = args[1];
+    m->interval = interval;
+    m->count = args[3];
+    m->value = args[4];
+    m->add = args[5];
+    pwm_queue_move(p, m);
+}
+DECL_COMMAND(command_queue_pwm_ramp,
+             "queue_pwm_ramp oid=%c clock=%u interval=%u count=%hu"
+             " value=%hu add=%hi");
+#endif
+
 void
 pwm_shutdown(void)
 {
@@ -0,0 +1,43 @@
+// Hardware edge counting support on rp2040
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "command.h" // shutdown
+#include "gpio.h" // gpio_counter_setup
+#include "internal.h" // enable_pclock
+#include "sched.h" // sched_shutdown
+#include "hardware/structs/pwm.h" // pwm_hw
+#include "hardware/regs/io_bank0.h" // IO_BANK0_GPIO0_CTRL_FUNCSEL_VALUE_PWM_A_0
+#include "hardware/regs/resets.h" // RESETS_RESET_PWM_BITS
+
+// Use the pwm slice of a "channel B" pin to count rising edges on it
+struct gpio_counter
+gpio_counter_setup(uint8_t pin, int8_t pull_up)
+{
+    if (pin >= 30 || !(pin & 1))
+        shutdown("Counter pin must be an odd numbered gpio");
+    pwm_slice_hw_t *slice = &pwm_hw->slice[(pin >> 1) & 0x7];
+
+    // Enable clock
+    if (!is_enabled_pclock(RESETS_RESET_PWM_BITS))
+        enable_pclock(RESETS_RESET_PWM_BITS);
+    if (slice->csr & PWM_CH0_CSR_EN_BITS)
+        shutdown("Counter pwm slice already in use");
+
+    slice->div = 1 << PWM_CH0_DIV_INT_LSB;
+    slice->top = 0xffff;
+    slice->ctr = 0;
+    slice->cc = 0;
+    slice->csr = ((PWM_CH0_CSR_DIVMODE_VALUE_RISE << PWM_CH0_CSR_DIVMODE_LSB)
+                  | PWM_CH0_CSR_EN_BITS);
+
+    gpio_peripheral(pin, IO_BANK0_GPIO0_CTRL_FUNCSEL_VALUE_PWM_A_0, pull_up);
+
+    return (struct gpio_counter){ .reg = (void*)&slice->ctr };
+}
+
+uint16_t
+gpio_counter_read(struct gpio_counter g)
+{
+    return *(volatile uint32_t*)g.reg;
+}
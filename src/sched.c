@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <setjmp.h> // setjmp
+#include <string.h> // memcpy
 #include "autoconf.h" // CONFIG_*
 #include "basecmd.h" // stats_update
 #include "board/io.h" // readb
@@ -15,7 +16,10 @@
 #include "sched.h" // sched_check_periodic
 #include "stepper.h" // stepper_event
 
-static struct timer periodic_timer, sentinel_timer, deleted_timer;
+static struct timer periodic_timer, sentinel_timer;
+#if !CONFIG_SCHED_TIMER_HEAP
+static struct timer deleted_timer;
+#endif
 
 static struct {
     struct timer *timer_list, *last_insert;
@@ -24,6 +28,87 @@ static struct {
 } SchedStatus = {.timer_list = &periodic_timer, .last_insert = &periodic_timer};
 
 
+/****************************************************************
+ * Timing histograms
+ ****************************************************************/
+
+#if CONFIG_SCHED_TIMING_HISTOGRAM
+
+enum {
+    TH_TIMER_LATENCY, TH_STEPPER_TIME, TH_TIMER_TIME, TH_TASK_TIME,
+    TH_TIMER_BATCH, TH_MAX
+};
+
+#define TH_BUCKETS 24
+DECL_CONSTANT("TIMING_HISTOGRAM_BUCKETS", TH_BUCKETS);
+DECL_CONSTANT("TIMING_HISTOGRAM_TYPES", TH_MAX);
+
+static uint32_t TimingHistogram[TH_MAX][TH_BUCKETS];
+
+// Add a duration (in clock ticks) to a histogram.  Bucket 'i' counts
+// the durations from 2^(i-1) to 2^i-1 ticks (bucket 0 counts zero).
+static void
+timing_hist_add(uint_fast8_t type, uint32_t ticks)
+{
+    uint_fast8_t bucket = ticks ? 32 - __builtin_clz(ticks) : 0;
+    if (bucket >= TH_BUCKETS)
+        bucket = TH_BUCKETS - 1;
+    TimingHistogram[type][bucket]++;
+}
+
+// Note the start of a timer callback (and how late it was dispatched)
+static inline uint32_t
+timing_hist_start(struct timer *t)
+{
+    uint32_t start = timer_read_time();
+    int32_t late = start - t->waketime;
+    timing_hist_add(TH_TIMER_LATENCY, late > 0 ? late : 0);
+    return start;
+}
+
+// Note the end of a timer callback or task loop
+static inline void
+timing_hist_end(uint_fast8_t type, uint32_t start)
+{
+    timing_hist_add(type, timer_read_time() - start);
+}
+
+// Note the number of timers run from a single timer irq
+void
+sched_timer_note_batch(uint32_t count)
+{
+    timing_hist_add(TH_TIMER_BATCH, count);
+}
+
+// Report (and then clear) a timing histogram
+void
+command_get_timing_histogram(uint32_t *args)
+{
+    uint_fast8_t type = args[0];
+    if (type >= TH_MAX)
+        shutdown("Invalid timing histogram type");
+    uint32_t counts[TH_BUCKETS];
+    irq_disable();
+    memcpy(counts, TimingHistogram[type], sizeof(counts));
+    memset(TimingHistogram[type], 0, sizeof(counts));
+    irq_enable();
+    uint_fast8_t i, len = 8 * sizeof(counts[0]);
+    for (i=0; i<TH_BUCKETS; i+=8)
+        sendf("timing_histogram type=%c offset=%c data=%*s"
+              , type, i, len, (uint8_t*)&counts[i]);
+}
+DECL_COMMAND(command_get_timing_histogram, "get_timing_histogram type=%c");
+
+#else
+
+enum { TH_STEPPER_TIME, TH_TIMER_TIME, TH_TASK_TIME };
+
+static inline uint32_t timing_hist_start(struct timer *t) { return 0; }
+static inline void timing_hist_end(uint_fast8_t type, uint32_t start) { }
+
+#endif
+
+
 /****************************************************************
  * Timers
  ****************************************************************/
@@ -63,6 +148,8 @@ static struct timer sentinel_timer = {
     .waketime = 0x80000000,
 };
 
+#if !CONFIG_SCHED_TIMER_HEAP
+
 // Find position for a timer in timer_list and insert it
 static void __always_inline
 insert_timer(struct timer *pos, struct timer *t, uint32_t waketime)
@@ -143,19 +230,21 @@ sched_del_timer(struct timer *del)
 }
 
 // Invoke the next timer - called from board hardware irq code.
-unsigned int
+unsigned int __fastcode
 sched_timer_dispatch(void)
 {
     // Invoke timer callback
     struct timer *t = SchedStatus.timer_list;
     uint_fast8_t res;
-    uint32_t updated_waketime;
+    uint32_t updated_waketime, hist_start = timing_hist_start(t);
     if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func)) {
         res = stepper_event(t);
         updated_waketime = t->waketime;
+        timing_hist_end(TH_STEPPER_TIME, hist_start);
     } else {
         res = t->func(t);
         updated_waketime = t->waketime;
+        timing_hist_end(TH_TIMER_TIME, hist_start);
     }
 
     // Update timer_list (rescheduling current timer if necessary)
@@ -189,6 +278,167 @@ sched_timer_reset(void)
     timer_kick();
 }
 
+#else // CONFIG_SCHED_TIMER_HEAP
+
+// The timer heap is an optional alternative to the sorted timer_list
+// that provides O(log n) timer insertion.  Each heap entry stores a
+// copy of the timer's waketime so that a timer callback may update
+// its own waketime while it is still on the heap.  The periodic_timer
+// is always on the heap (and thus the heap is never empty).
+struct timer_heap_entry {
+    uint32_t waketime;
+    struct timer *timer;
+};
+
+static struct {
+    struct timer_heap_entry list[CONFIG_SCHED_TIMER_HEAP_SIZE];
+    uint16_t count;
+    // Set when the first timer is deleted or a new first timer is
+    // added - the next dispatch then only updates the hardware timer
+    uint8_t skip_dispatch;
+} TimerHeap = {
+    .list = { { .timer = &periodic_timer } },
+    .count = 1,
+};
+
+// Place an entry at 'pos' or at one of its ancestors
+static void
+heap_sift_up(uint_fast16_t pos, struct timer_heap_entry e)
+{
+    struct timer_heap_entry *list = TimerHeap.list;
+    while (pos) {
+        uint_fast16_t parent = (pos - 1) / 2;
+        if (!timer_is_before(e.waketime, list[parent].waketime))
+            break;
+        list[pos] = list[parent];
+        pos = parent;
+    }
+    list[pos] = e;
+}
+
+// Place an entry at 'pos' or at one of its descendants
+static void __fastcode
+heap_sift_down(uint_fast16_t pos, struct timer_heap_entry e)
+{
+    struct timer_heap_entry *list = TimerHeap.list;
+    uint_fast16_t count = TimerHeap.count;
+    for (;;) {
+        uint_fast16_t child = pos * 2 + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count
+            && timer_is_before(list[child + 1].waketime, list[child].waketime))
+            child++;
+        if (!timer_is_before(list[child].waketime, e.waketime))
+            break;
+        list[pos] = list[child];
+        pos = child;
+    }
+    list[pos] = e;
+}
+
+// Remove the entry at 'pos' from the heap
+static void
+heap_remove(uint_fast16_t pos)
+{
+    struct timer_heap_entry last = TimerHeap.list[--TimerHeap.count];
+    if (pos >= TimerHeap.count)
+        return;
+    if (pos && timer_is_before(last.waketime
+                               , TimerHeap.list[(pos - 1) / 2].waketime))
+        heap_sift_up(pos, last);
+    else
+        heap_sift_down(pos, last);
+}
+
+// Schedule a function call at a supplied time.
+void
+sched_add_timer(struct timer *add)
+{
+    uint32_t waketime = add->waketime;
+    irqstatus_t flag = irq_save();
+    if (unlikely(TimerHeap.count >= ARRAY_SIZE(TimerHeap.list))) {
+        try_shutdown("Timer heap full");
+        irq_restore(flag);
+        return;
+    }
+    if (unlikely(timer_is_before(waketime, TimerHeap.list[0].waketime))) {
+        // This timer is before all other scheduled timers
+        if (timer_is_before(waketime, timer_read_time()))
+            try_shutdown("Timer too close");
+        TimerHeap.skip_dispatch = 1;
+        timer_kick();
+    }
+    struct timer_heap_entry e = { .waketime = waketime, .timer = add };
+    heap_sift_up(TimerHeap.count++, e);
+    irq_restore(flag);
+}
+
+// Remove a timer that may be live.
+void
+sched_del_timer(struct timer *del)
+{
+    irqstatus_t flag = irq_save();
+    uint_fast16_t i;
+    for (i=0; i<TimerHeap.count; i++) {
+        if (TimerHeap.list[i].timer == del) {
+            if (!i)
+                // The hardware timer is set for the deleted timer
+                TimerHeap.skip_dispatch = 1;
+            heap_remove(i);
+            break;
+        }
+    }
+    irq_restore(flag);
+}
+
+// Invoke the next timer - called from board hardware irq code.
+unsigned int __fastcode
+sched_timer_dispatch(void)
+{
+    if (unlikely(TimerHeap.skip_dispatch)) {
+        TimerHeap.skip_dispatch = 0;
+        return TimerHeap.list[0].waketime;
+    }
+
+    // Invoke timer callback
+    struct timer *t = TimerHeap.list[0].timer;
+    uint_fast8_t res;
+    uint32_t updated_waketime, hist_start = timing_hist_start(t);
+    if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func)) {
+        res = stepper_event(t);
+        updated_waketime = t->waketime;
+        timing_hist_end(TH_STEPPER_TIME, hist_start);
+    } else {
+        res = t->func(t);
+        updated_waketime = t->waketime;
+        timing_hist_end(TH_TIMER_TIME, hist_start);
+    }
+
+    // Update heap (rescheduling current timer if necessary)
+    if (unlikely(res == SF_DONE)) {
+        heap_remove(0);
+    } else {
+        struct timer_heap_entry e = { .waketime = updated_waketime
+                                      , .timer = t };
+        heap_sift_down(0, e);
+    }
+    return TimerHeap.list[0].waketime;
+}
+
+// Remove all user timers
+void
+sched_timer_reset(void)
+{
+    TimerHeap.list[0].waketime = periodic_timer.waketime;
+    TimerHeap.list[0].timer = &periodic_timer;
+    TimerHeap.count = 1;
+    TimerHeap.skip_dispatch = 1;
+    timer_kick();
+}
+
+#endif // CONFIG_SCHED_TIMER_HEAP
+
 
 /****************************************************************
  * Tasks
@@ -260,6 +510,7 @@ run_tasks(void)
         // Update statistics
         uint32_t cur = timer_read_time();
         stats_update(start, cur);
+        timing_hist_end(TH_TASK_TIME, start);
         start = cur;
     }
 }
@@ -19,6 +19,7 @@ struct sdiodev_s {
 };
 
 #define TIMEOUT_MSEC 500
+#define SD_CMD_STOP_TRANSMISSION 12
 
 void
 command_config_sdio(uint32_t *args)
@@ -101,6 +102,47 @@ command_sdio_read_data(uint32_t *args)
 DECL_COMMAND(command_sdio_read_data
              , "sdio_read_data oid=%c cmd=%c argument=%u");
 
+// Read several consecutive blocks with a single multi-block read
+void
+command_sdio_read_blocks(uint32_t *args)
+{
+    uint8_t oid = args[0];
+    uint8_t cmd = args[1];
+    uint32_t argument = args[2];
+    uint32_t count = args[3];
+    uint32_t data_len = 0;
+    struct sdiodev_s *sdio = sdiodev_oid_lookup(oid);
+    uint32_t timeout = TIMEOUT_MSEC*sdio->speed/1000;
+    uint8_t err = 0;
+    if (count && count * sdio->blocksize <= sizeof(sdio->data_buffer))
+        err = sdio_prepare_data_transfer(sdio->sdio_config, 1, count
+                                         , sdio->blocksize, timeout);
+    else
+        count = 0;
+    if (count && err == 0) {
+        err = sdio_send_command(sdio->sdio_config, cmd, argument
+                                , 1, NULL, NULL);
+        if (err == 0) {
+            err = sdio_read_data(sdio->sdio_config, sdio->data_buffer
+                                 , count, sdio->blocksize);
+            if (count > 1) {
+                // End the open ended multi-block read
+                uint8_t stop_err = sdio_send_command(
+                    sdio->sdio_config, SD_CMD_STOP_TRANSMISSION, 0
+                    , 1, NULL, NULL);
+                if (err == 0)
+                    err = stop_err;
+            }
+            if (err == 0)
+                data_len = count * sdio->blocksize;
+        }
+    }
+    sendf("sdio_read_data_response oid=%c error=%c read=%u"
+          , oid, err, data_len);
+}
+DECL_COMMAND(command_sdio_read_blocks
+             , "sdio_read_blocks oid=%c cmd=%c argument=%u count=%c");
+
 void
 command_sdio_write_data(uint32_t *args)
 {
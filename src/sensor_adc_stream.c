@@ -0,0 +1,130 @@
+// Support for streaming analog-to-digital samples at a fixed rate
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "basecmd.h" // oid_alloc
+#include "board/gpio.h" // gpio_adc_sample
+#include "board/io.h" // readb
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // DECL_TASK
+#include "sensor_bulk.h" // sensor_bulk_report
+
+struct adc_stream {
+    struct timer timer;
+    uint32_t rest_ticks, next_begin_time;
+    struct gpio_adc pin;
+    // Samples taken in the timer irq that the task has not yet reported
+    uint8_t pending_head, pending_tail;
+    uint16_t pending[16];
+    struct sensor_bulk sb;
+};
+
+static struct task_wake adc_stream_wake;
+
+#define BYTES_PER_SAMPLE 2
+
+// Take a sample
+static uint_fast8_t
+adc_stream_event(struct timer *timer)
+{
+    struct adc_stream *as = container_of(timer, struct adc_stream, timer);
+    uint32_t sample_delay = gpio_adc_sample(as->pin);
+    if (sample_delay) {
+        as->timer.waketime += sample_delay;
+        return SF_RESCHEDULE;
+    }
+    uint16_t value = gpio_adc_read(as->pin);
+    uint8_t head = as->pending_head;
+    if ((uint8_t)(head - as->pending_tail) >= ARRAY_SIZE(as->pending)) {
+        as->sb.possible_overflows++;
+    } else {
+        as->pending[head % ARRAY_SIZE(as->pending)] = value;
+        as->pending_head = head + 1;
+        sched_wake_task(&adc_stream_wake);
+    }
+    as->next_begin_time += as->rest_ticks;
+    as->timer.waketime = as->next_begin_time;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_adc_stream(uint32_t *args)
+{
+    struct gpio_adc pin = gpio_adc_setup(args[1]);
+    struct adc_stream *as = oid_alloc(args[0], command_config_adc_stream
+                                      , sizeof(*as));
+    as->timer.func = adc_stream_event;
+    as->pin = pin;
+}
+DECL_COMMAND(command_config_adc_stream, "config_adc_stream oid=%c pin=%u");
+
+void
+command_query_adc_stream(uint32_t *args)
+{
+    struct adc_stream *as = oid_lookup(args[0], command_config_adc_stream);
+
+    sched_del_timer(&as->timer);
+    gpio_adc_cancel_sample(as->pin);
+    as->pending_tail = as->pending_head;
+    if (!args[1])
+        // End measurements
+        return;
+
+    // Start new measurements query
+    as->rest_ticks = args[1];
+    sensor_bulk_reset(&as->sb);
+    irq_disable();
+    as->next_begin_time = timer_read_time() + as->rest_ticks;
+    as->timer.waketime = as->next_begin_time;
+    sched_add_timer(&as->timer);
+    irq_enable();
+}
+DECL_COMMAND(command_query_adc_stream, "query_adc_stream oid=%c rest_ticks=%u");
+
+void
+command_query_adc_stream_status(uint32_t *args)
+{
+    struct adc_stream *as = oid_lookup(args[0], command_config_adc_stream);
+    irq_disable();
+    uint32_t time = timer_read_time();
+    uint8_t pending = as->pending_head - as->pending_tail;
+    irq_enable();
+    sensor_bulk_status(&as->sb, args[0], time, 0, pending * BYTES_PER_SAMPLE);
+}
+DECL_COMMAND(command_query_adc_stream_status, "query_adc_stream_status oid=%c");
+
+// Move samples from the irq buffer to the bulk report buffer
+static void
+adc_stream_flush(struct adc_stream *as, uint8_t oid)
+{
+    for (;;) {
+        uint8_t tail = as->pending_tail;
+        if (tail == readb(&as->pending_head))
+            return;
+        irq_disable();
+        uint16_t value = as->pending[tail % ARRAY_SIZE(as->pending)];
+        as->pending_tail = tail + 1;
+        irq_enable();
+        uint8_t *d = &as->sb.data[as->sb.data_count];
+        d[0] = value;
+        d[1] = value >> 8;
+        as->sb.data_count += BYTES_PER_SAMPLE;
+        if (as->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(as->sb.data))
+            sensor_bulk_report(&as->sb, oid);
+    }
+}
+
+void
+adc_stream_task(void)
+{
+    if (!sched_check_wake(&adc_stream_wake))
+        return;
+    uint8_t oid;
+    struct adc_stream *as;
+    foreach_oid(oid, as, command_config_adc_stream) {
+        adc_stream_flush(as, oid);
+    }
+}
+DECL_TASK(adc_stream_task);
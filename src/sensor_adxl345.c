@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_HAVE_GPIO_SPI_BATCH
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_read_time
 #include "basecmd.h" // oid_alloc
@@ -17,7 +18,7 @@ struct adxl345 {
     struct timer timer;
     uint32_t rest_ticks;
     struct spidev_s *spi;
-    uint8_t flags;
+    uint8_t flags, fifo_pending;
     struct sensor_bulk sb;
 };
 
@@ -66,14 +67,19 @@ adxl_reschedule_timer(struct adxl345 *ax)
 #define SET_FIFO_CTL 0x90
 
 #define BYTES_PER_SAMPLE 5
+#define FIFO_READ_DELAY_US 5
 
-// Query accelerometer data
-static void
-adxl_query(struct adxl345 *ax, uint8_t oid)
+// Read several fifo entries per query if the spi bus supports batching
+#if CONFIG_HAVE_GPIO_SPI_BATCH
+#define MAX_BATCH_READS 8
+#else
+#define MAX_BATCH_READS 1
+#endif
+
+// Store one fifo entry and return the reported fifo status
+static uint_fast8_t
+adxl_store_sample(struct adxl345 *ax, uint8_t oid, uint8_t *msg)
 {
-    // Read data
-    uint8_t msg[9] = { AR_DATAX0 | AM_READ | AM_MULTI, 0, 0, 0, 0, 0, 0, 0, 0 };
-    spidev_transfer(ax->spi, 1, sizeof(msg), msg);
     // Extract x, y, z measurements
     uint_fast8_t fifo_status = msg[8] & ~0x80; // Ignore trigger bit
     uint8_t *d = &ax->sb.data[ax->sb.data_count];
@@ -95,14 +101,41 @@ adxl_query(struct adxl345 *ax, uint8_t oid)
     ax->sb.data_count += BYTES_PER_SAMPLE;
     if (ax->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ax->sb.data))
         sensor_bulk_report(&ax->sb, oid);
-    // Check fifo status
     if (fifo_status >= 31)
         ax->sb.possible_overflows++;
+    return fifo_status;
+}
+
+// Query accelerometer data
+static void
+adxl_query(struct adxl345 *ax, uint8_t oid)
+{
+    // Read data (reading all entries known to be in the fifo at once)
+    uint_fast8_t count = ax->fifo_pending, i;
+    if (count > MAX_BATCH_READS)
+        count = MAX_BATCH_READS;
+    if (!count)
+        count = 1;
+    uint8_t msgs[MAX_BATCH_READS][9];
+    memset(msgs, 0, sizeof(msgs));
+    for (i=0; i<count; i++)
+        msgs[i][0] = AR_DATAX0 | AM_READ | AM_MULTI;
+    spidev_transfer_batch(ax->spi, count, sizeof(msgs[0])
+                          , FIFO_READ_DELAY_US, msgs[0]);
+    uint_fast8_t fifo_status = 0;
+    for (i=0; i<count; i++) {
+        fifo_status = adxl_store_sample(ax, oid, msgs[i]);
+        if (!fifo_status)
+            break;
+    }
+    // Check fifo status
     if (fifo_status > 1) {
         // More data in fifo - wake this task again
+        ax->fifo_pending = fifo_status - 1;
         sched_wake_task(&adxl345_wake);
     } else {
         // Sleep until next check time
+        ax->fifo_pending = 0;
         ax->flags &= ~AX_PENDING;
         adxl_reschedule_timer(ax);
     }
@@ -114,7 +147,7 @@ command_query_adxl345(uint32_t *args)
     struct adxl345 *ax = oid_lookup(args[0], command_config_adxl345);
 
     sched_del_timer(&ax->timer);
-    ax->flags = 0;
+    ax->flags = ax->fifo_pending = 0;
     if (!args[1])
         // End measurements
         return;
@@ -0,0 +1,118 @@
+// Support for streaming register reads from an i2c sensor at a fixed rate
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "basecmd.h" // oid_alloc
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "i2ccmds.h" // i2cdev_read
+#include "sched.h" // DECL_TASK
+#include "sensor_bulk.h" // sensor_bulk_report
+
+enum {
+    IS_PENDING = 1<<0,
+};
+
+struct i2c_stream {
+    struct timer timer;
+    uint32_t rest_ticks;
+    struct i2cdev_s *i2c;
+    uint8_t reg, read_len, flags;
+    struct sensor_bulk sb;
+};
+
+static struct task_wake i2c_stream_wake;
+
+// Request a sample from the task
+static uint_fast8_t
+i2c_stream_event(struct timer *timer)
+{
+    struct i2c_stream *is = container_of(timer, struct i2c_stream, timer);
+    if (is->flags & IS_PENDING)
+        is->sb.possible_overflows++;
+    is->flags |= IS_PENDING;
+    sched_wake_task(&i2c_stream_wake);
+    is->timer.waketime += is->rest_ticks;
+    return SF_RESCHEDULE;
+}
+
+void
+command_config_i2c_stream(uint32_t *args)
+{
+    struct i2c_stream *is = oid_alloc(args[0], command_config_i2c_stream
+                                      , sizeof(*is));
+    is->timer.func = i2c_stream_event;
+    is->i2c = i2cdev_oid_lookup(args[1]);
+    is->reg = args[2];
+    is->read_len = args[3];
+    if (!is->read_len || is->read_len > ARRAY_SIZE(is->sb.data))
+        shutdown("Invalid i2c_stream read_len");
+}
+DECL_COMMAND(command_config_i2c_stream,
+             "config_i2c_stream oid=%c i2c_oid=%c reg=%c read_len=%c");
+
+void
+command_query_i2c_stream(uint32_t *args)
+{
+    struct i2c_stream *is = oid_lookup(args[0], command_config_i2c_stream);
+
+    sched_del_timer(&is->timer);
+    is->flags &= ~IS_PENDING;
+    if (!args[1])
+        // End measurements
+        return;
+
+    // Start new measurements query
+    is->rest_ticks = args[1];
+    sensor_bulk_reset(&is->sb);
+    irq_disable();
+    is->timer.waketime = timer_read_time() + is->rest_ticks;
+    sched_add_timer(&is->timer);
+    irq_enable();
+}
+DECL_COMMAND(command_query_i2c_stream, "query_i2c_stream oid=%c rest_ticks=%u");
+
+void
+command_query_i2c_stream_status(uint32_t *args)
+{
+    struct i2c_stream *is = oid_lookup(args[0], command_config_i2c_stream);
+    irq_disable();
+    uint32_t time = timer_read_time();
+    uint8_t pending = is->flags & IS_PENDING;
+    irq_enable();
+    sensor_bulk_status(&is->sb, args[0], time, 0, pending ? is->read_len : 0);
+}
+DECL_COMMAND(command_query_i2c_stream_status, "query_i2c_stream_status oid=%c");
+
+// Read a sample from the sensor and add it to the bulk report buffer
+static void
+i2c_stream_query(struct i2c_stream *is, uint8_t oid)
+{
+    irq_disable();
+    is->flags &= ~IS_PENDING;
+    irq_enable();
+    uint8_t read_len = is->read_len;
+    i2cdev_read(is->i2c, sizeof(is->reg), &is->reg
+                , read_len, &is->sb.data[is->sb.data_count]);
+    is->sb.data_count += read_len;
+
+    // Flush local buffer if needed
+    if (is->sb.data_count + read_len > ARRAY_SIZE(is->sb.data))
+        sensor_bulk_report(&is->sb, oid);
+}
+
+void
+i2c_stream_task(void)
+{
+    if (!sched_check_wake(&i2c_stream_wake))
+        return;
+    uint8_t oid;
+    struct i2c_stream *is;
+    foreach_oid(oid, is, command_config_i2c_stream) {
+        if (!(is->flags & IS_PENDING))
+            continue;
+        i2c_stream_query(is, oid);
+    }
+}
+DECL_TASK(i2c_stream_task);
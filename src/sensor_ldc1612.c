@@ -18,12 +18,12 @@
 
 enum {
     LDC_PENDING = 1<<0, LDC_HAVE_INTB = 1<<1,
-    LH_AWAIT_HOMING = 1<<1, LH_CAN_TRIGGER = 1<<2
+    LH_AWAIT_HOMING = 1<<1, LH_CAN_TRIGGER = 1<<2, LH_HAVE_LAST = 1<<3
 };
 
 struct ldc1612 {
     struct timer timer;
-    uint32_t rest_ticks;
+    uint32_t rest_ticks, sample_clock;
     struct i2cdev_s *i2c;
     uint8_t flags;
     struct sensor_bulk sb;
@@ -34,6 +34,7 @@ struct ldc1612 {
     uint8_t trigger_reason, error_reason;
     uint32_t trigger_threshold;
     uint32_t homing_clock;
+    uint32_t last_data, last_clock;
 };
 
 static struct task_wake ldc1612_wake;
@@ -53,6 +54,8 @@ ldc1612_event(struct timer *timer)
     if (ld->flags & LDC_PENDING)
         ld->sb.possible_overflows++;
     if (!(ld->flags & LDC_HAVE_INTB) || check_intb_asserted(ld)) {
+        if (!(ld->flags & LDC_PENDING))
+            ld->sample_clock = ld->timer.waketime;
         ld->flags |= LDC_PENDING;
         sched_wake_task(&ldc1612_wake);
     }
@@ -112,9 +115,22 @@ command_query_ldc1612_home_state(uint32_t *args)
 DECL_COMMAND(command_query_ldc1612_home_state,
              "query_ldc1612_home_state oid=%c");
 
+// Estimate the time the frequency crossed the trigger threshold
+static uint32_t
+interpolate_trigger(struct ldc1612 *ld, uint32_t data, uint32_t time)
+{
+    if (!(ld->homing_flags & LH_HAVE_LAST) || data <= ld->last_data
+        || ld->last_data >= ld->trigger_threshold)
+        return time;
+    uint32_t span = data - ld->last_data;
+    uint32_t offset = ld->trigger_threshold - ld->last_data;
+    uint32_t interval = time - ld->last_clock;
+    return ld->last_clock + (uint32_t)(((uint64_t)interval * offset) / span);
+}
+
 // Check if a sample should trigger a homing event
 static void
-check_home(struct ldc1612 *ld, uint32_t data)
+check_home(struct ldc1612 *ld, uint32_t data, uint32_t time)
 {
     uint8_t homing_flags = ld->homing_flags;
     if (!(homing_flags & LH_CAN_TRIGGER))
@@ -125,15 +141,18 @@ check_home(struct ldc1612 *ld, uint32_t data)
         trsync_do_trigger(ld->ts, ld->error_reason);
         return;
     }
-    uint32_t time = timer_read_time();
     if ((homing_flags & LH_AWAIT_HOMING)
         && timer_is_before(time, ld->homing_clock))
         return;
     homing_flags &= ~LH_AWAIT_HOMING;
     if (data > ld->trigger_threshold) {
         homing_flags = 0;
-        ld->homing_clock = time;
+        ld->homing_clock = interpolate_trigger(ld, data, time);
         trsync_do_trigger(ld->ts, ld->trigger_reason);
+    } else {
+        homing_flags |= LH_HAVE_LAST;
+        ld->last_data = data;
+        ld->last_clock = time;
     }
     ld->homing_flags = homing_flags;
 }
@@ -166,9 +185,13 @@ static void
 ldc1612_query(struct ldc1612 *ld, uint8_t oid)
 {
     // Check if data available (and clear INTB line)
+    uint32_t time = timer_read_time();
     uint16_t status = read_reg_status(ld);
     irq_disable();
     ld->flags &= ~LDC_PENDING;
+    if (ld->flags & LDC_HAVE_INTB)
+        // Use the time the intb line was first seen asserted
+        time = ld->sample_clock;
     irq_enable();
     if (!(status & 0x08))
         return;
@@ -181,7 +204,7 @@ ldc1612_query(struct ldc1612 *ld, uint8_t oid)
 
     // Check for endstop trigger
     uint32_t data = (d[0] << 24L) | (d[1] << 16L) | (d[2] << 8) | d[3];
-    check_home(ld, data);
+    check_home(ld, data, time);
 
     // Flush local buffer if needed
     if (ld->sb.data_count + BYTES_PER_SAMPLE > ARRAY_SIZE(ld->sb.data))
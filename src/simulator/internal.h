@@ -0,0 +1,8 @@
+#ifndef __SIMULATOR_INTERNAL_H
+#define __SIMULATOR_INTERNAL_H
+// Local definitions for the host simulator
+
+// serial.c
+void serial_poll(void);
+
+#endif // internal.h
@@ -11,6 +11,7 @@
 #include "board/misc.h" // timer_from_us
 #include "board/timer_irq.h" // timer_dispatch_many
 #include "command.h" // DECL_CONSTANT
+#include "internal.h" // serial_poll
 #include "sched.h" // DECL_INIT
 
 // Helper function that returns the system time as a 32bit counter
@@ -106,4 +107,5 @@ irq_poll(void)
     uint32_t now = timer_read_time();
     if (!timer_is_before(now, next_wake_time))
         do_timer_dispatch();
+    serial_poll();
 }
@@ -109,6 +109,26 @@ spidev_transfer(struct spidev_s *spi, uint8_t receive_data
         gpio_out_write(spi->pin, !(flags & SF_CS_ACTIVE_HIGH));
 }
 
+// Perform 'count' separate receive transfers of 'data_len' bytes each
+void
+spidev_transfer_batch(struct spidev_s *spi, uint8_t count
+                      , uint8_t data_len, uint16_t delay_us, uint8_t *data)
+{
+#if CONFIG_HAVE_GPIO_SPI_BATCH
+    uint_fast8_t flags = spi->flags;
+    if ((flags & SF_HARDWARE) && !(flags & SF_HAVE_PIN)) {
+        // The hardware manages chip select - submit all transfers at once
+        spi_prepare(spi->spi_config);
+        spi_transfer_batch(spi->spi_config, count, data_len, delay_us, data);
+        return;
+    }
+#endif
+    while (count--) {
+        spidev_transfer(spi, 1, data_len, data);
+        data += data_len;
+    }
+}
+
 void
 command_spi_transfer(uint32_t *args)
 {
@@ -10,5 +10,8 @@ int spidev_have_cs_pin(struct spidev_s *spi);
 struct gpio_out spidev_get_cs_pin(struct spidev_s *spi);
 void spidev_transfer(struct spidev_s *spi, uint8_t receive_data
                      , uint8_t data_len, uint8_t *data);
+void spidev_transfer_batch(struct spidev_s *spi, uint8_t count
+                           , uint8_t data_len, uint16_t delay_us
+                           , uint8_t *data);
 
 #endif // spicmds.h
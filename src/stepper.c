@@ -34,6 +34,9 @@ struct stepper_move {
     uint32_t interval;
     int16_t add;
     uint16_t count;
+#if CONFIG_WANT_STEPPER_ADD2
+    int16_t add2;
+#endif
     uint8_t flags;
 };
 
@@ -42,13 +45,23 @@ enum { MF_DIR=1<<0 };
 struct stepper {
     struct timer time;
     uint32_t interval;
+#if CONFIG_WANT_STEPPER_ADD2
+    int32_t add;
+    int16_t add2;
+#else
     int16_t add;
+#endif
     uint32_t count;
     uint32_t next_step_time, step_pulse_ticks;
     struct gpio_out step_pin, dir_pin;
     uint32_t position;
     struct move_queue_head mq;
     struct trsync_signal stop_signal;
+#if CONFIG_WANT_STEPPER_GROUP
+    struct stepper *group_leader, *group_next;
+    struct stepper_move group_pending;
+    uint8_t group_flags;
+#endif
     // gcc (pre v6) does better optimization when uint8_t are bitfields
     uint8_t flags : 8;
 };
@@ -60,8 +73,99 @@ enum {
     SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5
 };
 
+enum { GF_INVERT_DIR=1<<0, GF_PENDING=1<<1 };
+
+// A "stepper group" is a leader stepper along with a list of follower
+// steppers that are stepped from the leader's timer.  The host still
+// sends the full move schedule for each follower - the follower moves
+// are not executed, they are only checked against the leader's moves.
+
+#if CONFIG_WANT_STEPPER_GROUP
+
+// Check that a follower move matches the corresponding leader move
+static void
+stepper_group_check(struct stepper_move *m, struct stepper_move *fm)
+{
+    if (m->interval != fm->interval || m->count != fm->count
+        || m->add != fm->add || (m->flags ^ fm->flags) & MF_DIR
+#if CONFIG_WANT_STEPPER_ADD2
+        || m->add2 != fm->add2
+#endif
+        )
+        shutdown("Stepper group out of sync");
+}
+
+// Toggle the step pin of all followers of a group leader
+static inline void
+stepper_group_step(struct stepper *s)
+{
+    struct stepper *f;
+    for (f = s->group_next; f; f = f->group_next)
+        gpio_out_toggle_noirq(f->step_pin);
+}
+
+// Apply a move loaded by a group leader to all of its followers
+static void
+stepper_group_load(struct stepper *s, struct stepper_move *m)
+{
+    struct stepper *f;
+    for (f = s->group_next; f; f = f->group_next) {
+        if (m->flags & MF_DIR) {
+            f->position = -f->position + m->count;
+            gpio_out_toggle_noirq(f->dir_pin);
+        } else {
+            f->position += m->count;
+        }
+        if (f->flags & SF_NEED_RESET)
+            continue;
+        if (move_queue_empty(&f->mq)) {
+            // The follower's copy of this move has not arrived yet
+            if (f->group_flags & GF_PENDING)
+                shutdown("Stepper group out of sync");
+            f->group_flags |= GF_PENDING;
+            f->group_pending = *m;
+            continue;
+        }
+        struct move_node *mn = move_queue_pop(&f->mq);
+        struct stepper_move *fm = container_of(mn, struct stepper_move, node);
+        stepper_group_check(m, fm);
+        move_free(fm);
+    }
+}
+
+// Add a move to a follower's queue (caller must disable irqs)
+static void
+stepper_group_queue(struct stepper *f, struct stepper_move *m)
+{
+    if (f->group_flags & GF_PENDING) {
+        // Leader already started this move
+        f->group_flags &= ~GF_PENDING;
+        stepper_group_check(&f->group_pending, m);
+        move_free(m);
+        return;
+    }
+    move_queue_push(&m->node, &f->mq);
+}
+
+static inline int
+stepper_is_follower(struct stepper *s)
+{
+    return !!s->group_leader;
+}
+
+#else
+
+static inline void stepper_group_step(struct stepper *s) { }
+static inline void stepper_group_load(struct stepper *s
+                                      , struct stepper_move *m) { }
+static inline void stepper_group_queue(struct stepper *f
+                                       , struct stepper_move *m) { }
+static inline int stepper_is_follower(struct stepper *s) { return 0; }
+
+#endif
+
 // Setup a stepper for the next move in its queue
-static uint_fast8_t
+static uint_fast8_t __fastcode
 stepper_load_next(struct stepper *s)
 {
     if (move_queue_empty(&s->mq)) {
@@ -73,8 +177,13 @@ stepper_load_next(struct stepper *s)
     // Load next 'struct stepper_move' into 'struct stepper'
     struct move_node *mn = move_queue_pop(&s->mq);
     struct stepper_move *m = container_of(mn, struct stepper_move, node);
-    s->add = m->add;
     s->interval = m->interval + m->add;
+#if CONFIG_WANT_STEPPER_ADD2
+    s->add = m->add + m->add2;
+    s->add2 = m->add2;
+#else
+    s->add = m->add;
+#endif
     if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED) {
         s->time.waketime += m->interval;
         if (HAVE_AVR_OPTIMIZATION)
@@ -94,22 +203,34 @@ stepper_load_next(struct stepper *s)
     } else {
         s->position += m->count;
     }
+    stepper_group_load(s, m);
 
     move_free(m);
     return SF_RESCHEDULE;
 }
 
+// Update the step interval increment (for queue_step_add2 moves)
+static inline void
+stepper_add2(struct stepper *s)
+{
+#if CONFIG_WANT_STEPPER_ADD2
+    s->add += s->add2;
+#endif
+}
+
 // Optimized step function to step on each step pin edge
-uint_fast8_t
+uint_fast8_t __fastcode
 stepper_event_edge(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
     gpio_out_toggle_noirq(s->step_pin);
+    stepper_group_step(s);
     uint32_t count = s->count - 1;
     if (likely(count)) {
         s->count = count;
         s->time.waketime += s->interval;
         s->interval += s->add;
+        stepper_add2(s);
         return SF_RESCHEDULE;
     }
     return stepper_load_next(s);
@@ -138,11 +259,12 @@ stepper_event_avr(struct timer *t)
 }
 
 // Regular "double scheduled" step function
-uint_fast8_t
+uint_fast8_t __fastcode
 stepper_event_full(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
     gpio_out_toggle_noirq(s->step_pin);
+    stepper_group_step(s);
     uint32_t curtime = timer_read_time();
     uint32_t min_next_time = curtime + s->step_pulse_ticks;
     s->count--;
@@ -152,6 +274,7 @@ stepper_event_full(struct timer *t)
     if (likely(s->count)) {
         s->next_step_time += s->interval;
         s->interval += s->add;
+        stepper_add2(s);
         if (unlikely(timer_is_before(s->next_step_time, min_next_time)))
             // The next step event is too close - push it back
             goto reschedule_min;
@@ -171,7 +294,7 @@ reschedule_min:
 }
 
 // Optimized entry point for step function (may be inlined into sched.c code)
-uint_fast8_t
+uint_fast8_t __fastcode
 stepper_event(struct timer *t)
 {
     if (HAVE_EDGE_OPTIMIZATION)
@@ -216,19 +339,35 @@ stepper_oid_lookup(uint8_t oid)
     return oid_lookup(oid, command_config_stepper);
 }
 
-// Schedule a set of steps with a given timing
+#if CONFIG_WANT_STEPPER_GROUP
+// Step a stepper from the step timer of another stepper
 void
-command_queue_step(uint32_t *args)
+command_stepper_add_follower(uint32_t *args)
 {
     struct stepper *s = stepper_oid_lookup(args[0]);
-    struct stepper_move *m = move_alloc();
-    m->interval = args[1];
-    m->count = args[2];
-    if (!m->count)
-        shutdown("Invalid count parameter");
-    m->add = args[3];
-    m->flags = 0;
+    struct stepper *f = stepper_oid_lookup(args[1]);
+    if (s == f || s->group_leader || f->group_leader || f->group_next
+        || (s->flags ^ f->flags) & SF_SINGLE_SCHED
+        || s->step_pulse_ticks != f->step_pulse_ticks)
+        shutdown("Invalid stepper group");
+    if (args[2]) {
+        // Follower dir pin is the inverse of the leader's dir pin
+        f->group_flags = GF_INVERT_DIR;
+        f->position = -f->position;
+        gpio_out_write(f->dir_pin, 1);
+    }
+    f->group_leader = s;
+    f->group_next = s->group_next;
+    s->group_next = f;
+}
+DECL_COMMAND(command_stepper_add_follower,
+             "stepper_add_follower oid=%c follower_oid=%c invert_dir=%c");
+#endif
 
+// Add a 'struct stepper_move' to a stepper's queue
+static void
+stepper_queue_move(struct stepper *s, struct stepper_move *m)
+{
     irq_disable();
     uint8_t flags = s->flags;
     if (!!(flags & SF_LAST_DIR) != !!(flags & SF_NEXT_DIR)) {
@@ -240,6 +379,10 @@ command_queue_step(uint32_t *args)
         move_queue_push(&m->node, &s->mq);
     } else if (flags & SF_NEED_RESET) {
         move_free(m);
+    } else if (stepper_is_follower(s)) {
+        // Followers are stepped from the group leader's timer
+        s->flags = flags;
+        stepper_group_queue(s, m);
     } else {
         s->flags = flags;
         move_queue_push(&m->node, &s->mq);
@@ -248,19 +391,118 @@ command_queue_step(uint32_t *args)
     }
     irq_enable();
 }
+
+// Allocate a 'struct stepper_move' from queue_step parameters
+static struct stepper_move *
+stepper_alloc_move(uint32_t *args)
+{
+    struct stepper_move *m = move_alloc();
+    m->interval = args[1];
+    m->count = args[2];
+    if (!m->count)
+        shutdown("Invalid count parameter");
+    m->add = args[3];
+    m->flags = 0;
+    return m;
+}
+
+// Schedule a set of steps with a given timing
+void
+command_queue_step(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    struct stepper_move *m = stepper_alloc_move(args);
+#if CONFIG_WANT_STEPPER_ADD2
+    m->add2 = 0;
+#endif
+    stepper_queue_move(s, m);
+}
 DECL_COMMAND(command_queue_step,
              "queue_step oid=%c interval=%u count=%hu add=%hi");
 
-// Set the direction of the next queued step
+#if CONFIG_WANT_STEPPER_ADD2
+// Schedule a set of steps with a second order change in timing
 void
-command_set_next_step_dir(uint32_t *args)
+command_queue_step_add2(uint32_t *args)
 {
     struct stepper *s = stepper_oid_lookup(args[0]);
-    uint8_t nextdir = args[1] ? SF_NEXT_DIR : 0;
+    struct stepper_move *m = stepper_alloc_move(args);
+    m->add2 = args[4];
+    stepper_queue_move(s, m);
+}
+DECL_COMMAND(command_queue_step_add2,
+             "queue_step_add2 oid=%c interval=%u count=%hu add=%hi add2=%hi");
+#endif
+
+// Set the direction of the next queued step
+static void
+stepper_set_next_dir(struct stepper *s, uint8_t dir)
+{
+    uint8_t nextdir = dir ? SF_NEXT_DIR : 0;
     irq_disable();
     s->flags = (s->flags & ~SF_NEXT_DIR) | nextdir;
     irq_enable();
 }
+
+#if CONFIG_WANT_STEPPER_BATCH
+// Queue a run of step sequences from a compact delta encoded buffer
+static void
+stepper_queue_steps(uint32_t *args, uint8_t has_dir)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    uint8_t len = args[1], *p = command_decode_ptr(args[2]), *end = p + len;
+    uint32_t next_interval = 0;
+    while (p < end) {
+        // Each entry is: count*2+have_add2 (or count*4+dir*2+have_add2
+        // with has_dir), interval delta, add, [add2]
+        uint32_t margs[4], count_flag = command_parse_vlq(&p);
+        if (has_dir) {
+            stepper_set_next_dir(s, count_flag & 2);
+            count_flag = ((count_flag >> 1) & ~1) | (count_flag & 1);
+        }
+        margs[0] = args[0];
+        margs[1] = next_interval + command_parse_vlq(&p);
+        margs[2] = count_flag >> 1;
+        margs[3] = command_parse_vlq(&p);
+        int16_t add2 = count_flag & 1 ? command_parse_vlq(&p) : 0;
+        if (p > end || (add2 && !CONFIG_WANT_STEPPER_ADD2))
+            shutdown("Invalid queue_steps data");
+        struct stepper_move *m = stepper_alloc_move(margs);
+#if CONFIG_WANT_STEPPER_ADD2
+        m->add2 = add2;
+#endif
+        // The next interval is relative to the end of this sequence
+        uint32_t count = m->count;
+        next_interval = (m->interval + count * (uint32_t)m->add
+                         + (uint32_t)add2 * (count * (count - 1) / 2));
+        stepper_queue_move(s, m);
+    }
+}
+
+// Schedule a run of step sequences from a compact delta encoded buffer
+void
+command_queue_steps(uint32_t *args)
+{
+    stepper_queue_steps(args, 0);
+}
+DECL_COMMAND(command_queue_steps, "queue_steps oid=%c data=%*s");
+
+// Schedule a run of step sequences that each specify their direction
+void
+command_queue_steps_dir(uint32_t *args)
+{
+    stepper_queue_steps(args, 1);
+}
+DECL_COMMAND(command_queue_steps_dir, "queue_steps_dir oid=%c data=%*s");
+#endif
+
+// Set the direction of the next queue_step command
+void
+command_set_next_step_dir(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    stepper_set_next_dir(s, args[1]);
+}
 DECL_COMMAND(command_set_next_step_dir, "set_next_step_dir oid=%c dir=%c");
 
 // Set an absolute time that the next step will be relative to
@@ -282,12 +524,17 @@ DECL_COMMAND(command_reset_step_clock, "reset_step_clock oid=%c clock=%u");
 static uint32_t
 stepper_get_position(struct stepper *s)
 {
-    uint32_t position = s->position;
+    uint32_t position = s->position, count = s->count;
+#if CONFIG_WANT_STEPPER_GROUP
+    if (s->group_leader && !(s->flags & SF_NEED_RESET))
+        // Followers take their steps with the leader's step timer
+        count = s->group_leader->count;
+#endif
     // If stepper is mid-move, subtract out steps not yet taken
     if (HAVE_SINGLE_SCHEDULE && s->flags & SF_SINGLE_SCHED)
-        position -= s->count;
+        position -= count;
     else
-        position -= s->count / 2;
+        position -= count / 2;
     // The top bit of s->position is an optimized reverse direction flag
     if (position & 0x80000000)
         return -position;
@@ -312,12 +559,26 @@ static void
 stepper_stop(struct trsync_signal *tss, uint8_t reason)
 {
     struct stepper *s = container_of(tss, struct stepper, stop_signal);
+#if CONFIG_WANT_STEPPER_GROUP
+    if (!s->group_leader) {
+        // Stop followers while the leader's step count is still valid
+        struct stepper *f;
+        for (f = s->group_next; f; f = f->group_next)
+            if (!(f->flags & SF_NEED_RESET))
+                stepper_stop(&f->stop_signal, reason);
+    }
+    s->group_flags &= ~GF_PENDING;
+    uint8_t dir = s->group_flags & GF_INVERT_DIR;
+#else
+    uint8_t dir = 0;
+#endif
     sched_del_timer(&s->time);
     s->next_step_time = s->time.waketime = 0;
-    s->position = -stepper_get_position(s);
+    uint32_t position = stepper_get_position(s);
+    s->position = dir ? position : -position;
     s->count = 0;
     s->flags = (s->flags & (SF_INVERT_STEP|SF_SINGLE_SCHED)) | SF_NEED_RESET;
-    gpio_out_write(s->dir_pin, 0);
+    gpio_out_write(s->dir_pin, dir);
     if (!(HAVE_EDGE_OPTIMIZATION && s->flags & SF_SINGLE_SCHED))
         gpio_out_write(s->step_pin, s->flags & SF_INVERT_STEP);
     while (!move_queue_empty(&s->mq)) {
@@ -345,6 +606,8 @@ stepper_shutdown(void)
     struct stepper *s;
     foreach_oid(i, s, command_config_stepper) {
         move_queue_clear(&s->mq);
+    }
+    foreach_oid(i, s, command_config_stepper) {
         stepper_stop(&s->stop_signal, 0);
     }
 }
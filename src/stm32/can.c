@@ -127,7 +127,7 @@ canhw_send(struct canbus_msg *msg)
     else
         tir = (msg->id & 0x7ff) << CAN_TI0R_STID_Pos;
     tir |= msg->id & CANMSG_ID_RTR ? CAN_TI0R_RTR : 0;
-    mb->TIR = (msg->id << CAN_TI0R_STID_Pos) | CAN_TI0R_TXRQ;
+    mb->TIR = tir | CAN_TI0R_TXRQ;
     return CANMSG_DATA_LEN(msg);
 }
 
@@ -172,7 +172,14 @@ canhw_set_filter(uint32_t id)
 void
 CAN_IRQHandler(void)
 {
-    if (SOC_CAN->RF0R & CAN_RF0R_FMP0) {
+    // Drain all pending packets from the hardware fifo
+    for (;;) {
+        uint32_t rf0r = SOC_CAN->RF0R;
+        if (!(rf0r & CAN_RF0R_FMP0))
+            break;
+        if (rf0r & CAN_RF0R_RFOM0)
+            // Previous release still in progress - wait for it to finish
+            continue;
         // Read and ack data packet
         CAN_FIFOMailBox_TypeDef *mb = &SOC_CAN->sFIFOMailBox[0];
         uint32_t rir = mb->RIR;
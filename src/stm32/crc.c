@@ -0,0 +1,42 @@
+// Calculate crc16_ccitt using the stm32 CRC peripheral
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "generic/misc.h" // crc16_ccitt
+#include "internal.h" // CRC
+
+// The Klipper "ccitt" crc is the bit reflected form of polynomial
+// 0x1021 with an initial value of 0xffff.
+#define CRC_CR_SETUP (CRC_CR_POLYSIZE_0 | CRC_CR_REV_IN_0 | CRC_CR_REV_OUT)
+
+static void
+crc_setup(void)
+{
+#if defined(RCC_AHBENR_CRCEN)
+    RCC->AHBENR |= RCC_AHBENR_CRCEN;
+    RCC->AHBENR;
+#elif defined(RCC_AHB4ENR_CRCEN)
+    RCC->AHB4ENR |= RCC_AHB4ENR_CRCEN;
+    RCC->AHB4ENR;
+#else
+    RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
+    RCC->AHB1ENR;
+#endif
+    CRC->POL = 0x1021;
+    CRC->INIT = 0xffff;
+    CRC->CR = CRC_CR_SETUP;
+}
+
+// Implement the standard crc "ccitt" algorithm on the given buffer
+uint16_t
+crc16_ccitt(uint8_t *buf, uint_fast8_t len)
+{
+    if (CRC->CR != CRC_CR_SETUP)
+        // Peripheral not yet enabled (registers read as zero)
+        crc_setup();
+    CRC->CR = CRC_CR_SETUP | CRC_CR_RESET;
+    volatile uint8_t *dr = (void*)&CRC->DR;
+    while (len--)
+        *dr = *buf++;
+    return CRC->DR;
+}
@@ -94,6 +94,9 @@ struct fdcan_fifo {
 #define FDCAN_XTD (1<<30)
 #define FDCAN_RTR (1<<29)
 
+#define FDCAN_FDF (1<<21)
+#define FDCAN_BRS (1<<20)
+
 struct fdcan_msg_ram {
     uint32_t FLS[28]; // Filter list standard
     uint32_t FLE[16]; // Filter list extended
@@ -133,9 +136,17 @@ canhw_send(struct canbus_msg *msg)
         ids = (msg->id & 0x7ff) << 18;
     ids |= msg->id & CANMSG_ID_RTR ? FDCAN_RTR : 0;
     txfifo->id_section = ids;
-    txfifo->dlc_section = (msg->dlc & 0x0f) << 16;
-    txfifo->data[0] = msg->data32[0];
-    txfifo->data[1] = msg->data32[1];
+    uint32_t dlcs = (msg->dlc & 0x0f) << 16;
+    if (CONFIG_CANBUS_FD && msg->id & CANMSG_ID_FDF) {
+        txfifo->dlc_section = dlcs | FDCAN_FDF | FDCAN_BRS;
+        uint32_t i, words = DIV_ROUND_UP(CANMSG_DATA_LEN(msg), 4);
+        for (i=0; i<words; i++)
+            txfifo->data[i] = msg->data32[i];
+    } else {
+        txfifo->dlc_section = dlcs;
+        txfifo->data[0] = msg->data32[0];
+        txfifo->data[1] = msg->data32[1];
+    }
     barrier();
     SOC_CAN->TXBAR = ((uint32_t)1 << w_index);
     return CANMSG_DATA_LEN(msg);
@@ -193,8 +204,11 @@ CAN_IRQHandler(void)
     if (ir & FDCAN_IE_RF0NE) {
         SOC_CAN->IR = FDCAN_IE_RF0NE;
 
-        uint32_t rxf0s = SOC_CAN->RXF0S;
-        if (rxf0s & FDCAN_RXF0S_F0FL) {
+        // Drain all pending packets from the hardware fifo
+        for (;;) {
+            uint32_t rxf0s = SOC_CAN->RXF0S;
+            if (!(rxf0s & FDCAN_RXF0S_F0FL))
+                break;
             // Read and ack data packet
             uint32_t idx = (rxf0s & FDCAN_RXF0S_F0GI) >> FDCAN_RXF0S_F0GI_Pos;
             struct fdcan_fifo *rxf0 = &MSG_RAM.RXF0[idx];
@@ -205,9 +219,17 @@ CAN_IRQHandler(void)
             else
                 msg.id = (ids >> 18) & 0x7ff;
             msg.id |= ids & FDCAN_RTR ? CANMSG_ID_RTR : 0;
-            msg.dlc = (rxf0->dlc_section >> 16) & 0x0f;
-            msg.data32[0] = rxf0->data[0];
-            msg.data32[1] = rxf0->data[1];
+            uint32_t dlcs = rxf0->dlc_section;
+            msg.dlc = (dlcs >> 16) & 0x0f;
+            if (CONFIG_CANBUS_FD && dlcs & FDCAN_FDF) {
+                msg.id |= CANMSG_ID_FDF;
+                uint32_t i, words = DIV_ROUND_UP(CANMSG_DATA_LEN(&msg), 4);
+                for (i=0; i<words; i++)
+                    msg.data32[i] = rxf0->data[i];
+            } else {
+                msg.data32[0] = rxf0->data[0];
+                msg.data32[1] = rxf0->data[1];
+            }
             barrier();
             SOC_CAN->RXF0A = idx;
 
@@ -268,6 +290,40 @@ compute_btr(uint32_t pclock, uint32_t bitrate)
     return make_btr(sjw, time_seg1, time_seg2, brp);
 }
 
+#if CONFIG_CANBUS_FD
+// Configure the data phase bit timing and enable CAN FD frames
+static void
+can_setup_fd(uint32_t pclock)
+{
+    uint32_t bit_clocks = pclock / CONFIG_CANBUS_FD_DATA_FREQUENCY;
+
+    // Find number of time quantas that gives us the exact wanted bit time
+    uint32_t qs;
+    for (qs = 25; qs > 5; qs--)
+        if (bit_clocks % qs == 0)
+            break;
+    uint32_t brp       = bit_clocks / qs;
+    uint32_t time_seg2 = qs / 4; // sample at ~75%
+    uint32_t time_seg1 = qs - (1 + time_seg2);
+    uint32_t sjw       = time_seg2;
+
+    uint32_t dbtp = (((uint32_t)(sjw-1)) << FDCAN_DBTP_DSJW_Pos
+                     | ((uint32_t)(time_seg1-1)) << FDCAN_DBTP_DTSEG1_Pos
+                     | ((uint32_t)(time_seg2-1)) << FDCAN_DBTP_DTSEG2_Pos
+                     | ((uint32_t)(brp - 1)) << FDCAN_DBTP_DBRP_Pos);
+    if (brp <= 2) {
+        // Enable transmitter delay compensation (needed at high rates)
+        dbtp |= FDCAN_DBTP_TDC;
+        uint32_t tdco = brp * (1 + time_seg1); // at the sample point
+        SOC_CAN->TDCR = tdco << FDCAN_TDCR_TDCO_Pos;
+    }
+    SOC_CAN->DBTP = dbtp;
+
+    // Enable CAN FD frames with bit rate switching
+    SOC_CAN->CCCR |= FDCAN_CCCR_FDOE | FDCAN_CCCR_BRSE;
+}
+#endif
+
 void
 can_init(void)
 {
@@ -300,6 +356,10 @@ can_init(void)
 
     SOC_CAN->NBTP = btr;
 
+#if CONFIG_CANBUS_FD
+    can_setup_fd(pclock);
+#endif
+
 #if CONFIG_MACH_STM32H7
     /* Setup message RAM addresses */
     uint32_t f0sa = (uint32_t)MSG_RAM.RXF0 - SRAMCAN_BASE;
@@ -27,6 +27,12 @@ struct gpio_pwm {
 struct gpio_pwm gpio_pwm_setup(uint8_t pin, uint32_t cycle_time, uint8_t val);
 void gpio_pwm_write(struct gpio_pwm g, uint32_t val);
 
+struct gpio_counter {
+    void *reg;
+};
+struct gpio_counter gpio_counter_setup(uint32_t pin, int32_t pull_up);
+uint16_t gpio_counter_read(struct gpio_counter g);
+
 struct gpio_adc {
     void *adc;
     uint32_t chan;
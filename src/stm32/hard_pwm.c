@@ -371,3 +371,54 @@ void
 gpio_pwm_write(struct gpio_pwm g, uint32_t val) {
     *(volatile uint32_t*) g.reg = val;
 }
+
+// Count rising edges on a timer channel 1 or 2 input (external clock mode 1)
+struct gpio_counter
+gpio_counter_setup(uint32_t pin, int32_t pull_up)
+{
+    // Find pin in pwm_regs table
+    const struct gpio_pwm_info* p = pwm_regs;
+    for (;; p++) {
+        if (p >= &pwm_regs[ARRAY_SIZE(pwm_regs)])
+            shutdown("Not a valid counter pin");
+        if (p->pin == pin && (p->channel == 1 || p->channel == 2)
+            && IS_TIM_SLAVE_INSTANCE(p->timer))
+            break;
+    }
+
+    // Enable clock
+    if (!is_enabled_pclock((uint32_t) p->timer)) {
+        enable_pclock((uint32_t) p->timer);
+    }
+    TIM_TypeDef *t = p->timer;
+    if (t->CR1 & TIM_CR1_CEN)
+        shutdown("Counter timer already in use");
+
+    gpio_peripheral(p->pin, p->function, pull_up);
+
+    // Select TI1FP1 or TI2FP2 as the timer clock with a digital filter
+    t->CR1 = 0;
+    t->PSC = 0;
+    t->ARR = 0xffff;
+    if (p->channel == 1) {
+        t->CCMR1 = TIM_CCMR1_CC1S_0 | (TIM_CCMR1_IC1F_0 | TIM_CCMR1_IC1F_1);
+        t->CCER = 0;
+        t->SMCR = (TIM_SMCR_TS_0 | TIM_SMCR_TS_2)
+                  | (TIM_SMCR_SMS_0 | TIM_SMCR_SMS_1 | TIM_SMCR_SMS_2);
+    } else {
+        t->CCMR1 = TIM_CCMR1_CC2S_0 | (TIM_CCMR1_IC2F_0 | TIM_CCMR1_IC2F_1);
+        t->CCER = 0;
+        t->SMCR = (TIM_SMCR_TS_1 | TIM_SMCR_TS_2)
+                  | (TIM_SMCR_SMS_0 | TIM_SMCR_SMS_1 | TIM_SMCR_SMS_2);
+    }
+    t->EGR = TIM_EGR_UG;
+    t->CNT = 0;
+    t->CR1 = TIM_CR1_CEN;
+    return (struct gpio_counter){ .reg = (void*)&t->CNT };
+}
+
+uint16_t
+gpio_counter_read(struct gpio_counter g)
+{
+    return *(volatile uint32_t*)g.reg;
+}
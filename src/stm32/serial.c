@@ -50,14 +50,131 @@
   #define USARTx_IRQn USART3_IRQn
 #endif
 
+#if CONFIG_STM32_SERIAL_RX_DMA
+
+// Select the dma channel that receives from the serial port
+#if CONFIG_MACH_STM32F1
+  #if CONFIG_STM32_SERIAL_USART1 || CONFIG_STM32_SERIAL_USART1_ALT_PB7_PB6
+    #define RxDMA DMA1_Channel5
+    #define RxDMA_IRQn DMA1_Channel5_IRQn
+    #define RxDMA_IFCR_FLAGS DMA_IFCR_CGIF5
+  #elif CONFIG_STM32_SERIAL_USART2 || CONFIG_STM32_SERIAL_USART2_ALT_PD6_PD5
+    #define RxDMA DMA1_Channel6
+    #define RxDMA_IRQn DMA1_Channel6_IRQn
+    #define RxDMA_IFCR_FLAGS DMA_IFCR_CGIF6
+  #else
+    #define RxDMA DMA1_Channel3
+    #define RxDMA_IRQn DMA1_Channel3_IRQn
+    #define RxDMA_IFCR_FLAGS DMA_IFCR_CGIF3
+  #endif
+  #define RxDMA_IFCR DMA1->IFCR
+  #define RxDMA_NDTR RxDMA->CNDTR
+#else
+  // All stream interrupt flags (FEIF, DMEIF, TEIF, HTIF, TCIF)
+  #define DMA_STREAM_FLAGS 0x3d
+  #if CONFIG_STM32_SERIAL_USART1 || CONFIG_STM32_SERIAL_USART1_ALT_PB7_PB6
+    #define RxDMA DMA2_Stream2
+    #define RxDMA_IRQn DMA2_Stream2_IRQn
+    #define RxDMA_IFCR DMA2->LIFCR
+    #define RxDMA_IFCR_FLAGS (DMA_STREAM_FLAGS << 16)
+  #elif CONFIG_STM32_SERIAL_USART2 || CONFIG_STM32_SERIAL_USART2_ALT_PD6_PD5
+    #define RxDMA DMA1_Stream5
+    #define RxDMA_IRQn DMA1_Stream5_IRQn
+    #define RxDMA_IFCR DMA1->HIFCR
+    #define RxDMA_IFCR_FLAGS (DMA_STREAM_FLAGS << 6)
+  #else
+    #define RxDMA DMA1_Stream1
+    #define RxDMA_IRQn DMA1_Stream1_IRQn
+    #define RxDMA_IFCR DMA1->LIFCR
+    #define RxDMA_IFCR_FLAGS (DMA_STREAM_FLAGS << 6)
+  #endif
+  #define RxDMA_NDTR RxDMA->NDTR
+#endif
+
+#define CR1_FLAGS (USART_CR1_UE | USART_CR1_RE | USART_CR1_TE   \
+                   | USART_CR1_IDLEIE)
+
+// The dma engine fills this buffer in a loop - the interrupt handlers
+// forward new data to the generic serial code in blocks.
+static uint8_t rx_dma_buf[64], rx_dma_pos;
+
+// Forward any data the dma engine has stored since the last call
+static void
+serial_rx_dma_flush(void)
+{
+    uint_fast8_t end = sizeof(rx_dma_buf) - RxDMA_NDTR, pos = rx_dma_pos;
+    if (end >= sizeof(rx_dma_buf))
+        end = 0;
+    if (end < pos) {
+        serial_rx_data(&rx_dma_buf[pos], sizeof(rx_dma_buf) - pos);
+        pos = 0;
+    }
+    if (end > pos)
+        serial_rx_data(&rx_dma_buf[pos], end - pos);
+    rx_dma_pos = end;
+}
+
+// Dma half and full transfer interrupts
+void
+RxDMA_IRQHandler(void)
+{
+    RxDMA_IFCR = RxDMA_IFCR_FLAGS;
+    serial_rx_dma_flush();
+}
+
+static void
+serial_rx_dma_init(void)
+{
+#if CONFIG_MACH_STM32F1
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    RCC->AHBENR;
+    RxDMA->CPAR = (uint32_t)&USARTx->DR;
+    RxDMA->CMAR = (uint32_t)rx_dma_buf;
+    RxDMA->CNDTR = sizeof(rx_dma_buf);
+    RxDMA->CCR = (DMA_CCR_PL_1 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE
+                  | DMA_CCR_TCIE | DMA_CCR_EN);
+#else
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN | RCC_AHB1ENR_DMA2EN;
+    RCC->AHB1ENR;
+    RxDMA->PAR = (uint32_t)&USARTx->DR;
+    RxDMA->M0AR = (uint32_t)rx_dma_buf;
+    RxDMA->NDTR = sizeof(rx_dma_buf);
+    RxDMA->CR = ((4 << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PL_1 | DMA_SxCR_MINC
+                 | DMA_SxCR_CIRC | DMA_SxCR_HTIE | DMA_SxCR_TCIE
+                 | DMA_SxCR_EN);
+#endif
+    armcm_enable_irq(RxDMA_IRQHandler, RxDMA_IRQn, 0);
+    USARTx->CR3 = USART_CR3_DMAR;
+}
+
+#else // !CONFIG_STM32_SERIAL_RX_DMA
+
 #define CR1_FLAGS (USART_CR1_UE | USART_CR1_RE | USART_CR1_TE   \
                    | USART_CR1_RXNEIE)
 
+static void
+serial_rx_dma_flush(void)
+{
+}
+
+static void
+serial_rx_dma_init(void)
+{
+}
+
+#endif
+
 void
 USARTx_IRQHandler(void)
 {
     uint32_t sr = USARTx->SR;
-    if (sr & (USART_SR_RXNE | USART_SR_ORE)) {
+    if (CONFIG_STM32_SERIAL_RX_DMA) {
+        if (sr & (USART_SR_IDLE | USART_SR_ORE)) {
+            // The IDLE and ORE flags are cleared by reading SR then DR
+            USARTx->DR;
+            serial_rx_dma_flush();
+        }
+    } else if (sr & (USART_SR_RXNE | USART_SR_ORE)) {
         // The ORE flag is automatically cleared by reading SR, followed
         // by reading DR.
         serial_rx_byte(USARTx->DR);
@@ -87,6 +204,7 @@ serial_init(void)
     uint32_t div = DIV_ROUND_CLOSEST(pclk, CONFIG_SERIAL_BAUD);
     USARTx->BRR = (((div / 16) << USART_BRR_DIV_Mantissa_Pos)
                    | ((div % 16) << USART_BRR_DIV_Fraction_Pos));
+    serial_rx_dma_init();
     USARTx->CR1 = CR1_FLAGS;
     armcm_enable_irq(USARTx_IRQHandler, USARTx_IRQn, 0);
 
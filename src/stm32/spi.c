@@ -130,6 +130,10 @@ spi_prepare(struct spi_config config)
     spi->CR1 = config.spi_cr1;
 }
 
+// Transfer one byte at a time.  This is called from task context, so
+// timer interrupts (eg, stepper events) may run at any point during
+// the transfer.  Only one byte is ever outstanding so that an
+// interrupt can't cause an undetected receive overrun.
 void
 spi_transfer(struct spi_config config, uint8_t receive_data,
              uint8_t len, uint8_t *data)
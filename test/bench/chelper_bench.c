@@ -0,0 +1,498 @@
+// Microbenchmarks of the host C helper code
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This program runs fixed workloads against some of the performance
+// sensitive functions in klippy/chelper/ and reports the time (and,
+// when available, the cpu cycles and instructions) per operation.
+// It is built with "make chelper_bench" (see docs/Debugging.md).
+
+#include <linux/perf_event.h> // struct perf_event_attr
+#include <math.h> // sqrt
+#include <stdint.h> // uint64_t
+#include <stdio.h> // printf
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include <sys/ioctl.h> // ioctl
+#include <sys/syscall.h> // __NR_perf_event_open
+#include <sys/utsname.h> // uname
+#include <time.h> // clock_gettime
+#include <unistd.h> // syscall
+#include "compiler.h" // ARRAY_SIZE
+#include "itersolve.h" // struct stepper_kinematics
+#include "list.h" // list_next_entry
+#include "msgblock.h" // msgblock_crc16_ccitt
+#include "stepcompress.h" // stepcompress_append
+#include "trapq.h" // move_get_coord
+
+// Kinematic code without a header file
+struct stepper_kinematics *cartesian_stepper_alloc(char axis);
+struct stepper_kinematics *corexy_stepper_alloc(char type);
+struct stepper_kinematics *corexz_stepper_alloc(char type);
+struct stepper_kinematics *delta_stepper_alloc(double arm2, double tower_x
+                                               , double tower_y);
+struct stepper_kinematics *deltesian_stepper_alloc(double arm2, double arm_x);
+struct stepper_kinematics *polar_stepper_alloc(char type);
+struct stepper_kinematics *rotary_delta_stepper_alloc(
+    double shoulder_radius, double shoulder_height, double angle
+    , double upper_arm, double lower_arm);
+struct stepper_kinematics *winch_stepper_alloc(double anchor_x
+                                               , double anchor_y
+                                               , double anchor_z);
+struct stepper_kinematics *extruder_stepper_alloc(void);
+void extruder_set_pressure_advance(struct stepper_kinematics *sk
+                                   , double pressure_advance
+                                   , double smooth_time);
+struct stepper_kinematics *input_shaper_alloc(void);
+int input_shaper_set_sk(struct stepper_kinematics *sk
+                        , struct stepper_kinematics *orig_sk);
+int input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
+                                   , int n, double a[], double t[]);
+
+#define fail(fmt, args...) do {                         \
+        fprintf(stderr, "chelper_bench: " fmt "\n", ##args); \
+        exit(-1);                                       \
+    } while (0)
+
+// Sink for calculated values (so the compiler can not discard them)
+static volatile double result_sink;
+
+
+/****************************************************************
+ * Timing and performance counters
+ ****************************************************************/
+
+struct counters {
+    int fd_cycles, fd_instructions;
+};
+
+static int
+perf_open(uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group_fd < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// Open the cpu cycle and instruction counters (if available)
+static void
+counters_open(struct counters *c)
+{
+    c->fd_cycles = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    c->fd_instructions = -1;
+    if (c->fd_cycles >= 0)
+        c->fd_instructions = perf_open(PERF_COUNT_HW_INSTRUCTIONS
+                                       , c->fd_cycles);
+}
+
+static void
+counters_start(struct counters *c)
+{
+    if (c->fd_cycles < 0)
+        return;
+    ioctl(c->fd_cycles, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(c->fd_cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static uint64_t
+counter_read(int fd)
+{
+    uint64_t v;
+    if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v))
+        return 0;
+    return v;
+}
+
+static void
+counters_stop(struct counters *c, uint64_t *cycles, uint64_t *instructions)
+{
+    if (c->fd_cycles >= 0)
+        ioctl(c->fd_cycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    *cycles = counter_read(c->fd_cycles);
+    *instructions = counter_read(c->fd_instructions);
+}
+
+static uint64_t
+get_nsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/****************************************************************
+ * Test move
+ ****************************************************************/
+
+#define MOVE_SAMPLES 1000
+
+// A diagonal move that is reachable by all the supported kinematics
+// (the benchmarks use its acceleration phase)
+static struct trapq *
+test_trapq_alloc(struct move **pm)
+{
+    struct trapq *tq = trapq_alloc();
+    double axes_d[3] = { 30., 40., 2. };
+    double dist = sqrt(axes_d[0]*axes_d[0] + axes_d[1]*axes_d[1]
+                       + axes_d[2]*axes_d[2]);
+    double inv_dist = 1. / dist, cruise_v = dist / .300;
+    trapq_append(tq, 1., .100, .200, .100, 10., 20., 5.
+                 , axes_d[0] * inv_dist, axes_d[1] * inv_dist
+                 , axes_d[2] * inv_dist, 0., cruise_v, cruise_v / .100);
+    trapq_check_sentinels(tq);
+    *pm = trapq_find_move(tq, 1.050);
+    return tq;
+}
+
+
+/****************************************************************
+ * Benchmarks
+ ****************************************************************/
+
+struct bench {
+    const char *name;
+    void (*setup)(struct bench *b);
+    uint64_t (*run)(struct bench *b);
+    void (*teardown)(struct bench *b);
+    int iterations;
+    // Benchmark state
+    struct trapq *tq;
+    struct move *m;
+    struct stepper_kinematics *sk, *orig_sk;
+    char kin_type;
+    struct stepcompress *sc;
+    struct steppersync *ss;
+    double *step_times;
+    int step_count, compress_method, add2;
+    uint8_t *buf;
+};
+
+// move_get_coord()
+static void
+move_setup(struct bench *b)
+{
+    b->tq = test_trapq_alloc(&b->m);
+}
+
+static uint64_t
+move_get_coord_run(struct bench *b)
+{
+    struct move *m = b->m;
+    double step = m->move_t / MOVE_SAMPLES, sum = 0.;
+    int i, j;
+    for (i=0; i<b->iterations; i++) {
+        for (j=0; j<MOVE_SAMPLES; j++) {
+            struct coord c = move_get_coord(m, j * step);
+            sum += c.x + c.y + c.z;
+        }
+    }
+    result_sink = sum;
+    return (uint64_t)b->iterations * MOVE_SAMPLES;
+}
+
+static void
+move_teardown(struct bench *b)
+{
+    trapq_free(b->tq);
+}
+
+// Stepper kinematics calc_position_cb()
+static void
+kin_setup(struct bench *b)
+{
+    b->tq = test_trapq_alloc(&b->m);
+    static double shaper_a[] = { 1., 1.545, 0.597 };
+    static double shaper_t[] = { 0., 0.0106, 0.0212 };
+    struct stepper_kinematics *sk = NULL;
+    switch (b->kin_type) {
+    case 'c': sk = cartesian_stepper_alloc('x'); break;
+    case 'x': sk = corexy_stepper_alloc('+'); break;
+    case 'z': sk = corexz_stepper_alloc('+'); break;
+    case 'd': sk = delta_stepper_alloc(300.*300., -121.24, -70.); break;
+    case 'D': sk = deltesian_stepper_alloc(300.*300., -150.); break;
+    case 'p': sk = polar_stepper_alloc('a'); break;
+    case 'r':
+        sk = rotary_delta_stepper_alloc(33.9, 412.9, M_PI / 6., 170., 320.);
+        break;
+    case 'w': sk = winch_stepper_alloc(-200., -200., 300.); break;
+    case 'e':
+        sk = extruder_stepper_alloc();
+        extruder_set_pressure_advance(sk, 0.040, 0.040);
+        break;
+    case 's':
+        sk = input_shaper_alloc();
+        b->orig_sk = corexy_stepper_alloc('+');
+        if (input_shaper_set_sk(sk, b->orig_sk)
+            || input_shaper_set_shaper_params(sk, 'x', ARRAY_SIZE(shaper_a)
+                                              , shaper_a, shaper_t)
+            || input_shaper_set_shaper_params(sk, 'y', ARRAY_SIZE(shaper_a)
+                                              , shaper_a, shaper_t))
+            fail("unable to setup input shaper");
+        break;
+    }
+    if (!sk)
+        fail("unknown kinematics %c", b->kin_type);
+    itersolve_set_trapq(sk, b->tq);
+    b->sk = sk;
+}
+
+static uint64_t
+kin_run(struct bench *b)
+{
+    struct stepper_kinematics *sk = b->sk;
+    struct move *m = b->m;
+    sk_calc_callback calc_position_cb = sk->calc_position_cb;
+    double step = m->move_t / MOVE_SAMPLES, sum = 0.;
+    int i, j;
+    for (i=0; i<b->iterations; i++)
+        for (j=0; j<MOVE_SAMPLES; j++)
+            sum += calc_position_cb(sk, m, j * step);
+    if (sum != sum)
+        fail("invalid position in %s", b->name);
+    result_sink = sum;
+    return (uint64_t)b->iterations * MOVE_SAMPLES;
+}
+
+static void
+kin_teardown(struct bench *b)
+{
+    free(b->sk);
+    free(b->orig_sk);
+    b->orig_sk = NULL;
+    trapq_free(b->tq);
+}
+
+// Step compression (compress_bisect_add() and compress_greedy())
+#define COMPRESS_MCU_FREQ 72000000.
+
+static void
+compress_setup(struct bench *b)
+{
+    // Steps of a series of accelerate, cruise, decelerate moves at
+    // 160 steps per mm (100mm/s cruise, 3000mm/s^2 acceleration)
+    double accel = 3000. * 160., cruise_v = 100. * 160.;
+    double accel_t = cruise_v / accel, accel_d = .5 * cruise_v * accel_t;
+    int accel_steps = accel_d, cruise_steps = 3 * accel_steps, i, j;
+    int move_steps = 2 * accel_steps + cruise_steps;
+    double move_t = 2. * accel_t + cruise_steps / cruise_v;
+    if (!b->step_times) {
+        b->step_times = malloc(move_steps * sizeof(*b->step_times));
+        for (i=0; i<move_steps; i++) {
+            double pos = i + .5, t;
+            if (i < accel_steps)
+                t = sqrt(2. * pos / accel);
+            else if (i < accel_steps + cruise_steps)
+                t = accel_t + (pos - accel_d) / cruise_v;
+            else
+                t = move_t - sqrt(2. * (move_steps - pos) / accel);
+            b->step_times[i] = t;
+        }
+    }
+    b->sc = stepcompress_alloc(0);
+    stepcompress_fill(b->sc, 25. * COMPRESS_MCU_FREQ / 1000000., 1, 2);
+    if (b->add2)
+        stepcompress_fill_add2(b->sc, 3);
+    stepcompress_set_compress_method(b->sc, b->compress_method);
+    b->ss = steppersync_alloc(NULL, &b->sc, 1, 16);
+    steppersync_set_time(b->ss, 0., COMPRESS_MCU_FREQ);
+    b->step_count = b->iterations * move_steps;
+    for (i=0; i<b->iterations; i++)
+        for (j=0; j<move_steps; j++)
+            if (stepcompress_append(b->sc, 1, .100 + i * move_t
+                                    , b->step_times[j]))
+                fail("stepcompress_append failed");
+}
+
+static uint64_t
+compress_run(struct bench *b)
+{
+    // Compress all the queued steps
+    if (stepcompress_set_last_position(b->sc, UINT64_MAX, 0))
+        fail("step compression failed");
+    return b->step_count;
+}
+
+static void
+compress_teardown(struct bench *b)
+{
+    steppersync_free(b->ss);
+    stepcompress_free(b->sc);
+}
+
+// msgblock_crc16_ccitt() and msgblock_encode_int()
+#define BUF_SIZE 4096
+
+static void
+buf_setup(struct bench *b)
+{
+    b->buf = malloc(BUF_SIZE);
+    unsigned int seed = 1;
+    int i;
+    for (i=0; i<BUF_SIZE; i++)
+        b->buf[i] = rand_r(&seed);
+}
+
+static uint64_t
+crc16_run(struct bench *b)
+{
+    // Checksum messages of the maximum size
+    int len = MESSAGE_MAX - MESSAGE_TRAILER_SIZE, i, j;
+    uint32_t sum = 0;
+    for (i=0; i<b->iterations; i++)
+        for (j=0; j + len <= BUF_SIZE; j += len)
+            sum += msgblock_crc16_ccitt(&b->buf[j], len);
+    result_sink = sum;
+    return (uint64_t)b->iterations * (BUF_SIZE / len);
+}
+
+static uint64_t
+encode_int_run(struct bench *b)
+{
+    // Encode a mix of small and large (positive and negative) values
+    static const uint32_t values[] = {
+        0, 1, 5, 60, 95, 200, 3000, 12000, 200000, 1500000, 80000000,
+        -1, -30, -3000, -1500000, 0x80000000
+    };
+    uint8_t msg[MESSAGE_MAX * 2];
+    uint32_t sum = 0;
+    int i, j;
+    for (i=0; i<b->iterations; i++) {
+        uint8_t *p = msg;
+        for (j=0; j<ARRAY_SIZE(values); j++)
+            p = msgblock_encode_int(p, values[j] + i);
+        sum += p - msg;
+    }
+    result_sink = sum + msg[0];
+    return (uint64_t)b->iterations * ARRAY_SIZE(values);
+}
+
+static void
+buf_teardown(struct bench *b)
+{
+    free(b->buf);
+}
+
+#define BENCH_KIN(name, type) { name, kin_setup, kin_run, kin_teardown \
+        , 2000, .kin_type = type }
+#define BENCH_COMPRESS(name, method, use_add2) { name, compress_setup    \
+        , compress_run, compress_teardown, 50, .compress_method = method \
+        , .add2 = use_add2 }
+
+static struct bench benchmarks[] = {
+    { "move_get_coord", move_setup, move_get_coord_run, move_teardown, 10000 },
+    BENCH_KIN("calc_position_cartesian", 'c'),
+    BENCH_KIN("calc_position_corexy", 'x'),
+    BENCH_KIN("calc_position_corexz", 'z'),
+    BENCH_KIN("calc_position_delta", 'd'),
+    BENCH_KIN("calc_position_deltesian", 'D'),
+    BENCH_KIN("calc_position_polar", 'p'),
+    BENCH_KIN("calc_position_rotary_delta", 'r'),
+    BENCH_KIN("calc_position_winch", 'w'),
+    BENCH_KIN("calc_position_extruder", 'e'),
+    BENCH_KIN("calc_position_shaper", 's'),
+    BENCH_COMPRESS("compress_bisect_add", SC_METHOD_BISECT, 0),
+    BENCH_COMPRESS("compress_bisect_add2", SC_METHOD_BISECT, 1),
+    BENCH_COMPRESS("compress_greedy", SC_METHOD_GREEDY, 0),
+    { "msgblock_crc16_ccitt", buf_setup, crc16_run, buf_teardown, 20000 },
+    { "msgblock_encode_int", buf_setup, encode_int_run, buf_teardown
+      , 10000000 },
+};
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+// Run a benchmark 'repeat' times and report the fastest run
+static void
+run_bench(struct bench *b, struct counters *c, int repeat, double scale)
+{
+    double best_ns = 0., best_cycles = 0., best_instructions = 0.;
+    int iterations = b->iterations, i;
+    b->iterations = iterations * scale;
+    if (b->iterations < 1)
+        b->iterations = 1;
+    uint64_t ops = 0;
+    for (i=0; i<repeat; i++) {
+        b->setup(b);
+        uint64_t cycles, instructions;
+        counters_start(c);
+        uint64_t start = get_nsecs();
+        ops = b->run(b);
+        uint64_t end = get_nsecs();
+        counters_stop(c, &cycles, &instructions);
+        b->teardown(b);
+        double ns = (double)(end - start) / ops;
+        if (!i || ns < best_ns) {
+            best_ns = ns;
+            best_cycles = (double)cycles / ops;
+            best_instructions = (double)instructions / ops;
+        }
+    }
+    b->iterations = iterations;
+    printf("%-28s %10llu %10.2f", b->name, (unsigned long long)ops, best_ns);
+    if (c->fd_cycles >= 0)
+        printf(" %10.1f %10.1f", best_cycles, best_instructions);
+    printf("\n");
+    fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt, repeat = 5;
+    double scale = 1.;
+    while ((opt = getopt(argc, argv, "r:s:l")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 's':
+            scale = atof(optarg);
+            break;
+        case 'l': {
+            int i;
+            for (i=0; i<ARRAY_SIZE(benchmarks); i++)
+                printf("%s\n", benchmarks[i].name);
+            return 0;
+        }
+        default:
+            fprintf(stderr, "Usage: %s [-r repeat] [-s scale] [-l]"
+                    " [benchmark ...]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (repeat < 1)
+        repeat = 1;
+
+    struct counters c;
+    counters_open(&c);
+    struct utsname u;
+    if (!uname(&u))
+        printf("host: %s %s\n", u.machine, u.release);
+    if (c.fd_cycles < 0)
+        printf("cpu performance counters not available\n");
+    printf("%-28s %10s %10s", "benchmark", "ops", "ns/op");
+    if (c.fd_cycles >= 0)
+        printf(" %10s %10s", "cycles/op", "instr/op");
+    printf("\n");
+
+    int i, j;
+    for (i=0; i<ARRAY_SIZE(benchmarks); i++) {
+        struct bench *b = &benchmarks[i];
+        int selected = optind >= argc;
+        for (j=optind; j<argc; j++)
+            if (strstr(b->name, argv[j]))
+                selected = 1;
+        if (selected)
+            run_bench(b, &c, repeat, scale);
+    }
+    return 0;
+}
@@ -0,0 +1,1020 @@
+// Fuzz test of the host step generation and step compression code
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This harness decodes an arbitrary block of bytes into a kinematic
+// setup, optional input shaper and pressure advance parameters, and a
+// sequence of moves.  The moves are passed through trapq_append(),
+// itersolve and stepcompress (using a debug output serialqueue), and
+// the resulting step history is checked for consistency.
+//
+// The same moves are also run twice without step compression error -
+// once with the kinematics' direct step time solvers and once with
+// those callbacks cleared (so that every step is found by the
+// iterative secant solver).  The step times of those two runs must
+// match within a few clock ticks (or, for slow steps near a direction
+// change, reach the same stepper position).  Any failure calls abort()
+// so that it is reported by the fuzzing tool.
+//
+// Run "make stepgen_fuzz" to build a version that runs the inputs
+// given on the command-line (or stdin, as used by AFL), or a number
+// of random inputs with the "-n" option.  It can be built for
+// libFuzzer with something like:
+//  clang -g -O1 -fsanitize=fuzzer,address -DUSE_LIBFUZZER
+//    -Iklippy/chelper test/fuzz/stepgen_fuzz.c klippy/chelper/*.c
+//    -lm -lpthread
+
+#include <fcntl.h> // open
+#include <math.h> // sqrt
+#include <stddef.h> // offsetof
+#include <stdint.h> // uint8_t
+#include <stdio.h> // fprintf
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include <unistd.h> // usleep
+#include "compiler.h" // ARRAY_SIZE
+#include "itersolve.h" // itersolve_generate_steps
+#include "list.h" // list_next_entry
+#include "pyhelper.h" // get_monotonic
+#include "serialqueue.h" // serialqueue_alloc
+#include "stepcompress.h" // stepcompress_alloc
+#include "trapq.h" // trapq_append
+
+// Kinematic code without a header file
+struct stepper_kinematics *cartesian_stepper_alloc(char axis);
+struct stepper_kinematics *corexy_stepper_alloc(char type);
+struct stepper_kinematics *corexz_stepper_alloc(char type);
+struct stepper_kinematics *delta_stepper_alloc(double arm2, double tower_x
+                                               , double tower_y);
+struct stepper_kinematics *extruder_stepper_alloc(void);
+struct stepper_kinematics *winch_stepper_alloc(double anchor_x
+                                               , double anchor_y
+                                               , double anchor_z);
+void extruder_set_pressure_advance(struct stepper_kinematics *sk
+                                   , double pressure_advance
+                                   , double smooth_time);
+int extruder_set_shaper_params(struct stepper_kinematics *sk, char axis
+                               , int n, double a[], double t[]);
+double extruder_get_step_generation_window(struct stepper_kinematics *sk);
+struct stepper_kinematics *input_shaper_alloc(void);
+int input_shaper_set_sk(struct stepper_kinematics *sk
+                        , struct stepper_kinematics *orig_sk);
+int input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
+                                   , int n, double a[], double t[]);
+double input_shaper_get_step_generation_window(struct stepper_kinematics *sk);
+
+#define MAX_STEPPERS 4
+#define MAX_MOVES 256
+#define MAX_TOTAL_STEPS 200000
+#define MOVE_QUEUE_SIZE 16
+#define MAX_PULSES 5
+
+// Comparison limits of the direct and reference solver step times
+#define CMP_TICKS 3
+#define CMP_POSITION .000000100
+#define CMP_PAIR_POSITION .000001000
+#define CMP_MAX_EXCURSION 64
+#define CMP_MAX_DEPTH 3
+// Rapid step+dir+step filter time (from stepcompress.c)
+#define SDS_FILTER_TIME .000750
+
+static const double mcu_freqs[] = {
+    16000000., 20000000., 48000000., 64000000., 72000000., 120000000.,
+    180000000., 400000000.
+};
+
+static const double move_scales[] = { 0.0005, 0.02, 0.25, 2. };
+
+#define fail(fmt, args...) do {                         \
+        fprintf(stderr, "stepgen_fuzz: " fmt "\n", ##args); \
+        abort();                                        \
+    } while (0)
+
+
+/****************************************************************
+ * Input decoding
+ ****************************************************************/
+
+struct input {
+    const uint8_t *data;
+    size_t size, pos;
+};
+
+// Return the next input byte (or zero if the input is exhausted)
+static uint8_t
+get_byte(struct input *in)
+{
+    if (in->pos >= in->size)
+        return 0;
+    return in->data[in->pos++];
+}
+
+static int8_t
+get_sbyte(struct input *in)
+{
+    return (int8_t)get_byte(in);
+}
+
+static double
+clamp(double v, double low, double high)
+{
+    return v < low ? low : (v > high ? high : v);
+}
+
+enum {
+    KIN_CARTESIAN, KIN_COREXY, KIN_COREXZ, KIN_DELTA, KIN_WINCH,
+    KIN_COUNT
+};
+
+enum {
+    SF_EXTRUDER = 1<<0, SF_SHAPER = 1<<1, SF_ADD2 = 1<<2,
+    SF_QUEUE_STEPS = 1<<3, SF_GREEDY = 1<<4, SF_QUEUE_STEPS_DIR = 1<<5,
+};
+
+// Decoded kinematic and step compression setup
+struct setup {
+    uint8_t flags;
+    int kin, num_steppers;
+    double mcu_freq;
+    uint32_t max_error;
+    double step_dists[MAX_STEPPERS];
+    int shaper_n[2];
+    double shaper_a[2][MAX_PULSES], shaper_t[2][MAX_PULSES];
+    double pressure_advance, smooth_time;
+    double delta_radius, delta_arm;
+    struct coord anchors[3];
+};
+
+static void
+decode_setup(struct setup *su, struct input *in)
+{
+    memset(su, 0, sizeof(*su));
+    int i;
+    su->flags = get_byte(in);
+    su->mcu_freq = mcu_freqs[get_byte(in) % ARRAY_SIZE(mcu_freqs)];
+    su->max_error = (2 + get_byte(in) % 50) * su->mcu_freq / 1000000.;
+    su->kin = get_byte(in) % KIN_COUNT;
+    if (su->kin == KIN_DELTA) {
+        // The arm must be long enough to reach the whole move area
+        su->delta_radius = 100. + get_byte(in) * .5;
+        su->delta_arm = su->delta_radius + 125. + get_byte(in);
+    } else if (su->kin == KIN_WINCH) {
+        // Anchors are placed outside of the move area
+        for (i=0; i<3; i++) {
+            double a = (i * 85 + get_byte(in)) * 2. * M_PI / 256.;
+            double r = 120. + get_byte(in);
+            su->anchors[i].x = cos(a) * r;
+            su->anchors[i].y = sin(a) * r;
+            su->anchors[i].z = -100. + get_byte(in);
+        }
+    }
+    su->num_steppers = 3;
+    if (su->flags & SF_EXTRUDER) {
+        su->num_steppers++;
+        uint8_t pa = get_byte(in);
+        if (pa & 0x01) {
+            su->pressure_advance = (pa >> 1) * 0.002;
+            su->smooth_time = 0.005 + get_byte(in) * 0.0005;
+        }
+    }
+    for (i=0; i<su->num_steppers; i++)
+        su->step_dists[i] = 0.00125 * (1 + (get_byte(in) & 0x1f));
+    if (su->flags & SF_SHAPER) {
+        // Decode shaper pulses for the x and y axes
+        int axis;
+        for (axis=0; axis<2; axis++) {
+            su->shaper_n[axis] = 1 + get_byte(in) % MAX_PULSES;
+            double pt = 0.;
+            for (i=0; i<su->shaper_n[axis]; i++) {
+                su->shaper_a[axis][i] = 1. + get_byte(in);
+                if (i)
+                    pt += (1 + get_byte(in)) * 0.0002;
+                su->shaper_t[axis][i] = pt;
+            }
+        }
+    }
+}
+
+
+/****************************************************************
+ * Step history checks
+ ****************************************************************/
+
+// A step generated by a run that is compared to the reference solver
+struct step_record {
+    uint64_t clock;
+    int64_t position; // stepper position prior to the step
+    int dir;
+};
+
+struct step_log {
+    struct step_record *steps;
+    int count, size;
+};
+
+struct stepper {
+    struct stepper_kinematics *sk, *orig_sk;
+    struct stepcompress *sc;
+    struct trapq *tq;
+    double step_dist, start_pos;
+    int is_extruder;
+    // History checking state
+    uint64_t checked_clock;
+    int64_t position;
+    int have_history, checked_count;
+    // Steps not yet compared (only filled by the comparison runs)
+    struct step_log log;
+    // Move used by the last stepper_position() call
+    struct move *eval_move;
+};
+
+enum {
+    RUN_FUZZ, RUN_DIRECT, RUN_REFERENCE
+};
+
+struct test {
+    struct stepper steppers[MAX_STEPPERS];
+    int num_steppers, mode;
+    uint32_t max_error;
+    double mcu_freq, gen_window;
+    struct trapq *tq, *etq;
+    struct stepcompress *scs[MAX_STEPPERS];
+    struct steppersync *ss;
+    struct pull_history_steps *hist;
+    int hist_size;
+};
+
+static void
+log_step(struct step_log *log, uint64_t clock, int64_t position, int dir)
+{
+    if (log->count >= log->size) {
+        log->size = log->size ? log->size * 2 : 1024;
+        log->steps = realloc(log->steps, log->size * sizeof(*log->steps));
+        if (!log->steps)
+            fail("out of memory");
+    }
+    struct step_record *r = &log->steps[log->count++];
+    r->clock = clock;
+    r->position = position;
+    r->dir = dir;
+}
+
+// Walk each step of a queue_step sequence and return its last clock
+static uint64_t
+check_step_times(struct pull_history_steps *p, struct step_log *log)
+{
+    int count = p->step_count < 0 ? -p->step_count : p->step_count;
+    if (!count)
+        fail("empty step sequence at clock %llu"
+             , (unsigned long long)p->first_clock);
+    int dir = p->step_count > 0, sign = dir ? 1 : -1;
+    uint64_t clock = p->first_clock;
+    int64_t interval = p->interval, add = p->add;
+    if (log)
+        log_step(log, clock, p->start_position, dir);
+    int i;
+    for (i=1; i<count; i++) {
+        interval += add;
+        add += p->add2;
+        if (interval < 0 || interval >= 0x80000000)
+            fail("step %d of sequence at clock %llu has interval %lld"
+                 , i, (unsigned long long)p->first_clock
+                 , (long long)interval);
+        clock += interval;
+        if (log)
+            log_step(log, clock, p->start_position + i * sign, dir);
+    }
+    return clock;
+}
+
+// Check the steps generated since the last call
+static void
+check_history(struct test *t, struct stepper *s)
+{
+    int count;
+    for (;;) {
+        // A step at a direction change may share its clock with the
+        // last checked step, so also extract the sequences ending at
+        // 'checked_clock' (and skip the 'checked_count' already seen)
+        uint64_t start_clock = s->checked_clock ? s->checked_clock - 1 : 0;
+        count = stepcompress_extract_old(s->sc, t->hist, t->hist_size
+                                         , start_clock, UINT64_MAX);
+        if (count < t->hist_size)
+            break;
+        t->hist_size *= 2;
+        t->hist = realloc(t->hist, t->hist_size * sizeof(*t->hist));
+        if (!t->hist)
+            fail("out of memory");
+    }
+    struct step_log *log = t->mode == RUN_FUZZ ? NULL : &s->log;
+    // Entries are reported newest first
+    int skip = s->checked_count;
+    while (count--) {
+        struct pull_history_steps *p = &t->hist[count];
+        if (p->last_clock == s->checked_clock && skip) {
+            skip--;
+            continue;
+        }
+        if (s->have_history && p->first_clock < s->checked_clock)
+            fail("steps at clock %llu overlap previous step at %llu"
+                 , (unsigned long long)p->first_clock
+                 , (unsigned long long)s->checked_clock);
+        if (p->start_position != s->position)
+            fail("step sequence at clock %llu starts at position %lld"
+                 " (expected %lld)", (unsigned long long)p->first_clock
+                 , (long long)p->start_position, (long long)s->position);
+        if (p->max_error > t->max_error)
+            fail("step sequence at clock %llu has error %u (max %u)"
+                 , (unsigned long long)p->first_clock, p->max_error
+                 , t->max_error);
+        uint64_t last_clock = check_step_times(p, log);
+        if (last_clock != p->last_clock)
+            fail("step sequence at clock %llu ends at %llu (expected %llu)"
+                 , (unsigned long long)p->first_clock
+                 , (unsigned long long)last_clock
+                 , (unsigned long long)p->last_clock);
+        s->position += p->step_count;
+        if (s->have_history && p->last_clock == s->checked_clock) {
+            s->checked_count++;
+        } else {
+            s->checked_clock = p->last_clock;
+            s->checked_count = 1;
+        }
+        s->have_history = 1;
+    }
+}
+
+// Generate and compress all steps prior to 'flush_time'
+static void
+flush_steps(struct test *t, double flush_time)
+{
+    int i;
+    for (i=0; i<t->num_steppers; i++) {
+        struct stepper *s = &t->steppers[i];
+        int32_t ret = itersolve_generate_steps(s->sk, flush_time);
+        if (ret)
+            fail("stepper %d itersolve_generate_steps failed (%d) at time"
+                 " %.9f (run %d)", i, ret, flush_time, t->mode);
+        double pos = itersolve_get_commanded_pos(s->sk);
+        if (!isfinite(pos))
+            fail("invalid commanded position at time %.9f", flush_time);
+    }
+    uint64_t clock = flush_time * t->mcu_freq;
+    int ret = steppersync_flush(t->ss, clock, 0);
+    if (ret)
+        fail("steppersync_flush failed (%d) at time %.9f", ret, flush_time);
+    for (i=0; i<t->num_steppers; i++)
+        check_history(t, &t->steppers[i]);
+    // Release the history that has been checked (other than the
+    // sequences ending at 'checked_clock')
+    uint64_t expire_clock = UINT64_MAX;
+    for (i=0; i<t->num_steppers; i++)
+        if (t->steppers[i].checked_clock < expire_clock)
+            expire_clock = t->steppers[i].checked_clock;
+    if (expire_clock && expire_clock != UINT64_MAX)
+        steppersync_flush(t->ss, clock, expire_clock - 1);
+}
+
+// Check that the final step positions match the commanded position
+static void
+check_final_position(struct test *t)
+{
+    int i;
+    for (i=0; i<t->num_steppers; i++) {
+        struct stepper *s = &t->steppers[i];
+        double moved = itersolve_get_commanded_pos(s->sk) - s->start_pos;
+        double diff = s->position - moved / s->step_dist;
+        if (diff < -1. || diff > 1.)
+            fail("stepper %d at step position %lld but commanded %.3f steps"
+                 " (run %d)", i, (long long)s->position
+                 , moved / s->step_dist, t->mode);
+    }
+}
+
+
+/****************************************************************
+ * Reference solver comparison
+ ****************************************************************/
+
+// Calculate the commanded position of a stepper at a given time
+static double
+stepper_position(struct stepper *s, double time)
+{
+    // Like itersolve, positions after the last move use the tail sentinel
+    trapq_check_sentinels(s->tq);
+    struct list_head *moves = &s->tq->moves;
+    struct move *m = s->eval_move;
+    if (!m)
+        m = list_first_entry(moves, struct move, node);
+    while (time < m->print_time && !list_is_first(&m->node, moves))
+        m = list_prev_entry(m, node);
+    while (!list_is_last(&m->node, moves)) {
+        struct move *next = list_next_entry(m, node);
+        if (next->print_time > time)
+            break;
+        m = next;
+    }
+    s->eval_move = m;
+    double move_time = clamp(time - m->print_time, 0., m->move_t);
+    return s->sk->calc_position_cb(s->sk, m, move_time);
+}
+
+// Check if two steps have the same direction and position
+static int
+steps_equal(struct step_record *r1, struct step_record *r2)
+{
+    return r1->dir == r2->dir && r1->position == r2->position;
+}
+
+// Check if two step clocks are within a few ticks
+static int
+clocks_match(uint64_t clock1, uint64_t clock2)
+{
+    int64_t diff = clock1 - clock2;
+    return diff >= -CMP_TICKS && diff <= CMP_TICKS;
+}
+
+// Return the stepper position (relative to the step position passed
+// by the step) at a given clock
+static double
+step_excess(struct test *rt, struct stepper *rs, struct step_record *r
+            , double clock)
+{
+    double step_pos = r->position + (r->dir ? .5 : -.5);
+    double pos = stepper_position(rs, clock / rt->mcu_freq);
+    return pos - rs->start_pos - step_pos * rs->step_dist;
+}
+
+// Check if a step is on the reference solver's stepper trajectory
+// (the stepper passes the step position within a few clock ticks)
+static int
+step_on_reference(struct test *rt, struct stepper *rs, struct step_record *r)
+{
+    double e1 = step_excess(rt, rs, r, (double)r->clock - CMP_TICKS);
+    double e2 = step_excess(rt, rs, r, (double)r->clock + CMP_TICKS);
+    if (e1 > e2) {
+        double tmp = e1;
+        e1 = e2;
+        e2 = tmp;
+    }
+    return e1 <= CMP_POSITION && e2 >= -CMP_POSITION;
+}
+
+// Check if the stepper ends the test on the step position passed by a
+// step (whether that last step is generated depends on rounding)
+static int
+step_at_end(struct test *rt, struct stepper *rs, struct step_record *r)
+{
+    trapq_check_sentinels(rs->tq);
+    struct move *tail = list_last_entry(&rs->tq->moves, struct move, node);
+    double end_clock = (tail->print_time + 1.) * rt->mcu_freq;
+    return fabs(step_excess(rt, rs, r, end_clock)) <= CMP_POSITION;
+}
+
+// Return the number of steps at the start of a log that one solver
+// may generate while the other does not.  That is a step and reverse
+// step close to the rapid step+dir+step filter time of stepcompress,
+// or a pair where the stepper only barely passes a step position.
+// The iterative solver may also miss a brief excursion past step
+// positions, so a series of steps returning to the same position is
+// accepted from the direct solver (when 'is_direct' is set) if each
+// step is on the reference trajectory.
+static int
+skip_steps(struct test *rt, struct stepper *rs, struct step_log *log
+           , int idx, int is_direct)
+{
+    if (idx + 1 >= log->count)
+        return 0;
+    struct step_record *r1 = &log->steps[idx], *r2 = &log->steps[idx+1];
+    if (r1->dir != r2->dir) {
+        uint64_t sds_ticks = SDS_FILTER_TIME * rt->mcu_freq;
+        if (r2->clock - r1->clock <= sds_ticks + CMP_TICKS)
+            return 2;
+        double mid_clock = .5 * (r1->clock + r2->clock);
+        if (fabs(step_excess(rt, rs, r1, mid_clock)) <= CMP_PAIR_POSITION)
+            return 2;
+    }
+    if (!is_direct)
+        return 0;
+    int i;
+    for (i=idx; i<log->count && i<idx+CMP_MAX_EXCURSION; i++) {
+        struct step_record *r = &log->steps[i];
+        if (!step_on_reference(rt, rs, r))
+            return 0;
+        if (r->position + (r->dir ? 1 : -1) == r1->position)
+            return i + 1 - idx;
+    }
+    return 0;
+}
+
+enum { CMP_ANY = -2, CMP_ALIGNED = -1 };
+
+static int match_steps(struct test *rt, struct stepper *rs
+                       , struct step_log *dl, int *pdi
+                       , struct step_log *rl, int *pri, int depth);
+
+// Check if the steps at the given log positions may be matched.  With
+// a non-negative 'depth' the steps must match exactly (or do so after
+// at most 'depth' further choices of match_steps()), with CMP_ALIGNED
+// only their positions must match, and CMP_ANY accepts any steps.
+static int
+logs_aligned(struct test *rt, struct stepper *rs, struct step_log *dl
+             , int di, struct step_log *rl, int ri, int depth)
+{
+    if (depth == CMP_ANY || di >= dl->count || ri >= rl->count)
+        return 1;
+    struct step_record *d = &dl->steps[di], *r = &rl->steps[ri];
+    if (depth == CMP_ALIGNED)
+        return steps_equal(d, r);
+    if (steps_equal(d, r) && clocks_match(d->clock, r->clock))
+        return 1;
+    return depth > 0 && match_steps(rt, rs, dl, &di, rl, &ri, depth - 1);
+}
+
+// Match (or skip) the next steps of the direct and reference logs.
+// Only choices after which the following steps are aligned (as
+// checked by logs_aligned() with 'depth') are made, so that the
+// choice between ambiguous matches is resolved by the later steps.
+static int
+match_steps(struct test *rt, struct stepper *rs, struct step_log *dl
+            , int *pdi, struct step_log *rl, int *pri, int depth)
+{
+    int di = *pdi, ri = *pri, skip;
+    struct step_record *d = &dl->steps[di], *r = &rl->steps[ri];
+    // Slow steps near a direction change may pass the same step
+    // position more than once (both solvers are then correct)
+    if (steps_equal(d, r) && step_on_reference(rt, rs, d)
+        && logs_aligned(rt, rs, dl, di + 1, rl, ri + 1, depth)) {
+        *pdi = di + 1;
+        *pri = ri + 1;
+        return 1;
+    }
+    skip = skip_steps(rt, rs, dl, di, 0);
+    if (skip && logs_aligned(rt, rs, dl, di + skip, rl, ri, depth)) {
+        *pdi = di + skip;
+        return 1;
+    }
+    skip = skip_steps(rt, rs, rl, ri, 0);
+    if (skip && logs_aligned(rt, rs, dl, di, rl, ri + skip, depth)) {
+        *pri = ri + skip;
+        return 1;
+    }
+    skip = skip_steps(rt, rs, dl, di, 1);
+    if (skip && logs_aligned(rt, rs, dl, di + skip, rl, ri, depth)) {
+        *pdi = di + skip;
+        return 1;
+    }
+    return 0;
+}
+
+// Match the next steps that differ between the two logs, preferring
+// the choices that lead to exactly matching steps soonest
+static int
+match_next_steps(struct test *rt, struct stepper *rs, struct step_log *dl
+                 , int *pdi, struct step_log *rl, int *pri)
+{
+    int depth;
+    for (depth=0; depth<=CMP_MAX_DEPTH; depth++)
+        if (match_steps(rt, rs, dl, pdi, rl, pri, depth))
+            return 1;
+    return (match_steps(rt, rs, dl, pdi, rl, pri, CMP_ALIGNED)
+            || match_steps(rt, rs, dl, pdi, rl, pri, CMP_ANY));
+}
+
+// Compare the steps of a direct solver run to the reference run
+static void
+compare_stepper(struct test *dt, struct test *rt, int idx, int final)
+{
+    struct stepper *ds = &dt->steppers[idx], *rs = &rt->steppers[idx];
+    struct step_log *dl = &ds->log, *rl = &rs->log;
+    // Unless this is the final check, keep the last steps for the
+    // next call (they may be the start of skipped steps)
+    int keep = final ? 0 : CMP_MAX_EXCURSION, di = 0, ri = 0, skip;
+    while (di < dl->count - keep && ri < rl->count - keep) {
+        struct step_record *d = &dl->steps[di], *r = &rl->steps[ri];
+        if (steps_equal(d, r) && clocks_match(d->clock, r->clock)) {
+            di++;
+            ri++;
+        } else if (!match_next_steps(rt, rs, dl, &di, rl, &ri)) {
+            fail("stepper %d step at clock %llu (pos %lld dir %d) does not"
+                 " match reference step at clock %llu (pos %lld dir %d)"
+                 , idx, (unsigned long long)d->clock, (long long)d->position
+                 , d->dir, (unsigned long long)r->clock
+                 , (long long)r->position, r->dir);
+        }
+    }
+    if (final) {
+        while ((skip = skip_steps(rt, rs, dl, di, 1)))
+            di += skip;
+        while ((skip = skip_steps(rt, rs, rl, ri, 0)))
+            ri += skip;
+        if (di + 1 == dl->count && step_at_end(rt, rs, &dl->steps[di]))
+            di++;
+        if (ri + 1 == rl->count && step_at_end(rt, rs, &rl->steps[ri]))
+            ri++;
+        if (di < dl->count || ri < rl->count)
+            fail("stepper %d has %d unmatched steps (reference %d)"
+                 , idx, dl->count - di, rl->count - ri);
+    }
+    dl->count -= di;
+    memmove(dl->steps, &dl->steps[di], dl->count * sizeof(*dl->steps));
+    rl->count -= ri;
+    memmove(rl->steps, &rl->steps[ri], rl->count * sizeof(*rl->steps));
+}
+
+static void
+compare_steps(struct test *dt, struct test *rt, int final)
+{
+    int i;
+    for (i=0; i<dt->num_steppers; i++)
+        compare_stepper(dt, rt, i, final);
+}
+
+
+/****************************************************************
+ * Test setup
+ ****************************************************************/
+
+static struct serialqueue *
+get_serialqueue(void)
+{
+    static struct serialqueue *sq;
+    if (sq)
+        return sq;
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+        fail("unable to open /dev/null");
+    sq = serialqueue_alloc(fd, 'f', 0);
+    if (!sq)
+        fail("unable to allocate serialqueue");
+    serialqueue_set_clock_est(sq, 1000000000000., get_monotonic(), 0, 0);
+    return sq;
+}
+
+// Wait for the serialqueue to transmit all queued step commands
+static void
+drain_serialqueue(struct serialqueue *sq)
+{
+    int i;
+    for (i=0; i<10000; i++) {
+        int ready_bytes, upcoming_bytes;
+        serialqueue_get_buffer_stats(sq, &ready_bytes, &upcoming_bytes);
+        if (!ready_bytes && !upcoming_bytes)
+            return;
+        usleep(100);
+    }
+    fail("serialqueue did not drain");
+}
+
+static void
+setup_steppers(struct test *t, struct setup *su)
+{
+    struct stepper *s = t->steppers;
+    if (su->kin == KIN_CARTESIAN) {
+        s[0].orig_sk = cartesian_stepper_alloc('x');
+        s[1].orig_sk = cartesian_stepper_alloc('y');
+        s[2].orig_sk = cartesian_stepper_alloc('z');
+    } else if (su->kin == KIN_COREXY) {
+        s[0].orig_sk = corexy_stepper_alloc('+');
+        s[1].orig_sk = corexy_stepper_alloc('-');
+        s[2].orig_sk = cartesian_stepper_alloc('z');
+    } else if (su->kin == KIN_COREXZ) {
+        s[0].orig_sk = corexz_stepper_alloc('+');
+        s[1].orig_sk = cartesian_stepper_alloc('y');
+        s[2].orig_sk = corexz_stepper_alloc('-');
+    } else if (su->kin == KIN_WINCH) {
+        int i;
+        for (i=0; i<3; i++) {
+            struct coord *a = &su->anchors[i];
+            s[i].orig_sk = winch_stepper_alloc(a->x, a->y, a->z);
+        }
+    } else {
+        double arm2 = su->delta_arm * su->delta_arm;
+        double radius = su->delta_radius;
+        static const double angles[] = { 210., 330., 90. };
+        int i;
+        for (i=0; i<3; i++) {
+            double a = angles[i] * M_PI / 180.;
+            s[i].orig_sk = delta_stepper_alloc(arm2, cos(a) * radius
+                                               , sin(a) * radius);
+        }
+    }
+    t->tq = trapq_alloc();
+    int i;
+    for (i=0; i<3; i++)
+        s[i].tq = t->tq;
+    if (su->flags & SF_EXTRUDER) {
+        t->etq = trapq_alloc();
+        s[3].orig_sk = extruder_stepper_alloc();
+        s[3].tq = t->etq;
+        s[3].is_extruder = 1;
+    }
+    t->num_steppers = su->num_steppers;
+    for (i=0; i<t->num_steppers; i++) {
+        s[i].sk = s[i].orig_sk;
+        s[i].step_dist = su->step_dists[i];
+    }
+}
+
+static void
+setup_shaper(struct test *t, struct setup *su)
+{
+    int i;
+    for (i=0; i<t->num_steppers; i++) {
+        struct stepper *s = &t->steppers[i];
+        if (s->is_extruder) {
+            // The extruder applies the toolhead shaper itself
+            if (extruder_set_shaper_params(s->sk, 'x', su->shaper_n[0]
+                                           , su->shaper_a[0]
+                                           , su->shaper_t[0])
+                || extruder_set_shaper_params(s->sk, 'y', su->shaper_n[1]
+                                              , su->shaper_a[1]
+                                              , su->shaper_t[1]))
+                fail("unable to set extruder shaper params");
+            double window = extruder_get_step_generation_window(s->sk);
+            if (window > t->gen_window)
+                t->gen_window = window;
+            continue;
+        }
+        struct stepper_kinematics *is_sk = input_shaper_alloc();
+        if (input_shaper_set_sk(is_sk, s->orig_sk)) {
+            // Stepper is not moved by the x or y axes
+            free(is_sk);
+            continue;
+        }
+        if (input_shaper_set_shaper_params(is_sk, 'x', su->shaper_n[0]
+                                           , su->shaper_a[0]
+                                           , su->shaper_t[0])
+            || input_shaper_set_shaper_params(is_sk, 'y', su->shaper_n[1]
+                                              , su->shaper_a[1]
+                                              , su->shaper_t[1]))
+            fail("unable to set shaper params");
+        double window = input_shaper_get_step_generation_window(is_sk);
+        if (window > t->gen_window)
+            t->gen_window = window;
+        s->sk = is_sk;
+    }
+}
+
+static void
+setup_test(struct test *t, struct setup *su, int mode)
+{
+    memset(t, 0, sizeof(*t));
+    t->mode = mode;
+    t->hist_size = 1024;
+    t->hist = malloc(t->hist_size * sizeof(*t->hist));
+    t->mcu_freq = su->mcu_freq;
+    // The comparison runs store the exact step times
+    t->max_error = mode == RUN_FUZZ ? su->max_error : 0;
+    setup_steppers(t, su);
+    int i;
+    for (i=0; i<t->num_steppers; i++) {
+        struct stepper *s = &t->steppers[i];
+        itersolve_set_position(s->sk, 0., 0., 0.);
+        if (s->is_extruder && su->smooth_time) {
+            extruder_set_pressure_advance(s->sk, su->pressure_advance
+                                          , su->smooth_time);
+            double window = extruder_get_step_generation_window(s->sk);
+            if (window > t->gen_window)
+                t->gen_window = window;
+        }
+    }
+    if (su->flags & SF_SHAPER)
+        setup_shaper(t, su);
+    uint8_t flags = mode == RUN_FUZZ ? su->flags : 0;
+    for (i=0; i<t->num_steppers; i++) {
+        struct stepper *s = &t->steppers[i];
+        s->sc = t->scs[i] = stepcompress_alloc(i);
+        stepcompress_fill(s->sc, t->max_error, 1, 2);
+        if (flags & SF_ADD2)
+            stepcompress_fill_add2(s->sc, 3);
+        if (flags & SF_QUEUE_STEPS)
+            stepcompress_fill_queue_steps(s->sc, 4
+                                          , !!(flags & SF_QUEUE_STEPS_DIR));
+        if (flags & SF_GREEDY)
+            stepcompress_set_compress_method(s->sc, SC_METHOD_GREEDY);
+        itersolve_set_stepcompress(s->sk, s->sc, s->step_dist);
+        itersolve_set_trapq(s->sk, s->tq);
+        if (s->is_extruder)
+            extruder_set_pressure_advance(s->orig_sk, su->pressure_advance
+                                          , su->smooth_time);
+        s->start_pos = itersolve_get_commanded_pos(s->sk);
+        if (mode == RUN_REFERENCE) {
+            // Find every step with the iterative solver
+            s->sk->calc_linear_cb = NULL;
+            s->sk->calc_peak_cb = NULL;
+            s->sk->calc_inverse_cb = NULL;
+            s->sk->calc_poly_cb = NULL;
+        }
+    }
+    t->ss = steppersync_alloc(get_serialqueue(), t->scs, t->num_steppers
+                              , MOVE_QUEUE_SIZE);
+    steppersync_set_time(t->ss, 0., t->mcu_freq);
+}
+
+static void
+free_test(struct test *t)
+{
+    steppersync_free(t->ss);
+    int i;
+    for (i=0; i<t->num_steppers; i++) {
+        struct stepper *s = &t->steppers[i];
+        stepcompress_free(s->sc);
+        if (s->sk != s->orig_sk)
+            free(s->sk);
+        free(s->orig_sk);
+        free(s->log.steps);
+    }
+    trapq_free(t->tq);
+    if (t->etq)
+        trapq_free(t->etq);
+    free(t->hist);
+}
+
+// Add a trapezoid move (that starts and ends at a stop) to a test
+static void
+add_move(struct test *t, double print_time, double accel_t, double cruise_t
+         , double pos[3], double axes_r[3], double velocity, double accel
+         , double epos, double e_ratio)
+{
+    trapq_append(t->tq, print_time, accel_t, cruise_t, accel_t
+                 , pos[0], pos[1], pos[2], axes_r[0], axes_r[1], axes_r[2]
+                 , 0., velocity, accel);
+    if (!t->etq || !e_ratio)
+        return;
+    // Like klippy's extruder, pressure advance only applies when
+    // extruding during an xy move
+    int can_pa = e_ratio > 0. && (axes_r[0] || axes_r[1]);
+    trapq_append(t->etq, print_time, accel_t, cruise_t, accel_t
+                 , epos, 0., 0., 1., can_pa, 0.
+                 , 0., velocity * e_ratio, accel * e_ratio);
+}
+
+static void
+run_test(const uint8_t *data, size_t size)
+{
+    struct input in = { .data = data, .size = size };
+    struct setup su;
+    decode_setup(&su, &in);
+    struct test tests[3];
+    int i;
+    for (i=0; i<ARRAY_SIZE(tests); i++)
+        setup_test(&tests[i], &su, i);
+    struct test *ft = &tests[RUN_FUZZ];
+    struct test *dt = &tests[RUN_DIRECT], *rt = &tests[RUN_REFERENCE];
+    double gen_window = ft->gen_window;
+
+    // Decode and run the moves
+    double min_step_dist = su.step_dists[0];
+    for (i=1; i<su.num_steppers; i++)
+        if (su.step_dists[i] < min_step_dist)
+            min_step_dist = su.step_dists[i];
+    // Like klippy, start late enough that the first null move does not
+    // start at time zero (kin_shaper requires moves prior to a pulse)
+    double print_time = 1.100 + 2. * gen_window, total_dist = 0.;
+    double pos[3] = { 0., 0., 0. }, epos = 0.;
+    int count = 0;
+    while (in.pos < in.size && count++ < MAX_MOVES) {
+        uint8_t mflags = get_byte(&in);
+        double scale = move_scales[mflags & 0x03];
+        double end[3] = {
+            clamp(pos[0] + get_sbyte(&in) * scale, -80., 80.),
+            clamp(pos[1] + get_sbyte(&in) * scale, -80., 80.),
+            clamp(pos[2] + get_sbyte(&in) * scale * .1, 0., 50.),
+        };
+        double velocity = 1. + get_byte(&in) * 2.;
+        double accel = 10. + get_byte(&in) * 100.;
+        double dwell = (mflags & 0x04) ? get_byte(&in) * 0.001 : 0.;
+        double e_ratio = 0.;
+        if (su.flags & SF_EXTRUDER)
+            e_ratio = get_sbyte(&in) * .0005;
+        double axes_d[3] = { end[0]-pos[0], end[1]-pos[1], end[2]-pos[2] };
+        double dist = sqrt(axes_d[0]*axes_d[0] + axes_d[1]*axes_d[1]
+                           + axes_d[2]*axes_d[2]);
+        print_time += dwell;
+        total_dist += dist;
+        if (dist < .000000001 || total_dist / min_step_dist > MAX_TOTAL_STEPS)
+            continue;
+        // Build a trapezoid move that starts and ends at a stop
+        double accel_t = velocity / accel, cruise_t = 0.;
+        double accel_d = .5 * velocity * accel_t;
+        if (2. * accel_d > dist) {
+            velocity = sqrt(dist * accel);
+            accel_t = velocity / accel;
+        } else {
+            cruise_t = (dist - 2. * accel_d) / velocity;
+        }
+        double inv_dist = 1. / dist;
+        double axes_r[3] = { axes_d[0] * inv_dist, axes_d[1] * inv_dist
+                             , axes_d[2] * inv_dist };
+        for (i=0; i<ARRAY_SIZE(tests); i++)
+            add_move(&tests[i], print_time, accel_t, cruise_t, pos, axes_r
+                     , velocity, accel, epos, e_ratio);
+        print_time += 2. * accel_t + cruise_t;
+        memcpy(pos, end, sizeof(pos));
+        epos += dist * e_ratio;
+        if (mflags & 0x08)
+            // Generate steps up to the start of the next move
+            flush_steps(ft, print_time - gen_window);
+        // Compare the direct and reference solvers after every move
+        flush_steps(dt, print_time - gen_window);
+        flush_steps(rt, print_time - gen_window);
+        compare_steps(dt, rt, 0);
+    }
+    for (i=0; i<ARRAY_SIZE(tests); i++) {
+        flush_steps(&tests[i], print_time + gen_window + 0.100);
+        check_final_position(&tests[i]);
+    }
+    compare_steps(dt, rt, 1);
+
+    // Cleanup
+    drain_serialqueue(get_serialqueue());
+    for (i=0; i<ARRAY_SIZE(tests); i++)
+        free_test(&tests[i]);
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    run_test(data, size);
+    return 0;
+}
+
+#ifndef USE_LIBFUZZER
+
+static void
+run_file(FILE *f)
+{
+    size_t size = 0, alloc = 4096;
+    uint8_t *data = malloc(alloc);
+    for (;;) {
+        size_t ret = fread(&data[size], 1, alloc - size, f);
+        size += ret;
+        if (size < alloc)
+            break;
+        alloc *= 2;
+        data = realloc(data, alloc);
+    }
+    run_test(data, size);
+    free(data);
+}
+
+static void
+run_random(int count, unsigned int seed)
+{
+    uint8_t data[1024];
+    int i;
+    for (i=0; i<count; i++) {
+        unsigned int test_seed = seed + i;
+        size_t j, size = 16 + rand_r(&test_seed) % (sizeof(data) - 16);
+        for (j=0; j<size; j++)
+            data[j] = rand_r(&test_seed);
+        fprintf(stderr, "Running random input %d (seed %u)\n", i, seed + i);
+        run_test(data, size);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt, count = 0;
+    unsigned int seed = 1;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n count] [-s seed] [file ...]\n"
+                    , argv[0]);
+            return -1;
+        }
+    }
+    if (count) {
+        run_random(count, seed);
+        return 0;
+    }
+    if (optind >= argc) {
+        run_file(stdin);
+        return 0;
+    }
+    int i;
+    for (i=optind; i<argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f)
+            fail("unable to open %s", argv[i]);
+        run_file(f);
+        fclose(f);
+    }
+    return 0;
+}
+
+#endif // USE_LIBFUZZER